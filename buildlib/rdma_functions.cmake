@@ -140,6 +140,9 @@ function(rdma_shared_provider DEST VERSION_SCRIPT SOVERSION VERSION)
   if (ENABLE_STATIC)
     add_library(${DEST}-static STATIC ${ARGN})
     rdma_public_static_lib(${DEST} ${DEST}-static ${VERSION_SCRIPT})
+    if ("${STATIC_DATAPATH_PROVIDER}" STREQUAL "${DEST}")
+      target_compile_definitions(${DEST}-static PRIVATE RDMA_STATIC_DATAPATH_PROVIDER=1)
+    endif()
   endif()
 
   # Create the plugin shared library
@@ -186,6 +189,9 @@ function(rdma_provider DEST)
   if (ENABLE_STATIC)
     add_library(${DEST} STATIC ${ARGN})
     rdma_public_static_lib("${DEST}-rdmav${IBVERBS_PABI_VERSION}" ${DEST} ${BUILDLIB}/provider.map)
+    if ("${STATIC_DATAPATH_PROVIDER}" STREQUAL "${DEST}")
+      target_compile_definitions(${DEST} PRIVATE RDMA_STATIC_DATAPATH_PROVIDER=1)
+    endif()
   endif()
 
   # Create the plugin shared library
@@ -668,25 +668,21 @@ int add_to_portguid_hash(ibnd_port_t * port, ibnd_port_t * hash[])
 	return rc;
 }
 
-struct lid2guid_item {
-	cl_map_item_t cl_map;
-	ibnd_port_t *port;
-};
-
 void create_lid2guid(f_internal_t *f_int)
 {
-	cl_qmap_init(&f_int->lid2guid);
+	flat_map_init(&f_int->lid2guid);
 }
 
 void destroy_lid2guid(f_internal_t *f_int)
 {
-	cl_map_item_t *item;
+	flat_map_destroy(&f_int->lid2guid);
+}
 
-	for (item = cl_qmap_head(&f_int->lid2guid); item != cl_qmap_end(&f_int->lid2guid);
-	     item = cl_qmap_head(&f_int->lid2guid)) {
-		cl_qmap_remove_item(&f_int->lid2guid, item);
-		free(container_of(item, struct lid2guid_item, cl_map));
-	}
+/* Called once all ports are known, lookups are binary searches after this */
+void sort_lid2guid(f_internal_t *f_int)
+{
+	if (flat_map_sort(&f_int->lid2guid))
+		IBND_DEBUG("OOM: lid2guid left unsorted\n");
 }
 
 void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int)
@@ -697,20 +693,11 @@ void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int)
 	/* 0 < valid lid <= 0xbfff */
 	if (base_lid > 0 && base_lid <= 0xbfff) {
 		/* We add the port for all lids
-		 * so it is easier to find any "random" lid specified */
-		for (lid = base_lid; lid <= (base_lid + lid_mask); lid++) {
-			struct lid2guid_item *item;
-
-			item = malloc(sizeof(*item));
-			if (item) {
-				item->port = port;
-				if (cl_qmap_insert(&f_int->lid2guid, lid,
-						   &item->cl_map) != &item->cl_map) {
-					/* Port is already in map, release item */
-					free(item);
-				}
-			}
-		}
+		 * so it is easier to find any "random" lid specified.
+		 * If the lid is already in the map the first port is kept.
+		 */
+		for (lid = base_lid; lid <= (base_lid + lid_mask); lid++)
+			flat_map_insert(&f_int->lid2guid, lid, port);
 	}
 }
 
@@ -835,6 +822,8 @@ ibnd_fabric_t *ibnd_discover_fabric(char * ca_name, int ca_port,
 	f_int->fabric.total_mads_used = engine.total_smps;
 	f_int->fabric.maxhops_discovered += scan.initial_hops;
 
+	sort_lid2guid(f_int);
+
 	if (group_nodes(&f_int->fabric))
 		goto error;
 
@@ -944,14 +933,7 @@ ibnd_port_t *ibnd_find_port_lid(ibnd_fabric_t * fabric,
 {
 	f_internal_t *f = (f_internal_t *)fabric;
 
-	cl_map_item_t *p_item = cl_qmap_get(&f->lid2guid, lid);
-
-	if (p_item == &f->lid2guid.nil)
-		return NULL;
-
-	return container_of(p_item,
-			    struct lid2guid_item, cl_map)
-		->port;
+	return flat_map_get(&f->lid2guid, lid);
 }
 
 ibnd_port_t *ibnd_find_port_guid(ibnd_fabric_t * fabric, uint64_t guid)
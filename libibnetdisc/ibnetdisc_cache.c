@@ -680,6 +680,8 @@ ibnd_fabric_t *ibnd_load_fabric(const char *file, unsigned int flags)
 	if (_rebuild_ports(fabric_cache) < 0)
 		goto cleanup;
 
+	sort_lid2guid(f_int);
+
 	if (group_nodes(&f_int->fabric))
 		goto cleanup;
 
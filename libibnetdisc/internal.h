@@ -40,6 +40,7 @@
 
 #include <infiniband/ibnetdisc.h>
 #include <util/cl_qmap.h>
+#include <util/flat_map.h>
 
 #define	IBND_DEBUG(fmt, ...) \
 	if (ibdebug) { \
@@ -59,11 +60,12 @@
 
 typedef struct f_internal {
 	ibnd_fabric_t fabric;
-	cl_qmap_t lid2guid;
+	struct flat_map lid2guid;
 } f_internal_t;
 f_internal_t *allocate_fabric_internal(void);
 void create_lid2guid(f_internal_t *f_int);
 void destroy_lid2guid(f_internal_t *f_int);
+void sort_lid2guid(f_internal_t *f_int);
 void add_to_portlid_hash(ibnd_port_t * port, f_internal_t *f_int);
 
 typedef struct ibnd_scan {
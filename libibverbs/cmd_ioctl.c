@@ -125,6 +125,12 @@ static void finalize_attrs(struct ibv_command_buffer *cmd)
 	}
 }
 
+/*
+ * RDMA_VERBS_IOCTL carries exactly one method invocation; the uAPI has no
+ * multi-command form, so there is nothing to gain from queueing commands in
+ * userspace. Callers creating many objects should issue them from several
+ * threads instead, the kernel processes ioctls on one cmd_fd concurrently.
+ */
 int execute_ioctl(struct ibv_context *context, struct ibv_command_buffer *cmd)
 {
 	struct verbs_context *vctx = verbs_get_ctx(context);
@@ -106,6 +106,13 @@ LATEST_SYMVER_FUNC(ibv_free_device_list, 1_1, "IBVERBS_1.1",
 	free(list);
 }
 
+/*
+ * The cached device attributes are read without dev_list_lock so that
+ * monitoring threads polling them do not contend with ibv_get_device_list()
+ * and ibv_open_device(). The name, node type and index are filled in before
+ * the device is first returned by ibv_get_device_list() and never change
+ * afterwards, and the caller's device reference keeps them alive.
+ */
 LATEST_SYMVER_FUNC(ibv_get_device_name, 1_1, "IBVERBS_1.1",
 		   const char *,
 		   struct ibv_device *device)
@@ -113,6 +120,13 @@ LATEST_SYMVER_FUNC(ibv_get_device_name, 1_1, "IBVERBS_1.1",
 	return device->name;
 }
 
+/*
+ * The node GUID may be read lazily from sysfs on first use. The value is
+ * stored before VSYSFS_READ_NODE_GUID is set with release ordering, so a
+ * reader that observes the flag with acquire ordering also observes the GUID.
+ * Concurrent first callers may both read sysfs, they store the same value.
+ * No other flag is modified once the device has been published.
+ */
 LATEST_SYMVER_FUNC(ibv_get_device_guid, 1_1, "IBVERBS_1.1",
 		   __be64,
 		   struct ibv_device *device)
@@ -123,13 +137,13 @@ LATEST_SYMVER_FUNC(ibv_get_device_guid, 1_1, "IBVERBS_1.1",
 	uint16_t parts[4];
 	int i;
 
-	pthread_mutex_lock(&dev_list_lock);
-	if (sysfs_dev && sysfs_dev->flags & VSYSFS_READ_NODE_GUID) {
-		guid = sysfs_dev->node_guid;
-		pthread_mutex_unlock(&dev_list_lock);
-		return htobe64(guid);
-	}
-	pthread_mutex_unlock(&dev_list_lock);
+	if (!sysfs_dev)
+		return 0;
+
+	if (__atomic_load_n(&sysfs_dev->flags, __ATOMIC_ACQUIRE) &
+	    VSYSFS_READ_NODE_GUID)
+		return htobe64(__atomic_load_n(&sysfs_dev->node_guid,
+					       __ATOMIC_RELAXED));
 
 	if (ibv_read_ibdev_sysfs_file(attr, sizeof(attr), sysfs_dev,
 				      "node_guid") < 0)
@@ -142,10 +156,9 @@ LATEST_SYMVER_FUNC(ibv_get_device_guid, 1_1, "IBVERBS_1.1",
 	for (i = 0; i < 4; ++i)
 		guid = (guid << 16) | parts[i];
 
-	pthread_mutex_lock(&dev_list_lock);
-	sysfs_dev->node_guid = guid;
-	sysfs_dev->flags |= VSYSFS_READ_NODE_GUID;
-	pthread_mutex_unlock(&dev_list_lock);
+	__atomic_store_n(&sysfs_dev->node_guid, guid, __ATOMIC_RELAXED);
+	__atomic_fetch_or(&sysfs_dev->flags, VSYSFS_READ_NODE_GUID,
+			  __ATOMIC_RELEASE);
 
 	return htobe64(guid);
 }
@@ -251,6 +264,7 @@ int verbs_init_context(struct verbs_context *context_ex,
 	}
 
 	context_ex->priv->driver_id = driver_id;
+	pthread_mutex_init(&context_ex->priv->gid_cache.lock, NULL);
 	verbs_set_ops(context_ex, &verbs_dummy_ops);
 	context_ex->priv->use_ioctl_write = has_ioctl_write(context);
 
@@ -431,6 +445,7 @@ out:
 
 void verbs_uninit_context(struct verbs_context *context_ex)
 {
+	verbs_gid_cache_cleanup(&context_ex->priv->gid_cache);
 	free(context_ex->priv);
 	if (context_ex->context.cmd_fd != -1)
 		close(context_ex->context.cmd_fd);
@@ -485,6 +500,10 @@ LATEST_SYMVER_FUNC(ibv_get_async_event, 1_1, "IBVERBS_1.1",
 	case IBV_EVENT_WQ_FATAL:
 		event->element.wq = (void *) (uintptr_t) ev.element;
 		break;
+	case IBV_EVENT_GID_CHANGE:
+		verbs_gid_cache_invalidate(context);
+		event->element.port_num = ev.element;
+		break;
 	default:
 		event->element.port_num = ev.element;
 		break;
@@ -481,6 +481,19 @@ void verbs_register_driver(const struct verbs_device_ops *ops);
 		verbs_register_driver(&drv_struct);                            \
 	}
 
+/*
+ * Export a data path op under the name that verbs.h calls directly when an
+ * application statically linked to this provider sets RDMA_STATIC_DATAPATH.
+ * Only enabled for the provider selected by -DSTATIC_DATAPATH_PROVIDER.
+ */
+#ifdef RDMA_STATIC_DATAPATH_PROVIDER
+#define PROVIDER_DATAPATH_OP(provider_name, op, fn)                            \
+	extern typeof(fn) verbs_provider_##provider_name##_##op                \
+		__attribute__((alias(stringify(fn))))
+#else
+#define PROVIDER_DATAPATH_OP(provider_name, op, fn)
+#endif
+
 void *_verbs_init_and_alloc_context(struct ibv_device *device, int cmd_fd,
 				    size_t alloc_size,
 				    struct verbs_context *context_offset,
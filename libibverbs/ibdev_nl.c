@@ -32,8 +32,10 @@
 #include <util/rdma_nl.h>
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/socket.h>
 #include <sys/sysmacros.h>
 
 #include <ccan/list.h>
@@ -255,3 +257,110 @@ bool get_copy_on_fork(void)
 	nl_socket_free(nl);
 	return cof;
 }
+
+static int get_monitor_mode_cb(struct nl_msg *msg, void *data)
+{
+	struct nlattr *tb[RDMA_NLDEV_ATTR_MAX];
+	int ret;
+
+	ret = nlmsg_parse(nlmsg_hdr(msg), 0, tb, RDMA_NLDEV_ATTR_MAX - 1,
+			  rdmanl_policy);
+	if (ret < 0)
+		return ret;
+
+	if (tb[RDMA_NLDEV_SYS_ATTR_MONITOR_MODE])
+		*(uint8_t *)data =
+			nla_get_u8(tb[RDMA_NLDEV_SYS_ATTR_MONITOR_MODE]);
+	return NL_OK;
+}
+
+/*
+ * Whether nl_connect() sets close-on-exec depends on the libnl version, so
+ * create the fd here with SOCK_CLOEXEC and hand it to libnl already bound.
+ */
+static struct nl_sock *monitor_socket_alloc(void)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	struct nl_sock *nl;
+	int fd;
+
+	nl = nl_socket_alloc();
+	if (!nl)
+		return NULL;
+	nl_socket_disable_auto_ack(nl);
+	nl_socket_disable_msg_peek(nl);
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_RDMA);
+	if (fd < 0)
+		goto err;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    nl_socket_set_fd(nl, NETLINK_RDMA, fd)) {
+		close(fd);
+		goto err;
+	}
+	return nl;
+
+err:
+	nl_socket_free(nl);
+	return NULL;
+}
+
+/*
+ * Subscribe to the RDMA device register/unregister notifications. Kernels
+ * that do not advertise monitor support never send them, so no socket is
+ * returned in that case and the caller must keep rescanning. The socket
+ * lives until verbs_close_device_monitor() and must not leak across exec().
+ */
+struct nl_sock *verbs_open_device_monitor(void)
+{
+	uint8_t monitor_mode = 0;
+	struct nl_sock *nl;
+
+	nl = monitor_socket_alloc();
+	if (!nl)
+		return NULL;
+
+	if (rdmanl_get_sys(nl, get_monitor_mode_cb, &monitor_mode) ||
+	    !monitor_mode)
+		goto err;
+
+	if (nl_socket_add_membership(nl, RDMA_NL_GROUP_NOTIFY))
+		goto err;
+
+	return nl;
+
+err:
+	nl_socket_free(nl);
+	return NULL;
+}
+
+void verbs_close_device_monitor(struct nl_sock *nl)
+{
+	nl_socket_free(nl);
+}
+
+/*
+ * Drain all queued notifications. Any event, or a socket overflow that lost
+ * some, means the device list has to be rebuilt.
+ */
+bool verbs_device_monitor_changed(struct nl_sock *nl)
+{
+	int fd = nl_socket_get_fd(nl);
+	bool changed = false;
+	char buf[4096];
+	ssize_t len;
+
+	while (true) {
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len > 0) {
+			changed = true;
+			continue;
+		}
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return changed;
+		return true;
+	}
+}
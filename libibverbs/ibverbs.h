@@ -69,12 +69,31 @@ static inline void load_drivers(void)
 void load_drivers(void);
 #endif
 
+/*
+ * GID indexes already found by ibv_init_ah_from_wc(), in an open addressing
+ * hash on (port, GID, type). Port 0 marks an empty slot.
+ */
+struct verbs_gid_cache_entry {
+	union ibv_gid gid;
+	uint32_t port_num;
+	uint32_t gid_type;
+	int gid_index;
+};
+
+struct verbs_gid_cache {
+	pthread_mutex_t lock;
+	struct verbs_gid_cache_entry *entries;
+	uint32_t num_entries;
+	uint32_t hash_mask;
+};
+
 struct verbs_ex_private {
 	BMP_DECLARE(unsupported_ioctls, VERBS_OPS_NUM);
 	uint32_t driver_id;
 	bool use_ioctl_write;
 	struct verbs_context_ops ops;
 	bool imported;
+	struct verbs_gid_cache gid_cache;
 };
 
 static inline struct verbs_ex_private *get_priv(struct ibv_context *ctx)
@@ -87,9 +106,15 @@ static inline const struct verbs_context_ops *get_ops(struct ibv_context *ctx)
 	return &get_priv(ctx)->ops;
 }
 
+void verbs_gid_cache_invalidate(struct ibv_context *context);
+void verbs_gid_cache_cleanup(struct verbs_gid_cache *cache);
+
 enum ibv_node_type decode_knode_type(unsigned int knode_type);
 
 int find_sysfs_devs_nl(struct list_head *tmp_sysfs_dev_list);
+struct nl_sock *verbs_open_device_monitor(void);
+bool verbs_device_monitor_changed(struct nl_sock *nl);
+void verbs_close_device_monitor(struct nl_sock *nl);
 
 int try_access_device(const struct verbs_sysfs_dev *sysfs_dev);
 
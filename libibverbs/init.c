@@ -61,6 +61,7 @@ int abi_ver;
 
 static uint32_t verbs_log_level;
 static FILE *verbs_log_fp;
+static bool device_list_cache;
 
 __attribute__((format(printf, 3, 4)))
 void __verbs_log(struct verbs_context *ctx, uint32_t level,
@@ -548,15 +549,60 @@ static void try_all_drivers(struct list_head *sysfs_list,
 	}
 }
 
+/*
+ * With RDMAV_DEVICE_LIST_CACHE set the previous result is reused until the
+ * kernel reports that a device was added or removed. The subscription is
+ * made before the first scan so no event can slip in between. A forked child
+ * must not drain the parent's socket, so it drops its copy and subscribes
+ * again.
+ */
+static struct nl_sock *monitor;
+static bool monitor_tried;
+static pid_t monitor_pid;
+
+static bool device_list_changed(void)
+{
+	if (!device_list_cache)
+		return true;
+
+	if (monitor_tried && monitor_pid != getpid()) {
+		if (monitor)
+			verbs_close_device_monitor(monitor);
+		monitor = NULL;
+		monitor_tried = false;
+	}
+
+	if (!monitor_tried) {
+		monitor = verbs_open_device_monitor();
+		monitor_pid = getpid();
+		monitor_tried = true;
+		return true;
+	}
+
+	return !monitor || verbs_device_monitor_changed(monitor);
+}
+
+static void __attribute__((destructor)) device_monitor_fini(void)
+{
+	if (monitor)
+		verbs_close_device_monitor(monitor);
+	monitor = NULL;
+}
+
 int ibverbs_get_device_list(struct list_head *device_list)
 {
 	LIST_HEAD(sysfs_list);
 	struct verbs_sysfs_dev *sysfs_dev, *next_dev;
 	struct verbs_device *vdev, *tmp;
 	static int drivers_loaded;
+	static int cached_num_devices = -1;
 	unsigned int num_devices = 0;
 	int ret;
 
+	if (!device_list_changed() && cached_num_devices >= 0)
+		return cached_num_devices;
+	cached_num_devices = -1;
+
 	ret = find_sysfs_devs_nl(&sysfs_list);
 	if (ret) {
 		ret = find_sysfs_devs(&sysfs_list);
@@ -617,6 +663,7 @@ out:
 		free(sysfs_dev);
 	}
 
+	cached_num_devices = num_devices;
 	return num_devices;
 }
 
@@ -670,6 +717,8 @@ int ibverbs_init(void)
 			fprintf(stderr, PFX "Warning: fork()-safety requested "
 				"but init failed\n");
 
+	device_list_cache = check_env("RDMAV_DEVICE_LIST_CACHE");
+
 	verbs_allow_disassociate_destroy = check_env("RDMAV_ALLOW_DISASSOC_DESTROY")
 		/* Backward compatibility for the mlx4 driver env */
 		|| check_env("MLX4_DEVICE_FATAL_CLEANUP");
@@ -684,18 +733,25 @@ int ibverbs_init(void)
 	return 0;
 }
 
+/*
+ * Taking a reference requires already holding one, so it needs no ordering.
+ * Dropping one releases this thread's accesses to the device, and the final
+ * put acquires everyone else's before the device is freed.
+ */
 void ibverbs_device_hold(struct ibv_device *dev)
 {
 	struct verbs_device *verbs_device = verbs_get_device(dev);
 
-	atomic_fetch_add(&verbs_device->refcount, 1);
+	atomic_fetch_add_explicit(&verbs_device->refcount, 1,
+				  memory_order_relaxed);
 }
 
 void ibverbs_device_put(struct ibv_device *dev)
 {
 	struct verbs_device *verbs_device = verbs_get_device(dev);
 
-	if (atomic_fetch_sub(&verbs_device->refcount, 1) == 1) {
+	if (atomic_fetch_sub_explicit(&verbs_device->refcount, 1,
+				      memory_order_acq_rel) == 1) {
 		free(verbs_device->sysfs);
 		if (verbs_device->ops->uninit_device)
 			verbs_device->ops->uninit_device(verbs_device);
@@ -58,8 +58,24 @@ struct ibv_mem_node {
 	int			refcnt;
 };
 
-static struct ibv_mem_node *mm_root;
-static pthread_mutex_t mm_mutex = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * The address space is cut into MM_SHARD_SIZE granules which are hashed
+ * onto MM_NUM_SHARDS independent trees, each with its own lock, so that
+ * threads registering unrelated buffers do not serialize on one mutex. A
+ * range that crosses granules holds the locks of every shard it touches,
+ * taken in ascending index order.
+ */
+#define MM_SHARD_SHIFT		21
+#define MM_SHARD_SIZE		(1UL << MM_SHARD_SHIFT)
+#define MM_NUM_SHARDS_SHIFT	6
+#define MM_NUM_SHARDS		(1U << MM_NUM_SHARDS_SHIFT)
+
+struct ibv_mem_tree {
+	pthread_mutex_t		mutex;
+	struct ibv_mem_node    *root;
+};
+
+static struct ibv_mem_tree *mm_shards;
 static int page_size;
 static int huge_page_enabled;
 static int too_late;
@@ -124,14 +140,16 @@ out:
 
 int ibv_fork_init(void)
 {
+	struct ibv_mem_tree *shards;
 	void *tmp, *tmp_aligned;
 	int ret;
+	unsigned int i;
 	unsigned long size;
 
 	if (getenv("RDMAV_HUGEPAGES_SAFE"))
 		huge_page_enabled = 1;
 
-	if (mm_root)
+	if (mm_shards)
 		return 0;
 
 	if (ibv_is_fork_initialized() == IBV_FORK_UNNEEDED)
@@ -163,19 +181,39 @@ int ibv_fork_init(void)
 	if (ret)
 		return ENOSYS;
 
-	mm_root = malloc(sizeof *mm_root);
-	if (!mm_root)
+	shards = calloc(MM_NUM_SHARDS, sizeof(*shards));
+	if (!shards)
 		return ENOMEM;
 
-	mm_root->parent = NULL;
-	mm_root->left   = NULL;
-	mm_root->right  = NULL;
-	mm_root->color  = IBV_BLACK;
-	mm_root->start  = 0;
-	mm_root->end    = UINTPTR_MAX;
-	mm_root->refcnt = 0;
+	for (i = 0; i < MM_NUM_SHARDS; i++) {
+		struct ibv_mem_node *root;
+
+		root = malloc(sizeof(*root));
+		if (!root)
+			goto err;
+
+		root->parent = NULL;
+		root->left   = NULL;
+		root->right  = NULL;
+		root->color  = IBV_BLACK;
+		root->start  = 0;
+		root->end    = UINTPTR_MAX;
+		root->refcnt = 0;
 
+		pthread_mutex_init(&shards[i].mutex, NULL);
+		shards[i].root = root;
+	}
+
+	mm_shards = shards;
 	return 0;
+
+err:
+	while (i--) {
+		pthread_mutex_destroy(&shards[i].mutex);
+		free(shards[i].root);
+	}
+	free(shards);
+	return ENOMEM;
 }
 
 enum ibv_fork_status ibv_is_fork_initialized(void)
@@ -183,7 +221,7 @@ enum ibv_fork_status ibv_is_fork_initialized(void)
 	if (get_copy_on_fork())
 		return IBV_FORK_UNNEEDED;
 
-	return mm_root ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
+	return mm_shards ? IBV_FORK_ENABLED : IBV_FORK_DISABLED;
 }
 
 static struct ibv_mem_node *__mm_prev(struct ibv_mem_node *node)
@@ -218,7 +256,8 @@ static struct ibv_mem_node *__mm_next(struct ibv_mem_node *node)
 	return node;
 }
 
-static void __mm_rotate_right(struct ibv_mem_node *node)
+static void __mm_rotate_right(struct ibv_mem_tree *tree,
+			      struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -234,7 +273,7 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		tree->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -242,7 +281,8 @@ static void __mm_rotate_right(struct ibv_mem_node *node)
 	node->parent = tmp;
 }
 
-static void __mm_rotate_left(struct ibv_mem_node *node)
+static void __mm_rotate_left(struct ibv_mem_tree *tree,
+			     struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *tmp;
 
@@ -258,7 +298,7 @@ static void __mm_rotate_left(struct ibv_mem_node *node)
 		else
 			node->parent->left = tmp;
 	} else
-		mm_root = tmp;
+		tree->root = tmp;
 
 	tmp->parent = node->parent;
 
@@ -294,7 +334,8 @@ static int verify(struct ibv_mem_node *node)
 }
 #endif
 
-static void __mm_add_rebalance(struct ibv_mem_node *node)
+static void __mm_add_rebalance(struct ibv_mem_tree *tree,
+			       struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *parent, *gp, *uncle;
 
@@ -313,7 +354,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->right) {
-					__mm_rotate_left(parent);
+					__mm_rotate_left(tree, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -321,7 +362,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_right(gp);
+				__mm_rotate_right(tree, gp);
 			}
 		} else {
 			uncle = gp->left;
@@ -334,7 +375,7 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				node = gp;
 			} else {
 				if (node == parent->left) {
-					__mm_rotate_right(parent);
+					__mm_rotate_right(tree, parent);
 					node   = parent;
 					parent = node->parent;
 				}
@@ -342,19 +383,19 @@ static void __mm_add_rebalance(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				gp->color     = IBV_RED;
 
-				__mm_rotate_left(gp);
+				__mm_rotate_left(tree, gp);
 			}
 		}
 	}
 
-	mm_root->color = IBV_BLACK;
+	tree->root->color = IBV_BLACK;
 }
 
-static void __mm_add(struct ibv_mem_node *new)
+static void __mm_add(struct ibv_mem_tree *tree, struct ibv_mem_node *new)
 {
 	struct ibv_mem_node *node, *parent = NULL;
 
-	node = mm_root;
+	node = tree->root;
 	while (node) {
 		parent = node;
 		if (node->start < new->start)
@@ -373,10 +414,11 @@ static void __mm_add(struct ibv_mem_node *new)
 	new->right  = NULL;
 
 	new->color = IBV_RED;
-	__mm_add_rebalance(new);
+	__mm_add_rebalance(tree, new);
 }
 
-static void __mm_remove(struct ibv_mem_node *node)
+static void __mm_remove(struct ibv_mem_tree *tree,
+			struct ibv_mem_node *node)
 {
 	struct ibv_mem_node *child, *parent, *sib, *tmp;
 	int nodecol;
@@ -411,7 +453,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				node->parent->right = tmp;
 		} else
-			mm_root = tmp;
+			tree->root = tmp;
 	} else {
 		nodecol = node->color;
 
@@ -426,7 +468,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			else
 				parent->right = child;
 		} else
-			mm_root = child;
+			tree->root = child;
 	}
 
 	free(node);
@@ -434,14 +476,14 @@ static void __mm_remove(struct ibv_mem_node *node)
 	if (nodecol == IBV_RED)
 		return;
 
-	while ((!child || child->color == IBV_BLACK) && child != mm_root) {
+	while ((!child || child->color == IBV_BLACK) && child != tree->root) {
 		if (parent->left == child) {
 			sib = parent->right;
 
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_left(parent);
+				__mm_rotate_left(tree, parent);
 				sib = parent->right;
 			}
 
@@ -455,7 +497,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->left)
 						sib->left->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_right(sib);
+					__mm_rotate_right(tree, sib);
 					sib = parent->right;
 				}
 
@@ -463,8 +505,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->right)
 					sib->right->color = IBV_BLACK;
-				__mm_rotate_left(parent);
-				child = mm_root;
+				__mm_rotate_left(tree, parent);
+				child = tree->root;
 				break;
 			}
 		} else {
@@ -473,7 +515,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 			if (sib->color == IBV_RED) {
 				parent->color = IBV_RED;
 				sib->color    = IBV_BLACK;
-				__mm_rotate_right(parent);
+				__mm_rotate_right(tree, parent);
 				sib = parent->left;
 			}
 
@@ -487,7 +529,7 @@ static void __mm_remove(struct ibv_mem_node *node)
 					if (sib->right)
 						sib->right->color = IBV_BLACK;
 					sib->color = IBV_RED;
-					__mm_rotate_left(sib);
+					__mm_rotate_left(tree, sib);
 					sib = parent->left;
 				}
 
@@ -495,8 +537,8 @@ static void __mm_remove(struct ibv_mem_node *node)
 				parent->color = IBV_BLACK;
 				if (sib->left)
 					sib->left->color = IBV_BLACK;
-				__mm_rotate_right(parent);
-				child = mm_root;
+				__mm_rotate_right(tree, parent);
+				child = tree->root;
 				break;
 			}
 		}
@@ -506,9 +548,10 @@ static void __mm_remove(struct ibv_mem_node *node)
 		child->color = IBV_BLACK;
 }
 
-static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
+static struct ibv_mem_node *__mm_find_start(struct ibv_mem_tree *tree,
+					    uintptr_t start)
 {
-	struct ibv_mem_node *node = mm_root;
+	struct ibv_mem_node *node = tree->root;
 
 	while (node) {
 		if (node->start <= start && node->end >= start)
@@ -523,80 +566,177 @@ static struct ibv_mem_node *__mm_find_start(uintptr_t start, uintptr_t end)
 	return node;
 }
 
-static struct ibv_mem_node *merge_ranges(struct ibv_mem_node *node,
-					 struct ibv_mem_node *prev)
+static unsigned int mm_shard_index(uintptr_t addr)
+{
+	/* Fibonacci hash of the granule number */
+	return ((uint64_t)(addr >> MM_SHARD_SHIFT) * 0x9E3779B97F4A7C15ULL) >>
+	       (64 - MM_NUM_SHARDS_SHIFT);
+}
+
+static struct ibv_mem_tree *mm_shard(uintptr_t addr)
+{
+	return &mm_shards[mm_shard_index(addr)];
+}
+
+/* Last address of the granule holding start, clamped to end */
+static uintptr_t mm_chunk_end(uintptr_t start, uintptr_t end)
+{
+	uintptr_t chunk_end = start | (MM_SHARD_SIZE - 1);
+
+	return chunk_end < end ? chunk_end : end;
+}
+
+#define for_each_mm_chunk(cs, ce, start, end)				\
+	for (cs = start; cs <= end && ((ce = mm_chunk_end(cs, end)), 1); \
+	     cs = ce + 1)
+
+static uint64_t mm_lock_range(uintptr_t start, uintptr_t end)
+{
+	uint64_t mask = 0;
+	uintptr_t cs, ce;
+	unsigned int i;
+
+	for_each_mm_chunk(cs, ce, start, end) {
+		mask |= 1ULL << mm_shard_index(cs);
+		if (mask == UINT64_MAX)
+			break;
+	}
+
+	for (i = 0; i < MM_NUM_SHARDS; i++)
+		if (mask & (1ULL << i))
+			pthread_mutex_lock(&mm_shards[i].mutex);
+
+	return mask;
+}
+
+static void mm_unlock_range(uint64_t mask)
+{
+	unsigned int i;
+
+	for (i = MM_NUM_SHARDS; i--;)
+		if (mask & (1ULL << i))
+			pthread_mutex_unlock(&mm_shards[i].mutex);
+}
+
+static void merge_ranges(struct ibv_mem_tree *tree,
+			 struct ibv_mem_node *node, struct ibv_mem_node *prev)
 {
 	prev->end = node->end;
 	prev->refcnt = node->refcnt;
-	__mm_remove(node);
-
-	return prev;
+	__mm_remove(tree, node);
 }
 
-static struct ibv_mem_node *split_range(struct ibv_mem_node *node,
-					uintptr_t cut_line)
+static int split_range(struct ibv_mem_tree *tree, uintptr_t cut_line)
 {
-	struct ibv_mem_node *new_node = NULL;
+	struct ibv_mem_node *node, *new_node;
+
+	node = __mm_find_start(tree, cut_line);
+	if (node->start == cut_line)
+		return 0;
 
 	new_node = malloc(sizeof *new_node);
 	if (!new_node)
-		return NULL;
+		return -1;
 	new_node->start  = cut_line;
 	new_node->end    = node->end;
 	new_node->refcnt = node->refcnt;
 	node->end  = cut_line - 1;
-	__mm_add(new_node);
+	__mm_add(tree, new_node);
 
-	return new_node;
+	return 0;
 }
 
-static struct ibv_mem_node *get_start_node(uintptr_t start, uintptr_t end,
-					   int inc)
+/* Join the node starting at cut_line with its predecessor if they match */
+static void join_range(struct ibv_mem_tree *tree, uintptr_t cut_line)
 {
-	struct ibv_mem_node *node, *tmp = NULL;
+	struct ibv_mem_node *node, *prev;
 
-	node = __mm_find_start(start, end);
-	if (node->start < start)
-		node = split_range(node, start);
-	else {
-		tmp = __mm_prev(node);
-		if (tmp && tmp->refcnt == node->refcnt + inc)
-			node = merge_ranges(node, tmp);
-	}
-	return node;
+	node = __mm_find_start(tree, cut_line);
+	if (node->start != cut_line)
+		return;
+
+	prev = __mm_prev(node);
+	if (prev && prev->refcnt == node->refcnt)
+		merge_ranges(tree, node, prev);
 }
 
 /*
- * This function is called if madvise() fails to undo merging/splitting
- * operations performed on the node.
+ * Splitting does not change the refcount of any address, so it is the only
+ * step that may fail. Once every chunk boundary has its own node the refcount
+ * updates and the rollback path never need to allocate.
  */
-static struct ibv_mem_node *undo_node(struct ibv_mem_node *node,
-				      uintptr_t start, int inc)
+static int mm_split_chunks(uintptr_t start, uintptr_t end)
 {
-	struct ibv_mem_node *tmp = NULL;
-
-	/*
-	 * This condition can be true only if we merged this
-	 * node with the previous one, so we need to split them.
-	*/
-	if (start > node->start) {
-		tmp = split_range(node, start);
-		if (tmp) {
+	uintptr_t cs, ce;
+
+	for_each_mm_chunk(cs, ce, start, end) {
+		struct ibv_mem_tree *tree = mm_shard(cs);
+
+		if (split_range(tree, cs) || split_range(tree, ce + 1))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void mm_join_chunks(uintptr_t start, uintptr_t end)
+{
+	uintptr_t cs, ce;
+
+	for_each_mm_chunk(cs, ce, start, end) {
+		struct ibv_mem_tree *tree = mm_shard(cs);
+
+		join_range(tree, cs);
+		join_range(tree, ce + 1);
+	}
+}
+
+static void mm_update_chunks(uintptr_t start, uintptr_t end, int inc)
+{
+	struct ibv_mem_node *node;
+	uintptr_t cs, ce;
+
+	for_each_mm_chunk(cs, ce, start, end) {
+		node = __mm_find_start(mm_shard(cs), cs);
+		while (node && node->start <= ce) {
 			node->refcnt += inc;
-			node = tmp;
-		} else
-			return NULL;
+			node = __mm_next(node);
+		}
 	}
+}
 
-	tmp  =  __mm_prev(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(node, tmp);
+static bool mm_is_transition(struct ibv_mem_node *node, int inc)
+{
+	return inc == 1 ? node->refcnt == 1 : node->refcnt == 0;
+}
 
-	tmp  =  __mm_next(node);
-	if (tmp && tmp->refcnt == node->refcnt)
-		node = merge_ranges(tmp, node);
+/*
+ * Find the next run of addresses in [*pos, end] whose refcount just crossed
+ * zero. Adjacent runs are coalesced across shards so that a large range
+ * costs one madvise() no matter how many granules it covers.
+ */
+static bool mm_next_transition(uintptr_t *pos, uintptr_t end, int inc,
+			       uintptr_t *run_start, uintptr_t *run_end)
+{
+	struct ibv_mem_node *node;
+	uintptr_t addr = *pos;
+	bool found = false;
+
+	while (addr <= end) {
+		node = __mm_find_start(mm_shard(addr), addr);
+		if (mm_is_transition(node, inc)) {
+			if (!found)
+				*run_start = addr;
+			*run_end = node->end;
+			found = true;
+		} else if (found) {
+			break;
+		}
+		addr = node->end + 1;
+	}
 
-	return node;
+	*pos = addr;
+	return found;
 }
 
 static int do_madvise(void *addr, size_t length, int advice,
@@ -623,12 +763,11 @@ static int do_madvise(void *addr, size_t length, int advice,
 
 static int ibv_madvise_range(void *base, size_t size, int advice)
 {
-	uintptr_t start, end;
-	struct ibv_mem_node *node, *tmp;
+	uintptr_t start, end, pos, run_start = 0, run_end;
+	unsigned long range_page_size;
+	uint64_t locked;
 	int inc;
-	int rolling_back = 0;
 	int ret = 0;
-	unsigned long range_page_size;
 
 	if (!size || !base)
 		return 0;
@@ -641,83 +780,55 @@ static int ibv_madvise_range(void *base, size_t size, int advice)
 	start = (uintptr_t) base & ~(range_page_size - 1);
 	end   = ((uintptr_t) (base + size + range_page_size - 1) &
 		 ~(range_page_size - 1)) - 1;
-
-	pthread_mutex_lock(&mm_mutex);
-again:
 	inc = advice == MADV_DONTFORK ? 1 : -1;
 
-	node = get_start_node(start, end, inc);
-	if (!node) {
-		ret = -1;
-		goto out;
-	}
+	/* The chunk walks rely on end + 1 not wrapping */
+	if (end == UINTPTR_MAX)
+		return -1;
 
-	while (node && node->start <= end) {
-		if (node->end > end) {
-			if (!split_range(node, end + 1)) {
-				ret = -1;
-				goto out;
-			}
-		}
+	locked = mm_lock_range(start, end);
 
-		if ((inc == -1 && node->refcnt == 1) ||
-		    (inc ==  1 && node->refcnt == 0)) {
-			/*
-			 * If this is the first time through the loop,
-			 * and we merged this node with the previous
-			 * one, then we only want to do the madvise()
-			 * on start ... node->end (rather than
-			 * starting at node->start).
-			 *
-			 * Otherwise we end up doing madvise() on
-			 * bigger region than we're being asked to,
-			 * and that may lead to a spurious failure.
-			 */
-			if (start > node->start)
-				ret = do_madvise((void *) start,
-						 node->end - start + 1,
-						 advice, range_page_size);
-			else
-				ret = do_madvise((void *) node->start,
-						 node->end - node->start + 1,
-						 advice, range_page_size);
-			if (ret) {
-				node = undo_node(node, start, inc);
-
-				if (rolling_back || !node)
-					goto out;
-
-				/* madvise failed, roll back previous changes */
-				rolling_back = 1;
-				advice = advice == MADV_DONTFORK ?
-					MADV_DOFORK : MADV_DONTFORK;
-				end = node->end;
-				goto again;
-			}
-		}
+	ret = mm_split_chunks(start, end);
+	if (ret)
+		goto out;
+
+	mm_update_chunks(start, end, inc);
 
-		node->refcnt += inc;
-		node = __mm_next(node);
+	pos = start;
+	while (mm_next_transition(&pos, end, inc, &run_start, &run_end)) {
+		ret = do_madvise((void *) run_start, run_end - run_start + 1,
+				 advice, range_page_size);
+		if (ret)
+			break;
 	}
 
-	if (node) {
-		tmp = __mm_prev(node);
-		if (tmp && node->refcnt == tmp->refcnt)
-			node = merge_ranges(node, tmp);
+	if (ret) {
+		/* madvise failed, roll back the runs that were advised */
+		int undo = advice == MADV_DONTFORK ? MADV_DOFORK :
+						     MADV_DONTFORK;
+		uintptr_t failed = run_start;
+
+		pos = start;
+		while (failed > start &&
+		       mm_next_transition(&pos, failed - 1, inc, &run_start,
+					  &run_end))
+			do_madvise((void *) run_start,
+				   run_end - run_start + 1, undo,
+				   range_page_size);
+
+		mm_update_chunks(start, end, -inc);
 	}
 
 out:
-	if (rolling_back)
-		ret = -1;
+	mm_join_chunks(start, end);
+	mm_unlock_range(locked);
 
-	pthread_mutex_unlock(&mm_mutex);
-
-	return ret;
+	return ret ? -1 : 0;
 }
 
 int ibv_dontfork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_shards)
 		return ibv_madvise_range(base, size, MADV_DONTFORK);
 	else {
 		too_late = 1;
@@ -727,7 +838,7 @@ int ibv_dontfork_range(void *base, size_t size)
 
 int ibv_dofork_range(void *base, size_t size)
 {
-	if (mm_root)
+	if (mm_shards)
 		return ibv_madvise_range(base, size, MADV_DOFORK);
 	else {
 		too_late = 1;
@@ -751,6 +751,25 @@ int neigh_get_ll(struct get_neigh_handler *neigh_handler, void *addr_buff,
 	return neigh_len;
 }
 
+int neigh_get_dst(struct get_neigh_handler *neigh_handler, int *family,
+		  void *addr_buff, int addr_size)
+{
+	int dst_len;
+
+	if (neigh_handler->dst == NULL)
+		return -EINVAL;
+
+	dst_len = nl_addr_get_len(neigh_handler->dst);
+	if (dst_len > addr_size)
+		return -EINVAL;
+
+	*family = nl_addr_get_family(neigh_handler->dst);
+	memcpy(addr_buff, nl_addr_get_binary_addr(neigh_handler->dst),
+	       dst_len);
+
+	return dst_len;
+}
+
 void neigh_free_resources(struct get_neigh_handler *neigh_handler)
 {
 	/* Should be released first because it's holding a reference to dst */
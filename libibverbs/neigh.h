@@ -37,5 +37,7 @@ int neigh_set_dst(struct get_neigh_handler *neigh_handler,
 int neigh_get_oif_from_src(struct get_neigh_handler *neigh_handler);
 int neigh_get_ll(struct get_neigh_handler *neigh_handler, void *addr_buf,
 		 int addr_size);
+int neigh_get_dst(struct get_neigh_handler *neigh_handler, int *family,
+		  void *addr_buf, int addr_size);
 
 #endif
@@ -0,0 +1,545 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <ccan/list.h>
+
+#include "neigh_cache.h"
+
+/*
+ * Process wide cache of the L2 address resolved for a (SGID, DGID) pair.
+ *
+ * Entries are valid for ttl_ms, and are dropped or updated earlier when the
+ * kernel reports a change to the neighbour they were resolved from on the
+ * rtnetlink monitor socket. The socket is drained by lookups that miss, and
+ * by hits at most every NEIGH_CACHE_DRAIN_MS, so no thread is needed for it
+ * and hits normally make no system call. Misses from the non-blocking
+ * lookup are handed to a resolver thread that only runs while there is work
+ * queued.
+ */
+
+#define NEIGH_CACHE_BUCKETS 256
+#define NEIGH_CACHE_MAX_ENTRIES 4096
+/* The kernel's NUD_VALID, it is not part of the uAPI */
+#define NEIGH_NUD_VALID                                                        \
+	(NUD_PERMANENT | NUD_NOARP | NUD_REACHABLE | NUD_PROBE | NUD_STALE |   \
+	 NUD_DELAY)
+
+enum neigh_entry_state {
+	NEIGH_ENTRY_PENDING,
+	NEIGH_ENTRY_VALID,
+	NEIGH_ENTRY_FAILED,
+};
+
+struct neigh_entry {
+	struct list_node hash_entry;
+	struct list_node queue_entry;
+	struct neigh_cache_key key;
+	struct neigh_cache_result res;
+	enum neigh_entry_state state;
+	int err;
+	uint64_t expires;
+	/*
+	 * eventfd signalled when a pending entry completes, -1 if unused.
+	 * Lookups hand out duplicates of it, never this descriptor.
+	 */
+	int comp_fd;
+};
+
+struct neigh_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t resolver_done;
+	neigh_cache_resolve_t resolve;
+	unsigned int ttl_ms;
+	int monitor_fd;
+	uint64_t next_drain;
+	unsigned int num_entries;
+	bool resolver_running;
+	bool closing;
+	struct list_head queue;
+	struct list_head buckets[NEIGH_CACHE_BUCKETS];
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static struct list_head *key_bucket(struct neigh_cache *cache,
+				    const struct neigh_cache_key *key)
+{
+	uint32_t hash = 2166136261U;
+	const uint8_t *p = (const uint8_t *)key;
+	size_t i;
+
+	for (i = 0; i != sizeof(*key); i++)
+		hash = (hash ^ p[i]) * 16777619U;
+
+	return &cache->buckets[hash % NEIGH_CACHE_BUCKETS];
+}
+
+static struct neigh_entry *find_entry(struct neigh_cache *cache,
+				      const struct neigh_cache_key *key)
+{
+	struct neigh_entry *entry;
+
+	list_for_each(key_bucket(cache, key), entry, hash_entry)
+		if (!memcmp(&entry->key, key, sizeof(*key)))
+			return entry;
+
+	return NULL;
+}
+
+static void free_entry(struct neigh_cache *cache, struct neigh_entry *entry)
+{
+	list_del(&entry->hash_entry);
+	if (entry->comp_fd != -1)
+		close(entry->comp_fd);
+	cache->num_entries--;
+	free(entry);
+}
+
+static void complete_entry(struct neigh_entry *entry)
+{
+	uint64_t val = 1;
+	ssize_t __attribute__((unused)) rc;
+
+	if (entry->comp_fd != -1)
+		rc = write(entry->comp_fd, &val, sizeof(val));
+}
+
+/*
+ * Make room for one more entry. Pending entries are never evicted since the
+ * resolver thread or a waiter may still be using them.
+ */
+static bool reserve_entry(struct neigh_cache *cache)
+{
+	struct neigh_entry *entry, *tmp;
+	uint64_t now = now_ms();
+	unsigned int i;
+
+	if (cache->num_entries < NEIGH_CACHE_MAX_ENTRIES)
+		return true;
+
+	for (i = 0; i != NEIGH_CACHE_BUCKETS; i++)
+		list_for_each_safe(&cache->buckets[i], entry, tmp, hash_entry)
+			if (entry->state == NEIGH_ENTRY_VALID &&
+			    entry->expires <= now)
+				free_entry(cache, entry);
+
+	for (i = 0; i != NEIGH_CACHE_BUCKETS &&
+		    cache->num_entries >= NEIGH_CACHE_MAX_ENTRIES; i++)
+		list_for_each_safe(&cache->buckets[i], entry, tmp, hash_entry)
+			if (entry->state != NEIGH_ENTRY_PENDING) {
+				free_entry(cache, entry);
+				break;
+			}
+
+	return cache->num_entries < NEIGH_CACHE_MAX_ENTRIES;
+}
+
+static struct neigh_entry *add_entry(struct neigh_cache *cache,
+				     const struct neigh_cache_key *key,
+				     enum neigh_entry_state state)
+{
+	struct neigh_entry *entry;
+
+	if (!reserve_entry(cache))
+		return NULL;
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	entry->key = *key;
+	entry->state = state;
+	entry->comp_fd = -1;
+	list_add_tail(key_bucket(cache, key), &entry->hash_entry);
+	cache->num_entries++;
+	return entry;
+}
+
+static void neigh_event(struct neigh_cache *cache, int ifindex, int family,
+			const void *dst, size_t dst_len, const void *lladdr)
+{
+	struct neigh_entry *entry, *tmp;
+	unsigned int i;
+
+	if (dst_len > sizeof(entry->res.neigh_addr))
+		return;
+
+	/*
+	 * Entries are hashed on the GIDs, not on the neighbour, but events
+	 * are rare compared to lookups so a full scan is fine.
+	 */
+	for (i = 0; i != NEIGH_CACHE_BUCKETS; i++) {
+		list_for_each_safe(&cache->buckets[i], entry, tmp, hash_entry) {
+			if (entry->state != NEIGH_ENTRY_VALID ||
+			    entry->res.ifindex != ifindex ||
+			    entry->res.family != family ||
+			    memcmp(entry->res.neigh_addr, dst, dst_len))
+				continue;
+
+			if (lladdr)
+				memcpy(entry->res.mac, lladdr,
+				       sizeof(entry->res.mac));
+			else
+				free_entry(cache, entry);
+		}
+	}
+}
+
+static void flush_valid(struct neigh_cache *cache)
+{
+	struct neigh_entry *entry, *tmp;
+	unsigned int i;
+
+	for (i = 0; i != NEIGH_CACHE_BUCKETS; i++)
+		list_for_each_safe(&cache->buckets[i], entry, tmp, hash_entry)
+			if (entry->state == NEIGH_ENTRY_VALID)
+				free_entry(cache, entry);
+}
+
+static void process_nlmsgs(struct neigh_cache *cache, void *buf, size_t len)
+{
+	struct nlmsghdr *nlh;
+
+	for (nlh = buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		struct ndmsg *ndm = NLMSG_DATA(nlh);
+		void *dst = NULL, *lladdr = NULL;
+		size_t dst_len = 0, lladdr_len = 0;
+		struct rtattr *rta;
+		unsigned int attr_len;
+
+		if ((nlh->nlmsg_type != RTM_NEWNEIGH &&
+		     nlh->nlmsg_type != RTM_DELNEIGH) ||
+		    nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*ndm)))
+			continue;
+
+		attr_len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+		for (rta = (struct rtattr *)((char *)ndm +
+					     NLMSG_ALIGN(sizeof(*ndm)));
+		     RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+			if (rta->rta_type == NDA_DST) {
+				dst = RTA_DATA(rta);
+				dst_len = RTA_PAYLOAD(rta);
+			} else if (rta->rta_type == NDA_LLADDR) {
+				lladdr = RTA_DATA(rta);
+				lladdr_len = RTA_PAYLOAD(rta);
+			}
+		}
+
+		if (!dst)
+			continue;
+
+		if (nlh->nlmsg_type != RTM_NEWNEIGH ||
+		    !(ndm->ndm_state & NEIGH_NUD_VALID) ||
+		    lladdr_len != ETHERNET_LL_SIZE)
+			lladdr = NULL;
+
+		neigh_event(cache, ndm->ndm_ifindex, ndm->ndm_family, dst,
+			    dst_len, lladdr);
+	}
+}
+
+/* Called with the lock held, applies all the queued neighbour changes */
+static void drain_monitor(struct neigh_cache *cache)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	ssize_t len;
+
+	if (cache->monitor_fd == -1)
+		return;
+
+	while (true) {
+		len = recv(cache->monitor_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0) {
+			/* Events were lost, nothing can be trusted */
+			if (errno == ENOBUFS) {
+				flush_valid(cache);
+				continue;
+			}
+			return;
+		}
+		if (len == 0)
+			return;
+		process_nlmsgs(cache, buf, len);
+	}
+}
+
+/*
+ * Return the entry for key if it can be used, freeing it if it has expired.
+ */
+static struct neigh_entry *get_entry(struct neigh_cache *cache,
+				     const struct neigh_cache_key *key)
+{
+	struct neigh_entry *entry;
+	uint64_t now = now_ms();
+
+	entry = find_entry(cache, key);
+	if (!entry || now >= cache->next_drain) {
+		drain_monitor(cache);
+		cache->next_drain = now + NEIGH_CACHE_DRAIN_MS;
+		entry = find_entry(cache, key);
+	}
+
+	if (entry && entry->state == NEIGH_ENTRY_VALID &&
+	    entry->expires <= now) {
+		free_entry(cache, entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+static void *resolver_thread(void *arg)
+{
+	struct neigh_cache *cache = arg;
+	struct neigh_cache_result res;
+	struct neigh_entry *entry;
+	int err;
+
+	pthread_mutex_lock(&cache->lock);
+	while (!cache->closing) {
+		entry = list_pop(&cache->queue, struct neigh_entry,
+				 queue_entry);
+		if (!entry)
+			break;
+
+		/* Pending entries are never freed by anyone else */
+		pthread_mutex_unlock(&cache->lock);
+		memset(&res, 0, sizeof(res));
+		err = cache->resolve(&entry->key, &res);
+		pthread_mutex_lock(&cache->lock);
+
+		if (err) {
+			entry->state = NEIGH_ENTRY_FAILED;
+			entry->err = err;
+		} else {
+			entry->state = NEIGH_ENTRY_VALID;
+			entry->res = res;
+			entry->expires = now_ms() + cache->ttl_ms;
+		}
+		complete_entry(entry);
+	}
+	cache->resolver_running = false;
+	pthread_cond_broadcast(&cache->resolver_done);
+	pthread_mutex_unlock(&cache->lock);
+
+	return NULL;
+}
+
+static int queue_resolve(struct neigh_cache *cache, struct neigh_entry *entry)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	list_add_tail(&cache->queue, &entry->queue_entry);
+	if (cache->resolver_running)
+		return 0;
+
+	if (pthread_attr_init(&attr))
+		goto err;
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, resolver_thread, cache);
+	pthread_attr_destroy(&attr);
+	if (ret)
+		goto err;
+
+	cache->resolver_running = true;
+	return 0;
+
+err:
+	list_del(&entry->queue_entry);
+	return -EAGAIN;
+}
+
+/*
+ * Non-blocking lookup. Returns 0 and fills res on a hit. Otherwise starts
+ * resolving key in the background if that is not already in progress and
+ * returns -EAGAIN with *comp_fd set to an fd that becomes readable once the
+ * resolution completes, the lookup should then be repeated. Each such call
+ * returns a new fd that the caller owns and must close, it stays valid
+ * whatever happens to the entry. It should only be polled, reading it hides
+ * the completion from the other callers waiting on the same key. If the last
+ * resolution failed its error is returned once.
+ */
+int neigh_cache_lookup(struct neigh_cache *cache,
+		       const struct neigh_cache_key *key,
+		       struct neigh_cache_result *res, int *comp_fd)
+{
+	struct neigh_entry *entry;
+	int ret, fd;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = get_entry(cache, key);
+	if (!entry) {
+		entry = add_entry(cache, key, NEIGH_ENTRY_PENDING);
+		if (!entry) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		ret = queue_resolve(cache, entry);
+		if (ret) {
+			free_entry(cache, entry);
+			goto out;
+		}
+	}
+
+	switch (entry->state) {
+	case NEIGH_ENTRY_VALID:
+		*res = entry->res;
+		ret = 0;
+		break;
+	case NEIGH_ENTRY_FAILED:
+		ret = entry->err;
+		free_entry(cache, entry);
+		break;
+	case NEIGH_ENTRY_PENDING:
+	default:
+		if (entry->comp_fd == -1)
+			entry->comp_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		fd = entry->comp_fd == -1 ? -1 :
+			fcntl(entry->comp_fd, F_DUPFD_CLOEXEC, 0);
+		if (fd == -1) {
+			ret = -errno;
+			break;
+		}
+		*comp_fd = fd;
+		ret = -EAGAIN;
+		break;
+	}
+
+out:
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
+}
+
+/* Returns 0 and fills res only if key has a valid entry */
+int neigh_cache_get(struct neigh_cache *cache,
+		    const struct neigh_cache_key *key,
+		    struct neigh_cache_result *res)
+{
+	struct neigh_entry *entry;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = get_entry(cache, key);
+	if (entry && entry->state == NEIGH_ENTRY_VALID) {
+		*res = entry->res;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	return ret;
+}
+
+/*
+ * Record a result resolved by the caller. A pending entry for the same key
+ * is left to the resolver thread, its result will be the same.
+ */
+void neigh_cache_set(struct neigh_cache *cache,
+		     const struct neigh_cache_key *key,
+		     const struct neigh_cache_result *res)
+{
+	struct neigh_entry *entry;
+
+	pthread_mutex_lock(&cache->lock);
+	entry = find_entry(cache, key);
+	if (!entry)
+		entry = add_entry(cache, key, NEIGH_ENTRY_VALID);
+	if (entry && entry->state != NEIGH_ENTRY_PENDING) {
+		entry->state = NEIGH_ENTRY_VALID;
+		entry->res = *res;
+		entry->expires = now_ms() + cache->ttl_ms;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Open the rtnetlink socket that reports neighbour changes. Returns -1 if it
+ * is not available, the cache then relies on the TTL alone.
+ */
+int neigh_cache_open_monitor(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_NEIGH,
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* The cache takes ownership of monitor_fd, which may be -1 */
+struct neigh_cache *neigh_cache_alloc(neigh_cache_resolve_t resolve,
+				      unsigned int ttl_ms, int monitor_fd)
+{
+	struct neigh_cache *cache;
+	unsigned int i;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->resolver_done, NULL);
+	cache->resolve = resolve;
+	cache->ttl_ms = ttl_ms;
+	cache->monitor_fd = monitor_fd;
+	list_head_init(&cache->queue);
+	for (i = 0; i != NEIGH_CACHE_BUCKETS; i++)
+		list_head_init(&cache->buckets[i]);
+
+	return cache;
+}
+
+void neigh_cache_free(struct neigh_cache *cache)
+{
+	struct neigh_entry *entry, *tmp;
+	unsigned int i;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->closing = true;
+	while (cache->resolver_running)
+		pthread_cond_wait(&cache->resolver_done, &cache->lock);
+	pthread_mutex_unlock(&cache->lock);
+
+	for (i = 0; i != NEIGH_CACHE_BUCKETS; i++)
+		list_for_each_safe(&cache->buckets[i], entry, tmp, hash_entry)
+			free_entry(cache, entry);
+
+	if (cache->monitor_fd != -1)
+		close(cache->monitor_fd);
+	pthread_cond_destroy(&cache->resolver_done);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
@@ -0,0 +1,48 @@
+/* Licensed under the OpenIB.org BSD license (FreeBSD Variant) - See COPYING.md
+ */
+
+#ifndef _NEIGH_CACHE_H_
+#define _NEIGH_CACHE_H_
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+struct neigh_cache_key {
+	uint8_t sgid[16];
+	uint8_t dgid[16];
+};
+
+struct neigh_cache_result {
+	uint8_t mac[ETHERNET_LL_SIZE];
+	uint16_t vid;
+	/* The neighbour entry the MAC came from, matched against rtnetlink */
+	int ifindex;
+	int family;
+	uint8_t neigh_addr[16];
+};
+
+/* Blocking resolver, returns 0 or a negative errno */
+typedef int (*neigh_cache_resolve_t)(const struct neigh_cache_key *key,
+				     struct neigh_cache_result *res);
+
+struct neigh_cache;
+
+/* How long a cache hit may miss a neighbour change already reported */
+#define NEIGH_CACHE_DRAIN_MS 50
+
+struct neigh_cache *neigh_cache_alloc(neigh_cache_resolve_t resolve,
+				      unsigned int ttl_ms, int monitor_fd);
+void neigh_cache_free(struct neigh_cache *cache);
+int neigh_cache_open_monitor(void);
+
+int neigh_cache_lookup(struct neigh_cache *cache,
+		       const struct neigh_cache_key *key,
+		       struct neigh_cache_result *res, int *comp_fd);
+int neigh_cache_get(struct neigh_cache *cache,
+		    const struct neigh_cache_key *key,
+		    struct neigh_cache_result *res);
+void neigh_cache_set(struct neigh_cache *cache,
+		     const struct neigh_cache_key *key,
+		     const struct neigh_cache_result *res);
+
+#endif
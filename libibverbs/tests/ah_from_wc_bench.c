@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure ibv_init_ah_from_wc() for a GRH addressed to the last GID of the
+ * first port. The first call scans the GID table one entry at a time, the
+ * following ones find the index in the context's GID cache. Needs an RDMA
+ * device with a populated GID table, the test is skipped otherwise.
+ */
+#include <config.h>
+
+#include <endian.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+
+#define IB_NEXT_HDR 0x1b
+#define PORT_NUM 1
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The highest index holding a GID, which the linear scan reaches last */
+static int find_last_gid(struct ibv_context *ctx, struct ibv_gid_entry *out)
+{
+	struct ibv_port_attr port_attr;
+	struct ibv_gid_entry entry;
+	union ibv_gid zero = {};
+	int i, found = -1;
+
+	if (ibv_query_port(ctx, PORT_NUM, &port_attr))
+		return -1;
+
+	for (i = 0; i < port_attr.gid_tbl_len; i++) {
+		if (ibv_query_gid_ex(ctx, PORT_NUM, i, &entry, 0))
+			continue;
+		if (!memcmp(&entry.gid, &zero, sizeof(zero)))
+			continue;
+		*out = entry;
+		found = i;
+	}
+
+	return found;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int iterations = 1000000;
+	struct ibv_context *ctx = NULL;
+	struct ibv_device **list;
+	struct ibv_gid_entry entry;
+	struct ibv_ah_attr ah_attr;
+	struct ibv_wc wc = {};
+	struct ibv_grh grh = {};
+	double start, first, elapsed;
+	unsigned int i;
+	int failures = 0;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+
+	list = ibv_get_device_list(NULL);
+	if (list && list[0])
+		ctx = ibv_open_device(list[0]);
+	if (list)
+		ibv_free_device_list(list);
+	if (!ctx || find_last_gid(ctx, &entry) < 0) {
+		printf("No RDMA device with a GID table, skipping\n");
+		if (ctx)
+			ibv_close_device(ctx);
+		return 0;
+	}
+
+	wc.wc_flags = IBV_WC_GRH;
+	grh.version_tclass_flow = htobe32(6 << 28);
+	grh.next_hdr = entry.gid_type == IBV_GID_TYPE_ROCE_V2 ? IPPROTO_UDP :
+								IB_NEXT_HDR;
+	grh.dgid = entry.gid;
+
+	start = now_sec();
+	if (ibv_init_ah_from_wc(ctx, PORT_NUM, &wc, &grh, &ah_attr)) {
+		printf("  FAIL ibv_init_ah_from_wc\n");
+		failures++;
+	}
+	first = now_sec() - start;
+
+	start = now_sec();
+	for (i = 0; i < iterations; i++) {
+		if (ibv_init_ah_from_wc(ctx, PORT_NUM, &wc, &grh, &ah_attr) ||
+		    ah_attr.grh.sgid_index != entry.gid_index)
+			failures++;
+	}
+	elapsed = now_sec() - start;
+
+	printf("gid index %u: first call %.1f us, cached %.0f calls/sec\n",
+	       entry.gid_index, first * 1e6, iterations / elapsed);
+
+	ibv_close_device(ctx);
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
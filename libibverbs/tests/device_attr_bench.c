@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure the rate of ibv_get_device_guid()/ibv_get_device_name() calls done
+ * by monitoring threads, both alone and while other threads keep calling
+ * ibv_get_device_list(), which holds the device list lock while it rescans
+ * sysfs. The queried device is built here so no RDMA hardware is needed.
+ */
+#include <config.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/driver.h>
+
+#define MAX_THREADS 64
+#define TEST_GUID 0x0002c90300a1b2c3ULL
+
+static unsigned int iterations = 1000000;
+static struct verbs_sysfs_dev sysfs_dev = {
+	.flags = VSYSFS_READ_NODE_GUID,
+	.node_guid = TEST_GUID,
+};
+static struct verbs_device vdev = {
+	.device.name = "bench0",
+	.sysfs = &sysfs_dev,
+};
+static volatile bool stop_list;
+static int failures;
+
+struct thread_ctx {
+	pthread_t thread;
+	unsigned long bad;
+};
+
+static void *guid_thread(void *arg)
+{
+	struct thread_ctx *ctx = arg;
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		if (ibv_get_device_guid(&vdev.device) != htobe64(TEST_GUID))
+			ctx->bad++;
+		if (!ibv_get_device_name(&vdev.device))
+			ctx->bad++;
+	}
+
+	return NULL;
+}
+
+static void *list_thread(void *arg)
+{
+	struct ibv_device **list;
+
+	while (!stop_list) {
+		list = ibv_get_device_list(NULL);
+		if (list)
+			ibv_free_device_list(list);
+	}
+
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(unsigned int nthreads, unsigned int nlisters,
+	       struct thread_ctx *ctxs)
+{
+	pthread_t listers[MAX_THREADS];
+	double start, elapsed;
+	unsigned int i;
+
+	stop_list = false;
+	for (i = 0; i < nlisters; i++)
+		if (pthread_create(&listers[i], NULL, list_thread, NULL))
+			return -1;
+
+	start = now_sec();
+	for (i = 0; i < nthreads; i++) {
+		ctxs[i].bad = 0;
+		if (pthread_create(&ctxs[i].thread, NULL, guid_thread,
+				   &ctxs[i]))
+			return -1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(ctxs[i].thread, NULL);
+		if (ctxs[i].bad) {
+			printf("  FAIL thread %u: %lu bad reads\n", i,
+			       ctxs[i].bad);
+			failures++;
+		}
+	}
+	elapsed = now_sec() - start;
+
+	stop_list = true;
+	for (i = 0; i < nlisters; i++)
+		pthread_join(listers[i], NULL);
+
+	printf("%3u threads, %3u listing: %12.0f guid+name/sec\n", nthreads,
+	       nlisters, (double)nthreads * iterations / elapsed);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct thread_ctx ctxs[MAX_THREADS] = {};
+	unsigned int max_threads = 8;
+	unsigned int i;
+
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (!max_threads || max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+
+	for (i = 1; i <= max_threads; i *= 2) {
+		if (run(i, 0, ctxs))
+			return 1;
+		if (run(i, i, ctxs))
+			return 1;
+	}
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure the ibv_dontfork_range()/ibv_dofork_range() rate that backs
+ * ibv_reg_mr()/ibv_dereg_mr() in fork enabled processes, for an increasing
+ * number of threads. Each thread cycles through its own set of buffers and
+ * every iteration also takes a reference on a range shared by all threads,
+ * so the refcount handling across shards is exercised as well.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <infiniband/verbs.h>
+#include <infiniband/driver.h>
+
+#define MAX_THREADS 64
+#define BUFS_PER_THREAD 16
+#define BUF_PAGES 4
+
+static long page_size;
+static unsigned int iterations = 100000;
+static char *shared_buf;
+static int failures;
+
+struct thread_ctx {
+	pthread_t thread;
+	char *bufs;
+	int err;
+};
+
+static void *bench_thread(void *arg)
+{
+	struct thread_ctx *ctx = arg;
+	size_t len = BUF_PAGES * page_size;
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		char *buf = ctx->bufs + (i % BUFS_PER_THREAD) * len;
+
+		if (ibv_dontfork_range(buf, len) ||
+		    ibv_dontfork_range(shared_buf, page_size)) {
+			ctx->err = errno ? errno : EINVAL;
+			break;
+		}
+		if (ibv_dofork_range(shared_buf, page_size) ||
+		    ibv_dofork_range(buf, len)) {
+			ctx->err = errno ? errno : EINVAL;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Check that no VMA inside [buf, buf + len) is left marked VM_DONTCOPY */
+static bool range_is_dofork(char *buf, size_t len)
+{
+	unsigned long vma_start = 0, vma_end = 0;
+	bool ok = true, in_range = false;
+	char line[1024];
+	FILE *file;
+
+	file = fopen("/proc/self/smaps", "r");
+	if (!file)
+		return true;
+
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%lx-%lx", &vma_start, &vma_end) == 2) {
+			in_range = vma_start < (unsigned long)buf + len &&
+				   vma_end > (unsigned long)buf;
+			continue;
+		}
+		if (in_range && !strncmp(line, "VmFlags:", 8) &&
+		    strstr(line, " dc"))
+			ok = false;
+	}
+
+	fclose(file);
+	return ok;
+}
+
+static int run(unsigned int nthreads, struct thread_ctx *ctxs)
+{
+	double start, elapsed;
+	unsigned int i;
+
+	start = now_sec();
+	for (i = 0; i < nthreads; i++) {
+		ctxs[i].err = 0;
+		if (pthread_create(&ctxs[i].thread, NULL, bench_thread,
+				   &ctxs[i]))
+			return -1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(ctxs[i].thread, NULL);
+		if (ctxs[i].err) {
+			printf("  FAIL thread %u: %s\n", i,
+			       strerror(ctxs[i].err));
+			failures++;
+		}
+	}
+	elapsed = now_sec() - start;
+
+	printf("%3u threads: %12.0f reg+dereg/sec\n", nthreads,
+	       (double)nthreads * iterations / elapsed);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct thread_ctx ctxs[MAX_THREADS] = {};
+	unsigned int max_threads = 16;
+	size_t thread_len;
+	unsigned int i;
+	int ret;
+
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (!max_threads || max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+
+	ret = ibv_fork_init();
+	if (ret) {
+		printf("ibv_fork_init failed: %s\n", strerror(ret));
+		return 1;
+	}
+	if (ibv_is_fork_initialized() != IBV_FORK_ENABLED) {
+		printf("Fork protection is not needed on this kernel, skipping\n");
+		return 0;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	thread_len = BUFS_PER_THREAD * BUF_PAGES * page_size;
+
+	shared_buf = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (shared_buf == MAP_FAILED)
+		return 1;
+
+	for (i = 0; i < max_threads; i++) {
+		ctxs[i].bufs = mmap(NULL, thread_len, PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ctxs[i].bufs == MAP_FAILED)
+			return 1;
+	}
+
+	for (i = 1; i <= max_threads; i *= 2)
+		if (run(i, ctxs))
+			return 1;
+
+	if (!range_is_dofork(shared_buf, page_size)) {
+		printf("  FAIL shared range left as DONTFORK\n");
+		failures++;
+	}
+	for (i = 0; i < max_threads; i++) {
+		if (!range_is_dofork(ctxs[i].bufs, thread_len)) {
+			printf("  FAIL thread %u range left as DONTFORK\n", i);
+			failures++;
+		}
+		munmap(ctxs[i].bufs, thread_len);
+	}
+	munmap(shared_buf, page_size);
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,317 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Exercise the neighbour cache behind ibv_resolve_eth_l2_from_gid() with a
+ * fake resolver, and with rtnetlink neighbour messages fed through a
+ * socketpair instead of a real netlink socket.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/neighbour.h>
+#include <linux/rtnetlink.h>
+
+#include "../neigh_cache.h"
+
+static int failed_tests;
+
+#define EXPECT_EQ(expected, actual) \
+	({ \
+		typeof(expected) _expected = (expected); \
+		typeof(actual) _actual = (actual); \
+		if (_expected != _actual) { \
+			printf("  FAIL at line %d: %s not %s\n", __LINE__, \
+				#expected, #actual); \
+			printf("\tExpected: %ld\n", (long) _expected); \
+			printf("\t  Actual: %ld\n", (long) _actual); \
+			failed_tests++; \
+		} \
+	})
+
+#define TEST_IFINDEX 7
+
+static const uint8_t neigh_ip[4] = {192, 168, 1, 1};
+static const uint8_t mac_a[ETHERNET_LL_SIZE] = {0x02, 0, 0, 0, 0, 0xa};
+static const uint8_t mac_b[ETHERNET_LL_SIZE] = {0x02, 0, 0, 0, 0, 0xb};
+
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static bool resolve_blocked;
+static int resolve_calls;
+static int resolve_err;
+
+static int fake_resolve(const struct neigh_cache_key *key,
+			struct neigh_cache_result *res)
+{
+	pthread_mutex_lock(&resolve_lock);
+	resolve_calls++;
+	while (resolve_blocked)
+		pthread_cond_wait(&resolve_cond, &resolve_lock);
+	pthread_mutex_unlock(&resolve_lock);
+
+	if (resolve_err)
+		return resolve_err;
+
+	memcpy(res->mac, mac_a, sizeof(res->mac));
+	res->vid = 0xffff;
+	res->ifindex = TEST_IFINDEX;
+	res->family = AF_INET;
+	memcpy(res->neigh_addr, neigh_ip, sizeof(neigh_ip));
+	return 0;
+}
+
+static void set_resolve_blocked(bool blocked)
+{
+	pthread_mutex_lock(&resolve_lock);
+	resolve_blocked = blocked;
+	pthread_cond_broadcast(&resolve_cond);
+	pthread_mutex_unlock(&resolve_lock);
+}
+
+static void make_key(struct neigh_cache_key *key, uint8_t id)
+{
+	memset(key, 0, sizeof(*key));
+	key->sgid[15] = 1;
+	key->dgid[15] = id;
+}
+
+/* Send one RTM_NEWNEIGH/RTM_DELNEIGH message the way the kernel would */
+static void send_neigh(int fd, uint16_t type, uint16_t state, int ifindex,
+		       const uint8_t *lladdr)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+		char attrs[64];
+	} msg = {};
+	struct rtattr *rta;
+	ssize_t __attribute__((unused)) rc;
+
+	msg.nlh.nlmsg_type = type;
+	msg.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(msg.ndm));
+	msg.ndm.ndm_family = AF_INET;
+	msg.ndm.ndm_ifindex = ifindex;
+	msg.ndm.ndm_state = state;
+
+	rta = (struct rtattr *)((char *)&msg + NLMSG_ALIGN(msg.nlh.nlmsg_len));
+	rta->rta_type = NDA_DST;
+	rta->rta_len = RTA_LENGTH(sizeof(neigh_ip));
+	memcpy(RTA_DATA(rta), neigh_ip, sizeof(neigh_ip));
+	msg.nlh.nlmsg_len = NLMSG_ALIGN(msg.nlh.nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+	if (lladdr) {
+		rta = (struct rtattr *)((char *)&msg +
+					NLMSG_ALIGN(msg.nlh.nlmsg_len));
+		rta->rta_type = NDA_LLADDR;
+		rta->rta_len = RTA_LENGTH(ETHERNET_LL_SIZE);
+		memcpy(RTA_DATA(rta), lladdr, ETHERNET_LL_SIZE);
+		msg.nlh.nlmsg_len = NLMSG_ALIGN(msg.nlh.nlmsg_len) +
+				    RTA_ALIGN(rta->rta_len);
+	}
+
+	rc = send(fd, &msg, msg.nlh.nlmsg_len, 0);
+}
+
+static struct neigh_cache *alloc_cache(unsigned int ttl_ms, int *mock_fd)
+{
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds))
+		return NULL;
+	*mock_fd = fds[1];
+	return neigh_cache_alloc(fake_resolve, ttl_ms, fds[0]);
+}
+
+static void test_sync_get_set(void)
+{
+	struct neigh_cache_result res = {}, out;
+	struct neigh_cache_key key;
+	struct neigh_cache *cache;
+	int mock_fd;
+
+	cache = alloc_cache(60000, &mock_fd);
+	make_key(&key, 1);
+
+	EXPECT_EQ(-ENOENT, neigh_cache_get(cache, &key, &out));
+	EXPECT_EQ(0, fake_resolve(&key, &res));
+	neigh_cache_set(cache, &key, &res);
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+	EXPECT_EQ(0, memcmp(out.mac, mac_a, sizeof(mac_a)));
+
+	neigh_cache_free(cache);
+	close(mock_fd);
+}
+
+static void test_async_lookup(void)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct neigh_cache_result res;
+	struct neigh_cache_key key;
+	struct neigh_cache *cache;
+	int mock_fd, comp_fd = -1, fd2 = -1;
+
+	cache = alloc_cache(60000, &mock_fd);
+	make_key(&key, 2);
+	resolve_calls = 0;
+
+	set_resolve_blocked(true);
+	EXPECT_EQ(-EAGAIN, neigh_cache_lookup(cache, &key, &res, &comp_fd));
+	EXPECT_EQ(-EAGAIN, neigh_cache_lookup(cache, &key, &res, &fd2));
+	/* Every caller owns its own descriptor */
+	EXPECT_EQ(true, comp_fd != fd2);
+	pfd.fd = comp_fd;
+	EXPECT_EQ(0, poll(&pfd, 1, 0));
+	set_resolve_blocked(false);
+
+	EXPECT_EQ(1, poll(&pfd, 1, 5000));
+	pfd.fd = fd2;
+	EXPECT_EQ(1, poll(&pfd, 1, 0));
+	close(fd2);
+	close(comp_fd);
+	EXPECT_EQ(0, neigh_cache_lookup(cache, &key, &res, &comp_fd));
+	EXPECT_EQ(0, memcmp(res.mac, mac_a, sizeof(mac_a)));
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &res));
+	EXPECT_EQ(1, resolve_calls);
+
+	neigh_cache_free(cache);
+	close(mock_fd);
+}
+
+static void test_async_failure(void)
+{
+	struct pollfd pfd = { .events = POLLIN };
+	struct neigh_cache_result res;
+	struct neigh_cache_key key;
+	struct neigh_cache *cache;
+	int mock_fd, comp_fd = -1;
+
+	cache = alloc_cache(60000, &mock_fd);
+	make_key(&key, 3);
+
+	resolve_err = -EHOSTUNREACH;
+	EXPECT_EQ(-EAGAIN, neigh_cache_lookup(cache, &key, &res, &comp_fd));
+	pfd.fd = comp_fd;
+	EXPECT_EQ(1, poll(&pfd, 1, 5000));
+	EXPECT_EQ(-EHOSTUNREACH, neigh_cache_lookup(cache, &key, &res,
+						     &comp_fd));
+	/* The failed entry is gone, the caller's fd is still its own */
+	EXPECT_EQ(0, close(comp_fd));
+
+	/* The failure is reported once, the next lookup retries */
+	resolve_err = 0;
+	EXPECT_EQ(-EAGAIN, neigh_cache_lookup(cache, &key, &res, &comp_fd));
+	pfd.fd = comp_fd;
+	EXPECT_EQ(1, poll(&pfd, 1, 5000));
+	EXPECT_EQ(0, close(comp_fd));
+	EXPECT_EQ(0, neigh_cache_lookup(cache, &key, &res, &comp_fd));
+
+	neigh_cache_free(cache);
+	close(mock_fd);
+}
+
+static void wait_drain(void)
+{
+	usleep((NEIGH_CACHE_DRAIN_MS + 10) * 1000);
+}
+
+static void test_netlink_events(void)
+{
+	struct neigh_cache_result res = {}, out;
+	struct neigh_cache_key key;
+	struct neigh_cache *cache;
+	int mock_fd;
+
+	cache = alloc_cache(60000, &mock_fd);
+	make_key(&key, 4);
+	fake_resolve(&key, &res);
+	neigh_cache_set(cache, &key, &res);
+
+	/* Hits only look at the monitor socket every NEIGH_CACHE_DRAIN_MS */
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+	send_neigh(mock_fd, RTM_DELNEIGH, 0, TEST_IFINDEX, NULL);
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+	wait_drain();
+	EXPECT_EQ(-ENOENT, neigh_cache_get(cache, &key, &out));
+	neigh_cache_set(cache, &key, &res);
+
+	/* Another interface does not matter */
+	send_neigh(mock_fd, RTM_DELNEIGH, 0, TEST_IFINDEX + 1, NULL);
+	wait_drain();
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+
+	/* The neighbour changed its MAC */
+	send_neigh(mock_fd, RTM_NEWNEIGH, NUD_REACHABLE, TEST_IFINDEX, mac_b);
+	wait_drain();
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+	EXPECT_EQ(0, memcmp(out.mac, mac_b, sizeof(mac_b)));
+
+	/* Stale is still usable */
+	send_neigh(mock_fd, RTM_NEWNEIGH, NUD_STALE, TEST_IFINDEX, mac_b);
+	wait_drain();
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+
+	send_neigh(mock_fd, RTM_NEWNEIGH, NUD_FAILED, TEST_IFINDEX, NULL);
+	wait_drain();
+	EXPECT_EQ(-ENOENT, neigh_cache_get(cache, &key, &out));
+
+	neigh_cache_set(cache, &key, &res);
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+	send_neigh(mock_fd, RTM_DELNEIGH, 0, TEST_IFINDEX, NULL);
+	wait_drain();
+	EXPECT_EQ(-ENOENT, neigh_cache_get(cache, &key, &out));
+
+	neigh_cache_free(cache);
+	close(mock_fd);
+}
+
+static void test_ttl(void)
+{
+	struct neigh_cache_result res = {}, out;
+	struct neigh_cache_key key;
+	struct neigh_cache *cache;
+	int mock_fd;
+
+	cache = alloc_cache(20, &mock_fd);
+	make_key(&key, 5);
+	fake_resolve(&key, &res);
+	neigh_cache_set(cache, &key, &res);
+	EXPECT_EQ(0, neigh_cache_get(cache, &key, &out));
+	usleep(40000);
+	EXPECT_EQ(-ENOENT, neigh_cache_get(cache, &key, &out));
+
+	neigh_cache_free(cache);
+	close(mock_fd);
+}
+
+int main(int argc, char **argv)
+{
+	int all_failed_tests = 0;
+
+#define TEST(name) do { \
+	failed_tests = 0; \
+	name(); \
+	printf("%6s %s\n", failed_tests ? "FAILED" : "OK", #name); \
+	all_failed_tests += failed_tests; \
+	} while (0)
+
+	TEST(test_sync_get_set);
+	TEST(test_async_lookup);
+	TEST(test_async_failure);
+	TEST(test_netlink_events);
+	TEST(test_ttl);
+
+#undef TEST
+
+	if (all_failed_tests) {
+		printf("%d tests failed\n", all_failed_tests);
+		return 1;
+	}
+
+	return 0;
+}
@@ -53,6 +53,7 @@
 #include <net/if.h>
 #include <net/if_arp.h>
 #include "neigh.h"
+#include "neigh_cache.h"
 
 #undef ibv_query_port
 
@@ -777,7 +778,7 @@ int ibv_query_gid_type(struct ibv_context *context, uint8_t port_num,
 	return 0;
 }
 
-static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
+static int ibv_scan_gid_index(struct ibv_context *context, uint8_t port_num,
 			      union ibv_gid *gid,
 			      enum ibv_gid_type_sysfs gid_type)
 {
@@ -798,6 +799,211 @@ static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
 	return ret ? ret : i - 1;
 }
 
+static uint32_t gid_cache_hash(uint32_t port_num, const union ibv_gid *gid,
+			       enum ibv_gid_type_sysfs gid_type)
+{
+	uint64_t hash;
+
+	hash = be64toh(gid->global.subnet_prefix) * 0x9E3779B97F4A7C15ULL;
+	hash ^= be64toh(gid->global.interface_id);
+	hash ^= ((uint64_t)port_num << 1 | gid_type) << 56;
+	hash *= 0x9E3779B97F4A7C15ULL;
+
+	return hash >> 32;
+}
+
+static bool gid_cache_match(const struct verbs_gid_cache_entry *entry,
+			    uint32_t port_num, const union ibv_gid *gid,
+			    enum ibv_gid_type_sysfs gid_type)
+{
+	return entry->port_num == port_num && entry->gid_type == gid_type &&
+	       !memcmp(&entry->gid, gid, sizeof(*gid));
+}
+
+static int gid_cache_lookup(struct verbs_gid_cache *cache, uint32_t port_num,
+			    const union ibv_gid *gid,
+			    enum ibv_gid_type_sysfs gid_type)
+{
+	uint32_t i = gid_cache_hash(port_num, gid, gid_type);
+	struct verbs_gid_cache_entry *entry;
+
+	if (!cache->entries)
+		return -1;
+
+	for (;; i++) {
+		entry = &cache->entries[i & cache->hash_mask];
+		if (!entry->port_num)
+			return -1;
+		if (gid_cache_match(entry, port_num, gid, gid_type))
+			return entry->gid_index;
+	}
+}
+
+static void gid_cache_add_slot(struct verbs_gid_cache_entry *entries,
+			       uint32_t hash_mask,
+			       const struct verbs_gid_cache_entry *new)
+{
+	uint32_t i = gid_cache_hash(new->port_num, &new->gid, new->gid_type);
+
+	while (entries[i & hash_mask].port_num)
+		i++;
+	entries[i & hash_mask] = *new;
+}
+
+/* Keep the load factor at or below one half, on failure just don't cache */
+static void gid_cache_add(struct verbs_gid_cache *cache, uint32_t port_num,
+			  const union ibv_gid *gid,
+			  enum ibv_gid_type_sysfs gid_type, int gid_index)
+{
+	struct verbs_gid_cache_entry new = {
+		.gid = *gid,
+		.port_num = port_num,
+		.gid_type = gid_type,
+		.gid_index = gid_index,
+	};
+	struct verbs_gid_cache_entry *entries;
+	uint32_t nslots, i;
+
+	nslots = cache->entries ? cache->hash_mask + 1 : 0;
+	if ((cache->num_entries + 1) * 2 > nslots) {
+		nslots = nslots ? nslots * 2 : 16;
+		entries = calloc(nslots, sizeof(*entries));
+		if (!entries)
+			return;
+
+		for (i = 0; cache->entries && i <= cache->hash_mask; i++)
+			if (cache->entries[i].port_num)
+				gid_cache_add_slot(entries, nslots - 1,
+						   &cache->entries[i]);
+
+		free(cache->entries);
+		cache->entries = entries;
+		cache->hash_mask = nslots - 1;
+	}
+
+	gid_cache_add_slot(cache->entries, cache->hash_mask, &new);
+	cache->num_entries++;
+}
+
+void verbs_gid_cache_invalidate(struct ibv_context *context)
+{
+	struct verbs_gid_cache *cache = &get_priv(context)->gid_cache;
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->entries)
+		memset(cache->entries, 0,
+		       (cache->hash_mask + 1) * sizeof(*cache->entries));
+	cache->num_entries = 0;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void verbs_gid_cache_cleanup(struct verbs_gid_cache *cache)
+{
+	free(cache->entries);
+	cache->entries = NULL;
+	cache->num_entries = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
+
+static enum ibv_gid_type_sysfs gid_type_to_sysfs(uint32_t gid_type)
+{
+	return gid_type == IBV_GID_TYPE_ROCE_V2 ? IBV_GID_TYPE_SYSFS_ROCE_V2 :
+						  IBV_GID_TYPE_SYSFS_IB_ROCE_V1;
+}
+
+/* The GID table may change at any time, check a cached index still holds gid */
+static bool gid_index_holds(struct ibv_context *context, uint8_t port_num,
+			    int index, const union ibv_gid *gid,
+			    enum ibv_gid_type_sysfs gid_type)
+{
+	struct ibv_gid_entry entry;
+
+	if (ibv_query_gid_ex(context, port_num, index, &entry, 0))
+		return false;
+
+	return !memcmp(&entry.gid, gid, sizeof(*gid)) &&
+	       gid_type_to_sysfs(entry.gid_type) == gid_type;
+}
+
+/* Replace the cache content with the GID tables of all the ports */
+static int gid_cache_fill(struct ibv_context *context,
+			  struct verbs_gid_cache *cache)
+{
+	struct ibv_port_attr port_attr;
+	struct ibv_device_attr dev_attr;
+	struct ibv_gid_entry *entries;
+	size_t max_entries = 0;
+	ssize_t num, i;
+	int port;
+
+	if (ibv_query_device(context, &dev_attr))
+		return -1;
+
+	for (port = 1; port <= dev_attr.phys_port_cnt; port++) {
+		if (__lib_query_port(context, port, &port_attr,
+				     sizeof(port_attr)))
+			return -1;
+		max_entries += port_attr.gid_tbl_len;
+	}
+
+	entries = calloc(max_entries, sizeof(*entries));
+	if (!entries)
+		return -1;
+
+	num = ibv_query_gid_table(context, entries, max_entries, 0);
+	if (num < 0) {
+		free(entries);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (cache->entries)
+		memset(cache->entries, 0,
+		       (cache->hash_mask + 1) * sizeof(*cache->entries));
+	cache->num_entries = 0;
+	for (i = 0; i < num; i++)
+		gid_cache_add(cache, entries[i].port_num, &entries[i].gid,
+			      gid_type_to_sysfs(entries[i].gid_type),
+			      entries[i].gid_index);
+	pthread_mutex_unlock(&cache->lock);
+
+	free(entries);
+	return 0;
+}
+
+/*
+ * The GID tables are read into a per context cache with one query, the
+ * first time a GID is looked up and whenever a cached index turns out to be
+ * stale. A hit costs a single query of that index, so the application does
+ * not have to report GID changes. IBV_EVENT_GID_CHANGE from
+ * ibv_get_async_event() still empties the cache early.
+ */
+static int ibv_find_gid_index(struct ibv_context *context, uint8_t port_num,
+			      union ibv_gid *gid,
+			      enum ibv_gid_type_sysfs gid_type)
+{
+	struct verbs_gid_cache *cache = &get_priv(context)->gid_cache;
+	int index;
+
+	pthread_mutex_lock(&cache->lock);
+	index = gid_cache_lookup(cache, port_num, gid, gid_type);
+	pthread_mutex_unlock(&cache->lock);
+	if (index >= 0 &&
+	    gid_index_holds(context, port_num, index, gid, gid_type))
+		return index;
+
+	if (!gid_cache_fill(context, cache)) {
+		pthread_mutex_lock(&cache->lock);
+		index = gid_cache_lookup(cache, port_num, gid, gid_type);
+		pthread_mutex_unlock(&cache->lock);
+		if (index >= 0)
+			return index;
+	}
+
+	/* The GID is not there, or the table could not be read at once */
+	return ibv_scan_gid_index(context, port_num, gid, gid_type);
+}
+
 static inline void map_ipv4_addr_to_ipv6(__be32 ipv4, struct in6_addr *ipv6)
 {
 	ipv6->s6_addr32[0] = 0;
@@ -1028,43 +1234,37 @@ static inline int create_peer_from_gid(int family, void *raw_gid,
 }
 
 #define NEIGH_GET_DEFAULT_TIMEOUT_MS 3000
-int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
-				struct ibv_ah_attr *attr,
-				uint8_t eth_mac[ETHERNET_LL_SIZE],
-				uint16_t *vid)
+#define NEIGH_CACHE_TTL_MS 30000
+
+/* Blocking resolution of the L2 address of key->dgid as seen from key->sgid */
+static int resolve_eth_l2(const struct neigh_cache_key *key,
+			  struct neigh_cache_result *res)
 {
 	int dst_family;
 	int src_family;
 	int oif;
 	struct get_neigh_handler neigh_handler;
-	union ibv_gid sgid;
 	int ether_len;
 	struct peer_address src;
 	struct peer_address dst;
 	int ret = -EINVAL;
 	int err;
 
-	err = ibv_query_gid(context, attr->port_num,
-			    attr->grh.sgid_index, &sgid);
-
-	if (err)
-		return err;
-
 	err = neigh_init_resources(&neigh_handler,
 				   NEIGH_GET_DEFAULT_TIMEOUT_MS);
 
 	if (err)
 		return err;
 
-	dst_family = ipv6_addr_v4mapped((struct in6_addr *)attr->grh.dgid.raw) ?
+	dst_family = ipv6_addr_v4mapped((struct in6_addr *)key->dgid) ?
 			AF_INET : AF_INET6;
-	src_family = ipv6_addr_v4mapped((struct in6_addr *)sgid.raw) ?
+	src_family = ipv6_addr_v4mapped((struct in6_addr *)key->sgid) ?
 			AF_INET : AF_INET6;
 
-	if (create_peer_from_gid(dst_family, attr->grh.dgid.raw, &dst))
+	if (create_peer_from_gid(dst_family, (void *)key->dgid, &dst))
 		goto free_resources;
 
-	if (create_peer_from_gid(src_family, &sgid.raw, &src))
+	if (create_peer_from_gid(src_family, (void *)key->sgid, &src))
 		goto free_resources;
 
 	if (neigh_set_dst(&neigh_handler, dst_family, dst.address,
@@ -1088,22 +1288,24 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 	if (process_get_neigh(&neigh_handler))
 		goto free_resources;
 
-	if (vid) {
-		uint16_t ret_vid = neigh_get_vlan_id_from_dev(&neigh_handler);
-
-		if (ret_vid <= 0xfff)
-			neigh_set_vlan_id(&neigh_handler, ret_vid);
-		*vid = ret_vid;
-	}
+	res->vid = neigh_get_vlan_id_from_dev(&neigh_handler);
+	if (res->vid <= 0xfff)
+		neigh_set_vlan_id(&neigh_handler, res->vid);
 
 	/* We are using only Ethernet here */
 	ether_len = neigh_get_ll(&neigh_handler,
-				 eth_mac,
+				 res->mac,
 				 sizeof(uint8_t) * ETHERNET_LL_SIZE);
 
 	if (ether_len <= 0)
 		goto free_resources;
 
+	/* The neighbour is the gateway if the destination is routed */
+	res->ifindex = neigh_handler.oif;
+	if (neigh_get_dst(&neigh_handler, &res->family, res->neigh_addr,
+			  sizeof(res->neigh_addr)) < 0)
+		res->family = AF_UNSPEC;
+
 	ret = 0;
 
 free_resources:
@@ -1112,6 +1314,94 @@ free_resources:
 	return ret;
 }
 
+static pthread_once_t neigh_cache_once = PTHREAD_ONCE_INIT;
+static struct neigh_cache *neigh_cache;
+
+static void neigh_cache_init(void)
+{
+	int monitor_fd = neigh_cache_open_monitor();
+
+	neigh_cache = neigh_cache_alloc(resolve_eth_l2, NEIGH_CACHE_TTL_MS,
+					monitor_fd);
+	if (!neigh_cache && monitor_fd != -1)
+		close(monitor_fd);
+}
+
+static int get_neigh_cache_key(struct ibv_context *context,
+			       struct ibv_ah_attr *attr,
+			       struct neigh_cache_key *key)
+{
+	union ibv_gid sgid;
+	int err;
+
+	err = ibv_query_gid(context, attr->port_num,
+			    attr->grh.sgid_index, &sgid);
+	if (err)
+		return err;
+
+	memcpy(key->sgid, sgid.raw, sizeof(key->sgid));
+	memcpy(key->dgid, attr->grh.dgid.raw, sizeof(key->dgid));
+	return 0;
+}
+
+/*
+ * The blocking call always asks the kernel, as it did before the cache
+ * existed, and only records the result for ibv_resolve_eth_l2_from_gid_async.
+ */
+int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
+				struct ibv_ah_attr *attr,
+				uint8_t eth_mac[ETHERNET_LL_SIZE],
+				uint16_t *vid)
+{
+	struct neigh_cache_result res = {};
+	struct neigh_cache_key key;
+	int ret;
+
+	ret = get_neigh_cache_key(context, attr, &key);
+	if (ret)
+		return ret;
+
+	ret = resolve_eth_l2(&key, &res);
+	if (ret)
+		return ret;
+
+	pthread_once(&neigh_cache_once, neigh_cache_init);
+	if (neigh_cache)
+		neigh_cache_set(neigh_cache, &key, &res);
+
+	memcpy(eth_mac, res.mac, ETHERNET_LL_SIZE);
+	if (vid)
+		*vid = res.vid;
+	return 0;
+}
+
+int ibv_resolve_eth_l2_from_gid_async(struct ibv_context *context,
+				      struct ibv_ah_attr *attr,
+				      uint8_t eth_mac[ETHERNET_LL_SIZE],
+				      uint16_t *vid, int *comp_fd)
+{
+	struct neigh_cache_result res;
+	struct neigh_cache_key key;
+	int ret;
+
+	ret = get_neigh_cache_key(context, attr, &key);
+	if (ret)
+		return ret;
+
+	pthread_once(&neigh_cache_once, neigh_cache_init);
+	if (!neigh_cache)
+		return -ENOMEM;
+
+	ret = neigh_cache_lookup(neigh_cache, &key, &res, comp_fd);
+	if (ret)
+		return ret;
+
+	memcpy(eth_mac, res.mac, ETHERNET_LL_SIZE);
+	if (vid)
+		*vid = res.vid;
+	return 0;
+}
+
 int ibv_set_ece(struct ibv_qp *qp, struct ibv_ece *ece)
 {
 	if (!ece->vendor_id) {
@@ -2290,6 +2290,41 @@ static inline struct ibv_device **__ibv_get_device_list(int *num_devices)
 #define ibv_get_device_list(num_devices) __ibv_get_device_list(num_devices)
 #endif
 
+/*
+ * When statically linking against a single provider that was built with
+ * -DSTATIC_DATAPATH_PROVIDER=<name> the user can also set
+ * RDMA_STATIC_DATAPATH to that provider name. The data path verbs below then
+ * compare the context's op against the provider's implementation and call it
+ * directly, which removes the indirect branch and lets LTO inline it. Objects
+ * from any other provider, or using another variant of the op, still go
+ * through the ops table.
+ */
+#ifdef RDMA_STATIC_DATAPATH
+#define _RDMA_DATAPATH_SYM_(_provider, _op) verbs_provider_##_provider##_##_op
+#define _RDMA_DATAPATH_SYM(_provider, _op) _RDMA_DATAPATH_SYM_(_provider, _op)
+#define _RDMA_DATAPATH(_op) _RDMA_DATAPATH_SYM(RDMA_STATIC_DATAPATH, _op)
+
+int _RDMA_DATAPATH(poll_cq)(struct ibv_cq *cq, int num_entries,
+			    struct ibv_wc *wc);
+int _RDMA_DATAPATH(req_notify_cq)(struct ibv_cq *cq, int solicited_only);
+int _RDMA_DATAPATH(post_srq_recv)(struct ibv_srq *srq,
+				  struct ibv_recv_wr *recv_wr,
+				  struct ibv_recv_wr **bad_recv_wr);
+int _RDMA_DATAPATH(post_send)(struct ibv_qp *qp, struct ibv_send_wr *wr,
+			      struct ibv_send_wr **bad_wr);
+int _RDMA_DATAPATH(post_recv)(struct ibv_qp *qp, struct ibv_recv_wr *wr,
+			      struct ibv_recv_wr **bad_wr);
+
+#define _RDMA_DATAPATH_CALL(_ctx, _op, ...)                                    \
+	do {                                                                   \
+		if (__builtin_expect((_ctx)->ops._op == _RDMA_DATAPATH(_op),   \
+				     1))                                       \
+			return _RDMA_DATAPATH(_op)(__VA_ARGS__);               \
+	} while (0)
+#else
+#define _RDMA_DATAPATH_CALL(_ctx, _op, ...) do { } while (0)
+#endif
+
 /**
  * ibv_free_device_list - Free list from ibv_get_device_list()
  *
@@ -2924,6 +2959,7 @@ void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents);
  */
 static inline int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc)
 {
+	_RDMA_DATAPATH_CALL(cq->context, poll_cq, cq, num_entries, wc);
 	return cq->context->ops.poll_cq(cq, num_entries, wc);
 }
 
@@ -2938,6 +2974,7 @@ static inline int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc
  */
 static inline int ibv_req_notify_cq(struct ibv_cq *cq, int solicited_only)
 {
+	_RDMA_DATAPATH_CALL(cq->context, req_notify_cq, cq, solicited_only);
 	return cq->context->ops.req_notify_cq(cq, solicited_only);
 }
 
@@ -3037,6 +3074,8 @@ static inline int ibv_post_srq_recv(struct ibv_srq *srq,
 				    struct ibv_recv_wr *recv_wr,
 				    struct ibv_recv_wr **bad_recv_wr)
 {
+	_RDMA_DATAPATH_CALL(srq->context, post_srq_recv, srq, recv_wr,
+			    bad_recv_wr);
 	return srq->context->ops.post_srq_recv(srq, recv_wr, bad_recv_wr);
 }
 
@@ -3382,6 +3421,7 @@ static inline int ibv_destroy_rwq_ind_table(struct ibv_rwq_ind_table *rwq_ind_ta
 static inline int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
 				struct ibv_send_wr **bad_wr)
 {
+	_RDMA_DATAPATH_CALL(qp->context, post_send, qp, wr, bad_wr);
 	return qp->context->ops.post_send(qp, wr, bad_wr);
 }
 
@@ -3391,6 +3431,7 @@ static inline int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr,
 static inline int ibv_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr,
 				struct ibv_recv_wr **bad_wr)
 {
+	_RDMA_DATAPATH_CALL(qp->context, post_recv, qp, wr, bad_wr);
 	return qp->context->ops.post_recv(qp, wr, bad_wr);
 }
 
@@ -3489,6 +3530,11 @@ int ibv_resolve_eth_l2_from_gid(struct ibv_context *context,
 				uint8_t eth_mac[ETHERNET_LL_SIZE],
 				uint16_t *vid);
 
+int ibv_resolve_eth_l2_from_gid_async(struct ibv_context *context,
+				      struct ibv_ah_attr *attr,
+				      uint8_t eth_mac[ETHERNET_LL_SIZE],
+				      uint16_t *vid, int *comp_fd);
+
 static inline int ibv_is_qpt_supported(uint32_t caps, enum ibv_qp_type qpt)
 {
 	return !!(caps & (1 << qpt));
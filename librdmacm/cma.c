@@ -47,6 +47,7 @@
 #include <netdb.h>
 #include <syslog.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/sysmacros.h>
 
 #include "cma.h"
@@ -2786,11 +2787,28 @@ static int ucma_passive_ep(struct rdma_cm_id *id, struct rdma_addrinfo *res,
 	return 0;
 }
 
+static int ucma_set_connect_data(struct rdma_cm_id *id,
+				 struct rdma_addrinfo *res)
+{
+	struct cma_id_private *id_priv;
+
+	if (!res->ai_connect_len)
+		return 0;
+
+	id_priv = container_of(id, struct cma_id_private, id);
+	id_priv->connect = malloc(res->ai_connect_len);
+	if (!id_priv->connect)
+		return ERR(ENOMEM);
+
+	memcpy(id_priv->connect, res->ai_connect, res->ai_connect_len);
+	id_priv->connect_len = res->ai_connect_len;
+	return 0;
+}
+
 int rdma_create_ep(struct rdma_cm_id **id, struct rdma_addrinfo *res,
 		   struct ibv_pd *pd, struct ibv_qp_init_attr *qp_init_attr)
 {
 	struct rdma_cm_id *cm_id;
-	struct cma_id_private *id_priv;
 	int ret;
 
 	ret = rdma_create_id2(NULL, &cm_id, NULL, res->ai_port_space, res->ai_qp_type);
@@ -2830,16 +2848,9 @@ int rdma_create_ep(struct rdma_cm_id **id, struct rdma_addrinfo *res,
 			goto err;
 	}
 
-	if (res->ai_connect_len) {
-		id_priv = container_of(cm_id, struct cma_id_private, id);
-		id_priv->connect = malloc(res->ai_connect_len);
-		if (!id_priv->connect) {
-			ret = ERR(ENOMEM);
-			goto err;
-		}
-		memcpy(id_priv->connect, res->ai_connect, res->ai_connect_len);
-		id_priv->connect_len = res->ai_connect_len;
-	}
+	ret = ucma_set_connect_data(cm_id, res);
+	if (ret)
+		goto err;
 
 out:
 	*id = cm_id;
@@ -2867,6 +2878,213 @@ void rdma_destroy_ep(struct rdma_cm_id *id)
 	rdma_destroy_id(id);
 }
 
+static int ucma_ep_resolve_addr(struct rdma_ep_req *req)
+{
+	struct rdma_addrinfo *res = req->res;
+
+	if (af_ib_support)
+		return rdma_resolve_addr2(req->id, res->ai_src_addr,
+					  res->ai_src_len, res->ai_dst_addr,
+					  res->ai_dst_len, 2000);
+	return rdma_resolve_addr(req->id, res->ai_src_addr, res->ai_dst_addr,
+				 2000);
+}
+
+static int ucma_ep_resolve_route(struct rdma_ep_req *req)
+{
+	struct rdma_addrinfo *res = req->res;
+
+	if (res->ai_route_len)
+		return rdma_set_option(req->id, RDMA_OPTION_IB,
+				       RDMA_OPTION_IB_PATH, res->ai_route,
+				       res->ai_route_len);
+	return rdma_resolve_route(req->id, 2000);
+}
+
+static int ucma_ep_connect(struct rdma_ep_req *req)
+{
+	int ret;
+
+	if (req->qp_init_attr) {
+		req->qp_init_attr->qp_type = req->res->ai_qp_type;
+		ret = rdma_create_qp(req->id, req->pd, req->qp_init_attr);
+		if (ret)
+			return ret;
+	}
+
+	ret = ucma_set_connect_data(req->id, req->res);
+	if (ret)
+		return ret;
+
+	return rdma_connect(req->id, req->conn_param);
+}
+
+/*
+ * Each event moves a request to its next step: address resolution, route
+ * resolution, then connecting.  A request is done once its status is no
+ * longer EINPROGRESS.
+ */
+static void ucma_ep_process_event(struct rdma_ep_req *req,
+				  struct rdma_cm_event *event)
+{
+	int ret;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		ret = ucma_ep_resolve_route(req);
+		break;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		ret = ucma_ep_connect(req);
+		break;
+	case RDMA_CM_EVENT_CONNECT_RESPONSE:
+	case RDMA_CM_EVENT_ESTABLISHED:
+		req->status = 0;
+		return;
+	case RDMA_CM_EVENT_REJECTED:
+		req->status = ECONNREFUSED;
+		return;
+	default:
+		if (event->status < 0)
+			req->status = -event->status;
+		else if (event->status)
+			req->status = event->status;
+		else
+			req->status = ECONNABORTED;
+		return;
+	}
+
+	if (ret)
+		req->status = errno;
+}
+
+static int ucma_ep_wait(struct rdma_event_channel *channel,
+			struct timespec *deadline)
+{
+	struct pollfd fds = { .fd = channel->fd, .events = POLLIN };
+	struct timespec now;
+	int64_t timeout;
+
+	do {
+		timeout = -1;
+		if (deadline) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = (deadline->tv_sec - now.tv_sec) * 1000 +
+				  (deadline->tv_nsec - now.tv_nsec) / 1000000;
+			if (timeout < 0)
+				timeout = 0;
+		}
+	} while (poll(&fds, 1, timeout) < 0 && errno == EINTR);
+
+	return (fds.revents & POLLIN) ? 0 : ERR(ETIMEDOUT);
+}
+
+/*
+ * A connected request is moved to the user's channel right away, so that
+ * the events that follow, such as a disconnect, are reported there rather
+ * than read and dropped from the internal channel.
+ */
+static void ucma_ep_complete(struct rdma_ep_req *req,
+			     struct rdma_event_channel *channel)
+{
+	req->id->context = req->context;
+	if (rdma_migrate_id(req->id, channel)) {
+		req->status = errno;
+		req->id->context = req;
+	}
+}
+
+int rdma_connect_eps(struct rdma_event_channel *channel,
+		     struct rdma_ep_req *reqs, int cnt, int timeout_ms)
+{
+	struct rdma_event_channel *ep_channel;
+	struct rdma_cm_event *event;
+	struct rdma_ep_req *req;
+	struct timespec deadline;
+	int i, ret, pending = 0, connected = 0;
+
+	if (!reqs || cnt <= 0)
+		return ERR(EINVAL);
+
+	ep_channel = rdma_create_event_channel();
+	if (!ep_channel)
+		return -1;
+
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	for (i = 0; i < cnt; i++) {
+		req = &reqs[i];
+		req->id = NULL;
+		ret = rdma_create_id2(ep_channel, &req->id, req,
+				      req->res->ai_port_space,
+				      req->res->ai_qp_type);
+		if (!ret)
+			ret = ucma_ep_resolve_addr(req);
+		if (ret) {
+			req->status = errno;
+			if (req->id)
+				rdma_destroy_id(req->id);
+			req->id = NULL;
+		} else {
+			req->status = EINPROGRESS;
+			pending++;
+		}
+	}
+
+	if (!pending) {
+		rdma_destroy_event_channel(ep_channel);
+		return ERR(reqs[0].status);
+	}
+
+	while (pending) {
+		if (ucma_ep_wait(ep_channel, timeout_ms >= 0 ? &deadline : NULL))
+			break;
+
+		if (rdma_get_cm_event(ep_channel, &event))
+			break;
+
+		/* Only failed requests, which are destroyed below, get here */
+		req = event->id->context;
+		if (req->status != EINPROGRESS) {
+			rdma_ack_cm_event(event);
+			continue;
+		}
+
+		ucma_ep_process_event(req, event);
+		rdma_ack_cm_event(event);
+		if (req->status == EINPROGRESS)
+			continue;
+
+		pending--;
+		if (!req->status)
+			ucma_ep_complete(req, channel);
+	}
+
+	for (i = 0; i < cnt; i++) {
+		req = &reqs[i];
+		if (req->status == EINPROGRESS)
+			req->status = ETIMEDOUT;
+
+		if (req->status) {
+			if (req->id)
+				rdma_destroy_ep(req->id);
+			req->id = NULL;
+		} else {
+			connected++;
+		}
+	}
+
+	rdma_destroy_event_channel(ep_channel);
+	return connected;
+}
+
 int ucma_max_qpsize(struct rdma_cm_id *id)
 {
 	struct cma_id_private *id_priv;
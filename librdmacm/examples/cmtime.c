@@ -63,6 +63,8 @@ static uint32_t base_qpn = 1000;
 static _Atomic(uint32_t) cur_qpn;
 static uint32_t mimic_qp_delay;
 static bool mimic;
+static bool pipeline;
+static bool histogram;
 
 enum step {
 	STEP_FULL_CONNECT,
@@ -137,12 +139,63 @@ static struct ibv_cq *cq;
 #define start_time(s)		do { times[s][0] = gettime_us(); } while (0)
 #define end_time(s)		do { times[s][1] = gettime_us(); } while (0)
 
+#define HIST_BUCKETS 32		/* power of 2 microsecond buckets */
+
 
 static inline bool is_client(void)
 {
 	return dst_addr != NULL;
 }
 
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * Print a log2 histogram of the time each connection spent in each step,
+ * along with the median and 99th percentile.
+ */
+static void show_histogram(int iter)
+{
+	uint32_t hist[HIST_BUCKETS], *diffs;
+	int i, c, b, cnt;
+
+	diffs = calloc(iter, sizeof(*diffs));
+	if (!diffs)
+		return;
+
+	for (i = 0; i < STEP_CNT; i++) {
+		memset(hist, 0, sizeof hist);
+		for (c = 0, cnt = 0; c < iter; c++) {
+			if (!nodes[c].times[i][0] || !nodes[c].times[i][1])
+				continue;
+
+			diffs[cnt] = (uint32_t) (nodes[c].times[i][1] -
+						 nodes[c].times[i][0]);
+			for (b = 0; b < HIST_BUCKETS - 1 &&
+			     diffs[cnt] >= (1U << b); b++)
+				;
+			hist[b]++;
+			cnt++;
+		}
+		if (!cnt)
+			continue;
+
+		qsort(diffs, cnt, sizeof(*diffs), compare_u32);
+		printf("%-13s  p50(us) %10u  p99(us) %10u\n", step_str[i],
+		       diffs[cnt / 2], diffs[(cnt * 99) / 100]);
+		for (b = 0; b < HIST_BUCKETS; b++) {
+			if (hist[b])
+				printf("  < %10u us %10u\n", 1U << b, hist[b]);
+		}
+	}
+
+	free(diffs);
+}
+
 static void show_perf(int iter)
 {
 	uint32_t diff, max[STEP_CNT], min[STEP_CNT], sum[STEP_CNT];
@@ -176,6 +229,10 @@ static void show_perf(int iter)
 	else
 		printf("cm_conn        %10d\n", iter);
 	printf("threads        %10d\n", num_threads);
+	diff = (uint32_t) (times[STEP_FULL_CONNECT][1] -
+			   times[STEP_FULL_CONNECT][0]);
+	if (diff)
+		printf("conn/sec       %10.0f\n", iter * 1000000.0 / diff);
 
 	printf("step             avg/iter  total(us)    us/conn    sum(us)    max(us)    min(us)\n");
 	for (i = 0; i < STEP_CNT; i++) {
@@ -185,6 +242,9 @@ static void show_perf(int iter)
 			step_str[i], diff / iter, diff,
 			sum[i] / iter, sum[i], max[i], min[i]);
 	}
+
+	if (histogram)
+		show_histogram(iter);
 }
 
 static void sock_listen(int *listen_sock, int backlog)
@@ -485,6 +545,19 @@ static void resolve_route(struct work_item *item)
 	}
 }
 
+/*
+ * With -P, each connection moves to its next step as soon as the previous
+ * one completes, rather than waiting for all connections to finish a step.
+ */
+static void pipeline_connect(struct work_item *item)
+{
+	struct node *n = container_of(item, struct node, work);
+
+	create_qp(item);
+	modify_qp(n, IBV_QPS_INIT, STEP_INIT_QP_ATTR);
+	connect_qp(n);
+}
+
 static void connect_response(struct work_item *item)
 {
 	struct node *n = container_of(item, struct node, work);
@@ -551,10 +624,14 @@ static void cma_handler(struct rdma_cm_id *id, struct rdma_cm_event *event)
 	case RDMA_CM_EVENT_ADDR_RESOLVED:
 		end_perf(n, STEP_RESOLVE_ADDR);
 		atomic_fetch_add(&completed[STEP_RESOLVE_ADDR], 1);
+		if (pipeline)
+			wq_insert(&wq, &n->work, resolve_route);
 		break;
 	case RDMA_CM_EVENT_ROUTE_RESOLVED:
 		end_perf(n, STEP_RESOLVE_ROUTE);
 		atomic_fetch_add(&completed[STEP_RESOLVE_ROUTE], 1);
+		if (pipeline)
+			wq_insert(&wq, &n->work, pipeline_connect);
 		break;
 	case RDMA_CM_EVENT_CONNECT_REQUEST:
 		if (node_index == 0) {
@@ -754,6 +831,33 @@ static void server_connect(int iter)
 	destroy_ids(iter);
 }
 
+/*
+ * Set the total time of each step to run from the start of the pipeline
+ * until the last connection completed it.
+ */
+static void client_pipeline(int iter)
+{
+	uint64_t start;
+	int i, s;
+
+	printf("\tConnecting (pipelined)\n");
+	start = gettime_us();
+	for (i = 0; i < iter; i++)
+		wq_insert(&wq, &nodes[i].work, resolve_addr);
+
+	while (atomic_load(&completed[STEP_CONNECT]) < iter)
+		sched_yield();
+	end_time(STEP_FULL_CONNECT);
+
+	for (s = STEP_RESOLVE_ADDR; s <= STEP_ESTABLISH; s++) {
+		times[s][0] = start;
+		for (i = 0; i < iter; i++) {
+			if (nodes[i].times[s][1] > times[s][1])
+				times[s][1] = nodes[i].times[s][1];
+		}
+	}
+}
+
 static void client_connect(int iter)
 {
 	int i, ret;
@@ -777,6 +881,11 @@ static void client_connect(int iter)
 		end_time(STEP_BIND);
 	}
 
+	if (pipeline) {
+		client_pipeline(iter);
+		goto disconnect;
+	}
+
 	printf("\tResolving addresses\n");
 	start_time(STEP_RESOLVE_ADDR);
 	for (i = 0; i < iter; i++)
@@ -825,6 +934,7 @@ static void client_connect(int iter)
 	end_time(STEP_CONNECT);
 	end_time(STEP_FULL_CONNECT);
 
+disconnect:
 	oob_sendrecv(oob_sock, STEP_CONNECT);
 
 	printf("\tDisconnecting\n");
@@ -920,7 +1030,7 @@ int main(int argc, char **argv)
 
 	hints.ai_port_space = RDMA_PS_TCP;
 	hints.ai_qp_type = IBV_QPT_RC;
-	while ((op = getopt(argc, argv, "s:b:c:m:n:p:q:r:St:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:c:Hm:n:Pp:q:r:St:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -931,6 +1041,12 @@ int main(int argc, char **argv)
 		case 'c':
 			iter = atoi(optarg);
 			break;
+		case 'H':
+			histogram = true;
+			break;
+		case 'P':
+			pipeline = true;
+			break;
 		case 'p':
 			port = optarg;
 			break;
@@ -960,6 +1076,8 @@ int main(int argc, char **argv)
 			printf("\t[-s server_address]\n");
 			printf("\t[-b bind_address]\n");
 			printf("\t[-c connections]\n");
+			printf("\t[-H] (show per step latency histograms)\n");
+			printf("\t[-P] (pipeline the client connection steps)\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-q base_qpn]\n");
 			printf("\t[-m mimic_qp_delay_us]\n");
@@ -78,6 +78,13 @@ static inline int rs_socket(int f, int t, int p)
 	use_rs ? rrecvfrom(s,b,l,f,a,al) : recvfrom(s,b,l,f,a,al)
 #define rs_sendto(s,b,l,f,a,al) \
 	use_rs ? rsendto(s,b,l,f,a,al)   : sendto(s,b,l,f,a,al)
+#define rs_recvmsg(s,m,f) use_rs ? rrecvmsg(s,m,f) : recvmsg(s,m,f)
+#define rs_recvmmsg(s,m,n,f,t) \
+	use_rs ? rrecvmmsg(s,m,n,f,t)    : recvmmsg(s,m,n,f,t)
+#define rs_sendmmsg(s,m,n,f) \
+	use_rs ? rsendmmsg(s,m,n,f)      : sendmmsg(s,m,n,f)
+#define rs_sendfile(s,f,o,c) \
+	use_rs ? rsendfile(s,f,o,c)      : sendfile(s,f,o,c)
 #define rs_poll(f,n,t)	  use_rs ? rpoll(f,n,t)	   : poll(f,n,t)
 #define rs_fcntl(s,c,p)   use_rs ? rfcntl(s,c,p)   : fcntl(s,c,p)
 #define rs_setsockopt(s,l,n,v,ol) \
@@ -37,11 +37,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #include <rdma/rdma_cma.h>
 #include <rdma/rsocket.h>
@@ -79,6 +83,9 @@ static int use_async;
 static int use_rgai;
 static int verify;
 static int flags = MSG_DONTWAIT;
+static int zerocopy;
+static int send_flags;
+static unsigned int zc_sent, zc_done;
 static int poll_timeout = 0;
 static int custom;
 static int use_fork;
@@ -92,23 +99,41 @@ static int buffer_size, inline_size = 64;
 static char test_name[10] = "custom";
 static const char *port = "7471";
 static int keepalive;
+static enum {
+	file_none,
+	file_sendfile,
+	file_mmap
+} file_mode;
+static int file_fd = -1;
+static long long file_sent;
+static int busy_poll = -1;
+static int adaptive_poll;
+static struct rs_poll_stats poll_stats;
 static char *dst_addr;
 static char *src_addr;
 static struct timeval start, end;
+static struct rusage start_ru, end_ru;
 static void *buf;
 static struct rdma_addrinfo rai_hints;
 static struct addrinfo ai_hints;
 
+static float cpu_usec(struct rusage *ru)
+{
+	return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000. +
+	       ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
 static void show_perf(void)
 {
 	char str[32];
-	float usec;
+	float usec, cpu;
 	long long bytes;
 
 	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	cpu = cpu_usec(&end_ru) - cpu_usec(&start_ru);
 	bytes = (long long) iterations * transfer_count * transfer_size * 2;
 
-	/* name size transfers iterations bytes seconds Gb/sec usec/xfer */
+	/* name size transfers iterations bytes seconds Gb/sec usec/xfer cpu ns/KB */
 	printf("%-10s", test_name);
 	size_str(str, sizeof str, transfer_size);
 	printf("%-8s", str);
@@ -118,9 +143,29 @@ static void show_perf(void)
 	printf("%-8s", str);
 	size_str(str, sizeof str, bytes);
 	printf("%-8s", str);
-	printf("%8.2fs%10.2f%11.2f\n",
+	printf("%8.2fs%10.2f%11.2f%11.2f\n",
 		usec / 1000000., (bytes * 8) / (1000. * usec),
-		(usec / iterations) / (transfer_count * 2));
+		(usec / iterations) / (transfer_count * 2),
+		(cpu * 1000.) / (bytes / 1024.));
+}
+
+/* Report how often waits were satisfied by busy polling during the test */
+static void show_poll_stats(void)
+{
+	struct rs_poll_stats stats;
+	socklen_t len = sizeof stats;
+
+	if (!use_rs || (busy_poll < 0 && !adaptive_poll))
+		return;
+
+	if (rs_getsockopt(rs, SOL_RDMA, RDMA_POLL_STATS, &stats, &len))
+		return;
+
+	printf("%-10s%llu spin hits, %llu sleeps, %u usec spin, %u usec avg wait\n",
+	       "  poll", (unsigned long long) (stats.spin_hits - poll_stats.spin_hits),
+	       (unsigned long long) (stats.sleeps - poll_stats.sleeps),
+	       stats.spin_time, stats.avg_wait);
+	poll_stats = stats;
 }
 
 static void init_latency_test(int size)
@@ -145,13 +190,150 @@ static void init_bandwidth_test(int size)
 	transfer_count = size_to_count(transfer_size);
 }
 
+/*
+ * Read zero copy completions, which report the range of sends whose
+ * buffers may be reused.  Returns the number of notifications read.
+ */
+static int reap_zcopy(void)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	int cnt = 0;
+
+	for (;;) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		if (rs_recvmsg(rs, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg)
+			continue;
+		serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+			errno = serr->ee_errno;
+			perror("zerocopy notification");
+			return -1;
+		}
+		zc_done += serr->ee_data - serr->ee_info + 1;
+		cnt++;
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("rrecvmsg MSG_ERRQUEUE");
+		return -1;
+	}
+	return cnt;
+}
+
+static int wait_zcopy(void)
+{
+	struct pollfd fds;
+	int ret;
+
+	fds.fd = rs;
+	fds.events = 0;
+	while (zc_done != zc_sent) {
+		ret = reap_zcopy();
+		if (ret < 0)
+			return ret;
+		if (zc_done == zc_sent)
+			break;
+
+		ret = rs_poll(&fds, 1, -1);
+		if (ret < 0) {
+			perror("rpoll");
+			return ret;
+		}
+		if (fds.revents & POLLHUP)
+			return -1;
+	}
+	return 0;
+}
+
+/* Zero copy completions are signaled through POLLERR */
+static int poll_xfer(struct pollfd *fds)
+{
+	int ret;
+
+	do {
+		ret = do_poll(fds, poll_timeout);
+	} while (ret == POLLERR && zerocopy && reap_zcopy() > 0);
+
+	return ret;
+}
+
+/*
+ * Send from a tmpfs file, either with sendfile, or by mapping the file and
+ * sending from the mapping the way the preload library used to.  The file
+ * holds the pattern that format_buf generates, so each transfer starts at
+ * the offset that continues the pattern where the last one ended.
+ */
+static int send_file(int offset, int size)
+{
+	off_t pos = (file_sent & 0xff) + offset;
+	void *addr;
+	int ret;
+
+	if (file_mode == file_sendfile)
+		return rs_sendfile(rs, file_fd, &pos, size);
+
+	addr = mmap(NULL, pos + size, PROT_READ, MAP_SHARED, file_fd, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	ret = rs_send(rs, addr + pos, size, flags);
+	munmap(addr, pos + size);
+	return ret;
+}
+
+static int open_file(int size)
+{
+	char path[] = "/dev/shm/rstream.XXXXXX";
+	uint8_t *data;
+	int i, ret;
+
+	file_fd = mkstemp(path);
+	if (file_fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+
+	size += 0xff;
+	data = malloc(size);
+	if (!data) {
+		close(file_fd);
+		return -1;
+	}
+	for (i = 0; i < size; i++)
+		data[i] = (uint8_t) i;
+
+	ret = write(file_fd, data, size) == size ? 0 : -1;
+	if (ret) {
+		perror("write");
+		close(file_fd);
+	}
+	free(data);
+	return ret;
+}
+
 static int send_xfer(int size)
 {
 	struct pollfd fds;
 	int offset, ret;
 
-	if (verify)
+	if (verify) {
+		if (zerocopy) {
+			ret = wait_zcopy();
+			if (ret)
+				return ret;
+		}
 		format_buf(buf, size);
+	}
 
 	if (use_async) {
 		fds.fd = rs;
@@ -160,20 +342,27 @@ static int send_xfer(int size)
 
 	for (offset = 0; offset < size; ) {
 		if (use_async) {
-			ret = do_poll(&fds, poll_timeout);
+			ret = poll_xfer(&fds);
 			if (ret)
 				return ret;
 		}
 
-		ret = rs_send(rs, buf + offset, size - offset, flags);
+		if (file_mode)
+			ret = send_file(offset, size - offset);
+		else
+			ret = rs_send(rs, buf + offset, size - offset,
+				      flags | send_flags);
 		if (ret > 0) {
 			offset += ret;
+			if (send_flags & MSG_ZEROCOPY)
+				zc_sent++;
 		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
 			perror("rsend");
 			return ret;
 		}
 	}
 
+	file_sent += size;
 	return 0;
 }
 
@@ -189,7 +378,7 @@ static int recv_xfer(int size)
 
 	for (offset = 0; offset < size; ) {
 		if (use_async) {
-			ret = do_poll(&fds, poll_timeout);
+			ret = poll_xfer(&fds);
 			if (ret)
 				return ret;
 		}
@@ -232,6 +421,7 @@ static int run_test(void)
 		goto out;
 
 	gettimeofday(&start, NULL);
+	getrusage(RUSAGE_SELF, &start_ru);
 	for (i = 0; i < iterations; i++) {
 		for (t = 0; t < transfer_count; t++) {
 			ret = dst_addr ? send_xfer(transfer_size) :
@@ -247,8 +437,15 @@ static int run_test(void)
 				goto out;
 		}
 	}
+	if (zerocopy) {
+		ret = wait_zcopy();
+		if (ret)
+			goto out;
+	}
 	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &end_ru);
 	show_perf();
+	show_poll_stats();
 	ret = 0;
 
 out:
@@ -281,6 +478,8 @@ static void set_options(int fd)
 {
 	int val;
 
+	memset(&poll_stats, 0, sizeof poll_stats);
+
 	if (buffer_size) {
 		rs_setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void *) &buffer_size,
 			      sizeof buffer_size);
@@ -307,6 +506,21 @@ static void set_options(int fd)
 			val = 0;
 			rs_setsockopt(fd, SOL_RDMA, RDMA_INLINE, &val, sizeof val);
 		}
+
+		if (busy_poll >= 0)
+			rs_setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+				      sizeof busy_poll);
+		if (adaptive_poll)
+			rs_setsockopt(fd, SOL_RDMA, RDMA_ADAPTIVE_POLL,
+				      &adaptive_poll, sizeof adaptive_poll);
+	}
+
+	if (zerocopy) {
+		val = 1;
+		if (rs_setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof val))
+			perror("rsetsockopt SO_ZEROCOPY");
+		else
+			send_flags = MSG_ZEROCOPY;
 	}
 
 	if (keepalive)
@@ -506,14 +720,21 @@ static int run(void)
 		return -1;
 	}
 
+	if (file_mode && open_file(!custom ? test_size[TEST_CNT - 1].size :
+					     transfer_size)) {
+		free(buf);
+		return -1;
+	}
+
 	if (!dst_addr) {
 		ret = server_listen();
 		if (ret)
 			goto free;
 	}
 
-	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s\n",
-	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec", "usec/xfer");
+	printf("%-10s%-8s%-8s%-8s%-8s%8s %10s%13s%11s\n",
+	       "name", "bytes", "xfers", "iters", "total", "time", "Gb/sec",
+	       "usec/xfer", "cpu ns/KB");
 	if (!custom) {
 		optimization = opt_latency;
 		ret = dst_addr ? client_connect() : server_connect();
@@ -560,6 +781,8 @@ static int run(void)
 		rs_shutdown(rs, SHUT_RDWR);
 	rs_close(rs);
 free:
+	if (file_fd >= 0)
+		close(file_fd);
 	free(buf);
 	return ret;
 }
@@ -590,6 +813,9 @@ static int set_test_opt(const char *arg)
 		case 'v':
 			verify = 1;
 			break;
+		case 'z':
+			zerocopy = 1;
+			break;
 		default:
 			return -1;
 		}
@@ -606,6 +832,8 @@ static int set_test_opt(const char *arg)
 			use_rgai = 1;
 		} else if (!strncasecmp("verify", arg, 6)) {
 			verify = 1;
+		} else if (!strncasecmp("zerocopy", arg, 8)) {
+			zerocopy = 1;
 		} else if (!strncasecmp("fork", arg, 4)) {
 			use_fork = 1;
 			use_rs = 0;
@@ -622,7 +850,7 @@ int main(int argc, char **argv)
 
 	ai_hints.ai_socktype = SOCK_STREAM;
 	rai_hints.ai_port_space = RDMA_PS_TCP;
-	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:f:B:i:I:C:S:p:k:P:AF:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -669,6 +897,21 @@ int main(int argc, char **argv)
 		case 'k':
 			keepalive = atoi(optarg);
 			break;
+		case 'P':
+			busy_poll = atoi(optarg);
+			break;
+		case 'A':
+			adaptive_poll = 1;
+			break;
+		case 'F':
+			if (!strncasecmp("sendfile", optarg, 8)) {
+				file_mode = file_sendfile;
+			} else if (!strncasecmp("mmap", optarg, 4)) {
+				file_mode = file_mmap;
+			} else {
+				fprintf(stderr, "Warning: unknown file mode\n");
+			}
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -687,6 +930,10 @@ int main(int argc, char **argv)
 			printf("\t[-S transfer_size or all]\n");
 			printf("\t[-p port_number]\n");
 			printf("\t[-k keepalive_time]\n");
+			printf("\t[-P busy_poll_usec]\n");
+			printf("\t[-A] - adapt busy poll time to the traffic\n");
+			printf("\t[-F file_mode] - send from a tmpfs file\n");
+			printf("\t    sendfile or mmap\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -695,6 +942,7 @@ int main(int argc, char **argv)
 			printf("\t    n|nonblocking - use nonblocking calls\n");
 			printf("\t    r|resolve - use rdma cm to resolve address\n");
 			printf("\t    v|verify - verify data\n");
+			printf("\t    z|zerocopy - send from the user buffer (MSG_ZEROCOPY)\n");
 			exit(1);
 		}
 	}
@@ -27,6 +27,7 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -75,6 +76,7 @@ struct message {
 };
 
 #define CTRL_MSG_SIZE 16
+#define MAX_BATCH 1024
 
 struct client {
 	uint64_t recvcnt;
@@ -92,6 +94,12 @@ static int echo;
 static int transfer_size = 1000;
 static int transfer_count = 1000;
 static int buffer_size;
+static int dest_count;
+static int batch;
+static struct mmsghdr *mmsgs;
+static struct iovec *iovs;
+static struct message *bmsgs;
+static union socket_addr *baddrs;
 static char test_name[10] = "custom";
 static const char *port = "7174";
 static char *dst_addr;
@@ -101,18 +109,16 @@ static socklen_t g_addrlen;
 static struct timeval start, end;
 static struct message g_msg;
 
-static void show_perf(void)
+static void show_perf(int transfers)
 {
 	char str[32];
 	float usec;
 	long long bytes;
-	int transfers;
 
 	usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
-	transfers = echo ? transfer_count * 2 : be32toh(g_msg.data);
 	bytes = (long long) transfers * transfer_size;
 
-	/* name size transfers bytes seconds Gb/sec usec/xfer */
+	/* name size transfers bytes seconds Gb/sec usec/xfer msgs/sec */
 	printf("%-10s", test_name);
 	size_str(str, sizeof str, transfer_size);
 	printf("%-8s", str);
@@ -120,9 +126,9 @@ static void show_perf(void)
 	printf("%-8s", str);
 	size_str(str, sizeof str, bytes);
 	printf("%-8s", str);
-	printf("%8.2fs%10.2f%11.2f\n",
+	printf("%8.2fs%10.2f%11.2f%12.0f\n",
 		usec / 1000000., (bytes * 8) / (1000. * usec),
-		(usec / transfers));
+		(usec / transfers), transfers * 1000000. / usec);
 }
 
 static void init_latency_test(int size)
@@ -220,6 +226,43 @@ static ssize_t svr_recv(struct message *msg, size_t size,
 	return ret;
 }
 
+/* Receive up to batch messages with a single call */
+static int svr_recv_batch(void)
+{
+	struct pollfd fds;
+	int i, ret;
+
+	for (i = 0; i < batch; i++) {
+		iovs[i].iov_base = &bmsgs[i];
+		iovs[i].iov_len = sizeof bmsgs[i];
+		memset(&mmsgs[i], 0, sizeof mmsgs[i]);
+		mmsgs[i].msg_hdr.msg_iov = &iovs[i];
+		mmsgs[i].msg_hdr.msg_iovlen = 1;
+		mmsgs[i].msg_hdr.msg_name = &baddrs[i];
+		mmsgs[i].msg_hdr.msg_namelen = sizeof baddrs[i];
+	}
+
+	if (use_async) {
+		fds.fd = rs;
+		fds.events = POLLIN;
+	}
+
+	do {
+		if (use_async) {
+			ret = do_poll(&fds, poll_timeout);
+			if (ret)
+				return ret;
+		}
+
+		ret = rs_recvmmsg(rs, mmsgs, batch, flags | MSG_WAITFORONE, NULL);
+	} while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN));
+
+	if (ret < 0)
+		perror("rrecvmmsg");
+
+	return ret;
+}
+
 static int svr_process(struct message *msg, size_t size,
 		       union socket_addr *addr, socklen_t addrlen)
 {
@@ -291,9 +334,18 @@ out:
 static int svr_run(void)
 {
 	ssize_t len;
-	int ret;
+	int i, ret;
 
 	ret = svr_bind();
+	while (!ret && batch) {
+		len = svr_recv_batch();
+		if (len < 0)
+			return len;
+
+		for (i = 0; i < len && !ret; i++)
+			ret = svr_process(&bmsgs[i], mmsgs[i].msg_len, &baddrs[i],
+					  mmsgs[i].msg_hdr.msg_namelen);
+	}
 	while (!ret) {
 		g_addrlen = sizeof g_addr;
 		len = svr_recv(&g_msg, sizeof g_msg, &g_addr, &g_addrlen);
@@ -331,6 +383,71 @@ static ssize_t client_send(struct message *msg, size_t size)
 	return ret;
 }
 
+static ssize_t client_sendto(struct message *msg, size_t size,
+			     union socket_addr *addr, socklen_t addrlen)
+{
+	struct pollfd fds;
+	int ret;
+
+	if (use_async) {
+		fds.fd = rs;
+		fds.events = POLLOUT;
+	}
+
+	do {
+		if (use_async) {
+			ret = do_poll(&fds, poll_timeout);
+			if (ret)
+				return ret;
+		}
+
+		ret = rs_sendto(rs, msg, size, flags, &addr->sa, addrlen);
+	} while (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN));
+
+	if (ret < 0)
+		perror("rsendto");
+
+	return ret;
+}
+
+/* Send cnt copies of msg with as few calls as possible */
+static int client_send_batch(struct message *msg, size_t size, int cnt)
+{
+	struct pollfd fds;
+	int i, sent = 0, ret;
+
+	for (i = 0; i < cnt; i++) {
+		iovs[i].iov_base = msg;
+		iovs[i].iov_len = size;
+		memset(&mmsgs[i], 0, sizeof mmsgs[i]);
+		mmsgs[i].msg_hdr.msg_iov = &iovs[i];
+		mmsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if (use_async) {
+		fds.fd = rs;
+		fds.events = POLLOUT;
+	}
+
+	while (sent < cnt) {
+		if (use_async) {
+			ret = do_poll(&fds, poll_timeout);
+			if (ret)
+				return ret;
+		}
+
+		ret = rs_sendmmsg(rs, mmsgs + sent, cnt - sent, flags);
+		if (ret > 0) {
+			sent += ret;
+		} else if (errno != EWOULDBLOCK && errno != EAGAIN) {
+			perror("rsendmmsg");
+			return ret;
+		}
+	}
+
+	return sent;
+}
+
 static ssize_t client_recv(struct message *msg, size_t size, int timeout)
 {
 	struct pollfd fds;
@@ -372,7 +489,7 @@ static int client_send_recv(struct message *msg, size_t size, int timeout)
 
 static int run_test(void)
 {
-	int ret, i;
+	int ret, i, cnt;
 
 	g_msg.op = msg_op_start;
 	ret = client_send_recv(&g_msg, CTRL_MSG_SIZE, 1000);
@@ -381,11 +498,21 @@ static int run_test(void)
 
 	g_msg.op = echo ? msg_op_echo : msg_op_data;
 	gettimeofday(&start, NULL);
-	for (i = 0; i < transfer_count; i++) {
-		ret = echo ? client_send_recv(&g_msg, transfer_size, 1) :
-			     client_send(&g_msg, transfer_size);
-		if (ret != transfer_size)
-			goto out;
+	for (i = 0; i < transfer_count; i += cnt) {
+		if (batch && !echo) {
+			cnt = transfer_count - i;
+			if (cnt > batch)
+				cnt = batch;
+			ret = client_send_batch(&g_msg, transfer_size, cnt);
+			if (ret != cnt)
+				goto out;
+		} else {
+			cnt = 1;
+			ret = echo ? client_send_recv(&g_msg, transfer_size, 1) :
+				     client_send(&g_msg, transfer_size);
+			if (ret != transfer_size)
+				goto out;
+		}
 	}
 
 	g_msg.op = msg_op_end;
@@ -394,13 +521,72 @@ static int run_test(void)
 		goto out;
 
 	gettimeofday(&end, NULL);
-	show_perf();
+	show_perf(echo ? transfer_count * 2 : be32toh(g_msg.data));
 	ret = 0;
 
 out:
 	return ret;
 }
 
+/*
+ * Send to dest_count destinations: the ports that follow the server's port
+ * at the server's address.  Nothing needs to be listening on them.  The
+ * first pass adds each destination, the second measures sends that look up
+ * a destination among all of them.
+ */
+static int run_dest_test(void)
+{
+	struct addrinfo hints, *res;
+	union socket_addr *dests;
+	int ret, i, pass, cnt;
+	uint16_t base;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(dst_addr, port, &hints, &res);
+	if (ret) {
+		printf("getaddrinfo: %s\n", gai_strerror(ret));
+		return ret;
+	}
+
+	dests = calloc(dest_count, sizeof *dests);
+	if (!dests) {
+		ret = -1;
+		goto out;
+	}
+
+	base = (uint16_t) atoi(port);
+	for (i = 0; i < dest_count; i++) {
+		memcpy(&dests[i], res->ai_addr, res->ai_addrlen);
+		if (dests[i].sa.sa_family == AF_INET)
+			dests[i].sin.sin_port = htobe16(base + 1 + i);
+		else
+			dests[i].sin6.sin6_port = htobe16(base + 1 + i);
+	}
+
+	g_msg.op = msg_op_data;
+	for (pass = 0; pass < 2; pass++) {
+		snprintf(test_name, sizeof test_name, pass ? "dest_hit" : "dest_new");
+		cnt = pass ? transfer_count : dest_count;
+		gettimeofday(&start, NULL);
+		for (i = 0; i < cnt; i++) {
+			ret = client_sendto(&g_msg, transfer_size,
+					    &dests[i % dest_count], res->ai_addrlen);
+			if (ret != transfer_size)
+				goto free;
+		}
+		gettimeofday(&end, NULL);
+		show_perf(cnt);
+	}
+	ret = 0;
+
+free:
+	free(dests);
+out:
+	freeaddrinfo(res);
+	return ret;
+}
+
 static int client_connect(void)
 {
 	struct addrinfo hints, *res;
@@ -445,14 +631,17 @@ static int client_run(void)
 {
 	int i, ret;
 
-	printf("%-10s%-8s%-8s%-8s%8s %10s%13s\n",
-	       "name", "bytes", "xfers", "total", "time", "Gb/sec", "usec/xfer");
+	printf("%-10s%-8s%-8s%-8s%8s %10s%13s%12s\n",
+	       "name", "bytes", "xfers", "total", "time", "Gb/sec", "usec/xfer",
+	       "msgs/sec");
 
 	ret = client_connect();
 	if (ret)
 		return ret;
 
-	if (!custom) {
+	if (dest_count) {
+		ret = run_dest_test();
+	} else if (!custom) {
 		for (i = 0; i < TEST_CNT; i++) {
 			init_latency_test(test_size[i]);
 			run_test();
@@ -513,7 +702,7 @@ int main(int argc, char **argv)
 {
 	int op, ret;
 
-	while ((op = getopt(argc, argv, "s:b:B:C:S:p:T:")) != -1) {
+	while ((op = getopt(argc, argv, "s:b:B:C:S:p:D:M:T:")) != -1) {
 		switch (op) {
 		case 's':
 			dst_addr = optarg;
@@ -540,6 +729,12 @@ int main(int argc, char **argv)
 		case 'p':
 			port = optarg;
 			break;
+		case 'D':
+			dest_count = atoi(optarg);
+			break;
+		case 'M':
+			batch = atoi(optarg);
+			break;
 		case 'T':
 			if (!set_test_opt(optarg))
 				break;
@@ -553,6 +748,8 @@ int main(int argc, char **argv)
 			printf("\t[-C transfer_count]\n");
 			printf("\t[-S transfer_size]\n");
 			printf("\t[-p port_number]\n");
+			printf("\t[-D dest_count] - send to many destinations\n");
+			printf("\t[-M batch] - messages per sendmmsg/recvmmsg call\n");
 			printf("\t[-T test_option]\n");
 			printf("\t    s|sockets - use standard tcp/ip sockets\n");
 			printf("\t    a|async - asynchronous operation (use poll)\n");
@@ -566,6 +763,27 @@ int main(int argc, char **argv)
 	if (flags)
 		poll_timeout = -1;
 
+	if (dest_count < 0 || dest_count > 65535 - atoi(port)) {
+		printf("dest_count must fit in the ports above %s\n", port);
+		exit(1);
+	}
+
+	if (batch < 0 || batch > MAX_BATCH) {
+		printf("batch must be at most %d messages\n", MAX_BATCH);
+		exit(1);
+	}
+
+	if (batch) {
+		mmsgs = calloc(batch, sizeof *mmsgs);
+		iovs = calloc(batch, sizeof *iovs);
+		bmsgs = calloc(batch, sizeof *bmsgs);
+		baddrs = calloc(batch, sizeof *baddrs);
+		if (!mmsgs || !iovs || !bmsgs || !baddrs) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+
 	ret = dst_addr ? client_run() : svr_run();
 	return ret;
 }
@@ -122,10 +122,15 @@ void idx_replace(struct indexer *idx, int index, void *item)
 
 static int idm_grow(struct index_map *idm, int index)
 {
-	idm->array[idx_array_index(index)] = calloc(IDX_ENTRY_SIZE, sizeof(void *));
-	if (!idm->array[idx_array_index(index)])
+	void **entry;
+
+	entry = calloc(IDX_ENTRY_SIZE, sizeof(void *));
+	if (!entry)
 		goto nomem;
 
+	atomic_store_explicit(
+		(_Atomic(void **) *)&idm->array[idx_array_index(index)], entry,
+		memory_order_release);
 	return index;
 
 nomem:
@@ -148,7 +153,8 @@ int idm_set(struct index_map *idm, int index, void *item)
 	}
 
 	entry = idm->array[idx_array_index(index)];
-	entry[idx_entry_index(index)] = item;
+	atomic_store_explicit((_Atomic(void *) *)&entry[idx_entry_index(index)],
+			      item, memory_order_release);
 	return index;
 }
 
@@ -159,6 +165,7 @@ void *idm_clear(struct index_map *idm, int index)
 
 	entry = idm->array[idx_array_index(index)];
 	item = entry[idx_entry_index(index)];
-	entry[idx_entry_index(index)] = NULL;
+	atomic_store_explicit((_Atomic(void *) *)&entry[idx_entry_index(index)],
+			      NULL, memory_order_relaxed);
 	return item;
 }
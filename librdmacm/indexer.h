@@ -36,6 +36,7 @@
 
 #include <config.h>
 #include <stddef.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 
 /*
@@ -75,9 +76,11 @@ static inline void *idx_at(struct indexer *idx, int index)
 }
 
 /*
- * Index map - associates a structure with an index.  Synchronization
- * must be provided by the caller.  Caller must initialize the
- * index map by setting it to 0.
+ * Index map - associates a structure with an index.  Callers must
+ * serialize idm_set and idm_clear, but lookups may run concurrently with
+ * them without a lock: arrays are never freed, and entries are published
+ * with release semantics so that a reader sees an initialized item.
+ * Caller must initialize the index map by setting it to 0.
  */
 
 struct index_map
@@ -88,17 +91,26 @@ struct index_map
 int idm_set(struct index_map *idm, int index, void *item);
 void *idm_clear(struct index_map *idm, int index);
 
+static inline void **idm_array(struct index_map *idm, int index)
+{
+	return atomic_load_explicit(
+		(_Atomic(void **) *)&idm->array[idx_array_index(index)],
+		memory_order_acquire);
+}
+
 static inline void *idm_at(struct index_map *idm, int index)
 {
 	void **entry;
-	entry = idm->array[idx_array_index(index)];
-	return entry[idx_entry_index(index)];
+	entry = idm_array(idm, index);
+	return atomic_load_explicit(
+		(_Atomic(void *) *)&entry[idx_entry_index(index)],
+		memory_order_acquire);
 }
 
 static inline void *idm_lookup(struct index_map *idm, int index)
 {
-	return ((index <= IDX_MAX_INDEX) && idm->array[idx_array_index(index)]) ?
-		idm_at(idm, index) : NULL;
+	return ((index >= 0) && (index <= IDX_MAX_INDEX) &&
+		idm_array(idm, index)) ? idm_at(idm, index) : NULL;
 }
 
 typedef struct _dlist_entry {
@@ -38,6 +38,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 #include <netdb.h>
@@ -47,6 +48,7 @@
 #include <netinet/tcp.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -69,12 +71,16 @@ struct socket_calls {
 	ssize_t (*recvfrom)(int socket, void *buf, size_t len, int flags,
 			    struct sockaddr *src_addr, socklen_t *addrlen);
 	ssize_t (*recvmsg)(int socket, struct msghdr *msg, int flags);
+	int (*recvmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags, struct timespec *timeout);
 	ssize_t (*read)(int socket, void *buf, size_t count);
 	ssize_t (*readv)(int socket, const struct iovec *iov, int iovcnt);
 	ssize_t (*send)(int socket, const void *buf, size_t len, int flags);
 	ssize_t (*sendto)(int socket, const void *buf, size_t len, int flags,
 			  const struct sockaddr *dest_addr, socklen_t addrlen);
 	ssize_t (*sendmsg)(int socket, const struct msghdr *msg, int flags);
+	int (*sendmmsg)(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+			int flags);
 	ssize_t (*write)(int socket, const void *buf, size_t count);
 	ssize_t (*writev)(int socket, const struct iovec *iov, int iovcnt);
 	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
@@ -90,6 +96,11 @@ struct socket_calls {
 	int (*dup2)(int oldfd, int newfd);
 	ssize_t (*sendfile)(int out_fd, int in_fd, off_t *offset, size_t count);
 	int (*fxstat)(int ver, int fd, struct stat *buf);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events, int maxevents,
+			  int timeout);
+	int (*epoll_pwait)(int epfd, struct epoll_event *events, int maxevents,
+			   int timeout, const sigset_t *sigmask);
 };
 
 static struct socket_calls real;
@@ -98,14 +109,17 @@ static struct socket_calls rs;
 static struct index_map idm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
 
+static __thread int recursive;
 static int sq_size;
 static int rq_size;
 static int sq_inline;
+static int shared;
 static int fork_support;
 
 enum fd_type {
 	fd_normal,
-	fd_rsocket
+	fd_rsocket,
+	fd_repoll
 };
 
 enum fd_fork_state {
@@ -368,6 +382,10 @@ static void getenv_options(void)
 	if (var)
 		sq_inline = atoi(var);
 
+	var = getenv("RS_SHARED");
+	if (var)
+		shared = atoi(var);
+
 	var = getenv("RDMAV_FORK_SAFE");
 	if (var)
 		fork_support = atoi(var);
@@ -393,11 +411,13 @@ static void init_preload(void)
 	real.recv = dlsym(RTLD_NEXT, "recv");
 	real.recvfrom = dlsym(RTLD_NEXT, "recvfrom");
 	real.recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+	real.recvmmsg = dlsym(RTLD_NEXT, "recvmmsg");
 	real.read = dlsym(RTLD_NEXT, "read");
 	real.readv = dlsym(RTLD_NEXT, "readv");
 	real.send = dlsym(RTLD_NEXT, "send");
 	real.sendto = dlsym(RTLD_NEXT, "sendto");
 	real.sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+	real.sendmmsg = dlsym(RTLD_NEXT, "sendmmsg");
 	real.write = dlsym(RTLD_NEXT, "write");
 	real.writev = dlsym(RTLD_NEXT, "writev");
 	real.poll = dlsym(RTLD_NEXT, "poll");
@@ -411,6 +431,9 @@ static void init_preload(void)
 	real.dup2 = dlsym(RTLD_NEXT, "dup2");
 	real.sendfile = dlsym(RTLD_NEXT, "sendfile");
 	real.fxstat = dlsym(RTLD_NEXT, "__fxstat");
+	real.epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	real.epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	real.epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
 
 	rs.socket = dlsym(RTLD_DEFAULT, "rsocket");
 	rs.bind = dlsym(RTLD_DEFAULT, "rbind");
@@ -420,11 +443,13 @@ static void init_preload(void)
 	rs.recv = dlsym(RTLD_DEFAULT, "rrecv");
 	rs.recvfrom = dlsym(RTLD_DEFAULT, "rrecvfrom");
 	rs.recvmsg = dlsym(RTLD_DEFAULT, "rrecvmsg");
+	rs.recvmmsg = dlsym(RTLD_DEFAULT, "rrecvmmsg");
 	rs.read = dlsym(RTLD_DEFAULT, "rread");
 	rs.readv = dlsym(RTLD_DEFAULT, "rreadv");
 	rs.send = dlsym(RTLD_DEFAULT, "rsend");
 	rs.sendto = dlsym(RTLD_DEFAULT, "rsendto");
 	rs.sendmsg = dlsym(RTLD_DEFAULT, "rsendmsg");
+	rs.sendmmsg = dlsym(RTLD_DEFAULT, "rsendmmsg");
 	rs.write = dlsym(RTLD_DEFAULT, "rwrite");
 	rs.writev = dlsym(RTLD_DEFAULT, "rwritev");
 	rs.poll = dlsym(RTLD_DEFAULT, "rpoll");
@@ -527,11 +552,13 @@ static void set_rsocket_options(int rsocket)
 
 	if (sq_inline)
 		rsetsockopt(rsocket, SOL_RDMA, RDMA_INLINE, &sq_inline, sizeof sq_inline);
+
+	if (shared)
+		rsetsockopt(rsocket, SOL_RDMA, RDMA_SHARED, &shared, sizeof shared);
 }
 
 int socket(int domain, int type, int protocol)
 {
-	static __thread int recursive;
 	int index, ret;
 
 	init_preload();
@@ -809,6 +836,15 @@ ssize_t recvmsg(int socket, struct msghdr *msg, int flags)
 		rrecvmsg(fd, msg, flags) : real.recvmsg(fd, msg, flags);
 }
 
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	     int flags, struct timespec *timeout)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rrecvmmsg(fd, msgvec, vlen, flags, timeout) :
+		real.recvmmsg(fd, msgvec, vlen, flags, timeout);
+}
+
 ssize_t read(int socket, void *buf, size_t count)
 {
 	int fd;
@@ -848,6 +884,14 @@ ssize_t sendmsg(int socket, const struct msghdr *msg, int flags)
 		rsendmsg(fd, msg, flags) : real.sendmsg(fd, msg, flags);
 }
 
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	int fd;
+	return (fd_fork_get(socket, &fd) == fd_rsocket) ?
+		rsendmmsg(fd, msgvec, vlen, flags) :
+		real.sendmmsg(fd, msgvec, vlen, flags);
+}
+
 ssize_t write(int socket, const void *buf, size_t count)
 {
 	int fd;
@@ -992,6 +1036,93 @@ int select(int nfds, fd_set *readfds, fd_set *writefds,
 	return ret;
 }
 
+/*
+ * Epoll sets are created by the kernel, and stay there until an rsocket is
+ * added to one.  The set then becomes an repoll set, which takes over a
+ * duplicate of the kernel set to hold the normal fd's.  The application's
+ * fd keeps pointing to the kernel set, so it is still usable by calls that
+ * bypass the preload library, and is the index of the repoll set.
+ */
+static int epoll_to_repoll(int epfd)
+{
+	struct fd_info *fdi;
+	int kfd, ret;
+
+	fdi = calloc(1, sizeof(*fdi));
+	if (!fdi)
+		return ERR(ENOMEM);
+
+	kfd = real.fcntl(epfd, F_DUPFD_CLOEXEC, 0);
+	if (kfd < 0) {
+		ret = kfd;
+		goto err1;
+	}
+
+	ret = repoll_create_from(kfd);
+	if (ret < 0)
+		goto err2;
+
+	fdi->fd = ret;
+	fdi->type = fd_repoll;
+	fdi->state = fd_ready;
+	fdi->dupfd = -1;
+	atomic_store(&fdi->refcnt, 1);
+	ret = idm_set(&idm, epfd, fdi);
+	if (ret < 0) {
+		rclose(fdi->fd);
+		goto err1;
+	}
+	return 0;
+
+err2:
+	real.close(kfd);
+err1:
+	free(fdi);
+	return ret;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	int efd, ret;
+
+	init_preload();
+	if (fd_get(epfd, &efd) == fd_repoll)
+		return repoll_ctl(efd, op, fd_getd(fd), event);
+
+	if (op != EPOLL_CTL_ADD || fd_gett(fd) != fd_rsocket)
+		return real.epoll_ctl(efd, op, fd, event);
+
+	pthread_mutex_lock(&mut);
+	ret = (fd_gett(epfd) == fd_repoll) ? 0 : epoll_to_repoll(epfd);
+	pthread_mutex_unlock(&mut);
+	if (ret)
+		return ret;
+
+	return repoll_ctl(fd_getd(epfd), op, fd_getd(fd), event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+	       int timeout)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_wait(efd, events, maxevents, timeout) :
+		real.epoll_wait(efd, events, maxevents, timeout);
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout, const sigset_t *sigmask)
+{
+	int efd;
+
+	init_preload();
+	return (fd_get(epfd, &efd) == fd_repoll) ?
+		repoll_pwait(efd, events, maxevents, timeout, sigmask) :
+		real.epoll_pwait(efd, events, maxevents, timeout, sigmask);
+}
+
 int shutdown(int socket, int how)
 {
 	int fd;
@@ -1020,7 +1151,7 @@ int close(int socket)
 
 	idm_clear(&idm, socket);
 	real.close(socket);
-	ret = (fdi->type == fd_rsocket) ? rclose(fdi->fd) : real.close(fdi->fd);
+	ret = (fdi->type != fd_normal) ? rclose(fdi->fd) : real.close(fdi->fd);
 	free(fdi);
 	return ret;
 }
@@ -1154,22 +1285,12 @@ int dup2(int oldfd, int newfd)
 
 ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
 {
-	void *file_addr;
 	int fd;
-	size_t ret;
 
 	if (fd_get(out_fd, &fd) != fd_rsocket)
 		return real.sendfile(fd, in_fd, offset, count);
 
-	file_addr = mmap(NULL, count, PROT_READ, 0, in_fd, offset ? *offset : 0);
-	if (file_addr == (void *) -1)
-		return -1;
-
-	ret = rwrite(fd, file_addr, count);
-	if ((ret > 0) && offset)
-		lseek(in_fd, ret, SEEK_CUR);
-	munmap(file_addr, count);
-	return ret;
+	return rsendfile(fd, in_fd, offset, count);
 }
 
 int __fxstat(int ver, int socket, struct stat *buf)
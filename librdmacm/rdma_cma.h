@@ -310,6 +310,50 @@ int rdma_create_ep(struct rdma_cm_id **id, struct rdma_addrinfo *res,
  */
 void rdma_destroy_ep(struct rdma_cm_id *id);
 
+/**
+ * struct rdma_ep_req - A connection to establish with rdma_connect_eps.
+ * @res: Result from rdma_getaddrinfo, as for rdma_create_ep.
+ * @pd: Optional protection domain.  Ignored if qp_init_attr is NULL.
+ * @qp_init_attr: Optional attributes for a QP created on the rdma_cm_id.
+ * @conn_param: Optional connection parameters, as for rdma_connect.
+ * @context: User specified context stored in the connected rdma_cm_id.
+ * @id: Set to the connected rdma_cm_id, or NULL if the request failed.
+ * @status: Set to 0 on success, or an errno value giving the failure.
+ */
+struct rdma_ep_req {
+	struct rdma_addrinfo	*res;
+	struct ibv_pd		*pd;
+	struct ibv_qp_init_attr	*qp_init_attr;
+	struct rdma_conn_param	*conn_param;
+	void			*context;
+	struct rdma_cm_id	*id;
+	int			status;
+};
+
+/**
+ * rdma_connect_eps - Establish several active connections in parallel.
+ * @channel: Event channel the connected rdma_cm_ids are moved to, or NULL
+ *   for synchronous operation.
+ * @reqs: Array of connections to establish.
+ * @cnt: Number of entries in reqs.
+ * @timeout_ms: Time to wait for all connections to complete, or -1 to wait
+ *   until each has succeeded or failed.
+ * Description:
+ *   Performs the equivalent of rdma_create_ep followed by rdma_connect for
+ *   every request, with the address resolution, route resolution and
+ *   connection steps of all requests in flight at the same time.
+ * Notes:
+ *   Returns the number of connections established, or -1 with errno set if
+ *   none could be started.  Each request reports its own result in its
+ *   status field.  Requests that did not complete in time fail with
+ *   ETIMEDOUT.  Each rdma_cm_id is moved to channel as soon as it connects,
+ *   so later events for it are reported there.
+ * See also:
+ *   rdma_create_ep, rdma_connect, rdma_migrate_id, rdma_destroy_ep
+ */
+int rdma_connect_eps(struct rdma_event_channel *channel,
+		     struct rdma_ep_req *reqs, int cnt, int timeout_ms);
+
 /**
  * rdma_destroy_id - Release a communication identifier.
  * @id: The communication identifier to destroy.
@@ -36,6 +36,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <endian.h>
 #include <stdarg.h>
 #include <netdb.h>
@@ -44,12 +45,14 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <linux/errqueue.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
-#include <search.h>
 #include <time.h>
 #include <byteswap.h>
+#include <util/bitmap.h>
 #include <util/compiler.h>
 #include <util/util.h>
 #include <ccan/container_of.h>
@@ -68,9 +71,13 @@
 #define RS_QP_CTRL_SIZE 4	/* must be power of 2 */
 #define RS_CONN_RETRIES 6
 #define RS_SGL_SIZE 2
+#define RS_ZCOPY_MIN (1 << 14)
+#define RS_ZCOPY_REG_MIN (1 << 18)
+#define RS_RTUNE_PERIOD_US 1000
+#define RS_RTUNE_SHRINK 16	/* periods below a quarter of the buffer */
 static struct index_map idm;
+static struct index_map epidm;
 static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t svc_mut = PTHREAD_MUTEX_INITIALIZER;
 
 struct rsocket;
 
@@ -91,38 +98,44 @@ struct rs_svc_msg {
 	struct rsocket *rs;
 };
 
+enum {
+	RS_SVC_UDP,
+	RS_SVC_TCP,
+	RS_SVC_LISTEN,
+	RS_SVC_CONNECT,
+	RS_SVC_TYPES
+};
+
+/*
+ * Each service is sharded over svc_threads threads.  rsockets are assigned
+ * a shard round robin when allocated.
+ */
+#define RS_SVC_MAX_THREADS 64
+#define RS_SVC_WHEEL_SIZE 256	/* keepalive timer slots, 1 second each */
+
 struct rs_svc {
 	pthread_t id;
+	pthread_mutex_t mut;
 	int sock[2];
 	int cnt;
 	int size;
+	int type;
 	int context_size;
 	void *(*run)(void *svc);
 	struct rsocket **rss;
 	void *contexts;
+	dlist_entry *timers;
+	uint64_t timer_time;
+	struct rs_svc_stats stats;
 };
 
-static struct pollfd *udp_svc_fds;
 static void *udp_svc_run(void *arg);
-static struct rs_svc udp_svc = {
-	.context_size = sizeof(*udp_svc_fds),
-	.run = udp_svc_run
-};
-static uint64_t *tcp_svc_timeouts;
+static struct rs_svc udp_svc[RS_SVC_MAX_THREADS];
 static void *tcp_svc_run(void *arg);
-static struct rs_svc tcp_svc = {
-	.context_size = sizeof(*tcp_svc_timeouts),
-	.run = tcp_svc_run
-};
+static struct rs_svc tcp_svc[RS_SVC_MAX_THREADS];
 static void *cm_svc_run(void *arg);
-static struct rs_svc listen_svc = {
-	.context_size = sizeof(struct pollfd),
-	.run = cm_svc_run
-};
-static struct rs_svc connect_svc = {
-	.context_size = sizeof(struct pollfd),
-	.run = cm_svc_run
-};
+static struct rs_svc listen_svc[RS_SVC_MAX_THREADS];
+static struct rs_svc connect_svc[RS_SVC_MAX_THREADS];
 
 static uint32_t pollcnt;
 static bool suspendpoll;
@@ -134,8 +147,15 @@ static uint16_t def_sqsize = 384;
 static uint16_t def_rqsize = 384;
 static uint32_t def_mem = (1 << 17);
 static uint32_t def_wmem = (1 << 17);
+static uint32_t def_mem_max;
 static uint32_t polling_time = 10;
 static int wake_up_interval = 5000;
+static int def_shared;
+static uint32_t def_srqsize;
+static int def_adaptive_poll;
+static int svc_threads = 1;
+static cpu_set_t svc_cpus;
+static atomic_uint svc_next_shard;
 
 /*
  * Immediate data format is determined by the upper bits
@@ -169,10 +189,12 @@ enum {
 
 #define RS_WR_ID_FLAG_RECV (((uint64_t) 1) << 63)
 #define RS_WR_ID_FLAG_MSG_SEND (((uint64_t) 1) << 62) /* See RS_OPT_MSG_SEND */
+#define RS_WR_ID_FLAG_ZCOPY (((uint64_t) 1) << 61) /* Data sent from a user buffer */
 #define rs_send_wr_id(data) ((uint64_t) data)
 #define rs_recv_wr_id(data) (RS_WR_ID_FLAG_RECV | (uint64_t) data)
 #define rs_wr_is_recv(wr_id) (wr_id & RS_WR_ID_FLAG_RECV)
 #define rs_wr_is_msg_send(wr_id) (wr_id & RS_WR_ID_FLAG_MSG_SEND)
+#define rs_wr_is_zcopy(wr_id) (wr_id & RS_WR_ID_FLAG_ZCOPY)
 #define rs_wr_data(wr_id) ((uint32_t) wr_id)
 
 enum {
@@ -198,6 +220,9 @@ struct ds_smsg {
 	struct ds_smsg	*next;
 };
 
+/* Work requests posted together by rsendmmsg and rrecvmmsg */
+#define DS_MMSG_BATCH 32
+
 struct rs_sge {
 	uint64_t addr;
 	uint32_t key;
@@ -272,6 +297,9 @@ enum rs_state {
 #define RS_OPT_UDP_SVC    (1 << 2)
 #define RS_OPT_KEEPALIVE  (1 << 3)
 #define RS_OPT_CM_SVC	  (1 << 4)
+#define RS_OPT_SHARED	  (1 << 5)
+#define RS_OPT_ZEROCOPY	  (1 << 6)
+#define RS_OPT_ADAPTIVE_POLL (1 << 7)
 
 union socket_addr {
 	struct sockaddr		sa;
@@ -316,9 +344,43 @@ struct ds_qp {
 	int		  cq_armed;
 };
 
+struct rs_dev;
+
+/*
+ * Each MSG_ZEROCOPY send is assigned the next notification id.  Sends on a
+ * connection complete in order, so a send is done once the number of
+ * completed zero copy work requests reaches wr_end.  Sends that had to be
+ * copied have a NULL mr and only wait for the sends ahead of them.
+ *
+ * User buffers are covered by an implicit on-demand paging MR if the device
+ * supports one, which follows the process' mappings.  Otherwise each send
+ * registers its buffer and releases it when done, as a cached registration
+ * would outlive a free or munmap of the buffer and send stale pages.
+ */
+struct rs_zcopy_req {
+	uint32_t	  wr_end;
+	struct ibv_mr	  *mr;
+};
+
+struct rs_zcopy {
+	fastlock_t	  lock;
+	struct ibv_mr	  *odp_mr;
+
+	struct rs_zcopy_req *reqs;
+	uint32_t	  size;
+	uint32_t	  head;		/* id of the oldest send not done */
+	uint32_t	  tail;		/* id given to the next send */
+	uint32_t	  reported;	/* first id not returned by MSG_ERRQUEUE */
+	int		  copied;
+	uint32_t	  wr_posted;
+	uint32_t	  wr_done;
+};
+
 struct rsocket {
 	int		  type;
 	int		  index;
+	int		  svc_shard;
+	int		  svc_index[RS_SVC_TYPES];
 	fastlock_t	  slock;
 	fastlock_t	  rlock;
 	fastlock_t	  cq_lock;
@@ -331,6 +393,8 @@ struct rsocket {
 			struct rdma_cm_id *cm_id;
 			uint64_t	  tcp_opts;
 			unsigned int	  keepalive_time;
+			uint64_t	  keepalive_deadline;
+			dlist_entry	  keepalive_entry;
 			int		  accept_queue[2];
 
 			unsigned int	  ctrl_seqno;
@@ -358,6 +422,23 @@ struct rsocket {
 			struct ibv_mr	  *rmr;
 			uint8_t		  *rbuf;
 
+			/* receive buffer auto-tuning, off if rbuf_max is 0 */
+			uint32_t	  rbuf_max;
+			uint32_t	  rbuf_min;
+			uint32_t	  rbuf_want;
+			uint32_t	  rtune_low;
+			uint64_t	  rtune_start;
+			uint64_t	  rtune_bytes;
+			uint64_t	  rbuf_adv;	/* bytes advertised */
+			uint64_t	  rbuf_rcvd;	/* bytes written by peer */
+			uint64_t	  rtt_probe;
+			uint32_t	  rtt_us;
+			/* replaced buffer, read until rbuf_drain bytes remain */
+			uint32_t	  rbuf_drain;
+			uint32_t	  old_rbuf_size;
+			struct ibv_mr	  *old_rmr;
+			uint8_t		  *old_rbuf;
+
 			int		  sbuf_bytes_avail;
 			struct ibv_mr	  *smr;
 			struct ibv_sge	  ssgl[2];
@@ -365,7 +446,10 @@ struct rsocket {
 		/* datagram */
 		struct {
 			struct ds_qp	  *qp_list;
-			void		  *dest_map;
+			struct ds_dest	  **dest_map;
+			uint32_t	  dest_map_size;
+			uint32_t	  dest_cnt;
+			uint32_t	  dest_used;
 			struct ds_dest    *conn_dest;
 
 			int		  udp_sock;
@@ -386,6 +470,11 @@ struct rsocket {
 	int		  retries;
 	int		  err;
 
+	uint32_t	  busy_poll;
+	uint32_t	  poll_avg;	/* average wait, in 1/8 usec */
+	uint64_t	  spin_hits;
+	uint64_t	  sleeps;
+
 	int		  sqe_avail;
 	uint32_t	  sbuf_size;
 	uint16_t	  sq_size;
@@ -406,6 +495,8 @@ struct rsocket {
 	dlist_entry	  iomap_queue;
 	int		  iomap_pending;
 	int		  unack_cqe;
+	struct rs_dev	  *dev;
+	struct rs_zcopy	  *zcopy;
 };
 
 #define DS_UDP_TAG 0x55555555
@@ -488,12 +579,35 @@ static void ds_remove_qp(struct rsocket *rs, struct ds_qp *qp)
 	}
 }
 
-static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
+/*
+ * Pin the service threads of shard i to the i'th CPU of svc_cpus.
+ */
+static void rs_svc_set_affinity(struct rs_svc *svc, int shard)
+{
+	cpu_set_t set;
+	int cpu, n;
+
+	n = shard % CPU_COUNT(&svc_cpus);
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &svc_cpus) && !n--)
+			break;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(svc->id, sizeof(set), &set);
+}
+
+static int rs_notify_svc(struct rs_svc *svcs, struct rsocket *rs, int cmd)
 {
 	struct rs_svc_msg msg;
-	int ret;
+	struct rs_svc *svc;
+	uint64_t start, wait;
+	int ret, shard;
 
-	pthread_mutex_lock(&svc_mut);
+	shard = rs->svc_shard;
+	svc = &svcs[shard];
+	pthread_mutex_lock(&svc->mut);
 	if (!svc->cnt) {
 		ret = socketpair(AF_UNIX, SOCK_STREAM, 0, svc->sock);
 		if (ret)
@@ -504,13 +618,21 @@ static int rs_notify_svc(struct rs_svc *svc, struct rsocket *rs, int cmd)
 			ret = ERR(ret);
 			goto closepair;
 		}
+		if (CPU_COUNT(&svc_cpus))
+			rs_svc_set_affinity(svc, shard);
 	}
 
 	msg.cmd = cmd;
 	msg.status = EINVAL;
 	msg.rs = rs;
+	start = rs_time_us();
 	write_all(svc->sock[0], &msg, sizeof(msg));
 	read_all(svc->sock[0], &msg, sizeof(msg));
+	wait = rs_time_us() - start;
+	svc->stats.notifies++;
+	svc->stats.notify_time += wait;
+	if (wait > svc->stats.max_notify)
+		svc->stats.max_notify = wait;
 	ret = rdma_seterrno(msg.status);
 	if (svc->cnt)
 		goto unlock;
@@ -520,10 +642,33 @@ closepair:
 	close(svc->sock[0]);
 	close(svc->sock[1]);
 unlock:
-	pthread_mutex_unlock(&svc_mut);
+	pthread_mutex_unlock(&svc->mut);
 	return ret;
 }
 
+static void rs_get_svc_stats(struct rs_svc_stats *stats)
+{
+	struct rs_svc *svcs[] = { udp_svc, tcp_svc, listen_svc, connect_svc };
+	struct rs_svc *svc;
+	int i, j;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < RS_SVC_TYPES; i++) {
+		for (j = 0; j < svc_threads; j++) {
+			svc = &svcs[i][j];
+			stats->wakeups += svc->stats.wakeups;
+			stats->busy_time += svc->stats.busy_time;
+			stats->max_busy = max(stats->max_busy,
+					      svc->stats.max_busy);
+			stats->notifies += svc->stats.notifies;
+			stats->notify_time += svc->stats.notify_time;
+			stats->max_notify = max(stats->max_notify,
+						svc->stats.max_notify);
+			stats->keepalives += svc->stats.keepalives;
+		}
+	}
+}
+
 static int ds_compare_addr(const void *dst1, const void *dst2)
 {
 	const struct sockaddr *sa1, *sa2;
@@ -537,6 +682,142 @@ static int ds_compare_addr(const void *dst1, const void *dst2)
 	return memcmp(dst1, dst2, len);
 }
 
+/*
+ * Destinations of a datagram rsocket are kept in an open addressing hash
+ * table with linear probing, protected by map_lock.  Removed entries leave
+ * a marker behind so that probing continues past them, and are dropped
+ * when the table is rebuilt.
+ */
+#define DS_DEST_MAP_MIN 64
+#define DS_DEST_REMOVED ((struct ds_dest *) 1)
+
+static uint32_t ds_hash_addr(const void *addr)
+{
+	const struct sockaddr *sa = addr;
+	uint32_t hash = 0, word;
+	size_t i, len;
+
+	/* Hash the same bytes that ds_compare_addr compares */
+	len = (sa->sa_family == AF_INET6) ?
+	      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+	for (i = 0; i < len; i += sizeof(word)) {
+		memcpy(&word, (const uint8_t *) addr + i, sizeof(word));
+		word *= 0xcc9e2d51;
+		word = (word << 15) | (word >> 17);
+		hash ^= word * 0x1b873593;
+		hash = ((hash << 13) | (hash >> 19)) * 5 + 0xe6546b64;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static struct ds_dest *ds_find_dest(struct rsocket *rs, const void *addr)
+{
+	struct ds_dest *dest;
+	uint32_t i, mask;
+
+	if (!rs->dest_map)
+		return NULL;
+
+	mask = rs->dest_map_size - 1;
+	for (i = ds_hash_addr(addr) & mask; (dest = rs->dest_map[i]);
+	     i = (i + 1) & mask) {
+		if (dest != DS_DEST_REMOVED && !ds_compare_addr(addr, &dest->addr))
+			return dest;
+	}
+	return NULL;
+}
+
+static int ds_resize_dest_map(struct rsocket *rs, uint32_t size)
+{
+	struct ds_dest **map, *dest;
+	uint32_t i, j;
+
+	map = calloc(size, sizeof(*map));
+	if (!map)
+		return ERR(ENOMEM);
+
+	for (i = 0; i < rs->dest_map_size; i++) {
+		dest = rs->dest_map[i];
+		if (!dest || dest == DS_DEST_REMOVED)
+			continue;
+
+		for (j = ds_hash_addr(&dest->addr) & (size - 1); map[j];
+		     j = (j + 1) & (size - 1))
+			;
+		map[j] = dest;
+	}
+
+	free(rs->dest_map);
+	rs->dest_map = map;
+	rs->dest_map_size = size;
+	rs->dest_used = rs->dest_cnt;
+	return 0;
+}
+
+/* The caller must check that the address is not already in the map */
+static int ds_insert_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	uint32_t i, mask, size;
+	int ret;
+
+	/* Keep the table at most 3/4 full, counting removed entries */
+	if ((rs->dest_used + 1) * 4 > rs->dest_map_size * 3) {
+		size = max_t(uint32_t, rs->dest_map_size, DS_DEST_MAP_MIN);
+		if ((rs->dest_cnt + 1) * 2 > size)
+			size <<= 1;
+		ret = ds_resize_dest_map(rs, size);
+		if (ret)
+			return ret;
+	}
+
+	mask = rs->dest_map_size - 1;
+	for (i = ds_hash_addr(&dest->addr) & mask;
+	     rs->dest_map[i] && rs->dest_map[i] != DS_DEST_REMOVED;
+	     i = (i + 1) & mask)
+		;
+
+	if (!rs->dest_map[i])
+		rs->dest_used++;
+	rs->dest_map[i] = dest;
+	rs->dest_cnt++;
+	return 0;
+}
+
+static void ds_remove_dest(struct rsocket *rs, struct ds_dest *dest)
+{
+	uint32_t i, mask;
+
+	if (!rs->dest_map)
+		return;
+
+	mask = rs->dest_map_size - 1;
+	for (i = ds_hash_addr(&dest->addr) & mask; rs->dest_map[i];
+	     i = (i + 1) & mask) {
+		if (rs->dest_map[i] == dest) {
+			rs->dest_map[i] = DS_DEST_REMOVED;
+			rs->dest_cnt--;
+			return;
+		}
+	}
+}
+
+static void ds_free_dest_map(struct rsocket *rs)
+{
+	uint32_t i;
+
+	for (i = 0; i < rs->dest_map_size; i++) {
+		if (rs->dest_map[i] && rs->dest_map[i] != DS_DEST_REMOVED)
+			free(rs->dest_map[i]);
+	}
+	free(rs->dest_map);
+}
+
 static int rs_value_to_scale(int value, int bits)
 {
 	return value <= (1 << (bits - 1)) ?
@@ -558,6 +839,45 @@ static int rs_scale_to_value(int value, int bits)
 		(void) rc;                                                     \
 	}
 
+/*
+ * Read a list of CPUs such as "0-3,8".
+ */
+static void rs_parse_cpus(FILE *f, cpu_set_t *cpus)
+{
+	int first, last;
+	char sep;
+
+	CPU_ZERO(cpus);
+	while (fscanf(f, "%d", &first) == 1) {
+		last = first;
+		sep = fgetc(f);
+		if (sep == '-') {
+			if (fscanf(f, "%d", &last) != 1)
+				break;
+			sep = fgetc(f);
+		}
+		for (; first <= last; first++) {
+			if (first >= 0 && first < CPU_SETSIZE)
+				CPU_SET(first, cpus);
+		}
+		if (sep != ',')
+			break;
+	}
+}
+
+static void rs_svc_init(struct rs_svc *svcs, int type, int context_size,
+			void *(*run)(void *svc))
+{
+	int i;
+
+	for (i = 0; i < RS_SVC_MAX_THREADS; i++) {
+		pthread_mutex_init(&svcs[i].mut, NULL);
+		svcs[i].type = type;
+		svcs[i].context_size = context_size;
+		svcs[i].run = run;
+	}
+}
+
 static void rs_configure(void)
 {
 	FILE *f;
@@ -607,6 +927,11 @@ static void rs_configure(void)
 			def_mem = 1;
 	}
 
+	if ((f = fopen(RS_CONF_DIR "/mem_max", "r"))) {
+		failable_fscanf(f, "%u", &def_mem_max);
+		fclose(f);
+	}
+
 	if ((f = fopen(RS_CONF_DIR "/wmem_default", "r"))) {
 		failable_fscanf(f, "%u", &def_wmem);
 		fclose(f);
@@ -622,6 +947,41 @@ static void rs_configure(void)
 		def_iomap_size = (uint8_t) rs_value_to_scale(
 			(uint16_t) rs_scale_to_value(def_iomap_size, 8), 8);
 	}
+
+	if ((f = fopen(RS_CONF_DIR "/shared_default", "r"))) {
+		failable_fscanf(f, "%d", &def_shared);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/srqsize_default", "r"))) {
+		failable_fscanf(f, "%u", &def_srqsize);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/adaptive_poll_default", "r"))) {
+		failable_fscanf(f, "%d", &def_adaptive_poll);
+		fclose(f);
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/svc_threads", "r"))) {
+		failable_fscanf(f, "%d", &svc_threads);
+		fclose(f);
+		if (svc_threads < 1)
+			svc_threads = 1;
+		else if (svc_threads > RS_SVC_MAX_THREADS)
+			svc_threads = RS_SVC_MAX_THREADS;
+	}
+
+	if ((f = fopen(RS_CONF_DIR "/svc_cpus", "r"))) {
+		rs_parse_cpus(f, &svc_cpus);
+		fclose(f);
+	}
+
+	rs_svc_init(udp_svc, RS_SVC_UDP, sizeof(struct pollfd), udp_svc_run);
+	rs_svc_init(tcp_svc, RS_SVC_TCP, 0, tcp_svc_run);
+	rs_svc_init(listen_svc, RS_SVC_LISTEN, sizeof(struct pollfd), cm_svc_run);
+	rs_svc_init(connect_svc, RS_SVC_CONNECT, sizeof(struct pollfd),
+		    cm_svc_run);
 	init = 1;
 out:
 	pthread_mutex_unlock(&mut);
@@ -653,6 +1013,7 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 
 	rs->type = type;
 	rs->index = -1;
+	rs->svc_shard = atomic_fetch_add(&svc_next_shard, 1) % svc_threads;
 	if (type == SOCK_DGRAM) {
 		rs->udp_sock = -1;
 		rs->epfd = -1;
@@ -664,9 +1025,14 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = inherited_rs->sq_inline;
 		rs->sq_size = inherited_rs->sq_size;
 		rs->rq_size = inherited_rs->rq_size;
+		rs->busy_poll = inherited_rs->busy_poll;
+		rs->opts = inherited_rs->opts & RS_OPT_ADAPTIVE_POLL;
 		if (type == SOCK_STREAM) {
+			rs->rbuf_max = inherited_rs->rbuf_max;
 			rs->ctrl_max_seqno = inherited_rs->ctrl_max_seqno;
 			rs->target_iomap_size = inherited_rs->target_iomap_size;
+			rs->opts |= inherited_rs->opts &
+				    (RS_OPT_SHARED | RS_OPT_ZEROCOPY);
 		}
 	} else {
 		rs->sbuf_size = def_wmem;
@@ -674,9 +1040,15 @@ static struct rsocket *rs_alloc(struct rsocket *inherited_rs, int type)
 		rs->sq_inline = def_inline;
 		rs->sq_size = def_sqsize;
 		rs->rq_size = def_rqsize;
+		rs->busy_poll = polling_time;
+		if (def_adaptive_poll)
+			rs->opts = RS_OPT_ADAPTIVE_POLL;
 		if (type == SOCK_STREAM) {
+			rs->rbuf_max = def_mem_max;
 			rs->ctrl_max_seqno = RS_QP_CTRL_SIZE;
 			rs->target_iomap_size = def_iomap_size;
+			if (def_shared)
+				rs->opts |= RS_OPT_SHARED;
 		}
 	}
 	fastlock_init(&rs->slock);
@@ -756,162 +1128,484 @@ static void ds_set_qp_size(struct rsocket *rs)
 		rs->sbuf_size = rs->sq_size * RS_SNDLOWAT;
 }
 
-static int rs_init_bufs(struct rsocket *rs)
-{
-	uint32_t total_rbuf_size, total_sbuf_size;
-	size_t len;
+/*
+ * In shared mode, rsockets on the same device share an SRQ, and take
+ * their send buffers from a pool of slabs that are registered once.
+ * Without RS_OPT_MSG_SEND, receives are zero-length and only complete RDMA
+ * writes with immediate data, so any posted receive serves any connection.
+ * Each connection grants its peer rq_size credits, and the SRQ is kept
+ * filled to the sum of the credits of the connections using it, so a peer
+ * never finds it empty.  Connections that would push the sum past the size
+ * of the SRQ fall back to their own receive queue.
+ *
+ * Nothing else is shared.  Receive buffers are the targets of the peer's
+ * RDMA writes, so they stay allocated and registered per connection, which
+ * keeps every rkey limited to its own connection.  Each connection keeps
+ * its own CQ, and its buffers are sized by SO_SNDBUF and SO_RCVBUF.
+ */
+#define RS_POOL_UNIT	  4096
+#define RS_POOL_SLAB_SIZE (1 << 22)
+
+struct rs_slab {
+	struct rs_slab	  *next;
+	uint8_t		  *buf;
+	size_t		  size;
+	unsigned long	  used;
+	unsigned long	  *bmp;
+	struct ibv_mr	  *mr;
+};
 
-	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
-	if (!rs->rmsg)
-		return ERR(ENOMEM);
+struct rs_pool {
+	struct rs_slab	  *slabs;
+};
 
-	total_sbuf_size = rs->sbuf_size;
-	if (rs->sq_inline < RS_MAX_CTRL_MSG)
-		total_sbuf_size += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
-	rs->sbuf = forksafe_alloc(total_sbuf_size);
-	if (!rs->sbuf)
-		return ERR(ENOMEM);
+struct rs_dev {
+	struct rs_dev	  *next;
+	struct ibv_context *verbs;
+	struct ibv_pd	  *pd;
+	int		  refcnt;
+	pthread_mutex_t	  lock;
+	struct ibv_srq	  *srq;
+	uint32_t	  srq_max;
+	uint32_t	  srq_posted;
+	uint32_t	  srq_credits;
+	struct rs_pool	  spool;
+};
 
-	rs->smr = rdma_reg_msgs(rs->cm_id, rs->sbuf, total_sbuf_size);
-	if (!rs->smr)
-		return -1;
+static struct rs_dev *dev_list;
 
-	len = sizeof(*rs->target_sgl) * RS_SGL_SIZE +
-	      sizeof(*rs->target_iomap) * rs->target_iomap_size;
-	rs->target_buffer_list = forksafe_alloc(len);
-	if (!rs->target_buffer_list)
-		return ERR(ENOMEM);
+static void rs_slab_free(struct rs_slab *slab)
+{
+	if (slab->mr)
+		ibv_dereg_mr(slab->mr);
+	free(slab->bmp);
+	free(slab->buf);
+	free(slab);
+}
 
-	rs->target_mr = rdma_reg_write(rs->cm_id, rs->target_buffer_list, len);
-	if (!rs->target_mr)
-		return -1;
+static struct rs_slab *rs_slab_alloc(struct rs_dev *dev, struct rs_pool *pool,
+				     size_t len)
+{
+	struct rs_slab *slab;
 
-	rs->target_sgl = rs->target_buffer_list;
-	if (rs->target_iomap_size)
-		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
+	slab = calloc(1, sizeof(*slab));
+	if (!slab)
+		return NULL;
 
-	total_rbuf_size = rs->rbuf_size;
-	if (rs->opts & RS_OPT_MSG_SEND)
-		total_rbuf_size += rs->rq_size * RS_MSG_SIZE;
-	rs->rbuf = forksafe_alloc(total_rbuf_size);
-	if (!rs->rbuf)
-		return ERR(ENOMEM);
+	slab->size = max_t(size_t, RS_POOL_SLAB_SIZE, align(len, RS_POOL_UNIT));
+	slab->buf = forksafe_alloc(slab->size);
+	slab->bmp = bitmap_alloc0(slab->size / RS_POOL_UNIT);
+	if (!slab->buf || !slab->bmp)
+		goto err;
 
-	rs->rmr = rdma_reg_write(rs->cm_id, rs->rbuf, total_rbuf_size);
-	if (!rs->rmr)
-		return -1;
+	slab->mr = ibv_reg_mr(dev->pd, slab->buf, slab->size,
+			      IBV_ACCESS_LOCAL_WRITE);
+	if (!slab->mr)
+		goto err;
 
-	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
-	rs->sbuf_bytes_avail = rs->sbuf_size;
-	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	return slab;
 
-	rs->rbuf_free_offset = rs->rbuf_size >> 1;
-	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
-	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
-	rs->rseq_comp = rs->rq_size >> 1;
-	return 0;
+err:
+	rs_slab_free(slab);
+	return NULL;
 }
 
-static int ds_init_bufs(struct ds_qp *qp)
+static void *rs_pool_alloc(struct rs_dev *dev, struct rs_pool *pool,
+			   size_t len, struct ibv_mr **mr)
 {
-	qp->rbuf = forksafe_alloc(qp->rs->rbuf_size + sizeof(struct ibv_grh));
-	if (!qp->rbuf)
-		return ERR(ENOMEM);
-
-	qp->smr = rdma_reg_msgs(qp->cm_id, qp->rs->sbuf, qp->rs->sbuf_size);
-	if (!qp->smr)
-		return -1;
+	unsigned long units, nbits, start;
+	struct rs_slab *slab;
+	uint8_t *buf = NULL;
 
-	qp->rmr = rdma_reg_msgs(qp->cm_id, qp->rbuf, qp->rs->rbuf_size +
-						     sizeof(struct ibv_grh));
-	if (!qp->rmr)
-		return -1;
+	units = align(len, RS_POOL_UNIT) / RS_POOL_UNIT;
+	pthread_mutex_lock(&dev->lock);
+	for (slab = pool->slabs; slab; slab = slab->next) {
+		nbits = slab->size / RS_POOL_UNIT;
+		start = bitmap_find_free_region(slab->bmp, nbits, units);
+		if (start < nbits)
+			goto found;
+	}
 
-	return 0;
+	slab = rs_slab_alloc(dev, pool, len);
+	if (!slab) {
+		errno = ENOMEM;
+		goto out;
+	}
+	start = 0;
+found:
+	bitmap_fill_region(slab->bmp, start, start + units);
+	slab->used += units;
+	buf = slab->buf + start * RS_POOL_UNIT;
+	*mr = slab->mr;
+out:
+	pthread_mutex_unlock(&dev->lock);
+	if (buf)
+		memset(buf, 0, len);
+	return buf;
 }
 
-/*
- * If a user is waiting on a datagram rsocket through poll or select, then
- * we need the first completion to generate an event on the related epoll fd
- * in order to signal the user.  We arm the CQ on creation for this purpose
- */
-static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+/* The most recently added slab is kept when it empties, others are released */
+static void rs_pool_free(struct rs_dev *dev, struct rs_pool *pool,
+			 void *buf, size_t len)
 {
-	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
-	if (!cm_id->recv_cq_channel)
-		return -1;
-
-	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
-				       cm_id, cm_id->recv_cq_channel, 0);
-	if (!cm_id->recv_cq)
-		goto err1;
+	struct rs_slab *slab, **prev;
+	unsigned long start;
 
-	if (rs->fd_flags & O_NONBLOCK) {
-		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
-			goto err2;
+	pthread_mutex_lock(&dev->lock);
+	for (prev = &pool->slabs; (slab = *prev); prev = &slab->next) {
+		if ((uint8_t *) buf >= slab->buf &&
+		    (uint8_t *) buf < slab->buf + slab->size)
+			break;
 	}
+	assert(slab);
 
-	ibv_req_notify_cq(cm_id->recv_cq, 0);
-	cm_id->send_cq_channel = cm_id->recv_cq_channel;
-	cm_id->send_cq = cm_id->recv_cq;
-	return 0;
-
-err2:
-	ibv_destroy_cq(cm_id->recv_cq);
-	cm_id->recv_cq = NULL;
-err1:
-	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
-	cm_id->recv_cq_channel = NULL;
-	return -1;
+	start = ((uint8_t *) buf - slab->buf) / RS_POOL_UNIT;
+	len = align(len, RS_POOL_UNIT) / RS_POOL_UNIT;
+	bitmap_zero_region(slab->bmp, start, start + len);
+	slab->used -= len;
+	if (!slab->used && slab != pool->slabs) {
+		*prev = slab->next;
+		rs_slab_free(slab);
+	}
+	pthread_mutex_unlock(&dev->lock);
 }
 
-static inline int rs_post_recv(struct rsocket *rs)
+static void rs_free_dev(struct rs_dev *dev)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge;
-
-	wr.next = NULL;
-	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		wr.wr_id = rs_recv_wr_id(0);
-		wr.sg_list = NULL;
-		wr.num_sge = 0;
-	} else {
-		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
-		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
-			   (rs->rbuf_msg_index * RS_MSG_SIZE);
-		sge.length = RS_MSG_SIZE;
-		sge.lkey = rs->rmr->lkey;
+	struct rs_slab *slab;
 
-		wr.sg_list = &sge;
-		wr.num_sge = 1;
-		if(++rs->rbuf_msg_index == rs->rq_size)
-			rs->rbuf_msg_index = 0;
+	while ((slab = dev->spool.slabs)) {
+		dev->spool.slabs = slab->next;
+		rs_slab_free(slab);
 	}
-
-	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+	if (dev->srq)
+		ibv_destroy_srq(dev->srq);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev);
 }
 
-static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+static struct rs_dev *rs_get_dev(struct rdma_cm_id *cm_id)
 {
-	struct ibv_recv_wr wr, *bad;
-	struct ibv_sge sge[2];
+	struct ibv_srq_init_attr srq_attr;
+	struct ibv_device_attr attr;
+	struct rs_dev *dev;
 
-	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
-	sge[0].length = sizeof(struct ibv_grh);
-	sge[0].lkey = qp->rmr->lkey;
-	sge[1].addr = (uintptr_t) qp->rbuf + offset;
-	sge[1].length = RS_SNDLOWAT;
-	sge[1].lkey = qp->rmr->lkey;
+	pthread_mutex_lock(&mut);
+	for (dev = dev_list; dev; dev = dev->next) {
+		if (dev->verbs == cm_id->verbs) {
+			dev->refcnt++;
+			goto out;
+		}
+	}
 
-	wr.wr_id = rs_recv_wr_id(offset);
-	wr.next = NULL;
-	wr.sg_list = sge;
-	wr.num_sge = 2;
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		goto out;
 
-	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
-}
+	pthread_mutex_init(&dev->lock, NULL);
+	dev->verbs = cm_id->verbs;
+	dev->pd = cm_id->pd;
 
-static int rs_create_ep(struct rsocket *rs)
+	if (ibv_query_device(dev->verbs, &attr) || !attr.max_srq_wr)
+		goto err;
+
+	memset(&srq_attr, 0, sizeof srq_attr);
+	srq_attr.attr.max_wr = def_srqsize ?
+		min_t(uint32_t, def_srqsize, attr.max_srq_wr) :
+		(uint32_t) attr.max_srq_wr;
+	srq_attr.attr.max_sge = 1;
+	dev->srq = ibv_create_srq(dev->pd, &srq_attr);
+	if (!dev->srq)
+		goto err;
+	dev->srq_max = srq_attr.attr.max_wr;
+
+	dev->refcnt = 1;
+	dev->next = dev_list;
+	dev_list = dev;
+out:
+	pthread_mutex_unlock(&mut);
+	return dev;
+
+err:
+	rs_free_dev(dev);
+	pthread_mutex_unlock(&mut);
+	return NULL;
+}
+
+/* Called after the QP is destroyed, and before the rdma_cm_id holding the PD */
+static void rs_put_dev(struct rs_dev *dev)
+{
+	struct rs_dev **prev;
+
+	pthread_mutex_lock(&mut);
+	if (--dev->refcnt) {
+		pthread_mutex_unlock(&mut);
+		return;
+	}
+
+	for (prev = &dev_list; *prev != dev; prev = &(*prev)->next)
+		;
+	*prev = dev->next;
+	pthread_mutex_unlock(&mut);
+	rs_free_dev(dev);
+}
+
+/* Called with dev->lock held, posts receives up to the granted credits */
+static int rs_srq_fill(struct rs_dev *dev)
+{
+	struct ibv_recv_wr wr, *bad;
+
+	wr.wr_id = rs_recv_wr_id(0);
+	wr.next = NULL;
+	wr.sg_list = NULL;
+	wr.num_sge = 0;
+	while (dev->srq_posted < dev->srq_credits) {
+		if (ibv_post_srq_recv(dev->srq, &wr, &bad))
+			return -1;
+		dev->srq_posted++;
+	}
+	return 0;
+}
+
+static int rs_srq_reserve(struct rs_dev *dev, uint32_t credits)
+{
+	int ret;
+
+	pthread_mutex_lock(&dev->lock);
+	if (dev->srq_credits + credits > dev->srq_max) {
+		pthread_mutex_unlock(&dev->lock);
+		return ERR(ENOSPC);
+	}
+
+	dev->srq_credits += credits;
+	ret = rs_srq_fill(dev);
+	if (ret)
+		dev->srq_credits -= credits;
+	pthread_mutex_unlock(&dev->lock);
+	return ret;
+}
+
+/* Receives above the remaining credits are not reposted as they complete */
+static void rs_srq_release(struct rs_dev *dev, uint32_t credits)
+{
+	pthread_mutex_lock(&dev->lock);
+	dev->srq_credits -= credits;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static void rs_srq_consumed(struct rs_dev *dev, uint32_t cnt)
+{
+	pthread_mutex_lock(&dev->lock);
+	dev->srq_posted -= cnt;
+	rs_srq_fill(dev);
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static void *rs_alloc_buf(struct rsocket *rs, size_t len, int remote,
+			  struct ibv_mr **mr)
+{
+	void *buf;
+
+	if (rs->dev && !remote)
+		return rs_pool_alloc(rs->dev, &rs->dev->spool, len, mr);
+
+	buf = forksafe_alloc(len);
+	if (!buf) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	*mr = remote ? rdma_reg_write(rs->cm_id, buf, len) :
+		       rdma_reg_msgs(rs->cm_id, buf, len);
+	if (!*mr) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void rs_free_buf(struct rsocket *rs, void *buf, size_t len, int remote,
+			struct ibv_mr *mr)
+{
+	if (rs->dev && !remote) {
+		rs_pool_free(rs->dev, &rs->dev->spool, buf, len);
+	} else {
+		rdma_dereg_mr(mr);
+		free(buf);
+	}
+}
+
+static size_t rs_sbuf_total(struct rsocket *rs)
+{
+	size_t len = rs->sbuf_size;
+
+	if (rs->sq_inline < RS_MAX_CTRL_MSG)
+		len += RS_MAX_CTRL_MSG * RS_QP_CTRL_SIZE;
+	return len;
+}
+
+static size_t rs_rbuf_total(struct rsocket *rs)
+{
+	size_t len = rs->rbuf_size;
+
+	if (rs->opts & RS_OPT_MSG_SEND)
+		len += rs->rq_size * RS_MSG_SIZE;
+	return len;
+}
+
+static size_t rs_target_buffer_len(struct rsocket *rs)
+{
+	return sizeof(*rs->target_sgl) * RS_SGL_SIZE +
+	       sizeof(*rs->target_iomap) * rs->target_iomap_size;
+}
+
+static int rs_init_bufs(struct rsocket *rs)
+{
+	rs->rmsg = calloc(rs->rq_size + 1, sizeof(*rs->rmsg));
+	if (!rs->rmsg)
+		return ERR(ENOMEM);
+
+	rs->sbuf = rs_alloc_buf(rs, rs_sbuf_total(rs), 0, &rs->smr);
+	if (!rs->sbuf)
+		return -1;
+
+	rs->target_buffer_list = rs_alloc_buf(rs, rs_target_buffer_len(rs), 1,
+					      &rs->target_mr);
+	if (!rs->target_buffer_list)
+		return -1;
+
+	rs->target_sgl = rs->target_buffer_list;
+	if (rs->target_iomap_size)
+		rs->target_iomap = (struct rs_iomap *) (rs->target_sgl + RS_SGL_SIZE);
+
+	rs->rbuf = rs_alloc_buf(rs, rs_rbuf_total(rs), 1, &rs->rmr);
+	if (!rs->rbuf)
+		return -1;
+
+	rs->ssgl[0].addr = rs->ssgl[1].addr = (uintptr_t) rs->sbuf;
+	rs->sbuf_bytes_avail = rs->sbuf_size;
+	rs->ssgl[0].lkey = rs->ssgl[1].lkey = rs->smr->lkey;
+
+	rs->rbuf_free_offset = rs->rbuf_size >> 1;
+	rs->rbuf_bytes_avail = rs->rbuf_size >> 1;
+	rs->rbuf_adv = rs->rbuf_size >> 1;
+	rs->rbuf_max &= ~1;
+	if (rs->rbuf_max <= rs->rbuf_size || (rs->opts & RS_OPT_MSG_SEND))
+		rs->rbuf_max = 0;
+	rs->rbuf_min = rs->rbuf_want = rs->rbuf_size;
+	rs->sqe_avail = rs->sq_size - rs->ctrl_max_seqno;
+	rs->rseq_comp = rs->rq_size >> 1;
+	return 0;
+}
+
+static int ds_init_bufs(struct ds_qp *qp)
+{
+	qp->rbuf = forksafe_alloc(qp->rs->rbuf_size + sizeof(struct ibv_grh));
+	if (!qp->rbuf)
+		return ERR(ENOMEM);
+
+	qp->smr = rdma_reg_msgs(qp->cm_id, qp->rs->sbuf, qp->rs->sbuf_size);
+	if (!qp->smr)
+		return -1;
+
+	qp->rmr = rdma_reg_msgs(qp->cm_id, qp->rbuf, qp->rs->rbuf_size +
+						     sizeof(struct ibv_grh));
+	if (!qp->rmr)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * If a user is waiting on a datagram rsocket through poll or select, then
+ * we need the first completion to generate an event on the related epoll fd
+ * in order to signal the user.  We arm the CQ on creation for this purpose
+ */
+static int rs_create_cq(struct rsocket *rs, struct rdma_cm_id *cm_id)
+{
+	cm_id->recv_cq_channel = ibv_create_comp_channel(cm_id->verbs);
+	if (!cm_id->recv_cq_channel)
+		return -1;
+
+	cm_id->recv_cq = ibv_create_cq(cm_id->verbs, rs->sq_size + rs->rq_size,
+				       cm_id, cm_id->recv_cq_channel, 0);
+	if (!cm_id->recv_cq)
+		goto err1;
+
+	if (rs->fd_flags & O_NONBLOCK) {
+		if (set_fd_nonblock(cm_id->recv_cq_channel->fd, true))
+			goto err2;
+	}
+
+	ibv_req_notify_cq(cm_id->recv_cq, 0);
+	cm_id->send_cq_channel = cm_id->recv_cq_channel;
+	cm_id->send_cq = cm_id->recv_cq;
+	return 0;
+
+err2:
+	ibv_destroy_cq(cm_id->recv_cq);
+	cm_id->recv_cq = NULL;
+err1:
+	ibv_destroy_comp_channel(cm_id->recv_cq_channel);
+	cm_id->recv_cq_channel = NULL;
+	return -1;
+}
+
+static inline int rs_post_recv(struct rsocket *rs)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge;
+
+	wr.next = NULL;
+	if (!(rs->opts & RS_OPT_MSG_SEND)) {
+		wr.wr_id = rs_recv_wr_id(0);
+		wr.sg_list = NULL;
+		wr.num_sge = 0;
+	} else {
+		wr.wr_id = rs_recv_wr_id(rs->rbuf_msg_index);
+		sge.addr = (uintptr_t) rs->rbuf + rs->rbuf_size +
+			   (rs->rbuf_msg_index * RS_MSG_SIZE);
+		sge.length = RS_MSG_SIZE;
+		sge.lkey = rs->rmr->lkey;
+
+		wr.sg_list = &sge;
+		wr.num_sge = 1;
+		if(++rs->rbuf_msg_index == rs->rq_size)
+			rs->rbuf_msg_index = 0;
+	}
+
+	return rdma_seterrno(ibv_post_recv(rs->cm_id->qp, &wr, &bad));
+}
+
+static void ds_format_recv(struct rsocket *rs, struct ds_qp *qp,
+			   uint32_t offset, struct ibv_recv_wr *wr,
+			   struct ibv_sge *sge)
+{
+	sge[0].addr = (uintptr_t) qp->rbuf + rs->rbuf_size;
+	sge[0].length = sizeof(struct ibv_grh);
+	sge[0].lkey = qp->rmr->lkey;
+	sge[1].addr = (uintptr_t) qp->rbuf + offset;
+	sge[1].length = RS_SNDLOWAT;
+	sge[1].lkey = qp->rmr->lkey;
+
+	wr->wr_id = rs_recv_wr_id(offset);
+	wr->next = NULL;
+	wr->sg_list = sge;
+	wr->num_sge = 2;
+}
+
+static inline int ds_post_recv(struct rsocket *rs, struct ds_qp *qp, uint32_t offset)
+{
+	struct ibv_recv_wr wr, *bad;
+	struct ibv_sge sge[2];
+
+	ds_format_recv(rs, qp, offset, &wr, sge);
+	return rdma_seterrno(ibv_post_recv(qp->cm_id->qp, &wr, &bad));
+}
+
+static int rs_create_ep(struct rsocket *rs)
 {
 	struct ibv_qp_init_attr qp_attr;
 	int i, ret;
@@ -927,14 +1621,27 @@ static int rs_create_ep(struct rsocket *rs)
 	if (ret)
 		return ret;
 
+	/*
+	 * Fall back to per connection resources if the device has no SRQ, or
+	 * if it can not hold this connection's credits as well.
+	 */
+	if ((rs->opts & RS_OPT_SHARED) && !(rs->opts & RS_OPT_MSG_SEND)) {
+		rs->dev = rs_get_dev(rs->cm_id);
+		if (rs->dev && rs_srq_reserve(rs->dev, rs->rq_size)) {
+			rs_put_dev(rs->dev);
+			rs->dev = NULL;
+		}
+	}
+
 	memset(&qp_attr, 0, sizeof qp_attr);
 	qp_attr.qp_context = rs;
 	qp_attr.send_cq = rs->cm_id->send_cq;
 	qp_attr.recv_cq = rs->cm_id->recv_cq;
+	qp_attr.srq = rs->dev ? rs->dev->srq : NULL;
 	qp_attr.qp_type = IBV_QPT_RC;
 	qp_attr.sq_sig_all = 1;
 	qp_attr.cap.max_send_wr = rs->sq_size;
-	qp_attr.cap.max_recv_wr = rs->rq_size;
+	qp_attr.cap.max_recv_wr = rs->dev ? 0 : rs->rq_size;
 	qp_attr.cap.max_send_sge = 2;
 	qp_attr.cap.max_recv_sge = 1;
 	qp_attr.cap.max_inline_data = rs->sq_inline;
@@ -948,7 +1655,7 @@ static int rs_create_ep(struct rsocket *rs)
 		return ERR(ENOTSUP);
 
 	ret = rs_init_bufs(rs);
-	if (ret)
+	if (ret || rs->dev)
 		return ret;
 
 	for (i = 0; i < rs->rq_size; i++) {
@@ -1001,7 +1708,7 @@ static void ds_free_qp(struct ds_qp *qp)
 
 	if (qp->cm_id) {
 		if (qp->cm_id->qp) {
-			tdelete(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
+			ds_remove_dest(qp->rs, &qp->dest);
 			epoll_ctl(qp->rs->epfd, EPOLL_CTL_DEL,
 				  qp->cm_id->recv_cq_channel->fd, NULL);
 			rdma_destroy_qp(qp->cm_id);
@@ -1036,7 +1743,7 @@ static void ds_free(struct rsocket *rs)
 	if (rs->sbuf)
 		free(rs->sbuf);
 
-	tdestroy(rs->dest_map, free);
+	ds_free_dest_map(rs);
 	fastlock_destroy(&rs->map_lock);
 	fastlock_destroy(&rs->cq_wait_lock);
 	fastlock_destroy(&rs->cq_lock);
@@ -1045,68 +1752,213 @@ static void ds_free(struct rsocket *rs)
 	free(rs);
 }
 
-static void rs_free(struct rsocket *rs)
+static void rs_zcopy_put_mr(struct rs_zcopy *zc, struct ibv_mr *mr)
 {
-	if (rs->type == SOCK_DGRAM) {
-		ds_free(rs);
-		return;
-	}
+	if (mr != zc->odp_mr)
+		ibv_dereg_mr(mr);
+}
 
-	if (rs->rmsg)
-		free(rs->rmsg);
+/*
+ * Return a registration covering the user's buffer until the send
+ * completes, or NULL if the send should be copied.
+ */
+static struct ibv_mr *rs_zcopy_get_mr(struct rsocket *rs, const void *buf,
+				      size_t len)
+{
+	if (rs->zcopy->odp_mr)
+		return rs->zcopy->odp_mr;
 
-	if (rs->sbuf) {
-		if (rs->smr)
-			rdma_dereg_mr(rs->smr);
-		free(rs->sbuf);
-	}
+	if (len < RS_ZCOPY_REG_MIN)
+		return NULL;
 
-	if (rs->rbuf) {
-		if (rs->rmr)
-			rdma_dereg_mr(rs->rmr);
-		free(rs->rbuf);
-	}
+	return rdma_reg_msgs(rs->cm_id, (void *) buf, len);
+}
 
-	if (rs->target_buffer_list) {
-		if (rs->target_mr)
-			rdma_dereg_mr(rs->target_mr);
-		free(rs->target_buffer_list);
-	}
+/* Retire sends whose work requests have all completed */
+static void rs_zcopy_advance(struct rs_zcopy *zc)
+{
+	struct rs_zcopy_req *req;
 
-	if (rs->index >= 0)
-		rs_remove(rs);
+	for (; zc->head != zc->tail; zc->head++) {
+		req = &zc->reqs[zc->head & (zc->size - 1)];
+		if ((int32_t) (req->wr_end - zc->wr_done) > 0)
+			break;
 
-	if (rs->cm_id) {
-		rs_free_iomappings(rs);
-		if (rs->cm_id->qp) {
-			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
-			rdma_destroy_qp(rs->cm_id);
-		}
-		rdma_destroy_id(rs->cm_id);
+		if (req->mr)
+			rs_zcopy_put_mr(zc, req->mr);
+		else
+			zc->copied = 1;
 	}
+}
 
-	if (rs->accept_queue[0] > 0 || rs->accept_queue[1] > 0) {
-		close(rs->accept_queue[0]);
-		close(rs->accept_queue[1]);
-	}
+static void rs_zcopy_complete(struct rsocket *rs)
+{
+	struct rs_zcopy *zc = rs->zcopy;
 
-	fastlock_destroy(&rs->map_lock);
-	fastlock_destroy(&rs->cq_wait_lock);
-	fastlock_destroy(&rs->cq_lock);
-	fastlock_destroy(&rs->rlock);
-	fastlock_destroy(&rs->slock);
-	free(rs);
+	fastlock_acquire(&zc->lock);
+	zc->wr_done++;
+	rs_zcopy_advance(zc);
+	fastlock_release(&zc->lock);
 }
 
-static size_t rs_conn_data_offset(struct rsocket *rs)
+/* Queue the notification for a send, or drop its reference if nothing went */
+static void rs_zcopy_end(struct rsocket *rs, struct ibv_mr *mr, int sent)
 {
-	return (rs->cm_id->route.addr.src_addr.sa_family == AF_IB) ?
-		sizeof(struct ib_connect_hdr) : 0;
+	struct rs_zcopy *zc = rs->zcopy;
+	struct rs_zcopy_req *req;
+
+	fastlock_acquire(&zc->lock);
+	if (sent) {
+		req = &zc->reqs[zc->tail++ & (zc->size - 1)];
+		req->wr_end = zc->wr_posted;
+		req->mr = mr;
+		rs_zcopy_advance(zc);
+	} else if (mr) {
+		rs_zcopy_put_mr(zc, mr);
+	}
+	fastlock_release(&zc->lock);
 }
 
-static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
+static struct ibv_mr *rs_zcopy_reg_odp(struct rsocket *rs)
 {
-	conn->version = 1;
+	struct ibv_device_attr_ex attr;
+
+	if (ibv_query_device_ex(rs->cm_id->verbs, NULL, &attr))
+		return NULL;
+
+	if (!(attr.odp_caps.general_caps & IBV_ODP_SUPPORT_IMPLICIT) ||
+	    !(attr.odp_caps.per_transport_caps.rc_odp_caps &
+	      IBV_ODP_SUPPORT_WRITE))
+		return NULL;
+
+	return ibv_reg_mr(rs->cm_id->pd, NULL, SIZE_MAX, IBV_ACCESS_ON_DEMAND);
+}
+
+static struct rs_zcopy *rs_alloc_zcopy(struct rsocket *rs)
+{
+	struct rs_zcopy *zc;
+
+	zc = calloc(1, sizeof(*zc));
+	if (!zc)
+		return NULL;
+
+	zc->size = roundup_pow_of_two(rs->sq_size);
+	zc->reqs = calloc(zc->size, sizeof(*zc->reqs));
+	if (!zc->reqs) {
+		free(zc);
+		return NULL;
+	}
+
+	fastlock_init(&zc->lock);
+	if (!(rs->opts & RS_OPT_MSG_SEND))
+		zc->odp_mr = rs_zcopy_reg_odp(rs);
+	return zc;
+}
+
+/* Must be called before the PD is released, after the QP is destroyed */
+static void rs_free_zcopy(struct rs_zcopy *zc)
+{
+	struct rs_zcopy_req *req;
+
+	for (; zc->head != zc->tail; zc->head++) {
+		req = &zc->reqs[zc->head & (zc->size - 1)];
+		if (req->mr)
+			rs_zcopy_put_mr(zc, req->mr);
+	}
+	if (zc->odp_mr)
+		ibv_dereg_mr(zc->odp_mr);
+
+	fastlock_destroy(&zc->lock);
+	free(zc->reqs);
+	free(zc);
+}
+
+/*
+ * Receives the QP took from the SRQ but that were never polled are counted
+ * here, so that they are reposted for the remaining connections.  After a
+ * graceful shutdown there are no writes left in flight.
+ */
+static void rs_srq_reclaim(struct rsocket *rs)
+{
+	struct ibv_qp_attr attr;
+	struct ibv_wc wc;
+	uint32_t cnt = 0;
+
+	attr.qp_state = IBV_QPS_ERR;
+	ibv_modify_qp(rs->cm_id->qp, &attr, IBV_QP_STATE);
+	while (ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc) > 0) {
+		if (rs_wr_is_recv(wc.wr_id))
+			cnt++;
+	}
+	if (cnt)
+		rs_srq_consumed(rs->dev, cnt);
+}
+
+static void rs_free(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM) {
+		ds_free(rs);
+		return;
+	}
+
+	if (rs->rmsg)
+		free(rs->rmsg);
+
+	if (rs->sbuf)
+		rs_free_buf(rs, rs->sbuf, rs_sbuf_total(rs), 0, rs->smr);
+
+	if (rs->rbuf)
+		rs_free_buf(rs, rs->rbuf, rs_rbuf_total(rs), 1, rs->rmr);
+
+	if (rs->old_rbuf)
+		rs_free_buf(rs, rs->old_rbuf, rs->old_rbuf_size, 1, rs->old_rmr);
+
+	if (rs->target_buffer_list)
+		rs_free_buf(rs, rs->target_buffer_list,
+			    rs_target_buffer_len(rs), 1, rs->target_mr);
+
+	if (rs->index >= 0)
+		rs_remove(rs);
+
+	if (rs->cm_id) {
+		rs_free_iomappings(rs);
+		if (rs->cm_id->qp) {
+			ibv_ack_cq_events(rs->cm_id->recv_cq, rs->unack_cqe);
+			if (rs->dev)
+				rs_srq_reclaim(rs);
+			rdma_destroy_qp(rs->cm_id);
+		}
+		if (rs->zcopy)
+			rs_free_zcopy(rs->zcopy);
+		if (rs->dev) {
+			rs_srq_release(rs->dev, rs->rq_size);
+			rs_put_dev(rs->dev);
+		}
+		rdma_destroy_id(rs->cm_id);
+	}
+
+	if (rs->accept_queue[0] > 0 || rs->accept_queue[1] > 0) {
+		close(rs->accept_queue[0]);
+		close(rs->accept_queue[1]);
+	}
+
+	fastlock_destroy(&rs->map_lock);
+	fastlock_destroy(&rs->cq_wait_lock);
+	fastlock_destroy(&rs->cq_lock);
+	fastlock_destroy(&rs->rlock);
+	fastlock_destroy(&rs->slock);
+	free(rs);
+}
+
+static size_t rs_conn_data_offset(struct rsocket *rs)
+{
+	return (rs->cm_id->route.addr.src_addr.sa_family == AF_IB) ?
+		sizeof(struct ib_connect_hdr) : 0;
+}
+
+static void rs_format_conn_data(struct rsocket *rs, struct rs_conn_data *conn)
+{
+	conn->version = 1;
 	conn->flags = RS_CONN_FLAG_IOMAP |
 		      (rs_host_is_net() ? RS_CONN_FLAG_NET : 0);
 	conn->credits = htobe16(rs->rq_size);
@@ -1185,7 +2037,7 @@ static int ds_init_ep(struct rsocket *rs)
 	}
 	msg->next = NULL;
 
-	ret = rs_notify_svc(&udp_svc, rs, RS_SVC_ADD_DGRAM);
+	ret = rs_notify_svc(udp_svc, rs, RS_SVC_ADD_DGRAM);
 	if (ret)
 		return ret;
 
@@ -1288,7 +2140,7 @@ int rlisten(int socket, int backlog)
 	if (ret)
 		return ret;
 
-	ret = rs_notify_svc(&listen_svc, rs, RS_SVC_ADD_CM);
+	ret = rs_notify_svc(listen_svc, rs, RS_SVC_ADD_CM);
 	if (ret)
 		return ret;
 
@@ -1369,7 +2221,7 @@ int raccept(int socket, struct sockaddr *addr, socklen_t *addrlen)
 		rgetpeername(new_rs->index, addr, addrlen);
 	/* The app can still drive the CM state on failure */
 	int save_errno = errno;
-	rs_notify_svc(&connect_svc, new_rs, RS_SVC_ADD_CM);
+	rs_notify_svc(connect_svc, new_rs, RS_SVC_ADD_CM);
 	errno = save_errno;
 	return new_rs->index;
 }
@@ -1580,8 +2432,10 @@ static int ds_add_qp_dest(struct ds_qp *qp, union socket_addr *addr,
 	if (!qp->dest.ah)
 		return ERR(ENOMEM);
 
-	tsearch(&qp->dest.addr, &qp->rs->dest_map, ds_compare_addr);
-	return 0;
+	if (ds_find_dest(qp->rs, &qp->dest.addr))
+		return 0;
+
+	return ds_insert_dest(qp->rs, &qp->dest);
 }
 
 static int ds_create_qp(struct rsocket *rs, union socket_addr *src_addr,
@@ -1678,11 +2532,11 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	union socket_addr src_addr;
 	socklen_t src_len;
 	struct ds_qp *qp;
-	struct ds_dest **tdest, *new_dest;
+	struct ds_dest *tdest;
 	int ret = 0;
 
 	fastlock_acquire(&rs->map_lock);
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
+	tdest = ds_find_dest(rs, addr);
 	if (tdest)
 		goto found;
 
@@ -1694,21 +2548,25 @@ static int ds_get_dest(struct rsocket *rs, const struct sockaddr *addr,
 	if (ret)
 		goto out;
 
-	tdest = tfind(addr, &rs->dest_map, ds_compare_addr);
+	tdest = ds_find_dest(rs, addr);
 	if (!tdest) {
-		new_dest = calloc(1, sizeof(*new_dest));
-		if (!new_dest) {
+		tdest = calloc(1, sizeof(*tdest));
+		if (!tdest) {
 			ret = ERR(ENOMEM);
 			goto out;
 		}
 
-		memcpy(&new_dest->addr, addr, addrlen);
-		new_dest->qp = qp;
-		tdest = tsearch(&new_dest->addr, &rs->dest_map, ds_compare_addr);
+		memcpy(&tdest->addr, addr, addrlen);
+		tdest->qp = qp;
+		ret = ds_insert_dest(rs, tdest);
+		if (ret) {
+			free(tdest);
+			goto out;
+		}
 	}
 
 found:
-	*dest = *tdest;
+	*dest = tdest;
 out:
 	fastlock_release(&rs->map_lock);
 	return ret;
@@ -1728,7 +2586,7 @@ int rconnect(int socket, const struct sockaddr *addr, socklen_t addrlen)
 		if (ret == -1 && errno == EINPROGRESS) {
 			save_errno = errno;
 			/* The app can still drive the CM state on failure */
-			rs_notify_svc(&connect_svc, rs, RS_SVC_ADD_CM);
+			rs_notify_svc(connect_svc, rs, RS_SVC_ADD_CM);
 			errno = save_errno;
 		}
 	} else {
@@ -1856,6 +2714,21 @@ static int ds_post_send(struct rsocket *rs, struct ibv_sge *sge,
 	return rdma_seterrno(ibv_post_send(rs->conn_dest->qp->cm_id->qp, &wr, &bad));
 }
 
+static void rs_claim_target(struct rsocket *rs, uint32_t length,
+			    uint64_t *addr, uint32_t *rkey)
+{
+	*addr = rs->target_sgl[rs->target_sge].addr;
+	*rkey = rs->target_sgl[rs->target_sge].key;
+
+	rs->target_sgl[rs->target_sge].addr += length;
+	rs->target_sgl[rs->target_sge].length -= length;
+
+	if (!rs->target_sgl[rs->target_sge].length) {
+		if (++rs->target_sge == RS_SGL_SIZE)
+			rs->target_sge = 0;
+	}
+}
+
 /*
  * Update target SGE before sending data.  Otherwise the remote side may
  * update the entry before we do.
@@ -1872,20 +2745,41 @@ static int rs_write_data(struct rsocket *rs,
 	if (rs->opts & RS_OPT_MSG_SEND)
 		rs->sqe_avail--;
 	rs->sbuf_bytes_avail -= length;
+	rs_claim_target(rs, length, &addr, &rkey);
 
-	addr = rs->target_sgl[rs->target_sge].addr;
-	rkey = rs->target_sgl[rs->target_sge].key;
+	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
+				 flags, addr, rkey);
+}
 
-	rs->target_sgl[rs->target_sge].addr += length;
-	rs->target_sgl[rs->target_sge].length -= length;
+/*
+ * Zero copy sends are posted directly from the user's buffer, so they do
+ * not take space from the send buffer.  Their completions are flagged so
+ * that they release the user's buffer rather than send buffer space.
+ */
+static int rs_write_zcopy(struct rsocket *rs, struct ibv_sge *sge,
+			  uint32_t length)
+{
+	struct ibv_send_wr wr, *bad;
+	uint32_t msg;
+	int ret;
 
-	if (!rs->target_sgl[rs->target_sge].length) {
-		if (++rs->target_sge == RS_SGL_SIZE)
-			rs->target_sge = 0;
-	}
+	rs->sseq_no++;
+	rs->sqe_avail--;
 
-	return rs_post_write_msg(rs, sgl, nsge, rs_msg_set(RS_OP_DATA, length),
-				 flags, addr, rkey);
+	msg = rs_msg_set(RS_OP_DATA, length);
+	wr.wr_id = rs_send_wr_id(msg) | RS_WR_ID_FLAG_ZCOPY;
+	wr.next = NULL;
+	wr.sg_list = sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.send_flags = 0;
+	wr.imm_data = htobe32(msg);
+	rs_claim_target(rs, length, &wr.wr.rdma.remote_addr, &wr.wr.rdma.rkey);
+
+	ret = rdma_seterrno(ibv_post_send(rs->cm_id->qp, &wr, &bad));
+	if (!ret)
+		rs->zcopy->wr_posted++;
+	return ret;
 }
 
 static int rs_write_direct(struct rsocket *rs, struct rs_iomap *iom, uint64_t offset,
@@ -1923,6 +2817,17 @@ static uint32_t rs_sbuf_left(struct rsocket *rs)
 			   rs->ssgl[0].addr);
 }
 
+/*
+ * Half of the receive buffer is advertised at a time.  While a replaced
+ * buffer drains, only one region of the new buffer is advertised, so that
+ * the peer never holds more than RS_SGL_SIZE regions.
+ */
+static int rs_rbuf_credit_avail(struct rsocket *rs)
+{
+	return (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) &&
+	       (!rs->rbuf_drain || rs->rbuf_bytes_avail == rs->rbuf_size);
+}
+
 static void rs_send_credits(struct rsocket *rs)
 {
 	struct ibv_sge ibsge;
@@ -1931,7 +2836,7 @@ static void rs_send_credits(struct rsocket *rs)
 
 	rs->ctrl_seqno++;
 	rs->rseq_comp = rs->rseq_no + (rs->rq_size >> 1);
-	if (rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) {
+	if (rs_rbuf_credit_avail(rs)) {
 		if (rs->opts & RS_OPT_MSG_SEND)
 			rs->ctrl_seqno++;
 
@@ -1963,6 +2868,12 @@ static void rs_send_credits(struct rsocket *rs)
 			rs->remote_sgl.addr + rs->remote_sge * sizeof(struct rs_sge),
 			rs->remote_sgl.key);
 
+		/* Time how long a peer that used all of its credits takes to
+		 * send more, as an estimate of the round trip time. */
+		if (rs->rbuf_max && rs->rbuf_adv == rs->rbuf_rcvd)
+			rs->rtt_probe = rs_time_us();
+		rs->rbuf_adv += rs->rbuf_size >> 1;
+
 		rs->rbuf_bytes_avail -= rs->rbuf_size >> 1;
 		rs->rbuf_free_offset += rs->rbuf_size >> 1;
 		if (rs->rbuf_free_offset >= rs->rbuf_size)
@@ -1988,11 +2899,11 @@ static inline int rs_2ctrl_avail(struct rsocket *rs)
 static int rs_give_credits(struct rsocket *rs)
 {
 	if (!(rs->opts & RS_OPT_MSG_SEND)) {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_credit_avail(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_ctrl_avail(rs) && (rs->state & rs_connected);
 	} else {
-		return ((rs->rbuf_bytes_avail >= (rs->rbuf_size >> 1)) ||
+		return (rs_rbuf_credit_avail(rs) ||
 			((short) ((short) rs->rseq_no - (short) rs->rseq_comp) >= 0)) &&
 		       rs_2ctrl_avail(rs) && (rs->state & rs_connected);
 	}
@@ -2004,14 +2915,24 @@ static void rs_update_credits(struct rsocket *rs)
 		rs_send_credits(rs);
 }
 
+static void rs_rtt_sample(struct rsocket *rs)
+{
+	uint32_t rtt;
+
+	rtt = max_t(uint32_t, rs_time_us() - rs->rtt_probe, 1);
+	rs->rtt_us = rs->rtt_us ? (rs->rtt_us * 7 + rtt) / 8 : rtt;
+	rs->rtt_probe = 0;
+}
+
 static int rs_poll_cq(struct rsocket *rs)
 {
 	struct ibv_wc wc;
-	uint32_t msg;
+	uint32_t msg, srq_cnt = 0;
 	int ret, rcnt = 0;
 
 	while ((ret = ibv_poll_cq(rs->cm_id->recv_cq, 1, &wc)) > 0) {
 		if (rs_wr_is_recv(wc.wr_id)) {
+			srq_cnt++;
 			if (wc.status != IBV_WC_SUCCESS)
 				continue;
 			rcnt++;
@@ -2047,6 +2968,11 @@ static int rs_poll_cq(struct rsocket *rs)
 				/* We really shouldn't be here. */
 				break;
 			default:
+				if (rs_msg_op(msg) == RS_OP_DATA) {
+					rs->rbuf_rcvd += rs_msg_data(msg);
+					if (rs->rtt_probe)
+						rs_rtt_sample(rs);
+				}
 				rs->rmsg[rs->rmsg_tail].op = rs_msg_op(msg);
 				rs->rmsg[rs->rmsg_tail].data = rs_msg_data(msg);
 				if (++rs->rmsg_tail == rs->rq_size + 1)
@@ -2070,7 +2996,10 @@ static int rs_poll_cq(struct rsocket *rs)
 				break;
 			default:
 				rs->sqe_avail++;
-				rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
+				if (rs_wr_is_zcopy(wc.wr_id))
+					rs_zcopy_complete(rs);
+				else
+					rs->sbuf_bytes_avail += rs_msg_data(rs_wr_data(wc.wr_id));
 				break;
 			}
 			if (wc.status != IBV_WC_SUCCESS && (rs->state & rs_connected)) {
@@ -2080,7 +3009,11 @@ static int rs_poll_cq(struct rsocket *rs)
 		}
 	}
 
-	if (rs->state & rs_connected) {
+	/* Receives taken from the SRQ are returned right away */
+	if (rs->dev && srq_cnt)
+		rs_srq_consumed(rs->dev, srq_cnt);
+
+	if ((rs->state & rs_connected) && !rs->dev) {
 		while (!ret && rcnt--)
 			ret = rs_post_recv(rs);
 
@@ -2163,24 +3096,58 @@ static int rs_process_cq(struct rsocket *rs, int nonblock, int (*test)(struct rs
 	return ret;
 }
 
+/*
+ * Number of microseconds to busy poll before blocking.  In adaptive mode we
+ * spin for twice the average time that recent waits took to be satisfied,
+ * and skip spinning altogether if that would exceed the busy poll budget.
+ */
+static uint32_t rs_poll_budget(struct rsocket *rs)
+{
+	uint32_t spin;
+
+	if (!(rs->opts & RS_OPT_ADAPTIVE_POLL))
+		return rs->busy_poll;
+
+	spin = (rs->poll_avg >> 2) + 1;
+	return spin <= rs->busy_poll ? spin : 0;
+}
+
+static void rs_poll_record(struct rsocket *rs, uint64_t wait, int slept)
+{
+	if (slept)
+		rs->sleeps++;
+	else
+		rs->spin_hits++;
+
+	if (wait > UINT32_MAX >> 3)
+		wait = UINT32_MAX >> 3;
+	rs->poll_avg += (uint32_t) wait - (rs->poll_avg >> 3);
+}
+
 static int rs_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t poll_time = 0, budget;
 	int ret;
 
+	budget = rs_poll_budget(rs);
 	do {
 		ret = rs_process_cq(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret && start_time)
+				rs_poll_record(rs, poll_time, 0);
 			return ret;
+		}
 
 		if (!start_time)
 			start_time = rs_time_us();
 
 		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	} while (budget && poll_time <= budget);
 
 	ret = rs_process_cq(rs, 0, test);
+	if (!ret)
+		rs_poll_record(rs, rs_time_us() - start_time, 1);
 	return ret;
 }
 
@@ -2325,21 +3292,27 @@ static int ds_process_cqs(struct rsocket *rs, int nonblock, int (*test)(struct r
 static int ds_get_comp(struct rsocket *rs, int nonblock, int (*test)(struct rsocket *rs))
 {
 	uint64_t start_time = 0;
-	uint32_t poll_time;
+	uint32_t poll_time = 0, budget;
 	int ret;
 
+	budget = rs_poll_budget(rs);
 	do {
 		ret = ds_process_cqs(rs, 1, test);
-		if (!ret || nonblock || errno != EWOULDBLOCK)
+		if (!ret || nonblock || errno != EWOULDBLOCK) {
+			if (!ret && start_time)
+				rs_poll_record(rs, poll_time, 0);
 			return ret;
+		}
 
 		if (!start_time)
 			start_time = rs_time_us();
 
 		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	} while (budget && poll_time <= budget);
 
 	ret = ds_process_cqs(rs, 0, test);
+	if (!ret)
+		rs_poll_record(rs, rs_time_us() - start_time, 1);
 	return ret;
 }
 
@@ -2395,6 +3368,12 @@ static int rs_conn_can_send(struct rsocket *rs)
 	return rs_can_send(rs) || !(rs->state & rs_writable);
 }
 
+static int rs_zcopy_can_queue(struct rsocket *rs)
+{
+	return (rs->zcopy->tail - rs->zcopy->head < rs->zcopy->size) ||
+	       !(rs->state & rs_writable);
+}
+
 static int rs_conn_can_send_ctrl(struct rsocket *rs)
 {
 	return rs_ctrl_avail(rs) || !(rs->state & rs_connected);
@@ -2481,12 +3460,20 @@ static ssize_t ds_recvfrom(struct rsocket *rs, void *buf, size_t len, int flags,
 static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 {
 	size_t left = len;
-	uint32_t end_size, rsize;
+	uint32_t end_size, rsize, rbuf_size;
 	int rmsg_head, rbuf_offset;
+	uint8_t *rbuf;
 
 	rmsg_head = rs->rmsg_head;
 	rbuf_offset = rs->rbuf_offset;
 
+	/* Data that follows a replaced receive buffer is left for later */
+	if (rs->rbuf_drain && left > rs->rbuf_drain)
+		left = rs->rbuf_drain;
+	len = left;
+	rbuf = rs->rbuf_drain ? rs->old_rbuf : rs->rbuf;
+	rbuf_size = rs->rbuf_drain ? rs->old_rbuf_size : rs->rbuf_size;
+
 	for (; left && (rmsg_head != rs->rmsg_tail); left -= rsize) {
 		if (left < rs->rmsg[rmsg_head].data) {
 			rsize = left;
@@ -2496,15 +3483,15 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 				rmsg_head = 0;
 		}
 
-		end_size = rs->rbuf_size - rbuf_offset;
+		end_size = rbuf_size - rbuf_offset;
 		if (rsize > end_size) {
-			memcpy(buf, &rs->rbuf[rbuf_offset], end_size);
+			memcpy(buf, &rbuf[rbuf_offset], end_size);
 			rbuf_offset = 0;
 			buf += end_size;
 			rsize -= end_size;
 			left -= end_size;
 		}
-		memcpy(buf, &rs->rbuf[rbuf_offset], rsize);
+		memcpy(buf, &rbuf[rbuf_offset], rsize);
 		rbuf_offset += rsize;
 		buf += rsize;
 	}
@@ -2512,6 +3499,119 @@ static ssize_t rs_peek(struct rsocket *rs, void *buf, size_t len)
 	return len - left;
 }
 
+/*
+ * Data written into a receive buffer that has been replaced is read before
+ * any data in the new buffer.  A single write never spans the two.
+ */
+static void rs_copy_old_rbuf(struct rsocket *rs, void *buf, uint32_t len)
+{
+	uint32_t end_size;
+
+	end_size = rs->old_rbuf_size - rs->rbuf_offset;
+	if (len > end_size) {
+		memcpy(buf, &rs->old_rbuf[rs->rbuf_offset], end_size);
+		rs->rbuf_offset = 0;
+		buf += end_size;
+		len -= end_size;
+		rs->rbuf_drain -= end_size;
+	}
+	memcpy(buf, &rs->old_rbuf[rs->rbuf_offset], len);
+	rs->rbuf_offset += len;
+	rs->rbuf_drain -= len;
+
+	if (!rs->rbuf_drain) {
+		rs_free_buf(rs, rs->old_rbuf, rs->old_rbuf_size, 1, rs->old_rmr);
+		rs->old_rbuf = NULL;
+		rs->rbuf_offset = 0;
+	}
+}
+
+/*
+ * Switch to a receive buffer of rbuf_want bytes.  This waits until at most
+ * one region of the current buffer is held by the peer, which then drains
+ * while the first region of the new buffer is advertised.
+ */
+static void rs_resize_rbuf(struct rsocket *rs)
+{
+	struct ibv_mr *mr;
+	uint8_t *buf;
+
+	fastlock_acquire(&rs->cq_lock);
+	if (rs->rbuf_drain || !(rs->state & rs_connected) ||
+	    rs->rbuf_bytes_avail < (rs->rbuf_size >> 1))
+		goto out;
+
+	buf = rs_alloc_buf(rs, rs->rbuf_want, 1, &mr);
+	if (!buf) {
+		rs->rbuf_want = rs->rbuf_size;
+		goto out;
+	}
+
+	rs->rbuf_drain = rs->rbuf_size - rs->rbuf_bytes_avail;
+	if (rs->rbuf_drain) {
+		rs->old_rbuf = rs->rbuf;
+		rs->old_rmr = rs->rmr;
+		rs->old_rbuf_size = rs->rbuf_size;
+	} else {
+		rs_free_buf(rs, rs->rbuf, rs->rbuf_size, 1, rs->rmr);
+		rs->rbuf_offset = 0;
+	}
+
+	rs->rbuf = buf;
+	rs->rmr = mr;
+	rs->rbuf_size = rs->rbuf_want;
+	rs->rbuf_bytes_avail = rs->rbuf_size;
+	rs->rbuf_free_offset = 0;
+	rs_update_credits(rs);
+out:
+	fastlock_release(&rs->cq_lock);
+}
+
+/*
+ * Size the receive buffer for twice the data read per round trip, as
+ * measured over periods of at least RS_RTUNE_PERIOD_US, within rbuf_min
+ * and rbuf_max.  The round trip time is only sampled when the peer ran out
+ * of credits, so the buffer does not grow unless it limited the peer.  It
+ * shrinks after RS_RTUNE_SHRINK periods that needed less than a quarter.
+ */
+static void rs_tune_rbuf(struct rsocket *rs, size_t len)
+{
+	uint64_t now, elapsed, want;
+
+	now = rs_time_us();
+	rs->rtune_bytes += len;
+	if (!rs->rtune_start)
+		rs->rtune_start = now;
+
+	elapsed = now - rs->rtune_start;
+	if (elapsed < RS_RTUNE_PERIOD_US)
+		goto resize;
+
+	want = rs->rtune_bytes * rs->rtt_us * 2 / elapsed;
+	if (!rs->rtt_us) {
+		rs->rtune_low = 0;
+	} else if (want > rs->rbuf_size) {
+		rs->rbuf_want = min_t(uint64_t, roundup_pow_of_two(want),
+				      rs->rbuf_max);
+		rs->rtune_low = 0;
+	} else if (want < (rs->rbuf_size >> 2)) {
+		rs->rtune_low += elapsed / RS_RTUNE_PERIOD_US;
+		if (rs->rtune_low >= RS_RTUNE_SHRINK) {
+			want = roundup_pow_of_two(max_t(uint64_t, want << 1,
+							rs->rbuf_min));
+			rs->rbuf_want = min_t(uint64_t, want, rs->rbuf_size);
+			rs->rtune_low = 0;
+		}
+	} else {
+		rs->rtune_low = 0;
+	}
+	rs->rtune_start = now;
+	rs->rtune_bytes = 0;
+resize:
+	if (rs->rbuf_want != rs->rbuf_size)
+		rs_resize_rbuf(rs);
+}
+
 /*
  * Continue to receive any queued data even if the remote side has disconnected.
  */
@@ -2565,6 +3665,12 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 					rs->rmsg_head = 0;
 			}
 
+			if (rs->rbuf_drain) {
+				rs_copy_old_rbuf(rs, buf, rsize);
+				buf += rsize;
+				continue;
+			}
+
 			end_size = rs->rbuf_size - rs->rbuf_offset;
 			if (rsize > end_size) {
 				memcpy(buf, &rs->rbuf[rs->rbuf_offset], end_size);
@@ -2582,6 +3688,9 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags)
 
 	} while (left && (flags & MSG_WAITALL) && (rs->state & rs_readable));
 
+	if (rs->rbuf_max && left != len && !(flags & MSG_PEEK))
+		rs_tune_rbuf(rs, len - left);
+
 	fastlock_release(&rs->rlock);
 	return (ret && left == len) ? ret : len - left;
 }
@@ -2610,66 +3719,277 @@ ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 }
 
 /*
- * Simple, straightforward implementation for now that only tries to fill
- * in the first vector.
+ * Receive buffers released by rrecvmmsg are reposted in chains, one per
+ * QP, so that a batch of messages rings the doorbell once per chain.
  */
-static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
-{
-	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
-}
+struct ds_recv_batch {
+	struct ds_qp		*qp;
+	int			cnt;
+	struct ibv_recv_wr	wr[DS_MMSG_BATCH];
+	struct ibv_sge		sge[DS_MMSG_BATCH][2];
+};
 
-ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
+static void ds_flush_recvs(struct ds_recv_batch *batch)
 {
-	if (msg->msg_control && msg->msg_controllen)
-		return ERR(ENOTSUP);
+	struct ibv_recv_wr *bad;
 
-	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
+	if (!batch->cnt)
+		return;
+
+	ibv_post_recv(batch->qp->cm_id->qp, batch->wr, &bad);
+	batch->cnt = 0;
 }
 
-ssize_t rread(int socket, void *buf, size_t count)
+static void ds_batch_recv(struct rsocket *rs, struct ds_recv_batch *batch,
+			  struct ds_qp *qp, uint32_t offset)
 {
-	return rrecv(socket, buf, count, 0);
+	struct ibv_recv_wr *wr;
+
+	if (batch->cnt && (batch->qp != qp || batch->cnt == DS_MMSG_BATCH))
+		ds_flush_recvs(batch);
+
+	wr = &batch->wr[batch->cnt];
+	ds_format_recv(rs, qp, offset, wr, batch->sge[batch->cnt]);
+	if (batch->cnt)
+		wr[-1].next = wr;
+	batch->qp = qp;
+	batch->cnt++;
 }
 
-ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt)
+static size_t rs_copy_to_iov(const struct iovec *iov, size_t iovcnt,
+			     const void *src, size_t len)
 {
-	return rrecvv(socket, iov, iovcnt, 0);
+	size_t i, size, copied = 0;
+
+	for (i = 0; i < iovcnt && copied < len; i++) {
+		size = min_t(size_t, iov[i].iov_len, len - copied);
+		memcpy(iov[i].iov_base, src + copied, size);
+		copied += size;
+	}
+	return copied;
 }
 
-static int rs_send_iomaps(struct rsocket *rs, int flags)
+/*
+ * Return as many queued messages as fit in msgvec.  Only the wait for the
+ * first message blocks when MSG_WAITFORONE is set, and the timeout is
+ * checked after each message is received, as with recvmmsg.
+ */
+static int ds_recvmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags, struct timespec *timeout)
 {
-	struct rs_iomap_mr *iomr;
-	struct ibv_sge sge;
-	struct rs_iomap iom;
-	int ret;
+	struct ds_recv_batch batch;
+	struct ds_rmsg *rmsg;
+	struct ds_header *hdr;
+	struct msghdr *msg;
+	uint64_t end = 0;
+	size_t len, copied;
+	unsigned int i;
+	int nonblock, ret = 0;
 
-	fastlock_acquire(&rs->map_lock);
-	while (!dlist_empty(&rs->iomap_queue)) {
-		if (!rs_can_send(rs)) {
-			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
-					  rs_conn_can_send);
+	if (!(rs->state & rs_readable))
+		return ERR(EINVAL);
+
+	if (timeout)
+		end = rs_time_us() + timeout->tv_sec * 1000000 +
+		      timeout->tv_nsec / 1000;
+	if (flags & MSG_PEEK)
+		vlen = min_t(unsigned int, vlen, 1);
+
+	batch.cnt = 0;
+	for (i = 0; i < vlen; i++) {
+		if (!rs_have_rdata(rs)) {
+			ds_flush_recvs(&batch);
+			nonblock = rs_nonblocking(rs, flags) ||
+				   (i && (flags & MSG_WAITFORONE));
+			ret = ds_get_comp(rs, nonblock, rs_have_rdata);
 			if (ret)
 				break;
-			if (!(rs->state & rs_writable)) {
-				ret = ERR(ECONNRESET);
-				break;
-			}
 		}
 
-		iomr = container_of(rs->iomap_queue.next, struct rs_iomap_mr, entry);
-		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
-			iom.offset = iomr->offset;
-			iom.sge.addr = (uintptr_t) iomr->mr->addr;
-			iom.sge.length = iomr->mr->length;
-			iom.sge.key = iomr->mr->rkey;
-		} else {
-			iom.offset = bswap_64(iomr->offset);
-			iom.sge.addr = bswap_64((uintptr_t) iomr->mr->addr);
-			iom.sge.length = bswap_32(iomr->mr->length);
-			iom.sge.key = bswap_32(iomr->mr->rkey);
+		msg = &msgvec[i].msg_hdr;
+		rmsg = &rs->dmsg[rs->rmsg_head];
+		hdr = (struct ds_header *) (rmsg->qp->rbuf + rmsg->offset);
+		len = rmsg->length - hdr->length;
+
+		copied = rs_copy_to_iov(msg->msg_iov, msg->msg_iovlen,
+					(void *) hdr + hdr->length, len);
+		if (msg->msg_name)
+			ds_set_src(msg->msg_name, &msg->msg_namelen, hdr);
+		msg->msg_controllen = 0;
+		msg->msg_flags = (copied < len) ? MSG_TRUNC : 0;
+		msgvec[i].msg_len = (flags & MSG_TRUNC) ? len : copied;
+
+		if (!(flags & MSG_PEEK)) {
+			ds_batch_recv(rs, &batch, rmsg->qp, rmsg->offset);
+			if (++rs->rmsg_head == rs->rq_size + 1)
+				rs->rmsg_head = 0;
+			rs->rqe_avail++;
 		}
 
-		if (rs->sq_inline >= sizeof iom) {
+		if (timeout && rs_time_us() >= end) {
+			i++;
+			break;
+		}
+	}
+	ds_flush_recvs(&batch);
+
+	return i ? (int) i : ret;
+}
+
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		fastlock_acquire(&rs->rlock);
+		ret = ds_recvmmsg(rs, msgvec, vlen, flags, timeout);
+		fastlock_release(&rs->rlock);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rrecvmsg(socket, &msgvec[i].msg_hdr, flags);
+		if (ret <= 0)
+			break;
+		msgvec[i].msg_len = ret;
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+
+	return i ? (int) i : ret;
+}
+
+/*
+ * Simple, straightforward implementation for now that only tries to fill
+ * in the first vector.
+ */
+static ssize_t rrecvv(int socket, const struct iovec *iov, int iovcnt, int flags)
+{
+	return rrecv(socket, iov[0].iov_base, iov[0].iov_len, flags);
+}
+
+/*
+ * Zero copy completions are reported as TCP does: one sock_extended_err
+ * covering the range of notification ids whose buffers may be reused.
+ */
+static ssize_t rs_recv_errqueue(struct rsocket *rs, struct msghdr *msg)
+{
+	struct rs_zcopy *zc = rs->zcopy;
+	struct sock_extended_err *serr;
+	struct cmsghdr *cmsg;
+	uint32_t lo, hi;
+	int copied;
+
+	if (!zc)
+		return ERR(EAGAIN);
+	if (!msg->msg_control || msg->msg_controllen < CMSG_SPACE(sizeof(*serr)))
+		return ERR(EINVAL);
+
+	if (rs->cm_id->qp)
+		rs_process_cq(rs, 1, rs_poll_all);
+
+	fastlock_acquire(&zc->lock);
+	if (zc->reported == zc->head) {
+		fastlock_release(&zc->lock);
+		return ERR(EAGAIN);
+	}
+	lo = zc->reported;
+	hi = zc->head - 1;
+	copied = zc->copied;
+	zc->reported = zc->head;
+	zc->copied = 0;
+	fastlock_release(&zc->lock);
+
+	cmsg = CMSG_FIRSTHDR(msg);
+	if (rs->cm_id->route.addr.src_addr.sa_family == AF_INET6) {
+		cmsg->cmsg_level = SOL_IPV6;
+		cmsg->cmsg_type = IPV6_RECVERR;
+	} else {
+		cmsg->cmsg_level = SOL_IP;
+		cmsg->cmsg_type = IP_RECVERR;
+	}
+	cmsg->cmsg_len = CMSG_LEN(sizeof(*serr));
+	serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+	memset(serr, 0, sizeof(*serr));
+	serr->ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+	serr->ee_code = copied ? SO_EE_CODE_ZEROCOPY_COPIED : 0;
+	serr->ee_info = lo;
+	serr->ee_data = hi;
+
+	msg->msg_controllen = CMSG_SPACE(sizeof(*serr));
+	msg->msg_flags = MSG_ERRQUEUE;
+	return 0;
+}
+
+ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags)
+{
+	struct rsocket *rs;
+
+	if (flags & MSG_ERRQUEUE) {
+		rs = idm_at(&idm, socket);
+		if (!rs)
+			return ERR(EBADF);
+		if (rs->type != SOCK_STREAM)
+			return ERR(EAGAIN);
+		return rs_recv_errqueue(rs, msg);
+	}
+
+	if (msg->msg_control && msg->msg_controllen)
+		return ERR(ENOTSUP);
+
+	return rrecvv(socket, msg->msg_iov, (int) msg->msg_iovlen, msg->msg_flags);
+}
+
+ssize_t rread(int socket, void *buf, size_t count)
+{
+	return rrecv(socket, buf, count, 0);
+}
+
+ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt)
+{
+	return rrecvv(socket, iov, iovcnt, 0);
+}
+
+static int rs_send_iomaps(struct rsocket *rs, int flags)
+{
+	struct rs_iomap_mr *iomr;
+	struct ibv_sge sge;
+	struct rs_iomap iom;
+	int ret;
+
+	fastlock_acquire(&rs->map_lock);
+	while (!dlist_empty(&rs->iomap_queue)) {
+		if (!rs_can_send(rs)) {
+			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+					  rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		iomr = container_of(rs->iomap_queue.next, struct rs_iomap_mr, entry);
+		if (!(rs->opts & RS_OPT_SWAP_SGL)) {
+			iom.offset = iomr->offset;
+			iom.sge.addr = (uintptr_t) iomr->mr->addr;
+			iom.sge.length = iomr->mr->length;
+			iom.sge.key = iomr->mr->rkey;
+		} else {
+			iom.offset = bswap_64(iomr->offset);
+			iom.sge.addr = bswap_64((uintptr_t) iomr->mr->addr);
+			iom.sge.length = bswap_32(iomr->mr->length);
+			iom.sge.key = bswap_32(iomr->mr->rkey);
+		}
+
+		if (rs->sq_inline >= sizeof iom) {
 			sge.addr = (uintptr_t) &iom;
 			sge.length = sizeof iom;
 			sge.lkey = 0;
@@ -2764,6 +4084,9 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 	if (!rs->conn_dest->ah)
 		return ds_send_udp(rs, buf, len, flags, RS_OP_DATA);
 
+	if (len > RS_SNDLOWAT - rs->conn_dest->qp->hdr.length)
+		return ERR(EMSGSIZE);
+
 	if (!ds_can_send(rs)) {
 		ret = ds_get_comp(rs, rs_nonblocking(rs, flags), ds_can_send);
 		if (ret)
@@ -2785,6 +4108,33 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 	return ret ? ret : len;
 }
 
+/*
+ * Assign a notification id to a MSG_ZEROCOPY send.  Sends that are too
+ * small to be worth registering, or whose buffer cannot be registered, are
+ * copied but still report a completion, flagged as copied.
+ */
+static int rs_zcopy_reserve(struct rsocket *rs, int flags)
+{
+	int ret;
+
+	if (!rs->zcopy) {
+		rs->zcopy = rs_alloc_zcopy(rs);
+		if (!rs->zcopy)
+			return ERR(ENOMEM);
+	}
+
+	if (!rs_zcopy_can_queue(rs)) {
+		ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
+				  rs_zcopy_can_queue);
+		if (ret)
+			return ret;
+	}
+
+	if (!(rs->state & rs_writable))
+		return ERR(ECONNRESET);
+	return 0;
+}
+
 /*
  * We overlap sending the data, by posting a small work request immediately,
  * then increasing the size of the send on each iteration.
@@ -2792,10 +4142,11 @@ static ssize_t dsend(struct rsocket *rs, const void *buf, size_t len, int flags)
 ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 {
 	struct rsocket *rs;
+	struct ibv_mr *zmr = NULL;
 	struct ibv_sge sge;
 	size_t left = len;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int ret = 0;
+	int ret = 0, zcopy = 0;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
@@ -2822,6 +4173,14 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (ret)
 			goto out;
 	}
+	if ((flags & MSG_ZEROCOPY) && (rs->opts & RS_OPT_ZEROCOPY)) {
+		ret = rs_zcopy_reserve(rs, flags);
+		if (ret)
+			goto out;
+		zcopy = 1;
+		if (len >= RS_ZCOPY_MIN && !(rs->opts & RS_OPT_MSG_SEND))
+			zmr = rs_zcopy_get_mr(rs, buf, len);
+	}
 	for (; left; left -= xfer_size, buf += xfer_size) {
 		if (!rs_can_send(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
@@ -2834,7 +4193,10 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			}
 		}
 
-		if (olen < left) {
+		if (zmr) {
+			xfer_size = min_t(size_t, left,
+					  rs->target_sgl[rs->target_sge].length);
+		} else if (olen < left) {
 			xfer_size = olen;
 			if (olen < RS_MAX_TRANSFER)
 				olen <<= 1;
@@ -2842,12 +4204,17 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 			xfer_size = left;
 		}
 
-		if (xfer_size > rs->sbuf_bytes_avail)
+		if (!zmr && xfer_size > rs->sbuf_bytes_avail)
 			xfer_size = rs->sbuf_bytes_avail;
 		if (xfer_size > rs->target_sgl[rs->target_sge].length)
 			xfer_size = rs->target_sgl[rs->target_sge].length;
 
-		if (xfer_size <= rs->sq_inline) {
+		if (zmr) {
+			sge.addr = (uintptr_t) buf;
+			sge.length = xfer_size;
+			sge.lkey = zmr->lkey;
+			ret = rs_write_zcopy(rs, &sge, xfer_size);
+		} else if (xfer_size <= rs->sq_inline) {
 			sge.addr = (uintptr_t) buf;
 			sge.length = xfer_size;
 			sge.lkey = 0;
@@ -2872,6 +4239,8 @@ ssize_t rsend(int socket, const void *buf, size_t len, int flags)
 		if (ret)
 			break;
 	}
+	if (zcopy)
+		rs_zcopy_end(rs, zmr, left != len);
 out:
 	fastlock_release(&rs->slock);
 
@@ -2933,13 +4302,187 @@ static void rs_copy_iov(void *dst, const struct iovec **iov, size_t *offset, siz
 	}
 }
 
+/*
+ * Post a chain of datagram sends to one QP.  Send messages of work requests
+ * that could not be posted are returned to the free list.
+ */
+static int ds_flush_sends(struct rsocket *rs, struct ds_qp *qp,
+			  struct ibv_send_wr *wr, int cnt, int *posted)
+{
+	struct ibv_send_wr *bad = NULL;
+	struct ds_smsg *smsg;
+	int i, ret;
+
+	ret = rdma_seterrno(ibv_post_send(qp->cm_id->qp, wr, &bad));
+	if (!ret) {
+		*posted = cnt;
+		return 0;
+	}
+
+	*posted = bad ? bad - wr : 0;
+	for (i = *posted; i < cnt; i++) {
+		smsg = (struct ds_smsg *) (rs->sbuf + rs_wr_data(wr[i].wr_id));
+		smsg->next = rs->smsg_free;
+		rs->smsg_free = smsg;
+		rs->sqe_avail++;
+	}
+	return ret;
+}
+
+/*
+ * Messages are copied into send messages and chained, so that consecutive
+ * messages to destinations on the same QP are posted together.  The chain
+ * is posted before waiting for a free send message.
+ */
+static int ds_sendmmsg(struct rsocket *rs, struct mmsghdr *msgvec,
+		       unsigned int vlen, int flags)
+{
+	struct ibv_send_wr wr[DS_MMSG_BATCH];
+	struct ibv_sge sge[DS_MMSG_BATCH];
+	const struct iovec *iov;
+	struct ds_smsg *smsg;
+	struct ds_qp *qp = NULL;
+	struct msghdr *msg;
+	size_t len, offset;
+	unsigned int i, sent = 0;
+	int j, cnt = 0, posted, ret = 0;
+
+	for (i = 0; i < vlen; i++) {
+		msg = &msgvec[i].msg_hdr;
+		if (msg->msg_control && msg->msg_controllen) {
+			ret = ERR(ENOTSUP);
+			break;
+		}
+
+		if (msg->msg_name) {
+			if (!rs->conn_dest ||
+			    ds_compare_addr(msg->msg_name, &rs->conn_dest->addr)) {
+				ret = ds_get_dest(rs, msg->msg_name,
+						  msg->msg_namelen, &rs->conn_dest);
+				if (ret)
+					break;
+			}
+		} else if (!rs->conn_dest) {
+			ret = ERR(EDESTADDRREQ);
+			break;
+		}
+
+		for (len = 0, j = 0; j < msg->msg_iovlen; j++)
+			len += msg->msg_iov[j].iov_len;
+
+		if (cnt && (!rs->conn_dest->ah || rs->conn_dest->qp != qp ||
+			    cnt == DS_MMSG_BATCH || !ds_can_send(rs))) {
+			ret = ds_flush_sends(rs, qp, wr, cnt, &posted);
+			sent += posted;
+			cnt = 0;
+			if (ret)
+				break;
+		}
+
+		if (!rs->conn_dest->ah) {
+			ret = ds_sendv_udp(rs, msg->msg_iov, (int) msg->msg_iovlen,
+					   flags, RS_OP_DATA);
+			if (ret < 0)
+				break;
+			msgvec[i].msg_len = ret;
+			sent++;
+			ret = 0;
+			continue;
+		}
+
+		if (len > RS_SNDLOWAT - rs->conn_dest->qp->hdr.length) {
+			ret = ERR(EMSGSIZE);
+			break;
+		}
+
+		if (!ds_can_send(rs)) {
+			ret = ds_get_comp(rs, rs_nonblocking(rs, flags),
+					  ds_can_send);
+			if (ret)
+				break;
+		}
+
+		qp = rs->conn_dest->qp;
+		smsg = rs->smsg_free;
+		rs->smsg_free = smsg->next;
+		rs->sqe_avail--;
+
+		memcpy((void *) smsg, &qp->hdr, qp->hdr.length);
+		iov = msg->msg_iov;
+		offset = 0;
+		rs_copy_iov((void *) smsg + qp->hdr.length, &iov, &offset, len);
+
+		sge[cnt].addr = (uintptr_t) smsg;
+		sge[cnt].length = qp->hdr.length + len;
+		sge[cnt].lkey = qp->smr->lkey;
+
+		offset = (uint8_t *) smsg - rs->sbuf;
+		wr[cnt].wr_id = rs_send_wr_id(offset);
+		wr[cnt].next = NULL;
+		wr[cnt].sg_list = &sge[cnt];
+		wr[cnt].num_sge = 1;
+		wr[cnt].opcode = IBV_WR_SEND;
+		wr[cnt].send_flags = (sge[cnt].length <= rs->sq_inline) ?
+				     IBV_SEND_INLINE : 0;
+		wr[cnt].wr.ud.ah = rs->conn_dest->ah;
+		wr[cnt].wr.ud.remote_qpn = rs->conn_dest->qpn;
+		wr[cnt].wr.ud.remote_qkey = RDMA_UDP_QKEY;
+		if (cnt)
+			wr[cnt - 1].next = &wr[cnt];
+		cnt++;
+
+		msgvec[i].msg_len = len;
+	}
+
+	if (cnt) {
+		j = ds_flush_sends(rs, qp, wr, cnt, &posted);
+		sent += posted;
+		if (j && !ret)
+			ret = j;
+	}
+
+	return sent ? (int) sent : ret;
+}
+
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+	struct rsocket *rs;
+	unsigned int i;
+	ssize_t ret = 0;
+
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type == SOCK_DGRAM) {
+		if (rs->state == rs_init) {
+			ret = ds_init_ep(rs);
+			if (ret)
+				return ret;
+		}
+
+		fastlock_acquire(&rs->slock);
+		ret = ds_sendmmsg(rs, msgvec, vlen, flags);
+		fastlock_release(&rs->slock);
+		return ret;
+	}
+
+	for (i = 0; i < vlen; i++) {
+		ret = rsendmsg(socket, &msgvec[i].msg_hdr, flags);
+		if (ret < 0)
+			break;
+		msgvec[i].msg_len = ret;
+	}
+
+	return i ? (int) i : ret;
+}
+
 static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags)
 {
 	struct rsocket *rs;
 	const struct iovec *cur_iov;
 	size_t left, len, offset = 0;
 	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
-	int i, ret = 0;
+	int i, ret = 0, zcopy = 0;
 
 	rs = idm_at(&idm, socket);
 	if (!rs)
@@ -2965,6 +4508,12 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			goto out;
 	}
+	if ((flags & MSG_ZEROCOPY) && (rs->opts & RS_OPT_ZEROCOPY)) {
+		ret = rs_zcopy_reserve(rs, flags);
+		if (ret)
+			goto out;
+		zcopy = 1;
+	}
 	for (; left; left -= xfer_size) {
 		if (!rs_can_send(rs)) {
 			ret = rs_get_comp(rs, rs_nonblocking(rs, flags),
@@ -3013,6 +4562,8 @@ static ssize_t rsendv(int socket, const struct iovec *iov, int iovcnt, int flags
 		if (ret)
 			break;
 	}
+	if (zcopy)
+		rs_zcopy_end(rs, NULL, left != len);
 out:
 	fastlock_release(&rs->slock);
 
@@ -3024,6 +4575,11 @@ ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags)
 	if (msg->msg_control && msg->msg_controllen)
 		return ERR(ENOTSUP);
 
+	/* Only a single buffer is sent without copying */
+	if ((flags & MSG_ZEROCOPY) && msg->msg_iovlen == 1)
+		return rsend(socket, msg->msg_iov[0].iov_base,
+			     msg->msg_iov[0].iov_len, flags);
+
 	return rsendv(socket, msg->msg_iov, (int) msg->msg_iovlen, flags);
 }
 
@@ -3037,50 +4593,156 @@ ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt)
 	return rsendv(socket, iov, iovcnt, 0);
 }
 
-/* When mapping rpoll to poll, the events reported on the RDMA
- * fd are independent from the events rpoll may be looking for.
- * To avoid threads hanging in poll, whenever any event occurs,
- * we need to wakeup all threads in poll, so that they can check
- * if there has been a change on the rsockets they are monitoring.
- * To support this, we 'gate' threads entering and leaving rpoll.
+/*
+ * File data is read directly into the registered send buffer, rather than
+ * into a user buffer that rsend would copy from.  As with rsend, the size of
+ * each transfer grows, so that reading the next part of the file overlaps
+ * the RDMA writes of the parts already read.
  */
-static int rs_pollinit(void)
+ssize_t rsendfile(int socket, int in_fd, off_t *offset, size_t count)
 {
-	int ret = 0;
-
-	pthread_mutex_lock(&mut);
-	if (pollsignal >= 0)
-		goto unlock;
-
-	pollsignal = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
-	if (pollsignal < 0)
-		ret = -errno;
+	struct rsocket *rs;
+	struct iovec iov[2];
+	size_t left = count;
+	uint32_t xfer_size, olen = RS_OLAP_START_SIZE;
+	off_t pos = offset ? *offset : 0;
+	ssize_t len;
+	int iovcnt, ret = 0;
 
-unlock:
-	pthread_mutex_unlock(&mut);
-	return ret;
-}
+	rs = idm_at(&idm, socket);
+	if (!rs)
+		return ERR(EBADF);
+	if (rs->type != SOCK_STREAM)
+		return ERR(EOPNOTSUPP);
 
-/* When an event occurs, we must wait until the state of all rsockets
- * has settled.  Then we need to re-check the rsocket state prior to
- * blocking on poll().
- */
-static int rs_poll_enter(void)
-{
-	pthread_mutex_lock(&mut);
-	if (suspendpoll) {
-		pthread_mutex_unlock(&mut);
-		sched_yield();
-		return -EBUSY;
+	if (rs->state & rs_opening) {
+		ret = rs_do_connect(rs);
+		if (ret) {
+			if (errno == EINPROGRESS)
+				errno = EAGAIN;
+			return ret;
+		}
 	}
 
-	pollcnt++;
-	pthread_mutex_unlock(&mut);
-	return 0;
-}
-
-static void rs_poll_exit(void)
-{
+	fastlock_acquire(&rs->slock);
+	if (rs->iomap_pending) {
+		ret = rs_send_iomaps(rs, 0);
+		if (ret)
+			goto out;
+	}
+	while (left) {
+		if (!rs_can_send(rs)) {
+			ret = rs_get_comp(rs, rs_nonblocking(rs, 0),
+					  rs_conn_can_send);
+			if (ret)
+				break;
+			if (!(rs->state & rs_writable)) {
+				ret = ERR(ECONNRESET);
+				break;
+			}
+		}
+
+		if (olen < left) {
+			xfer_size = olen;
+			if (olen < RS_MAX_TRANSFER)
+				olen <<= 1;
+		} else {
+			xfer_size = left;
+		}
+
+		if (xfer_size > rs->sbuf_bytes_avail)
+			xfer_size = rs->sbuf_bytes_avail;
+		if (xfer_size > rs->target_sgl[rs->target_sge].length)
+			xfer_size = rs->target_sgl[rs->target_sge].length;
+
+		iov[0].iov_base = (void *) (uintptr_t) rs->ssgl[0].addr;
+		iov[0].iov_len = min_t(uint32_t, xfer_size, rs_sbuf_left(rs));
+		iov[1].iov_base = rs->sbuf;
+		iov[1].iov_len = xfer_size - iov[0].iov_len;
+		iovcnt = iov[1].iov_len ? 2 : 1;
+
+		len = offset ? preadv(in_fd, iov, iovcnt, pos) :
+			       readv(in_fd, iov, iovcnt);
+		if (len <= 0) {
+			ret = len;
+			break;
+		}
+
+		if ((size_t) len <= iov[0].iov_len) {
+			rs->ssgl[0].length = len;
+			ret = rs_write_data(rs, rs->ssgl, 1, len, 0);
+			if ((size_t) len < rs_sbuf_left(rs))
+				rs->ssgl[0].addr += len;
+			else
+				rs->ssgl[0].addr = (uintptr_t) rs->sbuf;
+		} else {
+			rs->ssgl[0].length = iov[0].iov_len;
+			rs->ssgl[1].length = len - iov[0].iov_len;
+			ret = rs_write_data(rs, rs->ssgl, 2, len, 0);
+			rs->ssgl[0].addr = (uintptr_t) rs->sbuf + rs->ssgl[1].length;
+		}
+		if (ret) {
+			/* None of this read went out, put it back for the caller */
+			if (!offset)
+				lseek(in_fd, -len, SEEK_CUR);
+			break;
+		}
+		pos += len;
+		left -= len;
+	}
+out:
+	fastlock_release(&rs->slock);
+
+	/* Both only account for data that was posted */
+	if (offset)
+		*offset = pos;
+	return (ret && left == count) ? ret : count - left;
+}
+
+/* When mapping rpoll to poll, the events reported on the RDMA
+ * fd are independent from the events rpoll may be looking for.
+ * To avoid threads hanging in poll, whenever any event occurs,
+ * we need to wakeup all threads in poll, so that they can check
+ * if there has been a change on the rsockets they are monitoring.
+ * To support this, we 'gate' threads entering and leaving rpoll.
+ */
+static int rs_pollinit(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&mut);
+	if (pollsignal >= 0)
+		goto unlock;
+
+	pollsignal = eventfd(0, EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (pollsignal < 0)
+		ret = -errno;
+
+unlock:
+	pthread_mutex_unlock(&mut);
+	return ret;
+}
+
+/* When an event occurs, we must wait until the state of all rsockets
+ * has settled.  Then we need to re-check the rsocket state prior to
+ * blocking on poll().
+ */
+static int rs_poll_enter(void)
+{
+	pthread_mutex_lock(&mut);
+	if (suspendpoll) {
+		pthread_mutex_unlock(&mut);
+		sched_yield();
+		return -EBUSY;
+	}
+
+	pollcnt++;
+	pthread_mutex_unlock(&mut);
+	return 0;
+}
+
+static void rs_poll_exit(void)
+{
 	uint64_t c;
 	int save_errno;
 	ssize_t ret;
@@ -3205,6 +4867,8 @@ check_cq:
 			revents |= POLLIN;
 		if ((events & POLLOUT) && rs_can_send(rs))
 			revents |= POLLOUT;
+		if (rs->zcopy && rs->zcopy->reported != rs->zcopy->head)
+			revents |= POLLERR;
 		if (!(rs->state & rs_connected)) {
 			if (rs->state == rs_disconnected)
 				revents |= POLLHUP;
@@ -3255,17 +4919,21 @@ check_cq:
 	return 0;
 }
 
-static int rs_poll_check(struct pollfd *fds, nfds_t nfds)
+/* We busy poll for the largest budget of the rsockets being polled */
+static int rs_poll_check(struct pollfd *fds, nfds_t nfds, uint32_t *budget)
 {
 	struct rsocket *rs;
 	int i, cnt = 0;
 
 	for (i = 0; i < nfds; i++) {
 		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs)
+		if (rs) {
+			if (budget)
+				*budget = max(*budget, rs_poll_budget(rs));
 			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
-		else
+		} else {
 			poll(&fds[i], 1, 0);
+		}
 
 		if (fds[i].revents)
 			cnt++;
@@ -3303,177 +4971,692 @@ static int rs_poll_arm(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
 	return 0;
 }
 
-static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+static int rs_poll_events(struct pollfd *rfds, struct pollfd *fds, nfds_t nfds)
+{
+	struct rsocket *rs;
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs) {
+			if (rfds[i].revents) {
+				fastlock_acquire(&rs->cq_wait_lock);
+				if (rs->type == SOCK_STREAM)
+					rs_get_cq_event(rs);
+				else
+					ds_get_cq_event(rs);
+				fastlock_release(&rs->cq_wait_lock);
+			}
+			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+		} else {
+			fds[i].revents = rfds[i].revents;
+		}
+		if (fds[i].revents)
+			cnt++;
+	}
+	return cnt;
+}
+
+static void rs_poll_fds_record(struct pollfd *fds, nfds_t nfds,
+			       uint64_t wait, int slept)
+{
+	struct rsocket *rs;
+	int i;
+
+	for (i = 0; i < nfds; i++) {
+		if (!fds[i].revents)
+			continue;
+		rs = idm_lookup(&idm, fds[i].fd);
+		if (rs)
+			rs_poll_record(rs, wait, slept);
+	}
+}
+
+/*
+ * We need to poll *all* fd's that the user specifies at least once.
+ * Note that we may receive events on an rsocket that may not be reported
+ * to the user (e.g. connection events or credit updates).  Process those
+ * events, then return to polling until we find ones of interest.
+ */
+int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct pollfd *rfds;
+	uint64_t start_time = 0;
+	uint32_t poll_time = 0, budget = 0;
+	int pollsleep, ret;
+
+	do {
+		ret = rs_poll_check(fds, nfds, start_time ? NULL : &budget);
+		if (ret || !timeout) {
+			if (ret > 0 && start_time)
+				rs_poll_fds_record(fds, nfds, poll_time, 0);
+			return ret;
+		}
+
+		if (!start_time)
+			start_time = rs_time_us();
+
+		poll_time = (uint32_t) (rs_time_us() - start_time);
+	} while (budget && poll_time <= budget);
+
+	rfds = rs_fds_alloc(nfds);
+	if (!rfds)
+		return ERR(ENOMEM);
+
+	do {
+		ret = rs_poll_arm(rfds, fds, nfds);
+		if (ret)
+			break;
+
+		if (rs_poll_enter())
+			continue;
+
+		if (timeout >= 0) {
+			timeout -= (int) ((rs_time_us() - start_time) / 1000);
+			if (timeout <= 0)
+				return 0;
+			pollsleep = min(timeout, wake_up_interval);
+		} else {
+			pollsleep = wake_up_interval;
+		}
+
+		ret = poll(rfds, nfds + 1, pollsleep);
+		if (ret < 0) {
+			rs_poll_exit();
+			break;
+		}
+
+		ret = rs_poll_events(rfds, fds, nfds);
+		rs_poll_stop();
+	} while (!ret);
+
+	if (ret > 0)
+		rs_poll_fds_record(fds, nfds, rs_time_us() - start_time, 1);
+	return ret;
+}
+
+static struct pollfd *
+rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	struct pollfd *fds;
+	int fd, i = 0;
+
+	fds = calloc(*nfds, sizeof(*fds));
+	if (!fds)
+		return NULL;
+
+	for (fd = 0; fd < *nfds; fd++) {
+		if (readfds && FD_ISSET(fd, readfds)) {
+			fds[i].fd = fd;
+			fds[i].events = POLLIN;
+		}
+
+		if (writefds && FD_ISSET(fd, writefds)) {
+			fds[i].fd = fd;
+			fds[i].events |= POLLOUT;
+		}
+
+		if (exceptfds && FD_ISSET(fd, exceptfds))
+			fds[i].fd = fd;
+
+		if (fds[i].fd)
+			i++;
+	}
+
+	*nfds = i;
+	return fds;
+}
+
+static int
+rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
+		  fd_set *writefds, fd_set *exceptfds)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < nfds; i++) {
+		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
+			FD_SET(fds[i].fd, readfds);
+			cnt++;
+		}
+
+		if (writefds && (fds[i].revents & POLLOUT)) {
+			FD_SET(fds[i].fd, writefds);
+			cnt++;
+		}
+
+		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
+			FD_SET(fds[i].fd, exceptfds);
+			cnt++;
+		}
+	}
+	return cnt;
+}
+
+static int rs_convert_timeout(struct timeval *timeout)
+{
+	return !timeout ? -1 :
+		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+}
+
+int rselect(int nfds, fd_set *readfds, fd_set *writefds,
+	    fd_set *exceptfds, struct timeval *timeout)
+{
+	struct pollfd *fds;
+	int ret;
+
+	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
+	if (!fds)
+		return ERR(ENOMEM);
+
+	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+
+	if (readfds)
+		FD_ZERO(readfds);
+	if (writefds)
+		FD_ZERO(writefds);
+	if (exceptfds)
+		FD_ZERO(exceptfds);
+
+	if (ret > 0)
+		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+
+	free(fds);
+	return ret;
+}
+
+/*
+ * repoll keeps the monitored fd's between calls, so that idle rsockets
+ * cost nothing.  Each rsocket is represented in a kernel epoll set by the
+ * fd that signals a change in its state: the CQ channel once connected,
+ * the accept queue while listening, or the rdma_cm channel while
+ * connecting.  Only rsockets whose fd fired, or which were reported ready
+ * by the previous call, are placed on the ready list and checked.  The
+ * pollsignal fd is added as well, so that state changes made by the
+ * service threads are seen, in which case all rsockets are checked.
+ * Normal fd's are kept, with the caller's event data, in a second kernel
+ * epoll set that is nested in the first, and its events are read out
+ * whenever it fires.
+ */
+#define RS_EPOLL_SIGNAL UINT64_MAX
+#define RS_EPOLL_NESTED (UINT64_MAX - 1)
+#define RS_EPOLL_BATCH	64
+
+struct rs_epoll_item {
+	dlist_entry	  entry;
+	dlist_entry	  ready_entry;
+	struct rsocket	  *rs;
+	int		  fd;
+	int		  wait_fd;
+	int		  ready;
+	int		  disabled;
+	struct epoll_event event;
+};
+
+struct rs_epoll {
+	int		  epfd;
+	int		  kfd;
+	pthread_mutex_t	  mut;
+	struct index_map  items;
+	dlist_entry	  item_list;
+	dlist_entry	  ready_list;
+};
+
+static int rs_epoll_wait_fd(struct rsocket *rs)
+{
+	if (rs->type == SOCK_DGRAM)
+		return rs->epfd;
+
+	if (rs->state == rs_listening)
+		return rs->accept_queue[0];
+	else if (rs->state >= rs_connected && rs->cm_id->recv_cq_channel)
+		return rs->cm_id->recv_cq_channel->fd;
+	else
+		return rs->cm_id->channel->fd;
+}
+
+static void rs_epoll_ready(struct rs_epoll *ep, struct rs_epoll_item *item)
+{
+	if (!item->ready && !item->disabled) {
+		dlist_insert_tail(&item->ready_entry, &ep->ready_list);
+		item->ready = 1;
+	}
+}
+
+static void rs_epoll_unready(struct rs_epoll_item *item)
+{
+	if (item->ready) {
+		dlist_remove(&item->ready_entry);
+		item->ready = 0;
+	}
+}
+
+static void rs_epoll_rescan(struct rs_epoll *ep)
+{
+	struct rs_epoll_item *item;
+	dlist_entry *entry;
+
+	for (entry = ep->item_list.next; entry != &ep->item_list;
+	     entry = entry->next) {
+		item = container_of(entry, struct rs_epoll_item, entry);
+		rs_epoll_ready(ep, item);
+	}
+}
+
+/*
+ * The fd an rsocket waits on changes as it connects or starts listening.
+ * The old fd belongs to the rsocket, and is still open.
+ */
+static int rs_epoll_watch(struct rs_epoll *ep, struct rs_epoll_item *item,
+			  int fd)
+{
+	struct epoll_event event;
+	int ret;
+
+	if (item->wait_fd == fd)
+		return 0;
+
+	if (item->wait_fd >= 0)
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+
+	event.events = EPOLLIN;
+	event.data.u64 = item->fd;
+	ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, fd, &event);
+	item->wait_fd = ret ? -1 : fd;
+	return ret;
+}
+
+/*
+ * If the fd was closed, the kernel has already dropped it from the epoll
+ * set, and the fd number may have been reused.
+ */
+static void rs_epoll_free_item(struct rs_epoll *ep, struct rs_epoll_item *item,
+			       int closed)
+{
+	if (!closed && item->wait_fd >= 0)
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+
+	rs_epoll_unready(item);
+	dlist_remove(&item->entry);
+	idm_clear(&ep->items, item->fd);
+	free(item);
+}
+
+static int rs_epoll_closed(struct rs_epoll_item *item)
+{
+	return idm_lookup(&idm, item->fd) != item->rs;
+}
+
+/*
+ * Returns the events to report for an rsocket.  If there are none, the
+ * CQ is left armed and the rsocket is taken off the ready list.
+ */
+static int rs_epoll_check(struct rs_epoll *ep, struct rs_epoll_item *item)
+{
+	struct rsocket *rs = item->rs;
+	int revents;
+
+	if (rs_epoll_closed(item)) {
+		rs_epoll_free_item(ep, item, 1);
+		return 0;
+	}
+
+	revents = rs_poll_rs(rs, item->event.events, 0, rs_is_cq_armed);
+	if (rs_epoll_watch(ep, item, rs_epoll_wait_fd(rs)))
+		revents |= EPOLLERR;
+
+	if (!revents)
+		rs_epoll_unready(item);
+	return revents;
+}
+
+static int rs_epoll_report(struct rs_epoll *ep, struct epoll_event *events,
+			   int maxevents, int cnt)
+{
+	struct rs_epoll_item *item;
+	dlist_entry *entry, reported;
+	int revents;
+
+	dlist_init(&reported);
+	entry = ep->ready_list.next;
+	while (entry != &ep->ready_list && cnt < maxevents) {
+		item = container_of(entry, struct rs_epoll_item, ready_entry);
+		entry = entry->next;
+
+		revents = rs_epoll_check(ep, item);
+		if (!revents)
+			continue;
+
+		events[cnt].events = revents;
+		events[cnt++].data = item->event.data;
+		if (item->event.events & EPOLLONESHOT) {
+			rs_epoll_unready(item);
+			item->disabled = 1;
+		} else if (item->event.events & EPOLLET) {
+			rs_epoll_unready(item);
+		} else {
+			dlist_remove(&item->ready_entry);
+			dlist_insert_tail(&item->ready_entry, &reported);
+		}
+	}
+
+	/* Level triggered rsockets stay ready, behind the ones not reported */
+	while (!dlist_empty(&reported)) {
+		entry = reported.next;
+		dlist_remove(entry);
+		dlist_insert_tail(entry, &ep->ready_list);
+	}
+	return cnt;
+}
+
+static int rs_epoll_events(struct rs_epoll *ep, struct epoll_event *kevents,
+			   int nevents, struct epoll_event *events,
+			   int maxevents)
+{
+	struct rs_epoll_item *item;
+	struct rsocket *rs;
+	int i, ret, cnt = 0;
+
+	for (i = 0; i < nevents; i++) {
+		if (kevents[i].data.u64 == RS_EPOLL_SIGNAL) {
+			rs_epoll_rescan(ep);
+			continue;
+		}
+
+		if (kevents[i].data.u64 == RS_EPOLL_NESTED) {
+			ret = epoll_wait(ep->kfd, events + cnt,
+					 maxevents - cnt, 0);
+			if (ret > 0)
+				cnt += ret;
+			continue;
+		}
+
+		item = idm_lookup(&ep->items, (int) kevents[i].data.u64);
+		if (!item)
+			continue;
+
+		if (rs_epoll_closed(item)) {
+			rs_epoll_free_item(ep, item, 1);
+			continue;
+		}
+
+		rs = item->rs;
+		fastlock_acquire(&rs->cq_wait_lock);
+		if (rs->type == SOCK_STREAM)
+			rs_get_cq_event(rs);
+		else
+			ds_get_cq_event(rs);
+		fastlock_release(&rs->cq_wait_lock);
+		rs_epoll_ready(ep, item);
+	}
+	return cnt;
+}
+
+/*
+ * The repoll set takes over epfd, a kernel epoll set, and reports its events
+ * along with those of the rsockets added to it.  Normal fd's passed to
+ * repoll_ctl are added to epfd.  On failure epfd is left to the caller.
+ */
+int repoll_create_from(int epfd)
+{
+	struct epoll_event event;
+	struct rs_epoll *ep;
+	int ret;
+
+	ret = rs_pollinit();
+	if (ret)
+		return ERR(-ret);
+
+	ep = calloc(1, sizeof(*ep));
+	if (!ep)
+		return ERR(ENOMEM);
+
+	ep->kfd = epfd;
+	ep->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (ep->epfd < 0) {
+		ret = ep->epfd;
+		goto err1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u64 = RS_EPOLL_SIGNAL;
+	ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, pollsignal, &event);
+	if (ret)
+		goto err2;
+
+	event.events = EPOLLIN;
+	event.data.u64 = RS_EPOLL_NESTED;
+	ret = epoll_ctl(ep->epfd, EPOLL_CTL_ADD, ep->kfd, &event);
+	if (ret)
+		goto err2;
+
+	pthread_mutex_init(&ep->mut, NULL);
+	dlist_init(&ep->item_list);
+	dlist_init(&ep->ready_list);
+
+	pthread_mutex_lock(&mut);
+	ret = idm_set(&epidm, ep->epfd, ep);
+	pthread_mutex_unlock(&mut);
+	if (ret < 0)
+		goto err3;
+
+	return ep->epfd;
+
+err3:
+	pthread_mutex_destroy(&ep->mut);
+err2:
+	close(ep->epfd);
+err1:
+	free(ep);
+	return ret;
+}
+
+int repoll_create(int size)
+{
+	int epfd, ret;
+
+	if (size <= 0)
+		return ERR(EINVAL);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return epfd;
+
+	ret = repoll_create_from(epfd);
+	if (ret < 0)
+		close(epfd);
+	return ret;
+}
+
+static int rs_epoll_add(struct rs_epoll *ep, struct rsocket *rs, int fd,
+			struct epoll_event *event)
+{
+	struct rs_epoll_item *item;
+	int ret;
+
+	item = calloc(1, sizeof(*item));
+	if (!item)
+		return ERR(ENOMEM);
+
+	item->fd = fd;
+	item->wait_fd = -1;
+	item->event = *event;
+	item->rs = rs;
+	ret = rs_epoll_watch(ep, item, rs_epoll_wait_fd(rs));
+	if (ret)
+		goto err;
+
+	ret = idm_set(&ep->items, fd, item);
+	if (ret < 0) {
+		epoll_ctl(ep->epfd, EPOLL_CTL_DEL, item->wait_fd, NULL);
+		goto err;
+	}
+
+	dlist_insert_tail(&item->entry, &ep->item_list);
+	rs_epoll_ready(ep, item);
+	return 0;
+
+err:
+	free(item);
+	return ret;
+}
+
+static void rs_epoll_mod(struct rs_epoll *ep, struct rs_epoll_item *item,
+			 struct epoll_event *event)
+{
+	item->event = *event;
+	item->disabled = 0;
+	rs_epoll_ready(ep, item);
+}
+
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
 {
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
 	struct rsocket *rs;
-	int i, cnt = 0;
+	int ret;
 
-	for (i = 0; i < nfds; i++) {
-		rs = idm_lookup(&idm, fds[i].fd);
-		if (rs) {
-			if (rfds[i].revents) {
-				fastlock_acquire(&rs->cq_wait_lock);
-				if (rs->type == SOCK_STREAM)
-					rs_get_cq_event(rs);
-				else
-					ds_get_cq_event(rs);
-				fastlock_release(&rs->cq_wait_lock);
-			}
-			fds[i].revents = rs_poll_rs(rs, fds[i].events, 1, rs_poll_all);
+	ep = idm_lookup(&epidm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+	if (op != EPOLL_CTL_DEL && !event)
+		return ERR(EFAULT);
+
+	pthread_mutex_lock(&ep->mut);
+	item = idm_lookup(&ep->items, fd);
+	if (item && rs_epoll_closed(item)) {
+		rs_epoll_free_item(ep, item, 1);
+		item = NULL;
+	}
+
+	rs = item ? item->rs : idm_lookup(&idm, fd);
+	if (!rs) {
+		pthread_mutex_unlock(&ep->mut);
+		return epoll_ctl(ep->kfd, op, fd, event);
+	}
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		ret = item ? ERR(EEXIST) : rs_epoll_add(ep, rs, fd, event);
+		break;
+	case EPOLL_CTL_MOD:
+		if (item)
+			rs_epoll_mod(ep, item, event);
+		ret = item ? 0 : ERR(ENOENT);
+		break;
+	case EPOLL_CTL_DEL:
+		if (item) {
+			rs_epoll_free_item(ep, item, 0);
+			ret = 0;
 		} else {
-			fds[i].revents = rfds[i].revents;
+			ret = ERR(ENOENT);
 		}
-		if (fds[i].revents)
-			cnt++;
+		break;
+	default:
+		ret = ERR(EINVAL);
+		break;
 	}
-	return cnt;
+	pthread_mutex_unlock(&ep->mut);
+	return ret;
 }
 
 /*
- * We need to poll *all* fd's that the user specifies at least once.
- * Note that we may receive events on an rsocket that may not be reported
- * to the user (e.g. connection events or credit updates).  Process those
- * events, then return to polling until we find ones of interest.
+ * Unlike rpoll, we do not wake up other polling threads after processing
+ * events.  That would force every other repoll set to check all of its
+ * rsockets.  The signal mask is only swapped by the kernel, while blocked.
  */
-int rpoll(struct pollfd *fds, nfds_t nfds, int timeout)
+int repoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		 int timeout, const sigset_t *sigmask)
 {
-	struct pollfd *rfds;
+	struct epoll_event kevents[RS_EPOLL_BATCH];
+	struct rs_epoll *ep;
 	uint64_t start_time = 0;
-	uint32_t poll_time;
-	int pollsleep, ret;
-
-	do {
-		ret = rs_poll_check(fds, nfds);
-		if (ret || !timeout)
-			return ret;
-
-		if (!start_time)
-			start_time = rs_time_us();
-
-		poll_time = (uint32_t) (rs_time_us() - start_time);
-	} while (poll_time <= polling_time);
+	int pollsleep = 1, ret, cnt;
 
-	rfds = rs_fds_alloc(nfds);
-	if (!rfds)
-		return ERR(ENOMEM);
+	ep = idm_lookup(&epidm, epfd);
+	if (!ep)
+		return ERR(EBADF);
+	if (maxevents <= 0)
+		return ERR(EINVAL);
 
 	do {
-		ret = rs_poll_arm(rfds, fds, nfds);
-		if (ret)
-			break;
+		pthread_mutex_lock(&ep->mut);
+		cnt = rs_epoll_report(ep, events, maxevents, 0);
+		pthread_mutex_unlock(&ep->mut);
+		if (cnt)
+			return cnt;
 
 		if (rs_poll_enter())
 			continue;
 
-		if (timeout >= 0) {
-			timeout -= (int) ((rs_time_us() - start_time) / 1000);
-			if (timeout <= 0)
-				return 0;
-			pollsleep = min(timeout, wake_up_interval);
+		if (timeout > 0) {
+			if (!start_time)
+				start_time = rs_time_us();
+			pollsleep = timeout -
+				    (int) ((rs_time_us() - start_time) / 1000);
+			if (pollsleep < 0)
+				pollsleep = 0;
+			pollsleep = min(pollsleep, wake_up_interval);
+		} else if (!timeout) {
+			pollsleep = 0;
 		} else {
 			pollsleep = wake_up_interval;
 		}
 
-		ret = poll(rfds, nfds + 1, pollsleep);
+		ret = epoll_pwait(ep->epfd, kevents,
+				  min(maxevents, RS_EPOLL_BATCH), pollsleep,
+				  sigmask);
 		if (ret < 0) {
 			rs_poll_exit();
-			break;
-		}
-
-		ret = rs_poll_events(rfds, fds, nfds);
-		rs_poll_stop();
-	} while (!ret);
-
-	return ret;
-}
-
-static struct pollfd *
-rs_select_to_poll(int *nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
-{
-	struct pollfd *fds;
-	int fd, i = 0;
-
-	fds = calloc(*nfds, sizeof(*fds));
-	if (!fds)
-		return NULL;
-
-	for (fd = 0; fd < *nfds; fd++) {
-		if (readfds && FD_ISSET(fd, readfds)) {
-			fds[i].fd = fd;
-			fds[i].events = POLLIN;
-		}
-
-		if (writefds && FD_ISSET(fd, writefds)) {
-			fds[i].fd = fd;
-			fds[i].events |= POLLOUT;
+			return ret;
 		}
 
-		if (exceptfds && FD_ISSET(fd, exceptfds))
-			fds[i].fd = fd;
-
-		if (fds[i].fd)
-			i++;
-	}
-
-	*nfds = i;
-	return fds;
-}
-
-static int
-rs_poll_to_select(int nfds, struct pollfd *fds, fd_set *readfds,
-		  fd_set *writefds, fd_set *exceptfds)
-{
-	int i, cnt = 0;
-
-	for (i = 0; i < nfds; i++) {
-		if (readfds && (fds[i].revents & (POLLIN | POLLHUP))) {
-			FD_SET(fds[i].fd, readfds);
-			cnt++;
-		}
+		/* Safe guard against missed wake ups, as rpoll does */
+		pthread_mutex_lock(&ep->mut);
+		if (!ret && pollsleep == wake_up_interval)
+			rs_epoll_rescan(ep);
 
-		if (writefds && (fds[i].revents & POLLOUT)) {
-			FD_SET(fds[i].fd, writefds);
-			cnt++;
-		}
+		cnt = rs_epoll_events(ep, kevents, ret, events, maxevents);
+		cnt = rs_epoll_report(ep, events, maxevents, cnt);
+		pthread_mutex_unlock(&ep->mut);
+		rs_poll_exit();
+	} while (!cnt && pollsleep);
 
-		if (exceptfds && (fds[i].revents & ~(POLLIN | POLLOUT))) {
-			FD_SET(fds[i].fd, exceptfds);
-			cnt++;
-		}
-	}
 	return cnt;
 }
 
-static int rs_convert_timeout(struct timeval *timeout)
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout)
 {
-	return !timeout ? -1 :
-		timeout->tv_sec * 1000 + timeout->tv_usec / 1000;
+	return repoll_pwait(epfd, events, maxevents, timeout, NULL);
 }
 
-int rselect(int nfds, fd_set *readfds, fd_set *writefds,
-	    fd_set *exceptfds, struct timeval *timeout)
+static int rs_epoll_close(int epfd)
 {
-	struct pollfd *fds;
-	int ret;
-
-	fds = rs_select_to_poll(&nfds, readfds, writefds, exceptfds);
-	if (!fds)
-		return ERR(ENOMEM);
-
-	ret = rpoll(fds, nfds, rs_convert_timeout(timeout));
+	struct rs_epoll_item *item;
+	struct rs_epoll *ep;
+	int i;
 
-	if (readfds)
-		FD_ZERO(readfds);
-	if (writefds)
-		FD_ZERO(writefds);
-	if (exceptfds)
-		FD_ZERO(exceptfds);
+	pthread_mutex_lock(&mut);
+	ep = idm_lookup(&epidm, epfd);
+	if (ep)
+		idm_clear(&epidm, epfd);
+	pthread_mutex_unlock(&mut);
+	if (!ep)
+		return EBADF;
 
-	if (ret > 0)
-		ret = rs_poll_to_select(nfds, fds, readfds, writefds, exceptfds);
+	while (!dlist_empty(&ep->item_list)) {
+		item = container_of(ep->item_list.next, struct rs_epoll_item,
+				    entry);
+		rs_epoll_free_item(ep, item, 1);
+	}
+	for (i = 0; i < IDX_ARRAY_SIZE; i++)
+		free(ep->items.array[i]);
 
-	free(fds);
-	return ret;
+	close(ep->epfd);
+	close(ep->kfd);
+	pthread_mutex_destroy(&ep->mut);
+	free(ep);
+	return 0;
 }
 
 /*
@@ -3490,7 +5673,7 @@ int rshutdown(int socket, int how)
 	if (!rs)
 		return ERR(EBADF);
 	if (rs->opts & RS_OPT_KEEPALIVE)
-		rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		rs_notify_svc(tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
@@ -3540,7 +5723,7 @@ out:
 static void ds_shutdown(struct rsocket *rs)
 {
 	if (rs->opts & RS_OPT_UDP_SVC)
-		rs_notify_svc(&udp_svc, rs, RS_SVC_REM_DGRAM);
+		rs_notify_svc(udp_svc, rs, RS_SVC_REM_DGRAM);
 
 	if (rs->fd_flags & O_NONBLOCK)
 		rs_set_nonblocking(rs, 0);
@@ -3558,16 +5741,16 @@ int rclose(int socket)
 
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
-		return EBADF;
+		return rs_epoll_close(socket);
 	if (rs->type == SOCK_STREAM) {
 		if (rs->state & rs_connected)
 			rshutdown(socket, SHUT_RDWR);
 		if (rs->opts & RS_OPT_KEEPALIVE)
-			rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+			rs_notify_svc(tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
 		if (rs->opts & RS_OPT_CM_SVC && rs->state == rs_listening)
-			rs_notify_svc(&listen_svc, rs, RS_SVC_REM_CM);
+			rs_notify_svc(listen_svc, rs, RS_SVC_REM_CM);
 		if (rs->opts & RS_OPT_CM_SVC)
-			rs_notify_svc(&connect_svc, rs, RS_SVC_REM_CM);
+			rs_notify_svc(connect_svc, rs, RS_SVC_REM_CM);
 	} else {
 		ds_shutdown(rs);
 	}
@@ -3639,9 +5822,9 @@ static int rs_set_keepalive(struct rsocket *rs, int on)
 				rs->keepalive_time = 7200;
 			}
 		}
-		ret = rs_notify_svc(&tcp_svc, rs, RS_SVC_ADD_KEEPALIVE);
+		ret = rs_notify_svc(tcp_svc, rs, RS_SVC_ADD_KEEPALIVE);
 	} else {
-		ret = rs_notify_svc(&tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
+		ret = rs_notify_svc(tcp_svc, rs, RS_SVC_REM_KEEPALIVE);
 	}
 
 	return ret;
@@ -3658,7 +5841,9 @@ int rsetsockopt(int socket, int level, int optname,
 	rs = idm_lookup(&idm, socket);
 	if (!rs)
 		return ERR(EBADF);
-	if (rs->type == SOCK_DGRAM && level != SOL_RDMA) {
+	/* Busy polling applies to the rsocket, not the UDP socket behind it */
+	if (rs->type == SOCK_DGRAM && level != SOL_RDMA &&
+	    !(level == SOL_SOCKET && optname == SO_BUSY_POLL)) {
 		ret = setsockopt(rs->udp_sock, level, optname, optval, optlen);
 		if (ret)
 			return ret;
@@ -3682,8 +5867,10 @@ int rsetsockopt(int socket, int level, int optname,
 			break;
 		case SO_RCVBUF:
 			if ((rs->type == SOCK_STREAM && !rs->rbuf) ||
-			    (rs->type == SOCK_DGRAM && !rs->qp_list))
+			    (rs->type == SOCK_DGRAM && !rs->qp_list)) {
 				rs->rbuf_size = (*(uint32_t *) optval) << 1;
+				rs->rbuf_max = 0;
+			}
 			ret = 0;
 			break;
 		case SO_SNDBUF:
@@ -3706,6 +5893,26 @@ int rsetsockopt(int socket, int level, int optname,
 			opt_on = *(int *) optval;
 			ret = 0;
 			break;
+		case SO_ZEROCOPY:
+			/* Tracked in rs->opts, optname is too large for so_opts */
+			opts = NULL;
+			if (rs->type == SOCK_STREAM) {
+				if (*(int *) optval)
+					rs->opts |= RS_OPT_ZEROCOPY;
+				else
+					rs->opts &= ~RS_OPT_ZEROCOPY;
+				ret = 0;
+			}
+			break;
+		case SO_BUSY_POLL:
+			opts = NULL;
+			if (*(int *) optval < 0) {
+				ret = ERR(EINVAL);
+				break;
+			}
+			rs->busy_poll = *(int *) optval;
+			ret = 0;
+			break;
 		default:
 			break;
 		}
@@ -3724,7 +5931,7 @@ int rsetsockopt(int socket, int level, int optname,
 			}
 			rs->keepalive_time = *(int *) optval;
 			ret = (rs->opts & RS_OPT_KEEPALIVE) ?
-			      rs_notify_svc(&tcp_svc, rs, RS_SVC_MOD_KEEPALIVE) : 0;
+			      rs_notify_svc(tcp_svc, rs, RS_SVC_MOD_KEEPALIVE) : 0;
 			break;
 		case TCP_NODELAY:
 			opt_on = *(int *) optval;
@@ -3779,6 +5986,27 @@ int rsetsockopt(int socket, int level, int optname,
 				(uint8_t) rs_value_to_scale(*(int *) optval, 8), 8);
 			ret = 0;
 			break;
+		case RDMA_SHARED:
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_SHARED;
+			else
+				rs->opts &= ~RS_OPT_SHARED;
+			ret = 0;
+			break;
+		case RDMA_ADAPTIVE_POLL:
+			if (*(int *) optval)
+				rs->opts |= RS_OPT_ADAPTIVE_POLL;
+			else
+				rs->opts &= ~RS_OPT_ADAPTIVE_POLL;
+			ret = 0;
+			break;
+		case RDMA_RMEM_MAX:
+			if (rs->type == SOCK_STREAM) {
+				if (!rs->rbuf)
+					rs->rbuf_max = *(uint32_t *) optval;
+				ret = 0;
+			}
+			break;
 		case RDMA_ROUTE:
 			if ((rs->optval = malloc(optlen))) {
 				memcpy(rs->optval, optval, optlen);
@@ -3835,6 +6063,7 @@ int rgetsockopt(int socket, int level, int optname,
 	void *opt;
 	struct ibv_sa_path_rec *path_rec;
 	struct ibv_path_data path_data;
+	struct rs_poll_stats *stats;
 	socklen_t len;
 	int ret = 0;
 	int num_paths;
@@ -3871,6 +6100,14 @@ int rgetsockopt(int socket, int level, int optname,
 			*optlen = sizeof(int);
 			rs->err = 0;
 			break;
+		case SO_ZEROCOPY:
+			*((int *) optval) = !!(rs->opts & RS_OPT_ZEROCOPY);
+			*optlen = sizeof(int);
+			break;
+		case SO_BUSY_POLL:
+			*((int *) optval) = (int) rs->busy_poll;
+			*optlen = sizeof(int);
+			break;
 		default:
 			ret = ENOTSUP;
 			break;
@@ -3930,6 +6167,39 @@ int rgetsockopt(int socket, int level, int optname,
 			*((int *) optval) = rs->target_iomap_size;
 			*optlen = sizeof(int);
 			break;
+		case RDMA_SHARED:
+			*((int *) optval) = !!(rs->opts & RS_OPT_SHARED);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_ADAPTIVE_POLL:
+			*((int *) optval) = !!(rs->opts & RS_OPT_ADAPTIVE_POLL);
+			*optlen = sizeof(int);
+			break;
+		case RDMA_RMEM_MAX:
+			*((int *) optval) = rs->type == SOCK_STREAM ?
+					    rs->rbuf_max : 0;
+			*optlen = sizeof(int);
+			break;
+		case RDMA_SVC_STATS:
+			if (*optlen < sizeof(struct rs_svc_stats)) {
+				ret = EINVAL;
+			} else {
+				rs_get_svc_stats(optval);
+				*optlen = sizeof(struct rs_svc_stats);
+			}
+			break;
+		case RDMA_POLL_STATS:
+			if (*optlen < sizeof(struct rs_poll_stats)) {
+				ret = EINVAL;
+			} else {
+				stats = optval;
+				stats->spin_hits = rs->spin_hits;
+				stats->sleeps = rs->sleeps;
+				stats->spin_time = rs_poll_budget(rs);
+				stats->avg_wait = rs->poll_avg >> 3;
+				*optlen = sizeof(struct rs_poll_stats);
+			}
+			break;
 		case RDMA_ROUTE:
 			if (rs->optval) {
 				if (*optlen < rs->optlen) {
@@ -4248,18 +6518,15 @@ static int rs_svc_add_rs(struct rs_svc *svc, struct rsocket *rs)
 	}
 
 	svc->rss[++svc->cnt] = rs;
+	rs->svc_index[svc->type] = svc->cnt;
 	return 0;
 }
 
 static int rs_svc_index(struct rs_svc *svc, struct rsocket *rs)
 {
-	int i;
+	int i = rs->svc_index[svc->type];
 
-	for (i = 1; i <= svc->cnt; i++) {
-		if (svc->rss[i] == rs)
-			return i;
-	}
-	return -1;
+	return (i >= 1 && i <= svc->cnt && svc->rss[i] == rs) ? i : -1;
 }
 
 static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
@@ -4268,18 +6535,34 @@ static int rs_svc_rm_rs(struct rs_svc *svc, struct rsocket *rs)
 
 	if ((i = rs_svc_index(svc, rs)) >= 0) {
 		svc->rss[i] = svc->rss[svc->cnt];
+		svc->rss[i]->svc_index[svc->type] = i;
 		memcpy(svc->contexts + i * svc->context_size,
 		       svc->contexts + svc->cnt * svc->context_size,
 		       svc->context_size);
+		rs->svc_index[svc->type] = 0;
 		svc->cnt--;
 		return 0;
 	}
 	return EBADF;
 }
 
+/*
+ * Account for the time a service thread spent handling a wakeup.
+ */
+static void rs_svc_update_stats(struct rs_svc *svc, uint64_t start)
+{
+	uint64_t busy = rs_time_us() - start;
+
+	svc->stats.wakeups++;
+	svc->stats.busy_time += busy;
+	if (busy > svc->stats.max_busy)
+		svc->stats.max_busy = busy;
+}
+
 static void udp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
+	struct pollfd *fds;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
@@ -4287,10 +6570,10 @@ static void udp_svc_process_sock(struct rs_svc *svc)
 		msg.status = rs_svc_add_rs(svc, msg.rs);
 		if (!msg.status) {
 			msg.rs->opts |= RS_OPT_UDP_SVC;
-			udp_svc_fds = svc->contexts;
-			udp_svc_fds[svc->cnt].fd = msg.rs->udp_sock;
-			udp_svc_fds[svc->cnt].events = POLLIN;
-			udp_svc_fds[svc->cnt].revents = 0;
+			fds = svc->contexts;
+			fds[svc->cnt].fd = msg.rs->udp_sock;
+			fds[svc->cnt].events = POLLIN;
+			fds[svc->cnt].revents = 0;
 		}
 		break;
 	case RS_SVC_REM_DGRAM:
@@ -4478,7 +6761,9 @@ static void udp_svc_process_rs(struct rsocket *rs)
 static void *udp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
+	struct pollfd *fds;
 	struct rs_svc_msg msg;
+	uint64_t start;
 	int i, ret;
 
 	ret = rs_svc_grow_sets(svc, 4);
@@ -4488,21 +6773,25 @@ static void *udp_svc_run(void *arg)
 		return (void *) (uintptr_t) ret;
 	}
 
-	udp_svc_fds = svc->contexts;
-	udp_svc_fds[0].fd = svc->sock[1];
-	udp_svc_fds[0].events = POLLIN;
+	fds = svc->contexts;
+	fds[0].fd = svc->sock[1];
+	fds[0].events = POLLIN;
 	do {
 		for (i = 0; i <= svc->cnt; i++)
-			udp_svc_fds[i].revents = 0;
+			fds[i].revents = 0;
 
-		poll(udp_svc_fds, svc->cnt + 1, -1);
-		if (udp_svc_fds[0].revents)
+		poll(fds, svc->cnt + 1, -1);
+		start = rs_time_us();
+		if (fds[0].revents) {
 			udp_svc_process_sock(svc);
+			fds = svc->contexts;
+		}
 
 		for (i = 1; i <= svc->cnt; i++) {
-			if (udp_svc_fds[i].revents)
+			if (fds[i].revents)
 				udp_svc_process_rs(svc->rss[i]);
 		}
+		rs_svc_update_stats(svc, start);
 	} while (svc->cnt >= 1);
 
 	return NULL;
@@ -4513,10 +6802,23 @@ static uint64_t rs_get_time(void)
 	return rs_time_us() / 1000000;
 }
 
+/*
+ * Keepalive deadlines are kept in a timer wheel with one second slots.
+ * Deadlines further out than the wheel wrap around and are skipped until
+ * they are due.
+ */
+static void tcp_svc_add_timer(struct rs_svc *svc, struct rsocket *rs,
+			      uint64_t now)
+{
+	rs->keepalive_deadline = now + max(rs->keepalive_time, 1U);
+	dlist_insert_tail(&rs->keepalive_entry,
+			  &svc->timers[rs->keepalive_deadline &
+				       (RS_SVC_WHEEL_SIZE - 1)]);
+}
+
 static void tcp_svc_process_sock(struct rs_svc *svc)
 {
 	struct rs_svc_msg msg;
-	int i;
 
 	read_all(svc->sock[1], &msg, sizeof msg);
 	switch (msg.cmd) {
@@ -4524,20 +6826,20 @@ static void tcp_svc_process_sock(struct rs_svc *svc)
 		msg.status = rs_svc_add_rs(svc, msg.rs);
 		if (!msg.status) {
 			msg.rs->opts |= RS_OPT_KEEPALIVE;
-			tcp_svc_timeouts = svc->contexts;
-			tcp_svc_timeouts[svc->cnt] = rs_get_time() +
-						     msg.rs->keepalive_time;
+			tcp_svc_add_timer(svc, msg.rs, rs_get_time());
 		}
 		break;
 	case RS_SVC_REM_KEEPALIVE:
 		msg.status = rs_svc_rm_rs(svc, msg.rs);
-		if (!msg.status)
+		if (!msg.status) {
 			msg.rs->opts &= ~RS_OPT_KEEPALIVE;
+			dlist_remove(&msg.rs->keepalive_entry);
+		}
 		break;
 	case RS_SVC_MOD_KEEPALIVE:
-		i = rs_svc_index(svc, msg.rs);
-		if (i >= 0) {
-			tcp_svc_timeouts[i] = rs_get_time() + msg.rs->keepalive_time;
+		if (rs_svc_index(svc, msg.rs) >= 0) {
+			dlist_remove(&msg.rs->keepalive_entry);
+			tcp_svc_add_timer(svc, msg.rs, rs_get_time());
 			msg.status = 0;
 		} else {
 			msg.status = EBADF;
@@ -4567,44 +6869,83 @@ static void tcp_svc_send_keepalive(struct rsocket *rs)
 	fastlock_release(&rs->cq_lock);
 }	
 
+/*
+ * Send keepalives for the slots that passed since the wheel was last
+ * advanced, and return the number of seconds until the next occupied slot.
+ */
+static int tcp_svc_expire_timers(struct rs_svc *svc, uint64_t now)
+{
+	dlist_entry *head, *entry, *next;
+	struct rsocket *rs;
+	uint64_t t;
+	int i;
+
+	t = svc->timer_time;
+	if (now - t > RS_SVC_WHEEL_SIZE)
+		t = now - RS_SVC_WHEEL_SIZE;
+	while (t < now) {
+		head = &svc->timers[++t & (RS_SVC_WHEEL_SIZE - 1)];
+		for (entry = head->next; entry != head; entry = next) {
+			next = entry->next;
+			rs = container_of(entry, struct rsocket, keepalive_entry);
+			if (rs->keepalive_deadline > now)
+				continue;
+
+			tcp_svc_send_keepalive(rs);
+			svc->stats.keepalives++;
+			dlist_remove(entry);
+			tcp_svc_add_timer(svc, rs, now);
+		}
+	}
+	svc->timer_time = now;
+
+	for (i = 1; i <= RS_SVC_WHEEL_SIZE; i++) {
+		if (!dlist_empty(&svc->timers[(now + i) &
+					      (RS_SVC_WHEEL_SIZE - 1)]))
+			return i;
+	}
+	return -1;
+}
+
 static void *tcp_svc_run(void *arg)
 {
 	struct rs_svc *svc = arg;
 	struct rs_svc_msg msg;
 	struct pollfd fds;
-	uint64_t now, next_timeout;
+	uint64_t start;
 	int i, ret, timeout;
 
 	ret = rs_svc_grow_sets(svc, 16);
+	if (!ret) {
+		svc->timers = calloc(RS_SVC_WHEEL_SIZE, sizeof(*svc->timers));
+		if (!svc->timers)
+			ret = ENOMEM;
+	}
 	if (ret) {
 		msg.status = ret;
 		write_all(svc->sock[1], &msg, sizeof msg);
 		return (void *) (uintptr_t) ret;
 	}
 
-	tcp_svc_timeouts = svc->contexts;
+	for (i = 0; i < RS_SVC_WHEEL_SIZE; i++)
+		dlist_init(&svc->timers[i]);
+	svc->timer_time = rs_get_time();
+
 	fds.fd = svc->sock[1];
 	fds.events = POLLIN;
 	timeout = -1;
 	do {
-		poll(&fds, 1, timeout * 1000);
+		poll(&fds, 1, timeout < 0 ? -1 : timeout * 1000);
+		start = rs_time_us();
 		if (fds.revents)
 			tcp_svc_process_sock(svc);
 
-		now = rs_get_time();
-		next_timeout = ~0;
-		for (i = 1; i <= svc->cnt; i++) {
-			if (tcp_svc_timeouts[i] <= now) {
-				tcp_svc_send_keepalive(svc->rss[i]);
-				tcp_svc_timeouts[i] =
-					now + svc->rss[i]->keepalive_time;
-			}
-			if (tcp_svc_timeouts[i] < next_timeout)
-				next_timeout = tcp_svc_timeouts[i];
-		}
-		timeout = (int) (next_timeout - now);
+		timeout = tcp_svc_expire_timers(svc, rs_get_time());
+		rs_svc_update_stats(svc, start);
 	} while (svc->cnt >= 1);
 
+	free(svc->timers);
+	svc->timers = NULL;
 	return NULL;
 }
 
@@ -4661,6 +7002,7 @@ static void *cm_svc_run(void *arg)
 	struct rs_svc *svc = arg;
 	struct pollfd *fds;
 	struct rs_svc_msg msg;
+	uint64_t start;
 	int i, ret;
 
 	ret = rs_svc_grow_sets(svc, 4);
@@ -4678,6 +7020,7 @@ static void *cm_svc_run(void *arg)
 			fds[i].revents = 0;
 
 		poll(fds, svc->cnt + 1, -1);
+		start = rs_time_us();
 		if (fds[0].revents) {
 			cm_svc_process_sock(svc);
 			/* svc->contexts may have been reallocated, so need to assign again */
@@ -4688,11 +7031,12 @@ static void *cm_svc_run(void *arg)
 			if (!fds[i].revents)
 				continue;
 
-			if (svc == &listen_svc)
+			if (svc->type == RS_SVC_LISTEN)
 				rs_accept(svc->rss[i]);
 			else
 				rs_handle_cm_event(svc->rss[i]);
 		}
+		rs_svc_update_stats(svc, start);
 	} while (svc->cnt >= 1);
 
 	return NULL;
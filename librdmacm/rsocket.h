@@ -39,12 +39,15 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct mmsghdr;
+
 int rsocket(int domain, int type, int protocol);
 int rbind(int socket, const struct sockaddr *addr, socklen_t addrlen);
 int rlisten(int socket, int backlog);
@@ -57,18 +60,29 @@ ssize_t rrecv(int socket, void *buf, size_t len, int flags);
 ssize_t rrecvfrom(int socket, void *buf, size_t len, int flags,
 		  struct sockaddr *src_addr, socklen_t *addrlen);
 ssize_t rrecvmsg(int socket, struct msghdr *msg, int flags);
+int rrecvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen,
+	      int flags, struct timespec *timeout);
 ssize_t rsend(int socket, const void *buf, size_t len, int flags);
 ssize_t rsendto(int socket, const void *buf, size_t len, int flags,
 		const struct sockaddr *dest_addr, socklen_t addrlen);
 ssize_t rsendmsg(int socket, const struct msghdr *msg, int flags);
+int rsendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
 ssize_t rread(int socket, void *buf, size_t count);
 ssize_t rreadv(int socket, const struct iovec *iov, int iovcnt);
 ssize_t rwrite(int socket, const void *buf, size_t count);
 ssize_t rwritev(int socket, const struct iovec *iov, int iovcnt);
+ssize_t rsendfile(int socket, int in_fd, off_t *offset, size_t count);
 
 int rpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int rselect(int nfds, fd_set *readfds, fd_set *writefds,
 	    fd_set *exceptfds, struct timeval *timeout);
+int repoll_create(int size);
+int repoll_create_from(int epfd);
+int repoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int repoll_wait(int epfd, struct epoll_event *events, int maxevents,
+		int timeout);
+int repoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+		 int timeout, const sigset_t *sigmask);
 
 int rgetpeername(int socket, struct sockaddr *addr, socklen_t *addrlen);
 int rgetsockname(int socket, struct sockaddr *addr, socklen_t *addrlen);
@@ -79,7 +93,31 @@ enum {
 	RDMA_RQSIZE,
 	RDMA_INLINE,
 	RDMA_IOMAPSIZE,
-	RDMA_ROUTE
+	RDMA_ROUTE,
+	RDMA_SHARED,
+	RDMA_ADAPTIVE_POLL,
+	RDMA_POLL_STATS,
+	RDMA_RMEM_MAX,
+	RDMA_SVC_STATS
+};
+
+/* Returned by rgetsockopt RDMA_POLL_STATS */
+struct rs_poll_stats {
+	uint64_t spin_hits;	/* waits satisfied while busy polling */
+	uint64_t sleeps;	/* waits that blocked for an event */
+	uint32_t spin_time;	/* microseconds the next wait will busy poll */
+	uint32_t avg_wait;	/* average microseconds waited for an event */
+};
+
+/* Returned by rgetsockopt RDMA_SVC_STATS, summed over all service threads */
+struct rs_svc_stats {
+	uint64_t wakeups;	/* times a service thread woke up */
+	uint64_t busy_time;	/* microseconds spent handling wakeups */
+	uint64_t notifies;	/* requests made of the service threads */
+	uint64_t notify_time;	/* microseconds waited for their replies */
+	uint64_t keepalives;	/* keepalive messages sent */
+	uint32_t max_busy;	/* longest wakeup, in microseconds */
+	uint32_t max_notify;	/* longest wait for a reply, in microseconds */
 };
 
 int rsetsockopt(int socket, int level, int optname,
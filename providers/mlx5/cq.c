@@ -1399,6 +1399,8 @@ int mlx5_poll_cq_v1(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 	return poll_cq(ibcq, ne, wc, 1);
 }
 
+PROVIDER_DATAPATH_OP(mlx5, poll_cq, mlx5_poll_cq_v1);
+
 static inline enum ibv_wc_opcode mlx5_cq_read_wc_opcode(struct ibv_cq_ex *ibcq)
 {
 	struct mlx5_cq *cq = to_mcq(ibv_cq_ex_to_cq(ibcq));
@@ -1759,6 +1761,8 @@ int mlx5_arm_cq(struct ibv_cq *ibvcq, int solicited)
 	return 0;
 }
 
+PROVIDER_DATAPATH_OP(mlx5, req_notify_cq, mlx5_arm_cq);
+
 void mlx5_cq_event(struct ibv_cq *cq)
 {
 	to_mcq(cq)->arm_sn++;
@@ -15,12 +15,24 @@ enum dr_arg_chunk_size {
 	DR_ARG_CHUNK_SIZE_MAX,
 };
 
+/*
+ * The free objects are spread over DR_ARG_POOL_SHARDS lists, each thread
+ * uses its own one and takes a batch from the others when it runs dry,
+ * before allocating a new range.
+ */
+#define DR_ARG_POOL_SHARDS	DR_MAX_SEND_RINGS
+#define DR_ARG_POOL_STEAL_BATCH	64
+
+struct dr_arg_pool_shard {
+	struct list_head	free_list;
+	pthread_mutex_t		mutex;
+};
+
 /* argument pool area */
 struct dr_arg_pool {
 	enum dr_arg_chunk_size	log_chunk_size;
 	struct mlx5dv_dr_domain	*dmn;
-	struct list_head	free_list;
-	pthread_mutex_t		mutex;
+	struct dr_arg_pool_shard shards[DR_ARG_POOL_SHARDS];
 };
 
 struct dr_arg_mngr {
@@ -28,7 +40,8 @@ struct dr_arg_mngr {
 	struct dr_arg_pool *pools[DR_ARG_CHUNK_SIZE_MAX];
 };
 
-static int dr_arg_pool_alloc_objs(struct dr_arg_pool *pool)
+static int dr_arg_pool_alloc_objs(struct dr_arg_pool *pool,
+				  struct dr_arg_pool_shard *shard)
 {
 	struct dr_arg_obj *arg_obj, *tmp_arg;
 	struct mlx5dv_devx_obj *devx_obj;
@@ -81,7 +94,7 @@ static int dr_arg_pool_alloc_objs(struct dr_arg_pool *pool)
 		arg_obj->obj = devx_obj;
 		arg_obj->obj_offset = i * (1 << pool->log_chunk_size);
 	}
-	list_append_list(&pool->free_list, &cur_list);
+	list_append_list(&shard->free_list, &cur_list);
 
 	return 0;
 
@@ -94,39 +107,89 @@ clean_arg_obj:
 	return errno;
 }
 
+static struct dr_arg_pool_shard *dr_arg_pool_get_shard(struct dr_arg_pool *pool)
+{
+	return &pool->shards[dr_get_thread_idx() % DR_ARG_POOL_SHARDS];
+}
+
+/* Move up to a batch of free objects from the other shards to this one */
+static void dr_arg_pool_steal_objs(struct dr_arg_pool *pool,
+				   struct dr_arg_pool_shard *shard)
+{
+	struct dr_arg_pool_shard *victim;
+	struct dr_arg_obj *arg_obj;
+	LIST_HEAD(stolen);
+	int i, num = 0;
+
+	for (i = 0; i < DR_ARG_POOL_SHARDS && !num; i++) {
+		victim = &pool->shards[i];
+		if (victim == shard)
+			continue;
+
+		pthread_mutex_lock(&victim->mutex);
+		while (num < DR_ARG_POOL_STEAL_BATCH) {
+			arg_obj = list_pop(&victim->free_list,
+					   struct dr_arg_obj, list_node);
+			if (!arg_obj)
+				break;
+			list_add_tail(&stolen, &arg_obj->list_node);
+			num++;
+		}
+		pthread_mutex_unlock(&victim->mutex);
+	}
+
+	if (!num)
+		return;
+
+	pthread_mutex_lock(&shard->mutex);
+	list_append_list(&shard->free_list, &stolen);
+	pthread_mutex_unlock(&shard->mutex);
+}
+
 static struct dr_arg_obj *dr_arg_pool_get_arg_obj(struct dr_arg_pool *pool)
 {
+	struct dr_arg_pool_shard *shard = dr_arg_pool_get_shard(pool);
 	struct dr_arg_obj *arg_obj = NULL;
 	int ret;
 
-	pthread_mutex_lock(&pool->mutex);
-	if (list_empty(&pool->free_list)) {
-		ret = dr_arg_pool_alloc_objs(pool);
+	pthread_mutex_lock(&shard->mutex);
+	if (list_empty(&shard->free_list)) {
+		/* Other threads may have freed objects to their own shard */
+		pthread_mutex_unlock(&shard->mutex);
+		dr_arg_pool_steal_objs(pool, shard);
+		pthread_mutex_lock(&shard->mutex);
+	}
+
+	if (list_empty(&shard->free_list)) {
+		ret = dr_arg_pool_alloc_objs(pool, shard);
 		if (ret)
 			goto out;
 	}
 
-	arg_obj = list_pop(&pool->free_list, struct dr_arg_obj, list_node);
+	arg_obj = list_pop(&shard->free_list, struct dr_arg_obj, list_node);
 	if (!arg_obj)
 		assert(false);
 
 out:
-	pthread_mutex_unlock(&pool->mutex);
+	pthread_mutex_unlock(&shard->mutex);
 	return arg_obj;
 }
 
 static void dr_arg_pool_put_arg_obj(struct dr_arg_pool *pool,
 				    struct dr_arg_obj *arg_obj)
 {
-	pthread_mutex_lock(&pool->mutex);
-	list_add(&pool->free_list, &arg_obj->list_node);
-	pthread_mutex_unlock(&pool->mutex);
+	struct dr_arg_pool_shard *shard = dr_arg_pool_get_shard(pool);
+
+	pthread_mutex_lock(&shard->mutex);
+	list_add(&shard->free_list, &arg_obj->list_node);
+	pthread_mutex_unlock(&shard->mutex);
 }
 
 static struct dr_arg_pool *dr_arg_pool_create(struct mlx5dv_dr_domain *dmn,
 					      enum dr_arg_chunk_size chunk_size)
 {
 	struct dr_arg_pool *pool;
+	int i;
 
 	pool = calloc(1, sizeof(struct dr_arg_pool));
 	if (!pool) {
@@ -136,16 +199,20 @@ static struct dr_arg_pool *dr_arg_pool_create(struct mlx5dv_dr_domain *dmn,
 
 	pool->dmn = dmn;
 
-	list_head_init(&pool->free_list);
-	pthread_mutex_init(&pool->mutex, NULL);
+	for (i = 0; i < DR_ARG_POOL_SHARDS; i++) {
+		list_head_init(&pool->shards[i].free_list);
+		pthread_mutex_init(&pool->shards[i].mutex, NULL);
+	}
 
 	pool->log_chunk_size = chunk_size;
-	if (dr_arg_pool_alloc_objs(pool))
+	if (dr_arg_pool_alloc_objs(pool, &pool->shards[0]))
 		goto free_pool;
 
 	return pool;
 
 free_pool:
+	for (i = 0; i < DR_ARG_POOL_SHARDS; i++)
+		pthread_mutex_destroy(&pool->shards[i].mutex);
 	free(pool);
 
 	return NULL;
@@ -153,18 +220,22 @@ free_pool:
 
 static void dr_arg_pool_destroy(struct dr_arg_pool *pool)
 {
+	struct dr_arg_pool_shard *shard;
 	struct dr_arg_obj *tmp_arg;
 	struct dr_arg_obj *arg_obj;
+	int i;
 
-	list_for_each_safe(&pool->free_list, arg_obj, tmp_arg, list_node) {
-		list_del(&arg_obj->list_node);
-		if (!arg_obj->obj_offset) /* the first in range */
-			mlx5dv_devx_obj_destroy(arg_obj->obj);
-		free(arg_obj);
+	for (i = 0; i < DR_ARG_POOL_SHARDS; i++) {
+		shard = &pool->shards[i];
+		list_for_each_safe(&shard->free_list, arg_obj, tmp_arg, list_node) {
+			list_del(&arg_obj->list_node);
+			if (!arg_obj->obj_offset) /* the first in range */
+				mlx5dv_devx_obj_destroy(arg_obj->obj);
+			free(arg_obj);
+		}
+		pthread_mutex_destroy(&shard->mutex);
 	}
 
-	pthread_mutex_destroy(&pool->mutex);
-
 	free(pool);
 }
 
@@ -52,6 +52,7 @@
  * Taken from http://create.stephan-brumme.com/crc32/ and adapted.
  */
 
+#include <config.h>
 #include <stdlib.h>
 #include <string.h>
 #include "mlx5dv_dr.h"
@@ -93,15 +94,18 @@ void dr_crc32_init_table(void)
 	}
 }
 
-/* Compute CRC32 (Slicing-by-8 algorithm) */
-uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length)
+static uint32_t dr_crc32_swap(uint32_t crc)
+{
+	return ((crc>>24) & 0xff) | ((crc<<8) & 0xff0000) |
+		((crc>>8) & 0xff00) | ((crc<<24) & 0xff000000);
+}
+
+static uint32_t dr_crc32_slice8_update(uint32_t crc, const void *input_data,
+				       size_t length)
 {
 	const uint32_t *current = (const uint32_t *)input_data;
 	const uint8_t *current_char;
-	uint32_t crc = 0, one, two;
-
-	if (!input_data)
-		return 0;
+	uint32_t one, two;
 
 	/* Process eight bytes at once (Slicing-by-8) */
 	while (length >= 8) {
@@ -126,6 +130,145 @@ uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length)
 		crc = (crc >> 8) ^ dr_ste_crc_tab32[0][(crc & 0xff)
 			^ *current_char++];
 
-	return ((crc>>24) & 0xff) | ((crc<<8) & 0xff0000) |
-		((crc>>8) & 0xff00) | ((crc<<24) & 0xff000000);
+	return crc;
+}
+
+/* Compute CRC32 (Slicing-by-8 algorithm) */
+uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length)
+{
+	if (!input_data)
+		return 0;
+
+	return dr_crc32_swap(dr_crc32_slice8_update(0, input_data, length));
+}
+
+/*
+ * dr_crc32_calc() returns the same value as dr_crc32_slice8_calc(). The
+ * implementation is picked at load time: carry-less multiply folding on x86
+ * CPUs with PCLMULQDQ, the CRC32 instructions on ARMv8 CPUs that have them,
+ * and the lookup tables otherwise.
+ */
+#if defined(__x86_64__) && HAVE_FUNC_ATTRIBUTE_IFUNC
+#include <immintrin.h>
+
+/*
+ * Folding and Barrett reduction constants for the bit reflected polynomial,
+ * see "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" by Intel.
+ */
+#define DR_CRC32_FOLD_R3	0x1751997d0ULL
+#define DR_CRC32_FOLD_R4	0x0ccaa009eULL
+#define DR_CRC32_FOLD_R5	0x163cd6124ULL
+#define DR_CRC32_POLY_P		0x1db710641ULL
+#define DR_CRC32_POLY_U		0x1f7011641ULL
+
+static uint32_t __attribute__((target("pclmul")))
+dr_crc32_pclmul_calc(const void *input_data, size_t length)
+{
+	const uint8_t *buf = input_data;
+	__m128i x, y, k, mask;
+	uint32_t crc;
+
+	if (!input_data)
+		return 0;
+
+	if (length < 16)
+		return dr_crc32_swap(dr_crc32_slice8_update(0, buf, length));
+
+	x = _mm_loadu_si128((const __m128i *)buf);
+	buf += 16;
+	length -= 16;
+
+	/* Fold 128 bits at a time into x */
+	k = _mm_set_epi64x(DR_CRC32_FOLD_R4, DR_CRC32_FOLD_R3);
+	while (length >= 16) {
+		y = _mm_clmulepi64_si128(x, k, 0x11);
+		x = _mm_clmulepi64_si128(x, k, 0x00);
+		x = _mm_xor_si128(x, y);
+		x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		length -= 16;
+	}
+
+	/* Fold 128 to 64 bits, this also appends 32 zero bits */
+	y = _mm_clmulepi64_si128(x, k, 0x10);
+	x = _mm_xor_si128(_mm_srli_si128(x, 8), y);
+
+	/* Fold 64 to 32 bits */
+	mask = _mm_set_epi32(0, 0, 0, -1);
+	y = _mm_srli_si128(x, 4);
+	x = _mm_and_si128(x, mask);
+	x = _mm_clmulepi64_si128(x, _mm_set_epi64x(0, DR_CRC32_FOLD_R5), 0x00);
+	x = _mm_xor_si128(x, y);
+
+	/* Barrett reduction of the remaining 64 bits */
+	k = _mm_set_epi64x(DR_CRC32_POLY_U, DR_CRC32_POLY_P);
+	y = x;
+	x = _mm_and_si128(x, mask);
+	x = _mm_clmulepi64_si128(x, k, 0x10);
+	x = _mm_and_si128(x, mask);
+	x = _mm_clmulepi64_si128(x, k, 0x00);
+	x = _mm_xor_si128(x, y);
+	crc = _mm_cvtsi128_si32(_mm_srli_si128(x, 4));
+
+	return dr_crc32_swap(dr_crc32_slice8_update(crc, buf, length));
 }
+
+typedef uint32_t (*dr_crc32_fn_t)(const void *, size_t);
+
+static dr_crc32_fn_t resolve_crc32(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul"))
+		return &dr_crc32_pclmul_calc;
+	return &dr_crc32_slice8_calc;
+}
+
+uint32_t dr_crc32_calc(const void *input_data, size_t length)
+	__attribute__((ifunc("resolve_crc32")));
+
+#elif defined(__aarch64__) && HAVE_FUNC_ATTRIBUTE_IFUNC
+#include <arm_acle.h>
+#include <sys/auxv.h>
+
+static uint32_t __attribute__((target("+crc")))
+dr_crc32_armv8_calc(const void *input_data, size_t length)
+{
+	const uint8_t *buf = input_data;
+	uint32_t crc = 0;
+	uint64_t val;
+
+	if (!input_data)
+		return 0;
+
+	for (; length >= 8; length -= 8, buf += 8) {
+		memcpy(&val, buf, sizeof(val));
+		crc = __crc32d(crc, val);
+	}
+	while (length-- != 0)
+		crc = __crc32b(crc, *buf++);
+
+	return dr_crc32_swap(crc);
+}
+
+typedef uint32_t (*dr_crc32_fn_t)(const void *, size_t);
+
+/* The aarch64 resolver gets AT_HWCAP, getauxval() may not be usable yet */
+static dr_crc32_fn_t resolve_crc32(uint64_t hwcap)
+{
+	if (hwcap & HWCAP_CRC32)
+		return &dr_crc32_armv8_calc;
+	return &dr_crc32_slice8_calc;
+}
+
+uint32_t dr_crc32_calc(const void *input_data, size_t length)
+	__attribute__((ifunc("resolve_crc32")));
+
+#else
+
+uint32_t dr_crc32_calc(const void *input_data, size_t length)
+{
+	return dr_crc32_slice8_calc(input_data, length);
+}
+
+#endif
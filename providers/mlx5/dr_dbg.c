@@ -43,6 +43,7 @@ enum dr_dump_rec_type {
 	DR_DUMP_REC_TYPE_DOMAIN_INFO_VPORT = 3003,
 	DR_DUMP_REC_TYPE_DOMAIN_INFO_CAPS = 3004,
 	DR_DUMP_REC_TYPE_DOMAIN_SEND_RING = 3005,
+	DR_DUMP_REC_TYPE_DOMAIN_ICM_POOL = 3006,
 
 	DR_DUMP_REC_TYPE_TABLE = 3100,
 	DR_DUMP_REC_TYPE_TABLE_RX = 3101,
@@ -636,6 +637,30 @@ static int dr_dump_send_ring(FILE *f, struct dr_send_ring *ring,
 	return 0;
 }
 
+static int dr_dump_icm_pool(FILE *f, struct dr_icm_pool *pool,
+			    enum dr_icm_type icm_type,
+			    const uint64_t domain_id)
+{
+	struct dr_icm_pool_stats stats;
+	int ret;
+
+	dr_icm_pool_get_stats(pool, &stats);
+
+	ret = fprintf(f, "%d,0x%" PRIx64 ",%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+		      ",%" PRIu64 "\n",
+		      DR_DUMP_REC_TYPE_DOMAIN_ICM_POOL,
+		      domain_id,
+		      icm_type,
+		      stats.hits,
+		      stats.misses,
+		      stats.refills,
+		      stats.flushes);
+	if (ret < 0)
+		return ret;
+
+	return 0;
+}
+
 static int dr_dump_domain_info_flex_parser(FILE *f, const char *flex_parser_name,
 					   const uint8_t flex_parser_value,
 					   const uint64_t domain_id)
@@ -788,6 +813,23 @@ static int dr_dump_domain(FILE *f, struct mlx5dv_dr_domain *dmn)
 			if (ret < 0)
 				return ret;
 		}
+
+		ret = dr_dump_icm_pool(f, dmn->ste_icm_pool, DR_ICM_TYPE_STE,
+				       domain_id);
+		if (ret < 0)
+			return ret;
+
+		ret = dr_dump_icm_pool(f, dmn->action_icm_pool,
+				       DR_ICM_TYPE_MODIFY_ACTION, domain_id);
+		if (ret < 0)
+			return ret;
+
+		if (dr_domain_is_support_sw_encap(dmn)) {
+			ret = dr_dump_icm_pool(f, dmn->encap_icm_pool,
+					       DR_ICM_TYPE_ENCAP, domain_id);
+			if (ret < 0)
+				return ret;
+		}
 	}
 
 	return 0;
@@ -41,6 +41,19 @@ enum {
 		 MLX5DV_DR_DOMAIN_SYNC_FLAGS_MEM),
 };
 
+static __thread int dr_thread_idx = -1;
+static atomic_uint dr_thread_idx_next;
+
+/* A small number per thread, used to spread threads over sharded locks */
+unsigned int dr_get_thread_idx(void)
+{
+	if (dr_thread_idx < 0)
+		dr_thread_idx = atomic_fetch_add(&dr_thread_idx_next, 1) &
+				INT32_MAX;
+
+	return dr_thread_idx;
+}
+
 bool dr_domain_is_support_sw_encap(struct mlx5dv_dr_domain *dmn)
 {
 	return !!dmn->info.caps.log_sw_encap_icm_size;
@@ -569,6 +582,41 @@ free_domain:
 	return NULL;
 }
 
+/*
+ * Move up to num_buckets buckets of the incremental rehashes in progress,
+ * return EAGAIN if some are still in progress afterwards.
+ */
+static int dr_domain_step_rehash(struct mlx5dv_dr_domain *dmn,
+				 uint32_t num_buckets)
+{
+	struct mlx5dv_dr_matcher *matcher;
+	struct mlx5dv_dr_table *tbl;
+	bool pending = false;
+	int ret = 0;
+
+	dr_domain_lock(dmn);
+	list_for_each(&dmn->tbl_list, tbl, tbl_list) {
+		list_for_each(&tbl->matcher_list, matcher, matcher_list) {
+			ret = dr_rule_rehash_advance(&matcher->rx,
+						     &num_buckets);
+			if (!ret)
+				ret = dr_rule_rehash_advance(&matcher->tx,
+							     &num_buckets);
+			if (ret)
+				goto out;
+
+			if (matcher->rx.rehash || matcher->tx.rehash)
+				pending = true;
+		}
+	}
+
+	if (pending)
+		ret = EAGAIN;
+out:
+	dr_domain_unlock(dmn);
+	return ret;
+}
+
 /*
  * Assure synchronization of the device steering tables with updates made by SW
  * insertion.
@@ -584,6 +632,11 @@ int mlx5dv_dr_domain_sync(struct mlx5dv_dr_domain *dmn, uint32_t flags)
 	}
 
 	if (flags & MLX5DV_DR_DOMAIN_SYNC_FLAGS_SW) {
+		/* Let all the rules added during incremental rehashes take effect */
+		ret = dr_domain_step_rehash(dmn, UINT32_MAX);
+		if (ret)
+			return ret;
+
 		ret = dr_send_ring_force_drain(dmn);
 		if (ret)
 			return ret;
@@ -643,6 +696,28 @@ void mlx5dv_dr_domain_allow_duplicate_rules(struct mlx5dv_dr_domain *dmn,
 	dr_domain_unlock(dmn);
 }
 
+void mlx5dv_dr_domain_set_incremental_rehash(struct mlx5dv_dr_domain *dmn,
+					     bool enable)
+{
+	dr_domain_lock(dmn);
+	if (enable)
+		dmn->flags |= DR_DOMAIN_FLAG_INCREMENTAL_REHASH;
+	else
+		dmn->flags &= ~DR_DOMAIN_FLAG_INCREMENTAL_REHASH;
+	dr_domain_unlock(dmn);
+}
+
+int mlx5dv_dr_domain_rehash_step(struct mlx5dv_dr_domain *dmn,
+				 uint32_t num_buckets)
+{
+	if (!dmn->info.supp_sw_steering) {
+		errno = EOPNOTSUPP;
+		return errno;
+	}
+
+	return dr_domain_step_rehash(dmn, num_buckets);
+}
+
 int mlx5dv_dr_domain_destroy(struct mlx5dv_dr_domain *dmn)
 {
 	if (atomic_load(&dmn->refcount) > 1)
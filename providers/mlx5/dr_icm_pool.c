@@ -34,6 +34,26 @@
 
 #define DR_ICM_MODIFY_HDR_ALIGN_BASE	64
 
+/*
+ * Chunks up to DR_ICM_MAG_MAX_LOG are handed out from per-thread magazines,
+ * so threads inserting rules concurrently do not serialize on the pool lock.
+ * Each thread is bound to one of DR_ICM_POOL_MAGS magazines. A magazine is
+ * refilled from the buddy allocator, and hands its freed chunks to the hot
+ * list, DR_ICM_MAG_BATCH chunks at a time.
+ */
+#define DR_ICM_POOL_MAGS	DR_MAX_SEND_RINGS
+#define DR_ICM_MAG_MAX_LOG	DR_CHUNK_SIZE_64
+#define DR_ICM_MAG_BATCH	16
+
+struct dr_icm_mag {
+	pthread_spinlock_t	lock;
+	uint8_t			num_chunks[DR_ICM_MAG_MAX_LOG + 1];
+	uint8_t			num_freed;
+	struct dr_icm_chunk	*freed[DR_ICM_MAG_BATCH];
+	struct dr_icm_chunk	*chunks[DR_ICM_MAG_MAX_LOG + 1][DR_ICM_MAG_BATCH];
+	struct dr_icm_pool_stats stats;
+};
+
 struct dr_icm_pool {
 	enum dr_icm_type	icm_type;
 	struct mlx5dv_dr_domain	*dmn;
@@ -44,6 +64,7 @@ struct dr_icm_pool {
 	uint64_t		hot_memory_size;
 	bool			syncing;
 	size_t			th;
+	struct dr_icm_mag	mags[DR_ICM_POOL_MAGS];
 };
 
 struct dr_icm_mr {
@@ -412,18 +433,6 @@ static int dr_icm_pool_sync_pool_buddies(struct dr_icm_pool *pool)
 	return err;
 }
 
-int dr_icm_pool_sync_pool(struct dr_icm_pool *pool)
-{
-	int ret = 0;
-
-	pthread_spin_lock(&pool->lock);
-	if (!pool->syncing)
-		ret = dr_icm_pool_sync_pool_buddies(pool);
-	pthread_spin_unlock(&pool->lock);
-
-	return ret;
-}
-
 static int dr_icm_handle_buddies_get_mem(struct dr_icm_pool *pool,
 					 enum dr_icm_chunk_size chunk_size,
 					 struct dr_icm_buddy_mem **buddy,
@@ -466,58 +475,225 @@ out:
 	return err;
 }
 
-/* Allocate an ICM chunk, each chunk holds a piece of ICM memory and
- * also memory used for HW STE management for optimisations.
- */
-struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
-					enum dr_icm_chunk_size chunk_size)
+static struct dr_icm_chunk *
+dr_icm_pool_alloc_chunk_locked(struct dr_icm_pool *pool,
+			       enum dr_icm_chunk_size chunk_size)
 {
 	struct dr_icm_buddy_mem *buddy;
-	struct dr_icm_chunk *chunk = NULL;
-	int ret;
+	struct dr_icm_chunk *chunk;
 	int seg;
 
-	pthread_spin_lock(&pool->lock);
-
 	if (chunk_size > pool->max_log_chunk_sz) {
 		errno = EINVAL;
-		goto out;
+		return NULL;
 	}
 
 	/* find mem, get back the relevant buddy pool and seg in that mem */
-	ret = dr_icm_handle_buddies_get_mem(pool, chunk_size, &buddy, &seg);
-	if (ret)
-		goto out;
+	if (dr_icm_handle_buddies_get_mem(pool, chunk_size, &buddy, &seg))
+		return NULL;
 
 	chunk = dr_icm_chunk_create(pool, chunk_size, buddy, seg);
 	if (!chunk)
-		goto out_err;
-
-	goto out;
+		dr_buddy_free_mem(buddy, seg, chunk_size);
 
-out_err:
-	dr_buddy_free_mem(buddy, seg, chunk_size);
-out:
-	pthread_spin_unlock(&pool->lock);
 	return chunk;
 }
 
-void dr_icm_free_chunk(struct dr_icm_chunk *chunk)
+/* Move freed chunks to the waiting list AKA "hot", called under pool lock */
+static void dr_icm_pool_free_chunks_locked(struct dr_icm_pool *pool,
+					   struct dr_icm_chunk **chunks,
+					   int num_chunks)
 {
-	struct dr_icm_buddy_mem *buddy = chunk->buddy_mem;
-	struct dr_icm_pool *pool = buddy->pool;
+	struct dr_icm_buddy_mem *buddy;
+	int i;
 
-	/* move the memory to the waiting list AKA "hot" */
-	pthread_spin_lock(&pool->lock);
-	list_del_init(&chunk->chunk_list);
-	list_add_tail(&buddy->hot_list, &chunk->chunk_list);
-	buddy->pool->hot_memory_size += chunk->byte_size;
+	for (i = 0; i < num_chunks; i++) {
+		buddy = chunks[i]->buddy_mem;
+		list_del_init(&chunks[i]->chunk_list);
+		list_add_tail(&buddy->hot_list, &chunks[i]->chunk_list);
+		pool->hot_memory_size += chunks[i]->byte_size;
+	}
 
 	/* Check if we have chunks that are waiting for sync-ste */
 	if (dr_icm_pool_is_sync_required(pool) && !pool->syncing)
-		dr_icm_pool_sync_pool_buddies(buddy->pool);
+		dr_icm_pool_sync_pool_buddies(pool);
+}
+
+static struct dr_icm_mag *dr_icm_pool_get_mag(struct dr_icm_pool *pool)
+{
+	return &pool->mags[dr_get_thread_idx() % DR_ICM_POOL_MAGS];
+}
+
+static int dr_icm_mag_refill(struct dr_icm_pool *pool, struct dr_icm_mag *mag,
+			     enum dr_icm_chunk_size chunk_size)
+{
+	struct dr_icm_chunk *chunk;
+	int num = 0;
+
+	pthread_spin_lock(&pool->lock);
+	while (num < DR_ICM_MAG_BATCH) {
+		chunk = dr_icm_pool_alloc_chunk_locked(pool, chunk_size);
+		if (!chunk)
+			break;
+		mag->chunks[chunk_size][num++] = chunk;
+	}
+	pthread_spin_unlock(&pool->lock);
+
+	mag->num_chunks[chunk_size] = num;
+	mag->stats.refills++;
+
+	return num ? 0 : ENOMEM;
+}
+
+/*
+ * Detach the freed chunks from the magazine, called with its lock held.
+ * They are handed to the hot list after the lock is released, as that may
+ * have to sync the pool with HW.
+ */
+static int dr_icm_mag_take_freed(struct dr_icm_mag *mag,
+				 struct dr_icm_chunk **chunks)
+{
+	int num = mag->num_freed;
+
+	if (!num)
+		return 0;
+
+	memcpy(chunks, mag->freed, num * sizeof(*chunks));
+	mag->num_freed = 0;
+	mag->stats.flushes++;
+
+	return num;
+}
 
+/* Return all the cached chunks to the buddies and flush the freed ones */
+static void dr_icm_mag_drain(struct dr_icm_pool *pool, struct dr_icm_mag *mag)
+{
+	struct dr_icm_chunk *freed[DR_ICM_MAG_BATCH];
+	struct dr_icm_chunk *chunk;
+	int num_freed;
+	int i;
+
+	pthread_spin_lock(&mag->lock);
+	num_freed = dr_icm_mag_take_freed(mag, freed);
+	pthread_spin_lock(&pool->lock);
+
+	for (i = 0; i <= DR_ICM_MAG_MAX_LOG; i++) {
+		while (mag->num_chunks[i]) {
+			chunk = mag->chunks[i][--mag->num_chunks[i]];
+			/* Never handed out, no need to wait for a sync */
+			dr_buddy_free_mem(chunk->buddy_mem, chunk->seg, i);
+			chunk->buddy_mem->used_memory -= chunk->byte_size;
+			dr_icm_chunk_destroy(chunk);
+		}
+	}
+
+	pthread_spin_unlock(&mag->lock);
+
+	if (num_freed)
+		dr_icm_pool_free_chunks_locked(pool, freed, num_freed);
+
+	pthread_spin_unlock(&pool->lock);
+}
+
+int dr_icm_pool_sync_pool(struct dr_icm_pool *pool)
+{
+	int ret = 0;
+	int i;
+
+	/* Give back the cached chunks too, so empty buddies can be reclaimed */
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++)
+		dr_icm_mag_drain(pool, &pool->mags[i]);
+
+	pthread_spin_lock(&pool->lock);
+	if (!pool->syncing)
+		ret = dr_icm_pool_sync_pool_buddies(pool);
 	pthread_spin_unlock(&pool->lock);
+
+	return ret;
+}
+
+/* Allocate an ICM chunk, each chunk holds a piece of ICM memory and
+ * also memory used for HW STE management for optimisations.
+ */
+struct dr_icm_chunk *dr_icm_alloc_chunk(struct dr_icm_pool *pool,
+					enum dr_icm_chunk_size chunk_size)
+{
+	struct dr_icm_chunk *chunk;
+	struct dr_icm_mag *mag;
+
+	if (chunk_size > DR_ICM_MAG_MAX_LOG) {
+		pthread_spin_lock(&pool->lock);
+		chunk = dr_icm_pool_alloc_chunk_locked(pool, chunk_size);
+		pthread_spin_unlock(&pool->lock);
+		return chunk;
+	}
+
+	mag = dr_icm_pool_get_mag(pool);
+	pthread_spin_lock(&mag->lock);
+
+	if (mag->num_chunks[chunk_size]) {
+		mag->stats.hits++;
+	} else {
+		mag->stats.misses++;
+		if (dr_icm_mag_refill(pool, mag, chunk_size)) {
+			pthread_spin_unlock(&mag->lock);
+			return NULL;
+		}
+	}
+
+	chunk = mag->chunks[chunk_size][--mag->num_chunks[chunk_size]];
+	pthread_spin_unlock(&mag->lock);
+
+	return chunk;
+}
+
+void dr_icm_free_chunk(struct dr_icm_chunk *chunk)
+{
+	struct dr_icm_pool *pool = chunk->buddy_mem->pool;
+	struct dr_icm_chunk *freed[DR_ICM_MAG_BATCH];
+	struct dr_icm_mag *mag;
+	int num_freed = 0;
+
+	if (ilog32(chunk->num_of_entries - 1) > DR_ICM_MAG_MAX_LOG) {
+		pthread_spin_lock(&pool->lock);
+		dr_icm_pool_free_chunks_locked(pool, &chunk, 1);
+		pthread_spin_unlock(&pool->lock);
+		return;
+	}
+
+	mag = dr_icm_pool_get_mag(pool);
+	pthread_spin_lock(&mag->lock);
+
+	mag->freed[mag->num_freed++] = chunk;
+	if (mag->num_freed == DR_ICM_MAG_BATCH)
+		num_freed = dr_icm_mag_take_freed(mag, freed);
+
+	pthread_spin_unlock(&mag->lock);
+
+	if (num_freed) {
+		pthread_spin_lock(&pool->lock);
+		dr_icm_pool_free_chunks_locked(pool, freed, num_freed);
+		pthread_spin_unlock(&pool->lock);
+	}
+}
+
+void dr_icm_pool_get_stats(struct dr_icm_pool *pool,
+			   struct dr_icm_pool_stats *stats)
+{
+	struct dr_icm_mag *mag;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++) {
+		mag = &pool->mags[i];
+		pthread_spin_lock(&mag->lock);
+		stats->hits += mag->stats.hits;
+		stats->misses += mag->stats.misses;
+		stats->refills += mag->stats.refills;
+		stats->flushes += mag->stats.flushes;
+		pthread_spin_unlock(&mag->lock);
+	}
 }
 
 void dr_icm_pool_set_pool_max_log_chunk_sz(struct dr_icm_pool *pool,
@@ -553,7 +729,7 @@ struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 				       enum dr_icm_type icm_type)
 {
 	struct dr_icm_pool *pool;
-	int ret;
+	int ret, i;
 
 	pool = calloc(1, sizeof(struct dr_icm_pool));
 	if (!pool) {
@@ -598,8 +774,21 @@ struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 		goto free_pool;
 	}
 
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++) {
+		ret = pthread_spin_init(&pool->mags[i].lock,
+					PTHREAD_PROCESS_PRIVATE);
+		if (ret) {
+			errno = ret;
+			goto destroy_mag_locks;
+		}
+	}
+
 	return pool;
 
+destroy_mag_locks:
+	while (i--)
+		pthread_spin_destroy(&pool->mags[i].lock);
+	pthread_spin_destroy(&pool->lock);
 free_pool:
 	free(pool);
 	return NULL;
@@ -608,10 +797,14 @@ free_pool:
 void dr_icm_pool_destroy(struct dr_icm_pool *pool)
 {
 	struct dr_icm_buddy_mem *buddy, *tmp_buddy;
+	int i;
 
+	/* Chunks held by the magazines are still on their buddy used_list */
 	list_for_each_safe(&pool->buddy_mem_list, buddy, tmp_buddy, list_node)
 		dr_icm_buddy_destroy(buddy);
 
+	for (i = 0; i < DR_ICM_POOL_MAGS; i++)
+		pthread_spin_destroy(&pool->mags[i].lock);
 	pthread_spin_destroy(&pool->lock);
 
 	free(pool);
@@ -1585,6 +1585,8 @@ int mlx5dv_dr_matcher_destroy(struct mlx5dv_dr_matcher *matcher)
 
 	dr_domain_lock(tbl->dmn);
 
+	dr_rule_rehash_finish(&matcher->rx);
+	dr_rule_rehash_finish(&matcher->tx);
 	dr_matcher_remove_from_tbl(matcher);
 	dr_matcher_uninit(matcher);
 	atomic_fetch_sub(&matcher->tbl->refcount, 1);
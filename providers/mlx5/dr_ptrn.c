@@ -12,11 +12,15 @@ enum dr_ptrn_modify_hdr_action_id {
 	DR_PTRN_MODIFY_HDR_ACTION_ID_INSERT_INLINE = 0x0a,
 };
 
+#define DR_PTRN_CACHE_INIT_LOG_SZ 6
+
 struct dr_ptrn_mngr {
 	struct mlx5dv_dr_domain *dmn;
 	struct dr_icm_pool *ptrn_icm_pool;
-	/* cache for modify_header ptrn */
-	struct list_head ptrn_list;
+	/* cache for modify_header ptrn, hashed on the compared fields */
+	struct list_head *ptrn_buckets;
+	uint32_t log_num_buckets;
+	uint32_t num_ptrns;
 	pthread_mutex_t modify_hdr_mutex;
 };
 
@@ -77,26 +81,89 @@ static bool dr_ptrn_compare_pattern(enum dr_ptrn_type type,
 	}
 }
 
+/* The part of an action that dr_ptrn_compare_modify_hdr() looks at */
+static uint64_t dr_ptrn_canon_modify_hdr(__be64 hw_action)
+{
+	u8 action_id = DEVX_GET(ste_double_action_add_v1, &hw_action, action_id);
+
+	if (action_id == DR_PTRN_MODIFY_HDR_ACTION_ID_COPY)
+		return (__force uint64_t)hw_action;
+
+	return (uint32_t)(__force uint64_t)hw_action;
+}
+
+static uint32_t dr_ptrn_hash(enum dr_ptrn_type type, size_t num_of_actions,
+			     __be64 hw_actions[])
+{
+	uint64_t hash = ((uint64_t)type << 32) | num_of_actions;
+	size_t i;
+
+	if (type != DR_PTRN_TYP_MODIFY_HDR)
+		num_of_actions = 0;
+
+	for (i = 0; i < num_of_actions; i++) {
+		hash ^= dr_ptrn_canon_modify_hdr(hw_actions[i]);
+		hash *= 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 32;
+	}
+
+	return hash;
+}
+
+static struct list_head *dr_ptrn_bucket(struct dr_ptrn_mngr *mngr,
+					uint32_t hash)
+{
+	return &mngr->ptrn_buckets[hash & ((1 << mngr->log_num_buckets) - 1)];
+}
+
+/* Double the number of buckets, on failure keep the current ones */
+static void dr_ptrn_cache_grow(struct dr_ptrn_mngr *mngr)
+{
+	uint32_t old_num_buckets = 1 << mngr->log_num_buckets;
+	struct list_head *old_buckets = mngr->ptrn_buckets;
+	struct dr_ptrn_obj *pattern, *tmp;
+	struct list_head *buckets;
+	uint32_t i;
+
+	buckets = calloc(old_num_buckets * 2, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	for (i = 0; i < old_num_buckets * 2; i++)
+		list_head_init(&buckets[i]);
+
+	mngr->ptrn_buckets = buckets;
+	mngr->log_num_buckets++;
+
+	for (i = 0; i < old_num_buckets; i++) {
+		list_for_each_safe(&old_buckets[i], pattern, tmp, list) {
+			list_del(&pattern->list);
+			list_add(dr_ptrn_bucket(mngr, pattern->hash),
+				 &pattern->list);
+		}
+	}
+
+	free(old_buckets);
+}
+
 static struct dr_ptrn_obj *
 dr_ptrn_find_cached_pattern(struct dr_ptrn_mngr *mngr,
 			    enum dr_ptrn_type type,
 			    size_t num_of_actions,
-			    __be64 hw_actions[])
+			    __be64 hw_actions[],
+			    uint32_t hash)
 {
-	struct dr_ptrn_obj *tmp;
 	struct dr_ptrn_obj *cached_pattern;
 
-	list_for_each_safe(&mngr->ptrn_list, cached_pattern, tmp, list) {
-		if (dr_ptrn_compare_pattern(type,
+	list_for_each(dr_ptrn_bucket(mngr, hash), cached_pattern, list) {
+		if (cached_pattern->hash == hash &&
+		    dr_ptrn_compare_pattern(type,
 					    cached_pattern->type,
 					    cached_pattern->rewrite_param.num_of_actions,
 					    (__be64 *)cached_pattern->rewrite_param.data,
 					    num_of_actions,
-					    hw_actions)) {
-			list_del(&cached_pattern->list);
-			list_add(&mngr->ptrn_list, &cached_pattern->list);
+					    hw_actions))
 			return cached_pattern;
-		}
 	}
 
 	return NULL;
@@ -104,7 +171,7 @@ dr_ptrn_find_cached_pattern(struct dr_ptrn_mngr *mngr,
 
 static struct dr_ptrn_obj *
 dr_ptrn_alloc_pattern(struct dr_ptrn_mngr *mngr, uint16_t num_of_actions,
-		      uint8_t *data, enum dr_ptrn_type type)
+		      uint8_t *data, enum dr_ptrn_type type, uint32_t hash)
 {
 	struct dr_ptrn_obj *pattern;
 	struct dr_icm_chunk *chunk;
@@ -138,13 +205,17 @@ dr_ptrn_alloc_pattern(struct dr_ptrn_mngr *mngr, uint16_t num_of_actions,
 	}
 
 	pattern->type = type;
+	pattern->hash = hash;
 
 	memcpy(pattern->rewrite_param.data, data, num_of_actions * DR_MODIFY_ACTION_SIZE);
 	pattern->rewrite_param.chunk = chunk;
 	pattern->rewrite_param.index = index;
 	pattern->rewrite_param.num_of_actions = num_of_actions;
 
-	list_add(&mngr->ptrn_list, &pattern->list);
+	list_add(dr_ptrn_bucket(mngr, hash), &pattern->list);
+	if (++mngr->num_ptrns > 1 << mngr->log_num_buckets)
+		dr_ptrn_cache_grow(mngr);
+
 	atomic_init(&pattern->refcount, 0);
 	return pattern;
 
@@ -156,9 +227,10 @@ free_chunk:
 }
 
 static void
-dr_ptrn_free_pattern(struct dr_ptrn_obj *pattern)
+dr_ptrn_free_pattern(struct dr_ptrn_mngr *mngr, struct dr_ptrn_obj *pattern)
 {
 	list_del(&pattern->list);
+	mngr->num_ptrns--;
 	dr_icm_free_chunk(pattern->rewrite_param.chunk);
 	free(pattern->rewrite_param.data);
 	free(pattern);
@@ -173,16 +245,21 @@ dr_ptrn_cache_get_pattern(struct dr_ptrn_mngr *mngr,
 	struct dr_ptrn_obj *pattern;
 	uint64_t *hw_actions;
 	uint8_t action_id;
+	uint32_t hash;
 	int i;
 
+	hash = dr_ptrn_hash(type, num_of_actions, (__be64 *)data);
+
 	pthread_mutex_lock(&mngr->modify_hdr_mutex);
 	pattern = dr_ptrn_find_cached_pattern(mngr,
 					      type,
 					      num_of_actions,
-					      (__be64 *)data);
+					      (__be64 *)data,
+					      hash);
 	if (!pattern) {
 		/* Alloc and add new pattern to cache */
-		pattern = dr_ptrn_alloc_pattern(mngr, num_of_actions, data, type);
+		pattern = dr_ptrn_alloc_pattern(mngr, num_of_actions, data,
+						type, hash);
 		if (!pattern)
 			goto out_unlock;
 
@@ -211,7 +288,7 @@ dr_ptrn_cache_get_pattern(struct dr_ptrn_mngr *mngr,
 	return pattern;
 
 free_pattern:
-	dr_ptrn_free_pattern(pattern);
+	dr_ptrn_free_pattern(mngr, pattern);
 out_unlock:
 	pthread_mutex_unlock(&mngr->modify_hdr_mutex);
 	return NULL;
@@ -226,7 +303,7 @@ dr_ptrn_cache_put_pattern(struct dr_ptrn_mngr *mngr,
 	if (atomic_fetch_sub(&pattern->refcount, 1) != 1)
 		goto out;
 
-	dr_ptrn_free_pattern(pattern);
+	dr_ptrn_free_pattern(mngr, pattern);
 out:
 	pthread_mutex_unlock(&mngr->modify_hdr_mutex);
 }
@@ -235,6 +312,7 @@ struct dr_ptrn_mngr *
 dr_ptrn_mngr_create(struct mlx5dv_dr_domain *dmn)
 {
 	struct dr_ptrn_mngr *mngr;
+	int i;
 
 	if (!dr_domain_is_support_modify_hdr_cache(dmn))
 		return NULL;
@@ -253,9 +331,21 @@ dr_ptrn_mngr_create(struct mlx5dv_dr_domain *dmn)
 		goto free_mngr;
 	}
 
-	list_head_init(&mngr->ptrn_list);
+	mngr->log_num_buckets = DR_PTRN_CACHE_INIT_LOG_SZ;
+	mngr->ptrn_buckets = calloc(1 << mngr->log_num_buckets,
+				    sizeof(*mngr->ptrn_buckets));
+	if (!mngr->ptrn_buckets) {
+		errno = ENOMEM;
+		goto free_pool;
+	}
+
+	for (i = 0; i < 1 << mngr->log_num_buckets; i++)
+		list_head_init(&mngr->ptrn_buckets[i]);
+
 	return mngr;
 
+free_pool:
+	dr_icm_pool_destroy(mngr->ptrn_icm_pool);
 free_mngr:
 	free(mngr);
 	return NULL;
@@ -265,16 +355,20 @@ void dr_ptrn_mngr_destroy(struct dr_ptrn_mngr *mngr)
 {
 	struct dr_ptrn_obj *tmp;
 	struct dr_ptrn_obj *pattern;
+	int i;
 
 	if (!mngr)
 		return;
 
-	list_for_each_safe(&mngr->ptrn_list, pattern, tmp, list) {
-		list_del(&pattern->list);
-		free(pattern->rewrite_param.data);
-		free(pattern);
+	for (i = 0; i < 1 << mngr->log_num_buckets; i++) {
+		list_for_each_safe(&mngr->ptrn_buckets[i], pattern, tmp, list) {
+			list_del(&pattern->list);
+			free(pattern->rewrite_param.data);
+			free(pattern);
+		}
 	}
 
+	free(mngr->ptrn_buckets);
 	dr_icm_pool_destroy(mngr->ptrn_icm_pool);
 	free(mngr);
 }
@@ -36,6 +36,10 @@
 
 /* +1 for the cross GVMI STE */
 #define DR_RULE_MAX_STE_CHAIN (DR_RULE_MAX_STES + DR_ACTION_MAX_STES + 1)
+/* Rules handled by the bulk API per acquisition of the domain locks */
+#define DR_RULE_BULK_CHUNK 64
+/* Buckets moved by an incremental rehash per rule insertion */
+#define DR_RULE_REHASH_STEP 64
 
 static int dr_rule_append_to_miss_list(struct dr_ste_ctx *ste_ctx,
 				       struct dr_ste *new_last_ste,
@@ -294,6 +298,14 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 		dr_htbl_get(new_htbl);
 		list_add_tail(dr_ste_get_miss_list(new_ste), &new_ste->miss_list_node);
 	} else {
+		/* Allocate first, nothing can fail once the entry is linked */
+		ste_info = calloc(1, sizeof(*ste_info));
+		if (!ste_info) {
+			dr_dbg(matcher->tbl->dmn, "Failed allocating ste_info\n");
+			errno = ENOMEM;
+			return NULL;
+		}
+
 		new_ste = dr_rule_rehash_handle_collision(matcher,
 							  nic_matcher,
 							  update_list,
@@ -302,6 +314,7 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 		if (!new_ste) {
 			dr_dbg(matcher->tbl->dmn, "Failed adding collision entry, index: %d\n",
 			       new_idx);
+			free(ste_info);
 			return NULL;
 		}
 		new_htbl->ctrl.num_of_collisions++;
@@ -312,18 +325,10 @@ static struct dr_ste *dr_rule_rehash_copy_ste(struct mlx5dv_dr_matcher *matcher,
 
 	new_htbl->ctrl.num_of_valid_entries++;
 
-	if (use_update_list) {
-		ste_info = calloc(1, sizeof(*ste_info));
-		if (!ste_info) {
-			dr_dbg(matcher->tbl->dmn, "Failed allocating ste_info\n");
-			errno = ENOMEM;
-			dr_htbl_put(new_ste->htbl);
-			return NULL;
-		}
+	if (use_update_list)
 		dr_send_fill_and_append_ste_send_info(new_ste, DR_STE_SIZE, 0,
 						      hw_ste, ste_info,
 						      update_list, true);
-	}
 
 	dr_rule_rehash_copy_ste_ctrl(matcher, nic_matcher, cur_ste, new_ste);
 
@@ -399,6 +404,41 @@ clean_copy:
 	return err;
 }
 
+/* Connect the STE pointing to the table being rehashed to new_htbl */
+static void dr_rule_rehash_connect_htbl(struct mlx5dv_dr_domain *dmn,
+					struct dr_ste_htbl *new_htbl,
+					uint8_t ste_location,
+					struct dr_ste_send_info *ste_info,
+					struct list_head *update_list)
+{
+	struct dr_ste *ste_to_update;
+
+	if (ste_location == 1) {
+		/* The previous table is an anchor, anchors size is always one STE */
+		struct dr_ste_htbl *prev_htbl = new_htbl->pointing_ste->htbl;
+
+		/*
+		 * It is safe to operate dr_ste_set_hit_addr on the hw_ste here
+		 * (48B len) which works only on first 32B
+		 */
+		dr_ste_set_hit_addr(dmn->ste_ctx,
+				    prev_htbl->ste_arr[0].hw_ste,
+				    dr_icm_pool_get_chunk_icm_addr(new_htbl->chunk),
+				    new_htbl->chunk->num_of_entries);
+
+		ste_to_update = &prev_htbl->ste_arr[0];
+	} else {
+		dr_ste_set_hit_addr_by_next_htbl(dmn->ste_ctx,
+						 new_htbl->pointing_ste->hw_ste,
+						 new_htbl);
+		ste_to_update = new_htbl->pointing_ste;
+	}
+
+	dr_send_fill_and_append_ste_send_info(ste_to_update, DR_STE_SIZE_CTRL,
+					      0, ste_to_update->hw_ste, ste_info,
+					      update_list, false);
+}
+
 static struct dr_ste_htbl *dr_rule_rehash_htbl_common(struct mlx5dv_dr_matcher *matcher,
 						      struct dr_matcher_rx_tx *nic_matcher,
 						      struct dr_ste_htbl *cur_htbl,
@@ -414,7 +454,6 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl_common(struct mlx5dv_dr_matcher *
 	struct dr_htbl_connect_info info;
 	LIST_HEAD(rehash_table_send_list);
 	struct dr_ste_htbl *new_htbl;
-	struct dr_ste *ste_to_update;
 	uint8_t *mask = NULL;
 	int err;
 
@@ -464,37 +503,16 @@ static struct dr_ste_htbl *dr_rule_rehash_htbl_common(struct mlx5dv_dr_matcher *
 		goto free_new_htbl;
 	}
 
-	/* Connect previous hash table to current */
 	if (ste_location == 1) {
-		/* The previous table is an anchor, anchors size is always one STE */
-		struct dr_ste_htbl *prev_htbl = cur_htbl->pointing_ste->htbl;
-
 		/* On matcher s_anchor we keep an extra refcount */
 		dr_htbl_get(new_htbl);
 		dr_htbl_put(cur_htbl);
 
 		nic_matcher->s_htbl = new_htbl;
-
-		/*
-		 * It is safe to operate dr_ste_set_hit_addr on the hw_ste here
-		 * (48B len) which works only on first 32B
-		 */
-		dr_ste_set_hit_addr(dmn->ste_ctx,
-				    prev_htbl->ste_arr[0].hw_ste,
-				    dr_icm_pool_get_chunk_icm_addr(new_htbl->chunk),
-				    new_htbl->chunk->num_of_entries);
-
-		ste_to_update = &prev_htbl->ste_arr[0];
-	} else {
-		dr_ste_set_hit_addr_by_next_htbl(dmn->ste_ctx,
-						 cur_htbl->pointing_ste->hw_ste,
-						 new_htbl);
-		ste_to_update = cur_htbl->pointing_ste;
 	}
 
-	dr_send_fill_and_append_ste_send_info(ste_to_update, DR_STE_SIZE_CTRL,
-					      0, ste_to_update->hw_ste, ste_info,
-					      update_list, false);
+	dr_rule_rehash_connect_htbl(dmn, new_htbl, ste_location, ste_info,
+				    update_list);
 
 	return new_htbl;
 
@@ -505,6 +523,354 @@ free_ste_info:
 	return NULL;
 }
 
+/*
+ * Incremental rehash: the entries of cur_htbl are moved to new_htbl a few
+ * buckets at a time, on each rule insertion into the matcher. Since both
+ * tables hash the same CRC modulo a power of two, old bucket i can only
+ * move to new buckets i + j * cur_entries. Lookups of buckets below
+ * next_index use new_htbl and the rest still use cur_htbl. HW keeps using
+ * cur_htbl until the last bucket was moved and written, only then the
+ * pointing STE is switched to new_htbl, so rules added to moved buckets
+ * take effect at that point.
+ */
+struct dr_rule_rehash {
+	struct mlx5dv_dr_matcher	*matcher;
+	struct dr_matcher_rx_tx		*nic_matcher;
+	struct dr_ste_htbl		*cur_htbl;
+	struct dr_ste_htbl		*new_htbl;
+	uint8_t				formated_ste[DR_STE_SIZE];
+	uint8_t				*mask;
+	uint8_t				ste_location;
+	uint8_t				lock_index;
+	uint32_t			next_index;
+	/* Collision tables still reachable by HW through cur_htbl */
+	struct dr_ste_htbl		**retired;
+	uint32_t			num_retired;
+	uint32_t			max_retired;
+};
+
+static struct dr_ste_htbl *
+dr_rule_rehash_pick_htbl(struct dr_rule_rehash *rehash, uint8_t *hw_ste)
+{
+	uint32_t index;
+
+	index = dr_ste_calc_hash_index(hw_ste, rehash->new_htbl);
+	index %= rehash->cur_htbl->chunk->num_of_entries;
+
+	return index < rehash->next_index ? rehash->new_htbl :
+					     rehash->cur_htbl;
+}
+
+static int dr_rule_rehash_retire(struct dr_rule_rehash *rehash,
+				 struct list_head *miss_list)
+{
+	struct dr_ste_htbl **retired;
+	struct dr_ste *ste;
+	uint32_t max;
+
+	list_for_each(miss_list, ste, miss_list_node) {
+		if (ste->htbl == rehash->cur_htbl)
+			continue;
+
+		if (rehash->num_retired == rehash->max_retired) {
+			max = max_t(uint32_t, 16, rehash->max_retired * 2);
+			retired = realloc(rehash->retired,
+					  max * sizeof(*retired));
+			if (!retired) {
+				errno = ENOMEM;
+				return errno;
+			}
+			rehash->retired = retired;
+			rehash->max_retired = max;
+		}
+
+		dr_htbl_get(ste->htbl);
+		rehash->retired[rehash->num_retired++] = ste->htbl;
+	}
+
+	return 0;
+}
+
+static int dr_rule_rehash_done(struct dr_rule_rehash *rehash)
+{
+	struct mlx5dv_dr_domain *dmn = rehash->matcher->tbl->dmn;
+	struct dr_ste_send_info *ste_info;
+	LIST_HEAD(update_list);
+	uint32_t i;
+	int ret;
+
+	ste_info = calloc(1, sizeof(*ste_info));
+	if (!ste_info) {
+		errno = ENOMEM;
+		return errno;
+	}
+
+	dr_rule_rehash_connect_htbl(dmn, rehash->new_htbl,
+				    rehash->ste_location, ste_info,
+				    &update_list);
+	ret = dr_rule_send_update_list(&update_list, dmn, false,
+				       rehash->lock_index);
+	if (ret) {
+		dr_dbg(dmn, "Failed connecting rehashed table\n");
+		return ret;
+	}
+
+	rehash->cur_htbl->rehash = NULL;
+	rehash->new_htbl->rehash = NULL;
+	rehash->nic_matcher->rehash = NULL;
+
+	for (i = 0; i < rehash->num_retired; i++)
+		dr_htbl_put(rehash->retired[i]);
+	dr_htbl_put(rehash->cur_htbl);
+
+	free(rehash->retired);
+	free(rehash);
+	return 0;
+}
+
+/*
+ * Drop the copies made of old bucket index when it could not be moved
+ * completely. They all sit in the new buckets old bucket index maps to,
+ * which nothing else uses before the bucket was moved, and none of them
+ * was written to HW yet.
+ */
+static void dr_rule_rehash_undo_bucket(struct dr_rule_rehash *rehash,
+				       uint32_t index,
+				       struct list_head *update_list)
+{
+	uint32_t cur_entries = rehash->cur_htbl->chunk->num_of_entries;
+	uint32_t new_entries = rehash->new_htbl->chunk->num_of_entries;
+	struct dr_ste_htbl *new_htbl = rehash->new_htbl;
+	struct dr_ste_send_info *ste_info, *tmp_ste_info;
+	struct list_head *miss_list;
+	struct dr_ste *ste, *tmp_ste;
+
+	list_for_each_safe(update_list, ste_info, tmp_ste_info, send_list) {
+		list_del(&ste_info->send_list);
+		free(ste_info);
+	}
+
+	/* Give the rules and the next tables back to the old STEs */
+	miss_list = dr_ste_get_miss_list(&rehash->cur_htbl->ste_arr[index]);
+	list_for_each(miss_list, ste, miss_list_node) {
+		if (ste->next_htbl)
+			ste->next_htbl->pointing_ste = ste;
+		dr_rule_set_last_member(ste->rule_rx_tx, ste, false);
+	}
+
+	for (; index < new_entries; index += cur_entries) {
+		miss_list = dr_ste_get_miss_list(&new_htbl->ste_arr[index]);
+		list_for_each_safe(miss_list, ste, tmp_ste, miss_list_node) {
+			list_del(&ste->miss_list_node);
+			atomic_init(&ste->refcount, 0);
+			ste->next_htbl = NULL;
+
+			new_htbl->ctrl.num_of_valid_entries--;
+			if (ste->htbl != new_htbl)
+				new_htbl->ctrl.num_of_collisions--;
+			dr_htbl_put(ste->htbl);
+		}
+	}
+}
+
+/*
+ * Copy all the entries of old bucket index to new_htbl, and only then drop
+ * them from the old miss list. Either the whole bucket is moved or nothing
+ * is, so a failed bucket can be moved again later.
+ */
+static int dr_rule_rehash_move_bucket(struct dr_rule_rehash *rehash,
+				      uint32_t index,
+				      struct list_head *update_list)
+{
+	uint32_t num_retired = rehash->num_retired;
+	struct dr_ste *cur_ste, *tmp_ste;
+	struct list_head *miss_list;
+	int ret;
+
+	miss_list = dr_ste_get_miss_list(&rehash->cur_htbl->ste_arr[index]);
+
+	/* HW may still walk the old miss list until we are done */
+	ret = dr_rule_rehash_retire(rehash, miss_list);
+	if (ret)
+		goto put_retired;
+
+	list_for_each(miss_list, cur_ste, miss_list_node) {
+		if (!dr_rule_rehash_copy_ste(rehash->matcher,
+					     rehash->nic_matcher,
+					     cur_ste,
+					     rehash->new_htbl,
+					     update_list)) {
+			ret = errno;
+			goto undo_bucket;
+		}
+	}
+
+	list_for_each_safe(miss_list, cur_ste, tmp_ste, miss_list_node) {
+		list_del(&cur_ste->miss_list_node);
+		dr_htbl_put(cur_ste->htbl);
+	}
+
+	return 0;
+
+undo_bucket:
+	dr_rule_rehash_undo_bucket(rehash, index, update_list);
+put_retired:
+	while (rehash->num_retired > num_retired)
+		dr_htbl_put(rehash->retired[--rehash->num_retired]);
+	return ret;
+}
+
+/* Move up to num_buckets buckets, finish the rehash after the last one */
+static int dr_rule_rehash_step(struct dr_rule_rehash *rehash,
+			       uint32_t num_buckets)
+{
+	struct mlx5dv_dr_domain *dmn = rehash->matcher->tbl->dmn;
+	uint32_t cur_entries = rehash->cur_htbl->chunk->num_of_entries;
+	uint32_t new_entries = rehash->new_htbl->chunk->num_of_entries;
+	uint32_t first = rehash->next_index;
+	LIST_HEAD(update_list);
+	uint32_t i, end;
+	int ret = 0;
+
+	end = min_t(uint32_t, first + num_buckets, cur_entries);
+
+	for (i = first; i < end; i++) {
+		if (!dr_ste_is_not_used(&rehash->cur_htbl->ste_arr[i])) {
+			ret = dr_rule_rehash_move_bucket(rehash, i,
+							 &update_list);
+			if (ret)
+				break;
+		}
+
+		/* Lookups of this bucket go to new_htbl from now on */
+		rehash->next_index = i + 1;
+
+		ret = dr_rule_send_update_list(&update_list, dmn, false,
+					       rehash->lock_index);
+		if (ret)
+			break;
+	}
+
+	/* Write the new buckets the moved entries may have landed in */
+	i = rehash->next_index;
+	for (end = first; i > first && end < new_entries; end += cur_entries) {
+		if (dr_send_postsend_htbl_range(dmn, rehash->new_htbl,
+						rehash->formated_ste,
+						rehash->mask, end, i - first,
+						rehash->lock_index)) {
+			dr_dbg(dmn, "Failed writing table to HW\n");
+			return errno;
+		}
+	}
+
+	if (ret || i < cur_entries)
+		return ret;
+
+	return dr_rule_rehash_done(rehash);
+}
+
+int dr_rule_rehash_finish(struct dr_matcher_rx_tx *nic_matcher)
+{
+	struct dr_rule_rehash *rehash = nic_matcher->rehash;
+
+	if (!rehash)
+		return 0;
+
+	return dr_rule_rehash_step(rehash,
+				   rehash->cur_htbl->chunk->num_of_entries);
+}
+
+/* Move at most *num_buckets buckets, the moved ones are taken off it */
+int dr_rule_rehash_advance(struct dr_matcher_rx_tx *nic_matcher,
+			   uint32_t *num_buckets)
+{
+	struct dr_rule_rehash *rehash = nic_matcher->rehash;
+	uint32_t left;
+
+	if (!rehash)
+		return 0;
+
+	left = rehash->cur_htbl->chunk->num_of_entries - rehash->next_index;
+	left = min_t(uint32_t, left, *num_buckets);
+	*num_buckets -= left;
+
+	return dr_rule_rehash_step(rehash, left);
+}
+
+static struct dr_ste_htbl *
+dr_rule_rehash_htbl_start(struct mlx5dv_dr_matcher *matcher,
+			  struct dr_matcher_rx_tx *nic_matcher,
+			  struct dr_ste_htbl *cur_htbl,
+			  uint8_t ste_location,
+			  enum dr_icm_chunk_size new_size,
+			  uint8_t lock_index)
+{
+	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	struct dr_htbl_connect_info info;
+	struct dr_rule_rehash *rehash;
+	struct dr_ste_htbl *new_htbl;
+
+	rehash = calloc(1, sizeof(*rehash));
+	if (!rehash) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	new_htbl = dr_ste_htbl_alloc(dmn->ste_icm_pool,
+				     new_size,
+				     cur_htbl->type,
+				     cur_htbl->lu_type,
+				     cur_htbl->byte_mask);
+	if (!new_htbl) {
+		dr_dbg(dmn, "Failed to allocate new hash table\n");
+		free(rehash);
+		return NULL;
+	}
+
+	info.type = CONNECT_MISS;
+	info.miss_icm_addr =
+		dr_icm_pool_get_chunk_icm_addr(nic_matcher->e_anchor->chunk);
+	dr_ste_set_formated_ste(dmn->ste_ctx,
+				dmn->info.caps.gvmi,
+				nic_dmn->type,
+				new_htbl,
+				rehash->formated_ste,
+				&info);
+
+	if (new_htbl->type == DR_STE_HTBL_TYPE_LEGACY)
+		rehash->mask = nic_matcher->ste_builder[ste_location - 1].bit_mask;
+
+	rehash->matcher = matcher;
+	rehash->nic_matcher = nic_matcher;
+	rehash->cur_htbl = cur_htbl;
+	rehash->new_htbl = new_htbl;
+	rehash->ste_location = ste_location;
+	rehash->lock_index = lock_index;
+
+	/* Keep the old table, HW uses it until the rehash is done */
+	dr_htbl_get(cur_htbl);
+
+	new_htbl->pointing_ste = cur_htbl->pointing_ste;
+	new_htbl->pointing_ste->next_htbl = new_htbl;
+	if (ste_location == 1) {
+		/* On matcher s_anchor we keep an extra refcount */
+		dr_htbl_get(new_htbl);
+		dr_htbl_put(cur_htbl);
+
+		nic_matcher->s_htbl = new_htbl;
+	}
+
+	cur_htbl->rehash = rehash;
+	new_htbl->rehash = rehash;
+	nic_matcher->rehash = rehash;
+
+	if (dr_rule_rehash_step(rehash, DR_RULE_REHASH_STEP))
+		dr_dbg(dmn, "Failed moving rehashed entries\n");
+
+	return new_htbl;
+}
+
 static struct dr_ste_htbl *dr_rule_rehash_htbl(struct mlx5dv_dr_rule *rule,
 					       struct dr_rule_rx_tx *nic_rule,
 					       struct dr_ste_htbl *cur_htbl,
@@ -529,6 +895,10 @@ int dr_rule_rehash_matcher_s_anchor(struct mlx5dv_dr_matcher *matcher,
 	LIST_HEAD(update_list);
 	int ret;
 
+	ret = dr_rule_rehash_finish(nic_matcher);
+	if (ret)
+		return ret;
+
 	if (nic_matcher->s_htbl->chunk_size == new_size) {
 		dr_dbg(dmn, "both are with the same size, nothing to do\n");
 		return 0;
@@ -575,6 +945,13 @@ static struct dr_ste_htbl *dr_rule_rehash(struct mlx5dv_dr_rule *rule,
 	if (new_size == cur_htbl->chunk_size)
 		return NULL; /* Skip rehash, we already at the max size */
 
+	if (dmn->flags & DR_DOMAIN_FLAG_INCREMENTAL_REHASH)
+		return dr_rule_rehash_htbl_start(rule->matcher,
+						 nic_rule->nic_matcher,
+						 cur_htbl, ste_location,
+						 new_size,
+						 nic_rule->lock_index);
+
 	return dr_rule_rehash_htbl(rule, nic_rule, cur_htbl, ste_location,
 				   update_list, new_size);
 }
@@ -1053,6 +1430,10 @@ static struct dr_ste *dr_rule_handle_ste_branch(struct mlx5dv_dr_rule *rule,
 	int index;
 
 again:
+	/* Buckets not moved yet by an incremental rehash are in the old table */
+	if (cur_htbl->rehash)
+		cur_htbl = dr_rule_rehash_pick_htbl(cur_htbl->rehash, hw_ste);
+
 	index = dr_ste_calc_hash_index(hw_ste, cur_htbl);
 	miss_list = &cur_htbl->chunk->miss_list[index];
 	ste = &cur_htbl->ste_arr[index];
@@ -1084,7 +1465,13 @@ again:
 			dr_dbg(dmn, "Duplicate rule inserted\n");
 		}
 
-		if (!skip_rehash && dr_rule_need_enlarge_hash(cur_htbl, dmn, nic_dmn)) {
+		/*
+		 * Rehashing while a table of the matcher is moved could free
+		 * STEs HW still reaches through the old table, so wait for
+		 * the running incremental rehash to finish.
+		 */
+		if (!skip_rehash && !nic_matcher->rehash &&
+		    dr_rule_need_enlarge_hash(cur_htbl, dmn, nic_dmn)) {
 			/* Hash table index in use, try to resize of the hash */
 			skip_rehash = true;
 
@@ -1233,39 +1620,89 @@ static bool dr_rule_verify(struct mlx5dv_dr_matcher *matcher,
 	return true;
 }
 
+/*
+ * HW matches the old copies of the moved entries until the incremental
+ * rehash is done. If the rule frees the copy of one, what the old copy
+ * points to would be released while HW can still reach it. If it frees the
+ * STE pointing to the table being rehashed, connecting the new table would
+ * write to the freed STE. In both cases the rehash has to be finished
+ * first. Entries not moved yet are removed from the old table directly.
+ */
+static bool dr_rule_rehash_blocks_free(struct dr_rule_rx_tx *nic_rule)
+{
+	struct dr_ste *ste_arr[DR_RULE_MAX_STES + DR_ACTION_MAX_STES +
+			       DR_ACTION_ASO_CROSS_GVMI_STES];
+	struct dr_rule_rehash *rehash = nic_rule->nic_matcher->rehash;
+	struct dr_ste *first_ste;
+	int i;
+
+	if (!rehash)
+		return false;
+
+	dr_rule_get_reverse_rule_members(ste_arr, nic_rule->last_rule_ste, &i);
+
+	while (i--) {
+		if (atomic_load(&ste_arr[i]->refcount) != 1)
+			continue;
+
+		if (ste_arr[i]->next_htbl == rehash->cur_htbl ||
+		    ste_arr[i]->next_htbl == rehash->new_htbl)
+			return true;
+
+		first_ste = dr_ste_get_miss_list_top(ste_arr[i]);
+		if (first_ste->htbl == rehash->new_htbl)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * The bulk API holds all the domain locks and the debug lock for a whole
+ * chunk of rules, in that case the per rule functions are called with
+ * locked set and take neither.
+ */
 static int dr_rule_destroy_rule_nic(struct mlx5dv_dr_rule *rule,
-				    struct dr_rule_rx_tx *nic_rule)
+				    struct dr_rule_rx_tx *nic_rule,
+				    bool locked)
 {
-	dr_rule_lock(nic_rule, NULL);
+	if (!locked)
+		dr_rule_lock(nic_rule, NULL);
+	if (dr_rule_rehash_blocks_free(nic_rule) &&
+	    dr_rule_rehash_finish(nic_rule->nic_matcher))
+		dr_dbg(rule->matcher->tbl->dmn, "Failed finishing rehash\n");
 	dr_rule_clean_rule_members(rule, nic_rule);
-	dr_rule_unlock(nic_rule);
+	if (!locked)
+		dr_rule_unlock(nic_rule);
 	return 0;
 }
 
-static int dr_rule_destroy_rule_fdb(struct mlx5dv_dr_rule *rule)
+static int dr_rule_destroy_rule_fdb(struct mlx5dv_dr_rule *rule, bool locked)
 {
-	dr_rule_destroy_rule_nic(rule, &rule->rx);
-	dr_rule_destroy_rule_nic(rule, &rule->tx);
+	dr_rule_destroy_rule_nic(rule, &rule->rx, locked);
+	dr_rule_destroy_rule_nic(rule, &rule->tx, locked);
 	return 0;
 }
 
-static int dr_rule_destroy_rule(struct mlx5dv_dr_rule *rule)
+static int dr_rule_destroy_rule(struct mlx5dv_dr_rule *rule, bool locked)
 {
 	struct mlx5dv_dr_domain *dmn = rule->matcher->tbl->dmn;
 
-	pthread_spin_lock(&dmn->debug_lock);
+	if (!locked)
+		pthread_spin_lock(&dmn->debug_lock);
 	list_del(&rule->rule_list);
-	pthread_spin_unlock(&dmn->debug_lock);
+	if (!locked)
+		pthread_spin_unlock(&dmn->debug_lock);
 
 	switch (dmn->type) {
 	case MLX5DV_DR_DOMAIN_TYPE_NIC_RX:
-		dr_rule_destroy_rule_nic(rule, &rule->rx);
+		dr_rule_destroy_rule_nic(rule, &rule->rx, locked);
 		break;
 	case MLX5DV_DR_DOMAIN_TYPE_NIC_TX:
-		dr_rule_destroy_rule_nic(rule, &rule->tx);
+		dr_rule_destroy_rule_nic(rule, &rule->tx, locked);
 		break;
 	case MLX5DV_DR_DOMAIN_TYPE_FDB:
-		dr_rule_destroy_rule_fdb(rule);
+		dr_rule_destroy_rule_fdb(rule, locked);
 		break;
 	default:
 		assert(false);
@@ -1341,7 +1778,8 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 			struct dr_rule_rx_tx *nic_rule,
 			struct dr_match_param *param,
 			size_t num_actions,
-			struct mlx5dv_dr_action *actions[])
+			struct mlx5dv_dr_action *actions[],
+			bool locked)
 {
 	uint8_t hw_ste_arr[DR_RULE_MAX_STE_CHAIN * DR_STE_SIZE] = {};
 	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
@@ -1368,7 +1806,14 @@ dr_rule_create_rule_nic(struct mlx5dv_dr_rule *rule,
 		return ret;
 
 	/* Set the lock index, and use the relative lock  */
-	dr_rule_lock(nic_rule, hw_ste_arr);
+	if (locked)
+		dr_rule_set_lock_index(nic_rule, hw_ste_arr);
+	else
+		dr_rule_lock(nic_rule, hw_ste_arr);
+
+	if (nic_matcher->rehash &&
+	    dr_rule_rehash_step(nic_matcher->rehash, DR_RULE_REHASH_STEP))
+		dr_dbg(dmn, "Failed moving rehashed entries\n");
 
 	/* Set the actions values/addresses inside the ste array */
 	ret = dr_actions_build_ste_arr(matcher, nic_matcher, actions,
@@ -1441,7 +1886,8 @@ free_rule:
 		}
 	}
 out_unlock:
-	dr_rule_unlock(nic_rule);
+	if (!locked)
+		dr_rule_unlock(nic_rule);
 	return ret;
 }
 
@@ -1449,7 +1895,8 @@ static int
 dr_rule_create_rule_fdb(struct mlx5dv_dr_rule *rule,
 			struct dr_match_param *param,
 			size_t num_actions,
-			struct mlx5dv_dr_action *actions[])
+			struct mlx5dv_dr_action *actions[],
+			bool locked)
 {
 	struct dr_match_param copy_param = {};
 	int ret;
@@ -1461,19 +1908,19 @@ dr_rule_create_rule_fdb(struct mlx5dv_dr_rule *rule,
 	memcpy(&copy_param, param, sizeof(struct dr_match_param));
 
 	ret = dr_rule_create_rule_nic(rule, &rule->rx, param,
-				      num_actions, actions);
+				      num_actions, actions, locked);
 	if (ret)
 		return ret;
 
 	ret = dr_rule_create_rule_nic(rule, &rule->tx, &copy_param,
-				      num_actions, actions);
+				      num_actions, actions, locked);
 	if (ret)
 		goto destroy_rule_nic_rx;
 
 	return 0;
 
 destroy_rule_nic_rx:
-	dr_rule_destroy_rule_nic(rule, &rule->rx);
+	dr_rule_destroy_rule_nic(rule, &rule->rx, locked);
 	return ret;
 }
 
@@ -1481,7 +1928,8 @@ static struct mlx5dv_dr_rule *
 dr_rule_create_rule(struct mlx5dv_dr_matcher *matcher,
 		    struct mlx5dv_flow_match_parameters *value,
 		    size_t num_actions,
-		    struct mlx5dv_dr_action *actions[])
+		    struct mlx5dv_dr_action *actions[],
+		    bool locked)
 {
 	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
 	struct dr_match_param param = {};
@@ -1509,18 +1957,18 @@ dr_rule_create_rule(struct mlx5dv_dr_matcher *matcher,
 	case MLX5DV_DR_DOMAIN_TYPE_NIC_RX:
 		rule->rx.nic_matcher = &matcher->rx;
 		ret = dr_rule_create_rule_nic(rule, &rule->rx, &param,
-					      num_actions, actions);
+					      num_actions, actions, locked);
 		break;
 	case MLX5DV_DR_DOMAIN_TYPE_NIC_TX:
 		rule->tx.nic_matcher = &matcher->tx;
 		ret = dr_rule_create_rule_nic(rule, &rule->tx, &param,
-					      num_actions, actions);
+					      num_actions, actions, locked);
 		break;
 	case MLX5DV_DR_DOMAIN_TYPE_FDB:
 		rule->rx.nic_matcher = &matcher->rx;
 		rule->tx.nic_matcher = &matcher->tx;
 		ret = dr_rule_create_rule_fdb(rule, &param,
-					      num_actions, actions);
+					      num_actions, actions, locked);
 		break;
 	default:
 		ret = EINVAL;
@@ -1531,9 +1979,11 @@ dr_rule_create_rule(struct mlx5dv_dr_matcher *matcher,
 	if (ret)
 		goto remove_action_members;
 
-	pthread_spin_lock(&dmn->debug_lock);
+	if (!locked)
+		pthread_spin_lock(&dmn->debug_lock);
 	list_add_tail(&matcher->rule_list, &rule->rule_list);
-	pthread_spin_unlock(&dmn->debug_lock);
+	if (!locked)
+		pthread_spin_unlock(&dmn->debug_lock);
 
 	return rule;
 
@@ -1620,7 +2070,8 @@ struct mlx5dv_dr_rule *mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
 	if (dr_is_root_table(matcher->tbl))
 		rule = dr_rule_create_rule_root(matcher, value, num_actions, actions);
 	else
-		rule = dr_rule_create_rule(matcher, value, num_actions, actions);
+		rule = dr_rule_create_rule(matcher, value, num_actions, actions,
+					   false);
 
 	if (!rule)
 		atomic_fetch_sub(&matcher->refcount, 1);
@@ -1637,9 +2088,129 @@ int mlx5dv_dr_rule_destroy(struct mlx5dv_dr_rule *rule)
 	if (dr_is_root_table(tbl))
 		ret = dr_rule_destroy_rule_root(rule);
 	else
-		ret = dr_rule_destroy_rule(rule);
+		ret = dr_rule_destroy_rule(rule, false);
 
 	if (!ret)
 		atomic_fetch_sub(&matcher->refcount, 1);
 	return ret;
 }
+
+static void dr_rule_bulk_lock(struct mlx5dv_dr_domain *dmn)
+{
+	/* Same order as the dump code */
+	pthread_spin_lock(&dmn->debug_lock);
+	dr_domain_lock(dmn);
+	dr_send_ring_batch_begin(dmn);
+}
+
+static void dr_rule_bulk_unlock(struct mlx5dv_dr_domain *dmn)
+{
+	dr_send_ring_batch_end(dmn);
+	dr_domain_unlock(dmn);
+	pthread_spin_unlock(&dmn->debug_lock);
+}
+
+static void dr_rule_destroy_rules_bulk(struct mlx5dv_dr_rule *rules[],
+				       size_t num_rules)
+{
+	struct mlx5dv_dr_domain *dmn;
+	size_t i, j;
+
+	for (i = 0; i < num_rules; i = j) {
+		dmn = rules[i]->matcher->tbl->dmn;
+
+		dr_rule_bulk_lock(dmn);
+		for (j = i; j < num_rules && j - i < DR_RULE_BULK_CHUNK &&
+		     rules[j]->matcher->tbl->dmn == dmn; j++) {
+			atomic_fetch_sub(&rules[j]->matcher->refcount, 1);
+			dr_rule_destroy_rule(rules[j], true);
+		}
+		dr_rule_bulk_unlock(dmn);
+	}
+}
+
+int mlx5dv_dr_rule_create_bulk(struct mlx5dv_dr_matcher *matcher,
+			       struct mlx5dv_dr_rule_attr *attrs,
+			       size_t num_rules,
+			       struct mlx5dv_dr_rule *rules[])
+{
+	struct mlx5dv_dr_domain *dmn = matcher->tbl->dmn;
+	size_t i, end;
+	int ret = 0;
+
+	if (dr_is_root_table(matcher->tbl)) {
+		for (i = 0; i < num_rules; i++) {
+			rules[i] = mlx5dv_dr_rule_create(matcher,
+							 attrs[i].value,
+							 attrs[i].num_actions,
+							 attrs[i].actions);
+			if (!rules[i]) {
+				ret = errno;
+				goto destroy_root_rules;
+			}
+		}
+		return 0;
+	}
+
+	atomic_fetch_add(&matcher->refcount, num_rules);
+
+	/*
+	 * The locks are dropped between chunks so that a large bulk does not
+	 * stall other threads inserting into the same domain.
+	 */
+	for (i = 0; i < num_rules && !ret;) {
+		end = min(num_rules, i + DR_RULE_BULK_CHUNK);
+
+		dr_rule_bulk_lock(dmn);
+		for (; i < end; i++) {
+			rules[i] = dr_rule_create_rule(matcher, attrs[i].value,
+						       attrs[i].num_actions,
+						       attrs[i].actions, true);
+			if (!rules[i]) {
+				ret = errno;
+				break;
+			}
+		}
+		dr_rule_bulk_unlock(dmn);
+	}
+
+	if (ret) {
+		atomic_fetch_sub(&matcher->refcount, num_rules - i);
+		dr_rule_destroy_rules_bulk(rules, i);
+		goto clear_rules;
+	}
+
+	return 0;
+
+destroy_root_rules:
+	while (i--)
+		mlx5dv_dr_rule_destroy(rules[i]);
+clear_rules:
+	memset(rules, 0, num_rules * sizeof(*rules));
+	errno = ret;
+	return ret;
+}
+
+int mlx5dv_dr_rule_destroy_bulk(struct mlx5dv_dr_rule *rules[],
+				size_t num_rules)
+{
+	size_t i, start = 0;
+	int ret = 0, err;
+
+	for (i = 0; i <= num_rules; i++) {
+		if (i < num_rules && !dr_is_root_table(rules[i]->matcher->tbl))
+			continue;
+
+		/* Flush the software steering rules collected so far */
+		dr_rule_destroy_rules_bulk(rules + start, i - start);
+		start = i + 1;
+
+		if (i < num_rules) {
+			err = mlx5dv_dr_rule_destroy(rules[i]);
+			if (err && !ret)
+				ret = err;
+		}
+	}
+
+	return ret;
+}
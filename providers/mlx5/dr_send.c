@@ -536,9 +536,9 @@ static void dr_rdma_handle_icm_write_segments(struct dr_qp *dr_qp,
 	}
 }
 
-static void dr_rdma_segments(struct dr_qp *dr_qp, uint64_t remote_addr,
-			     uint32_t rkey, struct dr_data_seg *data_seg,
-			     uint32_t opcode, bool send_now)
+static void *dr_rdma_segments(struct dr_qp *dr_qp, uint64_t remote_addr,
+			      uint32_t rkey, struct dr_data_seg *data_seg,
+			      uint32_t opcode, bool send_now)
 {
 	struct mlx5_wqe_ctrl_seg *ctrl = NULL;
 	void *qend = dr_qp->sq.qend;
@@ -586,21 +586,50 @@ static void dr_rdma_segments(struct dr_qp *dr_qp, uint64_t remote_addr,
 
 	if (send_now)
 		dr_post_send_db(dr_qp, ctrl);
+
+	return ctrl;
+}
+
+static void dr_send_ring_flush_db(struct dr_send_ring *send_ring)
+{
+	if (!send_ring->db_ctrl)
+		return;
+
+	dr_post_send_db(send_ring->qp, send_ring->db_ctrl);
+	send_ring->db_ctrl = NULL;
 }
 
-static void dr_post_send(struct dr_qp *dr_qp, struct postsend_info *send_info)
+static void dr_post_send(struct dr_send_ring *send_ring,
+			 struct postsend_info *send_info)
 {
+	struct dr_qp *dr_qp = send_ring->qp;
+	bool send_now;
+	void *ctrl;
+
+	/*
+	 * In batch mode the doorbell is rung only for signaled WQEs, so the
+	 * completions dr_handle_pending_wc() waits for are always in flight.
+	 */
+	send_now = !send_ring->batch ||
+		   (send_info->write.send_flags & IBV_SEND_SIGNALED) ||
+		   (send_info->type == WRITE_ICM &&
+		    (send_info->read.send_flags & IBV_SEND_SIGNALED));
+
 	if (send_info->type == WRITE_ICM) {
 		/* false, because we delay the post_send_db till the coming READ */
 		dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
 				 &send_info->write, MLX5_OPCODE_RDMA_WRITE, false);
-		/* true, because we send WRITE + READ together */
-		dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
-				 &send_info->read, MLX5_OPCODE_RDMA_READ, true);
+		/* send WRITE + READ together */
+		ctrl = dr_rdma_segments(dr_qp, send_info->remote_addr,
+					send_info->rkey, &send_info->read,
+					MLX5_OPCODE_RDMA_READ, send_now);
 	} else { /* GTA_ARG */
-		dr_rdma_segments(dr_qp, send_info->remote_addr, send_info->rkey,
-				 &send_info->write, MLX5_OPCODE_FLOW_TBL_ACCESS, true);
+		ctrl = dr_rdma_segments(dr_qp, send_info->remote_addr,
+					send_info->rkey, &send_info->write,
+					MLX5_OPCODE_FLOW_TBL_ACCESS, send_now);
 	}
+
+	send_ring->db_ctrl = send_now ? NULL : ctrl;
 }
 
 /*
@@ -659,8 +688,10 @@ static int dr_handle_pending_wc(struct mlx5dv_dr_domain *dmn,
 
 	if (send_ring->pending_wqe >= send_ring->signal_th) {
 		/* Queue is full start drain it */
-		if (send_ring->pending_wqe >= send_ring->signal_th * TH_NUMS_TO_DRAIN)
+		if (send_ring->pending_wqe >= send_ring->signal_th * TH_NUMS_TO_DRAIN) {
 			is_drain = true;
+			dr_send_ring_flush_db(send_ring);
+		}
 
 		do {
 			/*
@@ -761,7 +792,7 @@ static int dr_postsend_icm_data(struct mlx5dv_dr_domain *dmn,
 		goto out_unlock;
 
 	dr_fill_data_segs(dmn, send_ring, send_info);
-	dr_post_send(send_ring->qp, send_info);
+	dr_post_send(send_ring, send_info);
 
 out_unlock:
 	pthread_spin_unlock(&send_ring->lock);
@@ -827,38 +858,47 @@ int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn, struct dr_ste *ste,
 	return dr_postsend_icm_data(dmn, &send_info, ring_idx);
 }
 
-int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl,
-			  uint8_t *formated_ste, uint8_t *mask,
-			  uint8_t send_ring_idx)
+/*
+ * Write num_stes entries of htbl starting at first, the used entries from
+ * their hw_ste and the rest from formated_ste.
+ */
+int dr_send_postsend_htbl_range(struct mlx5dv_dr_domain *dmn,
+				struct dr_ste_htbl *htbl,
+				uint8_t *formated_ste, uint8_t *mask,
+				uint32_t first, uint32_t num_stes,
+				uint8_t send_ring_idx)
 {
 	bool legacy_htbl = htbl->type == DR_STE_HTBL_TYPE_LEGACY;
-	uint32_t byte_size = htbl->chunk->byte_size;
-	int i, j, num_stes_per_iter, iterations;
+	uint32_t max_stes = dmn->info.max_send_size / DR_STE_SIZE;
 	uint8_t ste_sz = htbl->ste_arr->size;
+	uint8_t empty_ste[DR_STE_SIZE];
+	uint32_t i, j, cur_stes;
 	uint8_t *data;
-	int ret;
+	int ret = 0;
 
-	ret = dr_get_tbl_copy_details(dmn, htbl, &data, &byte_size,
-				      &iterations, &num_stes_per_iter);
-	if (ret)
-		return ret;
+	data = calloc(min_t(uint32_t, num_stes, max_stes), DR_STE_SIZE);
+	if (!data) {
+		errno = ENOMEM;
+		return errno;
+	}
 
-	dr_ste_prepare_for_postsend(dmn->ste_ctx, formated_ste, DR_STE_SIZE);
+	memcpy(empty_ste, formated_ste, DR_STE_SIZE);
+	dr_ste_prepare_for_postsend(dmn->ste_ctx, empty_ste, DR_STE_SIZE);
 
-	/* Send the data iteration times */
-	for (i = 0; i < iterations; i++) {
-		uint32_t ste_index = i * (byte_size / DR_STE_SIZE);
+	for (i = first; i < first + num_stes; i += cur_stes) {
 		struct postsend_info send_info = {};
 
+		cur_stes = min_t(uint32_t, first + num_stes - i, max_stes);
+
 		/* Copy all ste's on the data buffer, need to add the bit_mask */
-		for (j = 0; j < num_stes_per_iter; j++) {
-			if (dr_ste_is_not_used(&htbl->ste_arr[ste_index + j])) {
+		for (j = 0; j < cur_stes; j++) {
+			if (dr_ste_is_not_used(&htbl->ste_arr[i + j])) {
 				memcpy(data + (j * DR_STE_SIZE),
-				       formated_ste, DR_STE_SIZE);
+				       empty_ste, DR_STE_SIZE);
 			} else {
 				/* Copy data */
 				memcpy(data + (j * DR_STE_SIZE),
-				       htbl->ste_arr[ste_index + j].hw_ste,
+				       htbl->ste_arr[i + j].hw_ste,
 				       ste_sz);
 				/* Copy bit_mask on legacy tables */
 				if (legacy_htbl)
@@ -873,21 +913,29 @@ int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl
 		}
 
 		send_info.write.addr	= (uintptr_t) data;
-		send_info.write.length	= byte_size;
+		send_info.write.length	= cur_stes * DR_STE_SIZE;
 		send_info.write.lkey	= 0;
-		send_info.remote_addr	= dr_ste_get_mr_addr(htbl->ste_arr + ste_index);
+		send_info.remote_addr	= dr_ste_get_mr_addr(htbl->ste_arr + i);
 		send_info.rkey		= dr_icm_pool_get_chunk_rkey(htbl->chunk);
 
 		ret = dr_postsend_icm_data(dmn, &send_info, send_ring_idx);
 		if (ret)
-			goto out_free;
+			break;
 	}
 
-out_free:
 	free(data);
 	return ret;
 }
 
+int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl,
+			  uint8_t *formated_ste, uint8_t *mask,
+			  uint8_t send_ring_idx)
+{
+	return dr_send_postsend_htbl_range(dmn, htbl, formated_ste, mask, 0,
+					   htbl->chunk->num_of_entries,
+					   send_ring_idx);
+}
+
 /* Initialize htble with default STEs */
 int dr_send_postsend_formated_htbl(struct mlx5dv_dr_domain *dmn,
 				   struct dr_ste_htbl *htbl,
@@ -1297,6 +1345,38 @@ free_send_ring:
 	return ret;
 }
 
+/*
+ * Defer the doorbells of the domain send rings until
+ * dr_send_ring_batch_end(), except for signaled WQEs. Used when many STE
+ * writes are posted back to back, e.g. by the bulk rule API.
+ */
+void dr_send_ring_batch_begin(struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_send_ring *send_ring;
+	int i;
+
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+		send_ring = dmn->send_ring[i];
+		pthread_spin_lock(&send_ring->lock);
+		send_ring->batch++;
+		pthread_spin_unlock(&send_ring->lock);
+	}
+}
+
+void dr_send_ring_batch_end(struct mlx5dv_dr_domain *dmn)
+{
+	struct dr_send_ring *send_ring;
+	int i;
+
+	for (i = 0; i < DR_MAX_SEND_RINGS; i++) {
+		send_ring = dmn->send_ring[i];
+		pthread_spin_lock(&send_ring->lock);
+		if (!--send_ring->batch)
+			dr_send_ring_flush_db(send_ring);
+		pthread_spin_unlock(&send_ring->lock);
+	}
+}
+
 int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn)
 {
 	struct dr_send_ring *send_ring = dmn->send_ring[0];
@@ -72,7 +72,7 @@ uint32_t dr_ste_calc_hash_index(uint8_t *hw_ste_p, struct dr_ste_htbl *htbl)
 		p_masked = hw_ste->tag;
 	}
 
-	crc32 = dr_crc32_slice8_calc(p_masked, len);
+	crc32 = dr_crc32_calc(p_masked, len);
 	index = crc32 % htbl->chunk->num_of_entries;
 
 	return index;
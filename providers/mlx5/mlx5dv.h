@@ -1998,6 +1998,12 @@ void mlx5dv_dr_domain_set_reclaim_device_memory(struct mlx5dv_dr_domain *dmn,
 void mlx5dv_dr_domain_allow_duplicate_rules(struct mlx5dv_dr_domain *domain,
 					    bool allow);
 
+void mlx5dv_dr_domain_set_incremental_rehash(struct mlx5dv_dr_domain *domain,
+					     bool enable);
+
+int mlx5dv_dr_domain_rehash_step(struct mlx5dv_dr_domain *domain,
+				 uint32_t num_buckets);
+
 struct mlx5dv_dr_table *
 mlx5dv_dr_table_create(struct mlx5dv_dr_domain *domain, uint32_t level);
 
@@ -2032,6 +2038,20 @@ mlx5dv_dr_rule_create(struct mlx5dv_dr_matcher *matcher,
 
 int mlx5dv_dr_rule_destroy(struct mlx5dv_dr_rule *rule);
 
+struct mlx5dv_dr_rule_attr {
+	struct mlx5dv_flow_match_parameters *value;
+	size_t num_actions;
+	struct mlx5dv_dr_action **actions;
+};
+
+int mlx5dv_dr_rule_create_bulk(struct mlx5dv_dr_matcher *matcher,
+			       struct mlx5dv_dr_rule_attr *attrs,
+			       size_t num_rules,
+			       struct mlx5dv_dr_rule *rules[]);
+
+int mlx5dv_dr_rule_destroy_bulk(struct mlx5dv_dr_rule *rules[],
+				size_t num_rules);
+
 enum mlx5dv_dr_action_flags {
 	MLX5DV_DR_ACTION_FLAGS_ROOT_LEVEL	= 1 << 0,
 };
@@ -202,6 +202,7 @@ struct dr_ste_htbl;
 struct dr_match_param;
 struct dr_devx_caps;
 struct dr_rule_rx_tx;
+struct dr_rule_rehash;
 struct dr_matcher_rx_tx;
 struct dr_ste_ctx;
 struct dr_ptrn_mngr;
@@ -280,6 +281,8 @@ struct dr_ste_htbl {
 	struct dr_ste		*pointing_ste;
 
 	struct dr_ste_htbl_ctrl ctrl;
+	/* Set on both tables while an incremental rehash moves entries */
+	struct dr_rule_rehash	*rehash;
 };
 
 struct dr_ste_send_info {
@@ -1075,6 +1078,7 @@ struct dr_domain_info {
 enum dr_domain_flags {
 	 DR_DOMAIN_FLAG_MEMORY_RECLAIM = 1 << 0,
 	 DR_DOMAIN_FLAG_DISABLE_DUPLICATE_RULES = 1 << 1,
+	 DR_DOMAIN_FLAG_INCREMENTAL_REHASH = 1 << 2,
 };
 
 struct mlx5dv_dr_domain {
@@ -1182,6 +1186,8 @@ struct dr_matcher_rx_tx {
 	uint64_t			default_icm_addr;
 	struct dr_table_rx_tx		*nic_tbl;
 	bool				fixed_size;
+	/* At most one incremental rehash in progress per matcher */
+	struct dr_rule_rehash		*rehash;
 };
 
 struct mlx5dv_dr_matcher {
@@ -1245,6 +1251,7 @@ struct dr_ptrn_obj {
 	atomic_int refcount;
 	struct list_node list;
 	enum dr_ptrn_type type;
+	uint32_t hash;
 };
 
 struct dr_arg_obj {
@@ -1380,18 +1387,26 @@ struct mlx5dv_dr_rule {
 	uint16_t		num_actions;
 };
 
+static inline void
+dr_rule_set_lock_index(struct dr_rule_rx_tx *nic_rule, uint8_t *hw_ste)
+{
+	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
+	uint32_t index;
+
+	if (nic_matcher->fixed_size && hw_ste) {
+		index = dr_ste_calc_hash_index(hw_ste, nic_matcher->s_htbl);
+		nic_rule->lock_index = index % NUM_OF_LOCKS;
+	}
+}
+
 static inline void
 dr_rule_lock(struct dr_rule_rx_tx *nic_rule, uint8_t *hw_ste)
 {
 	struct dr_matcher_rx_tx *nic_matcher = nic_rule->nic_matcher;
 	struct dr_domain_rx_tx *nic_dmn = nic_matcher->nic_tbl->nic_dmn;
-	uint32_t index;
 
 	if (nic_matcher->fixed_size) {
-		if (hw_ste) {
-			index = dr_ste_calc_hash_index(hw_ste, nic_matcher->s_htbl);
-			nic_rule->lock_index = index % NUM_OF_LOCKS;
-		}
+		dr_rule_set_lock_index(nic_rule, hw_ste);
 		pthread_spin_lock(&nic_dmn->locks[nic_rule->lock_index]);
 	} else {
 		pthread_spin_lock(&nic_dmn->locks[0]);
@@ -1609,11 +1624,24 @@ bool dr_domain_set_max_ste_icm_size(struct mlx5dv_dr_domain *dmn,
 int dr_rule_rehash_matcher_s_anchor(struct mlx5dv_dr_matcher *matcher,
 				    struct dr_matcher_rx_tx *nic_matcher,
 				    enum dr_icm_chunk_size new_size);
+int dr_rule_rehash_finish(struct dr_matcher_rx_tx *nic_matcher);
+int dr_rule_rehash_advance(struct dr_matcher_rx_tx *nic_matcher,
+			   uint32_t *num_buckets);
+
+/* Per-thread chunk magazine counters, summed over the pool */
+struct dr_icm_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t refills;
+	uint64_t flushes;
+};
 
 struct dr_icm_pool *dr_icm_pool_create(struct mlx5dv_dr_domain *dmn,
 				       enum dr_icm_type icm_type);
 void dr_icm_pool_destroy(struct dr_icm_pool *pool);
 int dr_icm_pool_sync_pool(struct dr_icm_pool *pool);
+void dr_icm_pool_get_stats(struct dr_icm_pool *pool,
+			   struct dr_icm_pool_stats *stats);
 
 uint64_t dr_icm_pool_get_chunk_icm_addr(struct dr_icm_chunk *chunk);
 uint64_t dr_icm_pool_get_chunk_mr_addr(struct dr_icm_chunk *chunk);
@@ -1642,6 +1670,7 @@ void dr_ste_copy_param(uint8_t match_criteria,
 
 void dr_crc32_init_table(void);
 uint32_t dr_crc32_slice8_calc(const void *input_data, size_t length);
+uint32_t dr_crc32_calc(const void *input_data, size_t length);
 
 struct dr_wq {
 	unsigned	*wqe_head;
@@ -1701,15 +1730,26 @@ struct dr_send_ring {
 	uint32_t		buf_size;
 	void			*sync_buff;
 	struct ibv_mr		*sync_mr;
+	/* Doorbells are deferred while batch is non zero */
+	uint32_t		batch;
+	/* Control segment of the last WQE posted without a doorbell */
+	void			*db_ctrl;
 };
 
 int dr_send_ring_alloc(struct mlx5dv_dr_domain *dmn);
 void dr_send_ring_free(struct mlx5dv_dr_domain *dmn);
 int dr_send_ring_force_drain(struct mlx5dv_dr_domain *dmn);
+void dr_send_ring_batch_begin(struct mlx5dv_dr_domain *dmn);
+void dr_send_ring_batch_end(struct mlx5dv_dr_domain *dmn);
 bool dr_send_allow_fl(struct dr_devx_caps *caps);
 int dr_send_postsend_ste(struct mlx5dv_dr_domain *dmn, struct dr_ste *ste,
 			 uint8_t *data, uint16_t size, uint16_t offset,
 			 uint8_t ring_idx);
+int dr_send_postsend_htbl_range(struct mlx5dv_dr_domain *dmn,
+				struct dr_ste_htbl *htbl,
+				uint8_t *formated_ste, uint8_t *mask,
+				uint32_t first, uint32_t num_stes,
+				uint8_t send_ring_idx);
 int dr_send_postsend_htbl(struct mlx5dv_dr_domain *dmn, struct dr_ste_htbl *htbl,
 			  uint8_t *formated_ste, uint8_t *mask,
 			  uint8_t send_ring_idx);
@@ -1780,6 +1820,7 @@ struct dr_arg_obj *dr_arg_get_obj(struct dr_arg_mngr *mngr,
 void dr_arg_put_obj(struct dr_arg_mngr *mngr, struct dr_arg_obj *arg_obj);
 uint32_t dr_arg_get_object_id(struct dr_arg_obj *arg_obj);
 bool dr_domain_is_support_sw_encap(struct mlx5dv_dr_domain *dmn);
+unsigned int dr_get_thread_idx(void);
 
 int dr_buddy_init(struct dr_icm_buddy_mem *buddy, uint32_t max_order);
 void dr_buddy_cleanup(struct dr_icm_buddy_mem *buddy);
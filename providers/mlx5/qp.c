@@ -1176,6 +1176,8 @@ int mlx5_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	return _mlx5_post_send(ibqp, wr, bad_wr);
 }
 
+PROVIDER_DATAPATH_OP(mlx5, post_send, mlx5_post_send);
+
 enum {
 	WQE_REQ_SETTERS_UD_XRC_DC = 2,
 };
@@ -3908,6 +3910,8 @@ out:
 	return err;
 }
 
+PROVIDER_DATAPATH_OP(mlx5, post_recv, mlx5_post_recv);
+
 static void mlx5_tm_add_op(struct mlx5_srq *srq, struct mlx5_tag_entry *tag,
 			   uint64_t wr_id, int nreq)
 {
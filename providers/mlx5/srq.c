@@ -323,6 +323,8 @@ int mlx5_post_srq_recv(struct ibv_srq *ibsrq,
 	return err;
 }
 
+PROVIDER_DATAPATH_OP(mlx5, post_srq_recv, mlx5_post_srq_recv);
+
 /* Build a linked list on an array of SRQ WQEs.
  * Since WQEs are always added to the tail and taken from the head
  * it doesn't matter where the last WQE points to.
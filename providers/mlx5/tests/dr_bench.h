@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB) */
+/*
+ * Helpers shared by the software steering benchmarks.
+ */
+#ifndef _DR_BENCH_H_
+#define _DR_BENCH_H_
+
+#include <endian.h>
+#include <string.h>
+#include <time.h>
+
+#include <infiniband/mlx5dv.h>
+
+/* fte_match_set_lyr_2_4, dst_ipv4 lives in its last dword */
+#define MATCH_SZ 64
+#define DST_IPV4_DW 15
+
+struct match_buf {
+	struct mlx5dv_flow_match_parameters params;
+	uint32_t buf[MATCH_SZ / 4];
+};
+
+static inline double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void set_dst_ipv4(struct match_buf *m, uint32_t ip)
+{
+	memset(m, 0, sizeof(*m));
+	m->params.match_sz = MATCH_SZ;
+	m->buf[DST_IPV4_DW] = htobe32(ip);
+}
+
+/* A NIC RX domain on the first mlx5 device that supports one, or NULL */
+static inline struct mlx5dv_dr_domain *open_domain(void)
+{
+	struct mlx5dv_dr_domain *dmn = NULL;
+	struct ibv_device **list;
+	struct ibv_context *ctx;
+	int i;
+
+	list = ibv_get_device_list(NULL);
+	if (!list)
+		return NULL;
+
+	for (i = 0; list[i] && !dmn; i++) {
+		if (!mlx5dv_is_supported(list[i]))
+			continue;
+		ctx = ibv_open_device(list[i]);
+		if (!ctx)
+			continue;
+		dmn = mlx5dv_dr_domain_create(ctx,
+					      MLX5DV_DR_DOMAIN_TYPE_NIC_RX);
+		if (!dmn)
+			ibv_close_device(ctx);
+	}
+
+	ibv_free_device_list(list);
+	return dmn;
+}
+
+#endif
@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure the throughput of the slicing-by-8 table CRC32 against
+ * dr_crc32_calc(), which picks a carry-less multiply or CRC32 instruction
+ * implementation when the CPU has one. The 16 and 32 byte sizes are the
+ * STE tags hashed on rule insertion.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../mlx5dv_dr.h"
+
+static const size_t sizes[] = {
+	DR_STE_SIZE_TAG, DR_STE_SIZE_MATCH_TAG, 64, 256, 4096,
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(uint32_t (*calc)(const void *, size_t), const void *buf,
+		  size_t len, unsigned long iterations, uint32_t *sum)
+{
+	volatile uint32_t acc = 0;
+	unsigned long i;
+	double start;
+
+	start = now_sec();
+	for (i = 0; i < iterations; i++)
+		acc += calc(buf, len);
+	*sum = acc;
+
+	return now_sec() - start;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long bytes = 1UL << 30;
+	uint64_t words[4096 / 8];
+	uint8_t *buf = (uint8_t *)words;
+	double t_table, t_calc;
+	uint32_t s_table, s_calc;
+	unsigned long iterations;
+	int failures = 0;
+	unsigned int i;
+
+	if (argc > 1)
+		bytes = strtoul(argv[1], NULL, 0);
+
+	dr_crc32_init_table();
+	for (i = 0; i < sizeof(words); i++)
+		buf[i] = random();
+
+	printf("%6s %14s %14s %8s\n", "bytes", "table MB/s", "calc MB/s",
+	       "speedup");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		iterations = bytes / sizes[i];
+		if (!iterations)
+			iterations = 1;
+
+		t_table = run(dr_crc32_slice8_calc, buf, sizes[i], iterations,
+			      &s_table);
+		t_calc = run(dr_crc32_calc, buf, sizes[i], iterations, &s_calc);
+		if (s_table != s_calc) {
+			printf("  FAIL %zu bytes: results differ\n", sizes[i]);
+			failures++;
+		}
+
+		printf("%6zu %14.0f %14.0f %7.2fx\n", sizes[i],
+		       iterations * sizes[i] / t_table / 1e6,
+		       iterations * sizes[i] / t_calc / 1e6, t_table / t_calc);
+	}
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Check that dr_crc32_calc(), which may use PCLMULQDQ or the ARMv8 CRC32
+ * instructions, matches the slicing-by-8 tables for random buffers of every
+ * length and alignment the STE hash could see, and for larger ones.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mlx5dv_dr.h"
+
+#define MAX_LEN 512
+#define NUM_ROUNDS 64
+
+static int failed_tests;
+
+/* CRC32 of "123456789" with a zero seed and no final xor, byte swapped */
+#define CHECK_VALUE 0x882dfd2d
+
+static void test_known_value(void)
+{
+	uint32_t crc = dr_crc32_slice8_calc("123456789", 9);
+
+	if (crc != CHECK_VALUE) {
+		printf("  FAIL table crc 0x%08x, expected 0x%08x\n", crc,
+		       CHECK_VALUE);
+		failed_tests++;
+	}
+	crc = dr_crc32_calc("123456789", 9);
+	if (crc != CHECK_VALUE) {
+		printf("  FAIL crc 0x%08x, expected 0x%08x\n", crc,
+		       CHECK_VALUE);
+		failed_tests++;
+	}
+	if (dr_crc32_calc(NULL, 16) != 0) {
+		printf("  FAIL NULL input\n");
+		failed_tests++;
+	}
+}
+
+static void test_random(void)
+{
+	/* Backed by uint64_t so the table version is given aligned words */
+	uint64_t words[(MAX_LEN + 16) / 8];
+	uint8_t *buf = (uint8_t *)words;
+	uint32_t expected, actual;
+	unsigned int round, off;
+	size_t len, i;
+
+	for (round = 0; round < NUM_ROUNDS; round++) {
+		for (i = 0; i < sizeof(words); i++)
+			buf[i] = random();
+
+		for (off = 0; off < 16; off += 4) {
+			for (len = 0; len <= MAX_LEN; len++) {
+				expected = dr_crc32_slice8_calc(buf + off, len);
+				actual = dr_crc32_calc(buf + off, len);
+				if (expected == actual)
+					continue;
+				printf("  FAIL len %zu off %u: 0x%08x not 0x%08x\n",
+				       len, off, actual, expected);
+				failed_tests++;
+			}
+		}
+	}
+}
+
+static void test_sparse(void)
+{
+	uint64_t words[DR_STE_SIZE_MATCH_TAG / 8] = {};
+	uint8_t *buf = (uint8_t *)words;
+	uint32_t expected, actual;
+	size_t len, i;
+
+	/* Masked tags are mostly zero, flip a single bit at a time */
+	for (len = DR_STE_SIZE_TAG; len <= DR_STE_SIZE_MATCH_TAG;
+	     len += DR_STE_SIZE_MATCH_TAG - DR_STE_SIZE_TAG) {
+		for (i = 0; i < len * 8; i++) {
+			memset(buf, 0, sizeof(words));
+			buf[i / 8] = 1 << (i % 8);
+			expected = dr_crc32_slice8_calc(buf, len);
+			actual = dr_crc32_calc(buf, len);
+			if (expected == actual)
+				continue;
+			printf("  FAIL len %zu bit %zu: 0x%08x not 0x%08x\n",
+			       len, i, actual, expected);
+			failed_tests++;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int all_failed_tests = 0;
+
+	dr_crc32_init_table();
+	srandom(argc > 1 ? atoi(argv[1]) : 1);
+
+#define TEST(name) do { \
+	failed_tests = 0; \
+	name(); \
+	printf("%6s %s\n", failed_tests ? "FAILED" : "OK", #name); \
+	all_failed_tests += failed_tests; \
+	} while (0)
+
+	TEST(test_known_value);
+	TEST(test_random);
+	TEST(test_sparse);
+
+#undef TEST
+
+	if (all_failed_tests) {
+		printf("%d tests failed\n", all_failed_tests);
+		return 1;
+	}
+
+	return 0;
+}
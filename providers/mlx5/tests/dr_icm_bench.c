@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure the rate of software steering ICM chunk allocation and release
+ * when several threads do it at once. Each thread creates and destroys L3
+ * tunnel decap actions, which take a small chunk from the modify header ICM
+ * pool. The per-thread chunk magazine hit rate is read back from the domain
+ * dump. Needs an mlx5 device with software steering support, the test is
+ * skipped otherwise.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/mlx5dv.h>
+
+#include "dr_bench.h"
+
+#define MAX_THREADS 64
+/* Outstanding actions per thread, so frees are not always followed by allocs */
+#define BURST 32
+#define DUMP_REC_TYPE_ICM_POOL 3006
+
+static unsigned int iterations = 20000;
+static struct mlx5dv_dr_domain *domain;
+static int failures;
+
+/* The inner L2 header restored by the decap */
+static uint8_t l2_hdr[14] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55,
+	0x00, 0x66, 0x77, 0x88, 0x99, 0xaa,
+	0x08, 0x00,
+};
+
+struct thread_ctx {
+	pthread_t thread;
+	unsigned long bad;
+};
+
+static void *decap_thread(void *arg)
+{
+	struct mlx5dv_dr_action *actions[BURST];
+	struct thread_ctx *ctx = arg;
+	unsigned int i, j;
+
+	for (i = 0; i < iterations; i += BURST) {
+		for (j = 0; j < BURST; j++) {
+			actions[j] = mlx5dv_dr_action_create_packet_reformat(
+				domain, 0,
+				MLX5DV_FLOW_ACTION_PACKET_REFORMAT_TYPE_L3_TUNNEL_TO_L2,
+				sizeof(l2_hdr), l2_hdr);
+			if (!actions[j])
+				ctx->bad++;
+		}
+		for (j = 0; j < BURST; j++)
+			if (actions[j])
+				mlx5dv_dr_action_destroy(actions[j]);
+	}
+
+	return NULL;
+}
+
+static int run(unsigned int nthreads, struct thread_ctx *ctxs)
+{
+	double start, elapsed;
+	unsigned int i;
+
+	start = now_sec();
+	for (i = 0; i < nthreads; i++) {
+		ctxs[i].bad = 0;
+		if (pthread_create(&ctxs[i].thread, NULL, decap_thread,
+				   &ctxs[i]))
+			return -1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(ctxs[i].thread, NULL);
+		if (ctxs[i].bad) {
+			printf("  FAIL thread %u: %lu failed actions\n", i,
+			       ctxs[i].bad);
+			failures++;
+		}
+	}
+	elapsed = now_sec() - start;
+
+	printf("%3u threads: %12.0f alloc+free/sec\n", nthreads,
+	       (double)nthreads * iterations / elapsed);
+	return 0;
+}
+
+/* Print the ICM pool magazine counters of the domain dump */
+static void report_stats(void)
+{
+	uint64_t domain_id, hits, misses, refills, flushes;
+	char line[512];
+	int type, icm_type;
+	FILE *f;
+
+	f = tmpfile();
+	if (!f)
+		return;
+
+	if (mlx5dv_dump_dr_domain(f, domain)) {
+		fclose(f);
+		return;
+	}
+
+	rewind(f);
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%d,0x%" SCNx64 ",%d,%" SCNu64 ",%" SCNu64
+			   ",%" SCNu64 ",%" SCNu64, &type, &domain_id,
+			   &icm_type, &hits, &misses, &refills,
+			   &flushes) != 7 ||
+		    type != DUMP_REC_TYPE_ICM_POOL)
+			continue;
+
+		printf("icm pool %d: hit rate %.2f%% (%" PRIu64 " hits, %"
+		       PRIu64 " misses), %" PRIu64 " refills, %" PRIu64
+		       " flushes\n", icm_type,
+		       hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+		       hits, misses, refills, flushes);
+	}
+
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread_ctx ctxs[MAX_THREADS] = {};
+	unsigned int max_threads = 8;
+	unsigned int i;
+
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+	if (!max_threads || max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+
+	domain = open_domain();
+	if (!domain) {
+		printf("No mlx5 software steering device, skipping\n");
+		return 0;
+	}
+
+	for (i = 1; i <= max_threads; i *= 2)
+		if (run(i, ctxs))
+			return 1;
+
+	report_stats();
+	mlx5dv_dr_domain_destroy(domain);
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
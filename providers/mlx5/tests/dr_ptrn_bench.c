@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure modify header action and rule creation when every action has a
+ * distinct rewrite pattern, as with many NAT rules. On devices that share
+ * patterns and keep the rewritten values in separate arguments, each action
+ * looks up the pattern cache and takes an argument object. Actions are
+ * created from several threads, then the same patterns are created again to
+ * time cache hits. Needs an mlx5 device with software steering support, the
+ * test is skipped otherwise.
+ */
+#include <config.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/mlx5dv.h>
+
+#include "dr_bench.h"
+
+#define MAX_THREADS 64
+/* Set actions per modify header, each picks a MAC half and a bit offset */
+#define NUM_SETS 3
+#define SET_ACTION_TYPE 0x1
+#define FIELD_OUT_SMAC_47_16 0x1
+#define FIELD_OUT_DMAC_47_16 0x4
+
+struct thread_ctx {
+	pthread_t thread;
+	unsigned int first;
+	unsigned int num;
+	unsigned long bad;
+};
+
+static unsigned int num_actions = 10000;
+static struct mlx5dv_dr_domain *domain;
+static struct mlx5dv_dr_action **actions;
+static int failures;
+
+/* Pattern id bits select the field and offset of each one bit set action */
+static struct mlx5dv_dr_action *create_rewrite(unsigned int id)
+{
+	__be64 sets[NUM_SETS];
+	uint32_t field, offset;
+	int i;
+
+	for (i = 0; i < NUM_SETS; i++) {
+		field = (id >> (i * 6)) & 1 ? FIELD_OUT_SMAC_47_16 :
+					      FIELD_OUT_DMAC_47_16;
+		offset = (id >> (i * 6 + 1)) & 0x1f;
+		sets[i] = htobe64((uint64_t)(SET_ACTION_TYPE << 28 |
+					     field << 16 | offset << 8 | 1)
+				  << 32 | (id & 1));
+	}
+
+	return mlx5dv_dr_action_create_modify_header(domain, 0, sizeof(sets),
+						     sets);
+}
+
+static void *create_thread(void *arg)
+{
+	struct thread_ctx *ctx = arg;
+	unsigned int i;
+
+	for (i = ctx->first; i < ctx->first + ctx->num; i++) {
+		actions[i] = create_rewrite(i);
+		if (!actions[i])
+			ctx->bad++;
+	}
+
+	return NULL;
+}
+
+static void destroy_actions(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < num_actions; i++) {
+		if (actions[i])
+			mlx5dv_dr_action_destroy(actions[i]);
+		actions[i] = NULL;
+	}
+}
+
+static int create_actions(unsigned int nthreads)
+{
+	struct thread_ctx ctxs[MAX_THREADS] = {};
+	double start, elapsed;
+	unsigned int i;
+
+	start = now_sec();
+	for (i = 0; i < nthreads; i++) {
+		ctxs[i].first = num_actions / nthreads * i;
+		ctxs[i].num = i == nthreads - 1 ?
+			      num_actions - ctxs[i].first :
+			      num_actions / nthreads;
+		if (pthread_create(&ctxs[i].thread, NULL, create_thread,
+				   &ctxs[i]))
+			return -1;
+	}
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(ctxs[i].thread, NULL);
+		if (ctxs[i].bad) {
+			printf("  FAIL thread %u: %lu failed actions: %s\n", i,
+			       ctxs[i].bad, strerror(errno));
+			failures++;
+		}
+	}
+	elapsed = now_sec() - start;
+
+	printf("%3u threads: %12.0f actions/sec\n", nthreads,
+	       num_actions / elapsed);
+	return 0;
+}
+
+/* Same patterns again while the first set is alive, all cache hits */
+static void create_cached(void)
+{
+	struct mlx5dv_dr_action *action;
+	double start, elapsed;
+	unsigned int i;
+
+	start = now_sec();
+	for (i = 0; i < num_actions; i++) {
+		action = create_rewrite(i);
+		if (!action) {
+			failures++;
+			continue;
+		}
+		mlx5dv_dr_action_destroy(action);
+	}
+	elapsed = now_sec() - start;
+
+	printf("cached:      %12.0f create+destroy/sec\n",
+	       num_actions / elapsed);
+}
+
+static void create_rules(void)
+{
+	struct mlx5dv_dr_matcher *matcher;
+	struct mlx5dv_dr_rule **rules;
+	struct mlx5dv_dr_table *tbl;
+	struct match_buf mask, value;
+	double start, elapsed;
+	unsigned int i;
+
+	tbl = mlx5dv_dr_table_create(domain, 1);
+	set_dst_ipv4(&mask, 0xffffffff);
+	matcher = tbl ? mlx5dv_dr_matcher_create(tbl, 0, 1, &mask.params) :
+			NULL;
+	rules = calloc(num_actions, sizeof(*rules));
+	if (!matcher || !rules) {
+		printf("  FAIL matcher: %s\n", strerror(errno));
+		failures++;
+		goto out;
+	}
+
+	start = now_sec();
+	for (i = 0; i < num_actions; i++) {
+		set_dst_ipv4(&value, 0x0a000000 + i);
+		rules[i] = mlx5dv_dr_rule_create(matcher, &value.params, 1,
+						 &actions[i]);
+		if (!rules[i])
+			failures++;
+	}
+	elapsed = now_sec() - start;
+	printf("rules:       %12.0f rules/sec\n", num_actions / elapsed);
+
+	for (i = 0; i < num_actions; i++)
+		if (rules[i])
+			mlx5dv_dr_rule_destroy(rules[i]);
+out:
+	free(rules);
+	if (matcher)
+		mlx5dv_dr_matcher_destroy(matcher);
+	if (tbl)
+		mlx5dv_dr_table_destroy(tbl);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max_threads = 8;
+	unsigned int i;
+
+	if (argc > 1)
+		num_actions = atoi(argv[1]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (!max_threads || max_threads > MAX_THREADS)
+		max_threads = MAX_THREADS;
+	if (!num_actions || num_actions > 1 << (NUM_SETS * 6))
+		num_actions = 1 << (NUM_SETS * 6);
+
+	domain = open_domain();
+	if (!domain) {
+		printf("No mlx5 software steering device, skipping\n");
+		return 0;
+	}
+
+	actions = calloc(num_actions, sizeof(*actions));
+	if (!actions)
+		return 1;
+
+	for (i = 1; i <= max_threads; i *= 2) {
+		if (create_actions(i))
+			return 1;
+		if (i * 2 <= max_threads)
+			destroy_actions();
+	}
+
+	create_cached();
+	create_rules();
+	destroy_actions();
+	free(actions);
+	mlx5dv_dr_domain_destroy(domain);
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
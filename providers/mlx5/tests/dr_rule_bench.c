@@ -0,0 +1,274 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+/*
+ * Measure the software steering rule insertion and deletion rate of
+ * mlx5dv_dr_rule_create()/destroy() against the bulk variants, and the
+ * insertion pauses caused by hash table rehashes with and without
+ * incremental rehash. It also destroys all the rules behind one STE while
+ * the table it points to is rehashed. The rules match on the outer
+ * destination IPv4 address and drop. Needs an mlx5 device with software steering support, the test is
+ * skipped otherwise.
+ */
+#include <config.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <infiniband/mlx5dv.h>
+
+#include "dr_bench.h"
+
+/* dmac_47_16, matched by the STE in front of the dst_ipv4 one */
+#define DMAC_47_16_DW 2
+
+static unsigned int num_rules = 100000;
+static struct mlx5dv_dr_table *tbl;
+static struct match_buf mask;
+static double *latency;
+static int failures;
+
+/* A new matcher for each run, so that its hash tables start small again */
+static struct mlx5dv_dr_matcher *create_matcher(void)
+{
+	struct mlx5dv_dr_matcher *matcher;
+
+	matcher = mlx5dv_dr_matcher_create(tbl, 0, 1, &mask.params);
+	if (!matcher) {
+		printf("  FAIL matcher: %s\n", strerror(errno));
+		failures++;
+	}
+	return matcher;
+}
+
+static void report(const char *name, unsigned int n, double elapsed)
+{
+	printf("%-8s %8u rules: %12.0f rules/sec\n", name, n, n / elapsed);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* The slowest insertions are the ones that rehashed a table */
+static void report_pauses(unsigned int n)
+{
+	if (!n)
+		return;
+
+	qsort(latency, n, sizeof(*latency), cmp_double);
+	printf("%-8s p50 %.1f us, p99 %.1f us, p99.99 %.1f us, max %.1f us\n",
+	       "", latency[n / 2] * 1e6, latency[n * 99 / 100] * 1e6,
+	       latency[(n - 1) - (n - 1) / 10000] * 1e6,
+	       latency[n - 1] * 1e6);
+}
+
+static void run_single(struct mlx5dv_dr_rule_attr *attrs,
+		       struct mlx5dv_dr_rule **rules)
+{
+	struct mlx5dv_dr_matcher *matcher;
+	double start, t;
+	unsigned int i;
+
+	matcher = create_matcher();
+	if (!matcher)
+		return;
+
+	start = now_sec();
+	for (i = 0; i < num_rules; i++) {
+		t = now_sec();
+		rules[i] = mlx5dv_dr_rule_create(matcher, attrs[i].value,
+						 attrs[i].num_actions,
+						 attrs[i].actions);
+		latency[i] = now_sec() - t;
+		if (!rules[i]) {
+			printf("  FAIL rule %u: %s\n", i, strerror(errno));
+			failures++;
+			break;
+		}
+	}
+	report("create", i, now_sec() - start);
+	report_pauses(i);
+
+	num_rules = i;
+	start = now_sec();
+	for (i = 0; i < num_rules; i++)
+		mlx5dv_dr_rule_destroy(rules[i]);
+	report("destroy", num_rules, now_sec() - start);
+
+	mlx5dv_dr_matcher_destroy(matcher);
+}
+
+static void run_bulk(struct mlx5dv_dr_rule_attr *attrs,
+		     struct mlx5dv_dr_rule **rules)
+{
+	struct mlx5dv_dr_matcher *matcher;
+	double start;
+	int ret;
+
+	matcher = create_matcher();
+	if (!matcher)
+		return;
+
+	start = now_sec();
+	ret = mlx5dv_dr_rule_create_bulk(matcher, attrs, num_rules, rules);
+	if (ret) {
+		printf("  FAIL bulk create: %s\n", strerror(ret));
+		failures++;
+		mlx5dv_dr_matcher_destroy(matcher);
+		return;
+	}
+	report("bulk create", num_rules, now_sec() - start);
+
+	start = now_sec();
+	ret = mlx5dv_dr_rule_destroy_bulk(rules, num_rules);
+	if (ret) {
+		printf("  FAIL bulk destroy: %s\n", strerror(ret));
+		failures++;
+	}
+	report("bulk destroy", num_rules, now_sec() - start);
+
+	mlx5dv_dr_matcher_destroy(matcher);
+}
+
+/*
+ * All the rules share the dmac STE, which points to the dst_ipv4 table.
+ * Destroy them while that table is being rehashed, so the pointing STE is
+ * freed, then reuse its slot with rules on another dmac.
+ */
+static void run_destroy_rehashing(struct mlx5dv_dr_domain *dmn,
+				  struct mlx5dv_dr_action *drop)
+{
+	struct mlx5dv_dr_matcher *matcher;
+	struct match_buf l2_mask, value;
+	struct mlx5dv_dr_rule **rules;
+	unsigned int i, n = 0;
+	int ret;
+
+	set_dst_ipv4(&l2_mask, 0xffffffff);
+	l2_mask.buf[DMAC_47_16_DW] = 0xffffffff;
+	matcher = mlx5dv_dr_matcher_create(tbl, 0, 1, &l2_mask.params);
+	rules = calloc(num_rules, sizeof(*rules));
+	if (!matcher || !rules) {
+		printf("  FAIL rehash matcher: %s\n", strerror(errno));
+		failures++;
+		goto out;
+	}
+
+	/* Stop as soon as an insertion left a rehash in progress */
+	for (i = 0; i < num_rules; i++) {
+		set_dst_ipv4(&value, 0x0a000000 + i);
+		value.buf[DMAC_47_16_DW] = htobe32(0x00112233);
+		rules[n] = mlx5dv_dr_rule_create(matcher, &value.params, 1,
+						 &drop);
+		if (!rules[n]) {
+			printf("  FAIL rule %u: %s\n", i, strerror(errno));
+			failures++;
+			break;
+		}
+		n++;
+		if (mlx5dv_dr_domain_rehash_step(dmn, 0) == EAGAIN)
+			break;
+	}
+	if (i == num_rules)
+		printf("  no rehash in %u rules, nothing to check\n", n);
+
+	for (i = 0; i < n; i++)
+		mlx5dv_dr_rule_destroy(rules[i]);
+
+	ret = mlx5dv_dr_domain_rehash_step(dmn, 0);
+	if (ret) {
+		printf("  FAIL rehash still in progress: %s\n", strerror(ret));
+		failures++;
+	}
+
+	for (i = 0, n = 0; i < num_rules; i++) {
+		set_dst_ipv4(&value, 0x0a000000 + i);
+		value.buf[DMAC_47_16_DW] = htobe32(0x00445566);
+		rules[n] = mlx5dv_dr_rule_create(matcher, &value.params, 1,
+						 &drop);
+		if (!rules[n]) {
+			printf("  FAIL rule %u: %s\n", i, strerror(errno));
+			failures++;
+			break;
+		}
+		n++;
+	}
+
+	ret = mlx5dv_dr_domain_sync(dmn, MLX5DV_DR_DOMAIN_SYNC_FLAGS_SW);
+	if (ret) {
+		printf("  FAIL sync: %s\n", strerror(ret));
+		failures++;
+	}
+
+	for (i = 0; i < n; i++)
+		mlx5dv_dr_rule_destroy(rules[i]);
+	printf("destroy while rehashing: %u rules reinserted\n", n);
+out:
+	if (matcher)
+		mlx5dv_dr_matcher_destroy(matcher);
+	free(rules);
+}
+
+int main(int argc, char **argv)
+{
+	struct mlx5dv_dr_rule_attr *attrs;
+	struct mlx5dv_dr_action *drop;
+	struct mlx5dv_dr_domain *dmn;
+	struct mlx5dv_dr_rule **rules;
+	struct match_buf *values;
+	unsigned int i;
+
+	if (argc > 1)
+		num_rules = atoi(argv[1]);
+
+	dmn = open_domain();
+	if (!dmn) {
+		printf("No mlx5 software steering device, skipping\n");
+		return 0;
+	}
+
+	tbl = mlx5dv_dr_table_create(dmn, 1);
+	drop = mlx5dv_dr_action_create_drop();
+	set_dst_ipv4(&mask, 0xffffffff);
+	values = calloc(num_rules, sizeof(*values));
+	attrs = calloc(num_rules, sizeof(*attrs));
+	rules = calloc(num_rules, sizeof(*rules));
+	latency = calloc(num_rules, sizeof(*latency));
+	if (!tbl || !drop || !values || !attrs || !rules || !latency) {
+		printf("Failed to set up the table: %s\n", strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < num_rules; i++) {
+		set_dst_ipv4(&values[i], 0x0a000000 + i);
+		attrs[i].value = &values[i].params;
+		attrs[i].num_actions = 1;
+		attrs[i].actions = &drop;
+	}
+
+	run_single(attrs, rules);
+	run_bulk(attrs, rules);
+	printf("incremental rehash:\n");
+	mlx5dv_dr_domain_set_incremental_rehash(dmn, true);
+	run_single(attrs, rules);
+	run_destroy_rehashing(dmn, drop);
+	mlx5dv_dr_action_destroy(drop);
+	mlx5dv_dr_table_destroy(tbl);
+	mlx5dv_dr_domain_destroy(dmn);
+	free(latency);
+	free(rules);
+	free(attrs);
+	free(values);
+
+	if (failures) {
+		printf("%d tests failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
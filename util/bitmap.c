@@ -1,6 +1,7 @@
 /* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
 
 #define _GNU_SOURCE
+#include <config.h>
 #include "bitmap.h"
 #include <string.h>
 #include <strings.h>
@@ -12,6 +13,210 @@
 #define BMP_LAST_WORD_MASK(end) (BMP_WORD_OFFSET(end) == 0 ? ~0UL : \
 				 ~BMP_FIRST_WORD_MASK(end))
 
+/*
+ * Word scanning kernels. Each returns the index of the first word in
+ * [idx, end_idx) that differs from invert (0 to look for set bits, ~0UL to
+ * look for clear bits), or end_idx if there is none, and the popcount of the
+ * words in [idx, end_idx). The AVX2 versions are picked at load time on CPUs
+ * that support them, aarch64 always has NEON.
+ */
+static unsigned long scan_words_scalar(const unsigned long *bmp,
+				       unsigned long idx,
+				       unsigned long end_idx,
+				       unsigned long invert)
+{
+	for (; idx < end_idx; idx++)
+		if (bmp[idx] != invert)
+			return idx;
+
+	return end_idx;
+}
+
+static unsigned long weight_words_scalar(const unsigned long *bmp,
+					 unsigned long idx,
+					 unsigned long end_idx)
+{
+	unsigned long weight = 0;
+
+	for (; idx < end_idx; idx++)
+		weight += __builtin_popcountl(bmp[idx]);
+
+	return weight;
+}
+
+#if defined(__x86_64__) && HAVE_FUNC_ATTRIBUTE_IFUNC
+#include <immintrin.h>
+
+static unsigned long __attribute__((target("avx2")))
+scan_words_avx2(const unsigned long *bmp, unsigned long idx,
+		unsigned long end_idx, unsigned long invert)
+{
+	__m256i inv = _mm256_set1_epi64x(invert);
+
+	for (; idx + 4 <= end_idx; idx += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&bmp[idx]);
+
+		v = _mm256_xor_si256(v, inv);
+		if (!_mm256_testz_si256(v, v))
+			break;
+	}
+
+	return scan_words_scalar(bmp, idx, end_idx, invert);
+}
+
+static unsigned long __attribute__((target("avx2")))
+weight_vector_avx2(__m256i acc)
+{
+	return _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+	       _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+}
+
+/*
+ * Nibble lookup popcount: each byte is counted by looking up its two nibbles
+ * with vpshufb, the byte counts are added up for up to 31 vectors (8 * 31 <
+ * 256) before vpsadbw folds them into the four 64 bit lane sums.
+ */
+static unsigned long __attribute__((target("avx2")))
+weight_words_avx2(const unsigned long *bmp, unsigned long idx,
+		  unsigned long end_idx)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+					     1, 2, 2, 3, 2, 3, 3, 4,
+					     0, 1, 1, 2, 1, 2, 2, 3,
+					     1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+
+	while (idx + 4 <= end_idx) {
+		unsigned long n = min((end_idx - idx) / 4, 31UL);
+		__m256i cnt = _mm256_setzero_si256();
+
+		for (; n; n--, idx += 4) {
+			__m256i v = _mm256_loadu_si256(
+				(const __m256i *)&bmp[idx]);
+			__m256i lo = _mm256_and_si256(v, low_mask);
+			__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+						      low_mask);
+
+			cnt = _mm256_add_epi8(cnt,
+					      _mm256_shuffle_epi8(lut, lo));
+			cnt = _mm256_add_epi8(cnt,
+					      _mm256_shuffle_epi8(lut, hi));
+		}
+		acc = _mm256_add_epi64(acc,
+				       _mm256_sad_epu8(cnt,
+						       _mm256_setzero_si256()));
+	}
+
+	return weight_vector_avx2(acc) +
+	       weight_words_scalar(bmp, idx, end_idx);
+}
+
+typedef unsigned long (*scan_words_fn_t)(const unsigned long *,
+					 unsigned long, unsigned long,
+					 unsigned long);
+typedef unsigned long (*weight_words_fn_t)(const unsigned long *,
+					   unsigned long, unsigned long);
+
+static scan_words_fn_t resolve_scan_words(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &scan_words_avx2;
+	return &scan_words_scalar;
+}
+
+static weight_words_fn_t resolve_weight_words(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &weight_words_avx2;
+	return &weight_words_scalar;
+}
+
+static unsigned long scan_words(const unsigned long *bmp, unsigned long idx,
+				unsigned long end_idx, unsigned long invert)
+	__attribute__((ifunc("resolve_scan_words")));
+static unsigned long weight_words(const unsigned long *bmp, unsigned long idx,
+				  unsigned long end_idx)
+	__attribute__((ifunc("resolve_weight_words")));
+
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+
+static unsigned long scan_words(const unsigned long *bmp, unsigned long idx,
+				unsigned long end_idx, unsigned long invert)
+{
+	uint64x2_t inv = vdupq_n_u64(invert);
+
+	for (; idx + 4 <= end_idx; idx += 4) {
+		uint64x2_t a = veorq_u64(vld1q_u64((const uint64_t *)&bmp[idx]),
+					 inv);
+		uint64x2_t b = veorq_u64(
+			vld1q_u64((const uint64_t *)&bmp[idx + 2]), inv);
+		uint64x2_t v = vorrq_u64(a, b);
+
+		if (vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1))
+			break;
+	}
+
+	return scan_words_scalar(bmp, idx, end_idx, invert);
+}
+
+static unsigned long weight_words(const unsigned long *bmp, unsigned long idx,
+				  unsigned long end_idx)
+{
+	unsigned long weight = 0;
+
+	for (; idx + 2 <= end_idx; idx += 2) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)&bmp[idx]);
+
+		weight += vaddvq_u8(vcntq_u8(v));
+	}
+
+	return weight + weight_words_scalar(bmp, idx, end_idx);
+}
+
+#else
+
+static unsigned long scan_words(const unsigned long *bmp, unsigned long idx,
+				unsigned long end_idx, unsigned long invert)
+{
+	return scan_words_scalar(bmp, idx, end_idx, invert);
+}
+
+static unsigned long weight_words(const unsigned long *bmp, unsigned long idx,
+				  unsigned long end_idx)
+{
+	return weight_words_scalar(bmp, idx, end_idx);
+}
+
+#endif
+
+static unsigned long find_bit(const unsigned long *bmp, unsigned long start,
+			      unsigned long end, unsigned long invert)
+{
+	unsigned long curr_idx = BMP_WORD_INDEX(start);
+	unsigned long last_idx;
+	unsigned long word;
+
+	assert(start <= end);
+
+	if (start >= end)
+		return end;
+
+	word = (bmp[curr_idx] ^ invert) & BMP_FIRST_WORD_MASK(start);
+	if (!word) {
+		last_idx = BMP_WORD_INDEX(end - 1);
+		curr_idx = scan_words(bmp, curr_idx + 1, last_idx + 1, invert);
+		if (curr_idx > last_idx)
+			return end;
+		word = bmp[curr_idx] ^ invert;
+	}
+
+	return min(end, curr_idx * BITS_PER_LONG + __builtin_ctzl(word));
+}
+
 /*
  * Finds the first set bit in the bitmap starting from
  * 'start' bit until ('end'-1) bit.
@@ -21,21 +226,47 @@
 unsigned long bitmap_find_first_bit(const unsigned long *bmp,
 				    unsigned long start, unsigned long end)
 {
-	unsigned long curr_offset = BMP_WORD_OFFSET(start);
+	return find_bit(bmp, start, end, 0);
+}
+
+/*
+ * Finds the first clear bit in the bitmap starting from
+ * 'start' bit until ('end'-1) bit.
+ *
+ * Returns the clear bit index if found, otherwise returns 'end'.
+ */
+unsigned long bitmap_find_first_zero_bit(const unsigned long *bmp,
+					 unsigned long start,
+					 unsigned long end)
+{
+	return find_bit(bmp, start, end, ULONG_MAX);
+}
+
+/*
+ * Counts the set bits in the following range: [start,end-1]
+ */
+unsigned long bitmap_weight_region(const unsigned long *bmp,
+				   unsigned long start, unsigned long end)
+{
 	unsigned long curr_idx = BMP_WORD_INDEX(start);
+	unsigned long last_idx = BMP_WORD_INDEX(end - 1);
+	unsigned long start_mask, last_mask;
 
 	assert(start <= end);
 
-	for (; start < end; curr_idx++) {
-		unsigned long bit = ffsl(bmp[curr_idx] >> curr_offset);
+	if (start >= end)
+		return 0;
+
+	start_mask = BMP_FIRST_WORD_MASK(start);
+	last_mask = BMP_LAST_WORD_MASK(end);
 
-		if (bit)
-			return min(end, start + bit - 1);
-		start += BITS_PER_LONG - curr_offset;
-		curr_offset = 0;
-	}
+	if (curr_idx == last_idx)
+		return __builtin_popcountl(bmp[curr_idx] & start_mask &
+					   last_mask);
 
-	return end;
+	return __builtin_popcountl(bmp[curr_idx] & start_mask) +
+	       weight_words(bmp, curr_idx + 1, last_idx) +
+	       __builtin_popcountl(bmp[last_idx] & last_mask);
 }
 
 /*
@@ -103,36 +334,34 @@ void bitmap_fill_region(unsigned long *bmp, unsigned long start,
 }
 
 /*
- * Checks whether the contiguous region of region_size bits starting from
- * start is free.
+ * Finds a contiguous region with the size of region_size
+ * in the bitmap that is not set, starting the search at 'start'.
  *
- * Returns true if the said region is free, otherwise returns false.
+ * Returns first index of such region if found,
+ * otherwise returns nbits.
  */
-static bool bitmap_is_free_region(unsigned long *bmp, unsigned long start,
-				  unsigned long region_size)
+unsigned long bitmap_find_next_zero_area(const unsigned long *bmp,
+					 unsigned long nbits,
+					 unsigned long start,
+					 unsigned long region_size)
 {
-	unsigned long curr_idx;
-	unsigned long last_idx;
-	unsigned long last_mask;
-	unsigned long start_mask;
-
-	curr_idx = BMP_WORD_INDEX(start);
-	start_mask = BMP_FIRST_WORD_MASK(start);
-	last_idx = BMP_WORD_INDEX(start + region_size - 1);
-	last_mask = BMP_LAST_WORD_MASK(start + region_size);
+	unsigned long end;
 
-	if (curr_idx == last_idx)
-		return !(bmp[curr_idx] & start_mask & last_mask);
+	if (!region_size)
+		return start <= nbits ? start : nbits;
 
-	if (bmp[curr_idx] & start_mask)
-		return false;
+	while (start + region_size <= nbits) {
+		start = bitmap_find_first_zero_bit(bmp, start, nbits);
+		if (start + region_size > nbits)
+			break;
 
-	for (curr_idx++; curr_idx < last_idx; curr_idx++) {
-		if (bmp[curr_idx])
-			return false;
+		end = bitmap_find_first_bit(bmp, start, start + region_size);
+		if (end == start + region_size)
+			return start;
+		start = end + 1;
 	}
 
-	return !(bmp[curr_idx] & last_mask);
+	return nbits;
 }
 
 /*
@@ -146,19 +375,5 @@ unsigned long bitmap_find_free_region(unsigned long *bmp,
 				      unsigned long nbits,
 				      unsigned long region_size)
 {
-	unsigned long start;
-
-	if (!region_size)
-		return 0;
-
-	for (start = 0; start + region_size <= nbits; start++) {
-		if (bitmap_test_bit(bmp, start))
-			continue;
-
-		if (bitmap_is_free_region(bmp, start, region_size))
-			return start;
-	}
-
-	return nbits;
+	return bitmap_find_next_zero_area(bmp, nbits, 0, region_size);
 }
-
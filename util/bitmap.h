@@ -17,6 +17,18 @@
 unsigned long bitmap_find_first_bit(const unsigned long *bmp,
 				    unsigned long start, unsigned long end);
 
+unsigned long bitmap_find_first_zero_bit(const unsigned long *bmp,
+					 unsigned long start,
+					 unsigned long end);
+
+unsigned long bitmap_weight_region(const unsigned long *bmp,
+				   unsigned long start, unsigned long end);
+
+unsigned long bitmap_find_next_zero_area(const unsigned long *bmp,
+					 unsigned long nbits,
+					 unsigned long start,
+					 unsigned long region_size);
+
 void bitmap_zero_region(unsigned long *bmp, unsigned long start,
 			unsigned long end);
 
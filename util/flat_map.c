@@ -0,0 +1,129 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <util/flat_map.h>
+
+void flat_map_destroy(struct flat_map *map)
+{
+	free(map->entries);
+	flat_map_init(map);
+}
+
+int flat_map_insert(struct flat_map *map, uint64_t key, void *value)
+{
+	struct flat_map_entry *entries;
+	size_t max_entries;
+
+	if (map->num_entries == map->max_entries) {
+		max_entries = map->max_entries ? map->max_entries * 2 : 64;
+		entries = realloc(map->entries,
+				  max_entries * sizeof(*map->entries));
+		if (!entries)
+			return ENOMEM;
+		map->entries = entries;
+		map->max_entries = max_entries;
+	}
+
+	map->entries[map->num_entries].key = key;
+	map->entries[map->num_entries].value = value;
+	map->num_entries++;
+	return 0;
+}
+
+void *flat_map_get(const struct flat_map *map, uint64_t key)
+{
+	const struct flat_map_entry *base = map->entries;
+	size_t n = map->num_sorted, i;
+
+	/* Branch free search for the last entry with a key <= key */
+	if (n) {
+		while (n > 1) {
+			size_t half = n / 2;
+
+			base = base[half].key <= key ? base + half : base;
+			n -= half;
+		}
+		if (base->key == key)
+			return base->value;
+	}
+
+	for (i = map->num_sorted; i < map->num_entries; i++)
+		if (map->entries[i].key == key)
+			return map->entries[i].value;
+
+	return NULL;
+}
+
+/*
+ * Stable bottom up merge sort of src into dst, both of length n. Stability
+ * keeps the earliest insert of a key in front so that it wins the dedup.
+ */
+static struct flat_map_entry *merge_sort(struct flat_map_entry *src,
+					 struct flat_map_entry *tmp, size_t n)
+{
+	struct flat_map_entry *from = src, *to = tmp, *swap;
+	size_t width, lo;
+
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			size_t mid = lo + width < n ? lo + width : n;
+			size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+			size_t i = lo, j = mid, k = lo;
+
+			while (i < mid && j < hi)
+				to[k++] = from[j].key < from[i].key ?
+						  from[j++] : from[i++];
+			while (i < mid)
+				to[k++] = from[i++];
+			while (j < hi)
+				to[k++] = from[j++];
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	return from;
+}
+
+int flat_map_sort(struct flat_map *map)
+{
+	size_t n_tail = map->num_entries - map->num_sorted;
+	struct flat_map_entry *tmp, *tail, *head = map->entries;
+	size_t i = 0, j = 0, k = 0;
+
+	if (!n_tail)
+		return 0;
+
+	tmp = malloc(map->num_entries * sizeof(*tmp) + n_tail * sizeof(*tmp));
+	if (!tmp)
+		return ENOMEM;
+
+	/* tmp holds the merged output followed by scratch for the tail sort */
+	tail = merge_sort(head + map->num_sorted, tmp + map->num_entries,
+			  n_tail);
+
+	/* Ties go to the sorted part, it was inserted first */
+	while (i < map->num_sorted || j < n_tail) {
+		struct flat_map_entry *ent;
+
+		if (j == n_tail ||
+		    (i < map->num_sorted && head[i].key <= tail[j].key))
+			ent = &head[i++];
+		else
+			ent = &tail[j++];
+
+		if (k && tmp[k - 1].key == ent->key)
+			continue;
+		tmp[k++] = *ent;
+	}
+
+	memcpy(map->entries, tmp, k * sizeof(*tmp));
+	map->num_entries = k;
+	map->num_sorted = k;
+	free(tmp);
+	return 0;
+}
@@ -0,0 +1,74 @@
+/* GPLv2 or OpenIB.org BSD (MIT) See COPYING file */
+
+#ifndef UTIL_FLAT_MAP_H
+#define UTIL_FLAT_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An ordered uint64_t -> pointer map stored as one array of entries. It suits
+ * maps that are bulk loaded and then mostly read, where it avoids the per
+ * item allocation and pointer chasing of cl_qmap.
+ *
+ * Inserts are appended to an unsorted tail. flat_map_sort() merges the tail
+ * into the sorted part, so the owner should call it once loading is done.
+ * Lookups never modify the map and remain correct before sorting, they only
+ * get slower as the tail grows. As with cl_qmap_insert(), the first value
+ * inserted for a key is kept and later duplicates are dropped.
+ */
+struct flat_map_entry {
+	uint64_t key;
+	void *value;
+};
+
+struct flat_map {
+	struct flat_map_entry *entries;
+	size_t num_entries;
+	size_t num_sorted;
+	size_t max_entries;
+};
+
+static inline void flat_map_init(struct flat_map *map)
+{
+	map->entries = NULL;
+	map->num_entries = 0;
+	map->num_sorted = 0;
+	map->max_entries = 0;
+}
+
+void flat_map_destroy(struct flat_map *map);
+
+/**
+ * flat_map_insert - Add a key to the map
+ *
+ * Return 0 if succeeded, ENOMEM otherwise
+ */
+int flat_map_insert(struct flat_map *map, uint64_t key, void *value);
+
+/**
+ * flat_map_get - Find the value stored for a key
+ *
+ * Return the value, or NULL if the key is not in the map
+ */
+void *flat_map_get(const struct flat_map *map, uint64_t key);
+
+/**
+ * flat_map_sort - Merge all pending inserts into the sorted array
+ *
+ * Return 0 if succeeded, ENOMEM otherwise, in which case the map is left
+ * unchanged
+ */
+int flat_map_sort(struct flat_map *map);
+
+static inline size_t flat_map_count(const struct flat_map *map)
+{
+	return map->num_entries;
+}
+
+/* Iterate in ascending key order, the map must be sorted */
+#define flat_map_for_each(map, ent)					\
+	for (ent = (map)->entries;					\
+	     ent != (map)->entries + (map)->num_sorted; ent++)
+
+#endif
@@ -4,19 +4,27 @@
 #include <pthread.h>
 #include <stdlib.h>
 
-#include <ccan/list.h>
+#include <ccan/minmax.h>
 #include <util/interval_set.h>
 #include <util/util.h>
 
-struct iset {
-	struct list_head head;
-	pthread_mutex_t lock;
-};
-
+/*
+ * The free ranges are kept in an AVL tree ordered by start address. Each node
+ * also records the largest length found in its subtree so that allocation can
+ * skip whole subtrees that have no range long enough.
+ */
 struct iset_range {
-	struct list_node entry;
+	struct iset_range *left;
+	struct iset_range *right;
 	uint64_t start;
 	uint64_t length;
+	uint64_t max_length;
+	int height;
+};
+
+struct iset {
+	struct iset_range *root;
+	pthread_mutex_t lock;
 };
 
 struct iset *iset_create(void)
@@ -30,17 +38,22 @@ struct iset *iset_create(void)
 	}
 
 	pthread_mutex_init(&iset->lock, NULL);
-	list_head_init(&iset->head);
 	return iset;
 }
 
-void iset_destroy(struct iset *iset)
+static void free_ranges(struct iset_range *r)
 {
-	struct iset_range *range, *tmp;
+	if (!r)
+		return;
 
-	list_for_each_safe(&iset->head, range, tmp, entry)
-		free(range);
+	free_ranges(r->left);
+	free_ranges(r->right);
+	free(r);
+}
 
+void iset_destroy(struct iset *iset)
+{
+	free_ranges(iset->root);
 	free(iset);
 }
 
@@ -66,12 +79,157 @@ static struct iset_range *create_range(uint64_t start, uint64_t length)
 
 	range->start = start;
 	range->length = length;
+	range->max_length = length;
+	range->height = 1;
 	return range;
 }
 
-static void delete_range(struct iset_range *r)
+static int height(struct iset_range *r)
+{
+	return r ? r->height : 0;
+}
+
+static uint64_t max_length(struct iset_range *r)
+{
+	return r ? r->max_length : 0;
+}
+
+static void update_range(struct iset_range *r)
+{
+	uint64_t child_max = max(max_length(r->left), max_length(r->right));
+
+	r->height = max(height(r->left), height(r->right)) + 1;
+	r->max_length = max(r->length, child_max);
+}
+
+static struct iset_range *rotate_right(struct iset_range *r)
+{
+	struct iset_range *l = r->left;
+
+	r->left = l->right;
+	l->right = r;
+	update_range(r);
+	update_range(l);
+	return l;
+}
+
+static struct iset_range *rotate_left(struct iset_range *r)
+{
+	struct iset_range *n = r->right;
+
+	r->right = n->left;
+	n->left = r;
+	update_range(r);
+	update_range(n);
+	return n;
+}
+
+static struct iset_range *balance(struct iset_range *r)
+{
+	int diff;
+
+	update_range(r);
+	diff = height(r->left) - height(r->right);
+
+	if (diff > 1) {
+		if (height(r->left->left) < height(r->left->right))
+			r->left = rotate_left(r->left);
+		return rotate_right(r);
+	}
+
+	if (diff < -1) {
+		if (height(r->right->right) < height(r->right->left))
+			r->right = rotate_right(r->right);
+		return rotate_left(r);
+	}
+
+	return r;
+}
+
+static struct iset_range *tree_insert(struct iset_range *r,
+				      struct iset_range *rnew)
+{
+	if (!r)
+		return rnew;
+
+	if (rnew->start < r->start)
+		r->left = tree_insert(r->left, rnew);
+	else
+		r->right = tree_insert(r->right, rnew);
+
+	return balance(r);
+}
+
+static struct iset_range *tree_remove_min(struct iset_range *r,
+					  struct iset_range **min)
 {
-	list_del(&r->entry);
+	if (!r->left) {
+		*min = r;
+		return r->right;
+	}
+
+	r->left = tree_remove_min(r->left, min);
+	return balance(r);
+}
+
+/* Unlink the range starting at @start, the caller frees it */
+static struct iset_range *tree_remove(struct iset_range *r, uint64_t start)
+{
+	struct iset_range *min, *right;
+
+	if (start < r->start) {
+		r->left = tree_remove(r->left, start);
+		return balance(r);
+	}
+	if (start > r->start) {
+		r->right = tree_remove(r->right, start);
+		return balance(r);
+	}
+
+	if (!r->right)
+		return r->left;
+
+	right = tree_remove_min(r->right, &min);
+	min->right = right;
+	min->left = r->left;
+	return balance(min);
+}
+
+/*
+ * Recompute the annotations on the path to the range starting at @start after
+ * its start or length was changed in a way that kept the tree ordered.
+ */
+static void tree_fixup(struct iset_range *r, uint64_t start)
+{
+	if (start < r->start)
+		tree_fixup(r->left, start);
+	else if (start > r->start)
+		tree_fixup(r->right, start);
+
+	update_range(r);
+}
+
+static void find_neighbours(struct iset *iset, uint64_t start,
+			    struct iset_range **prev, struct iset_range **next)
+{
+	struct iset_range *r = iset->root;
+
+	*prev = NULL;
+	*next = NULL;
+	while (r) {
+		if (r->start > start) {
+			*next = r;
+			r = r->left;
+		} else {
+			*prev = r;
+			r = r->right;
+		}
+	}
+}
+
+static void delete_range(struct iset *iset, struct iset_range *r)
+{
+	iset->root = tree_remove(iset->root, r->start);
 	free(r);
 }
 
@@ -89,21 +247,24 @@ static bool check_do_combine(struct iset *iset,
 	if (n && (start + length == n->start)) {
 		if (combined2prev) {
 			p->length += n->length;
-			delete_range(n);
+			delete_range(iset, n);
 		} else {
 			n->start = start;
 			n->length += length;
+			tree_fixup(iset->root, n->start);
 		}
 		combined2next = true;
 	}
 
+	if (combined2prev)
+		tree_fixup(iset->root, p->start);
+
 	return combined2prev || combined2next;
 }
 
 int iset_insert_range(struct iset *iset, uint64_t start, uint64_t length)
 {
-	struct iset_range *prev = NULL, *r, *rnew;
-	bool found = false, combined;
+	struct iset_range *prev, *next, *rnew;
 	int ret = 0;
 
 	if (!length || (start + length - 1 < start)) {
@@ -112,34 +273,22 @@ int iset_insert_range(struct iset *iset, uint64_t start, uint64_t length)
 	}
 
 	pthread_mutex_lock(&iset->lock);
-	list_for_each(&iset->head, r, entry) {
-		if (range_overlap(r->start, r->length, start, length)) {
-			errno = EINVAL;
-			ret = errno;
-			goto out;
-		}
-
-		if (r->start > start) {
-			found = true;
-			break;
-		}
-
-		prev = r;
+	find_neighbours(iset, start, &prev, &next);
+	if ((prev && range_overlap(prev->start, prev->length, start, length)) ||
+	    (next && range_overlap(next->start, next->length, start, length))) {
+		errno = EINVAL;
+		ret = errno;
+		goto out;
 	}
 
-	combined = check_do_combine(iset, prev, found ? r : NULL,
-				    start, length);
-	if (!combined) {
+	if (!check_do_combine(iset, prev, next, start, length)) {
 		rnew = create_range(start, length);
 		if (!rnew) {
 			ret = errno;
 			goto out;
 		}
 
-		if (!found)
-			list_add_tail(&iset->head, &rnew->entry);
-		else
-			list_add_before(&iset->head, &r->entry, &rnew->entry);
+		iset->root = tree_insert(iset->root, rnew);
 	}
 
 out:
@@ -152,12 +301,40 @@ static int power_of_two(uint64_t x)
 	return ((x != 0) && !(x & (x - 1)));
 }
 
+static bool range_fits(struct iset_range *r, uint64_t length,
+		       uint64_t alignment)
+{
+	uint64_t astart = align(r->start, alignment);
+
+	/* Check for wrap around */
+	return (astart + length - 1 >= astart) &&
+	       (astart + length - 1 <= r->start + r->length - 1);
+}
+
+/* Lowest addressed range that can hold @length at @alignment */
+static struct iset_range *find_fit(struct iset_range *r, uint64_t length,
+				   uint64_t alignment)
+{
+	struct iset_range *found;
+
+	if (!r || r->max_length < length)
+		return NULL;
+
+	found = find_fit(r->left, length, alignment);
+	if (found)
+		return found;
+
+	if (range_fits(r, length, alignment))
+		return r;
+
+	return find_fit(r->right, length, alignment);
+}
+
 int iset_alloc_range(struct iset *iset, uint64_t length,
 		     uint64_t *start, uint64_t alignment)
 {
 	struct iset_range *r, *rnew;
 	uint64_t astart, rend;
-	bool found = false;
 	int ret = 0;
 
 	if (!power_of_two(alignment)) {
@@ -166,27 +343,21 @@ int iset_alloc_range(struct iset *iset, uint64_t length,
 	}
 
 	pthread_mutex_lock(&iset->lock);
-	list_for_each(&iset->head, r, entry) {
-		astart = align(r->start, alignment);
-		/* Check for wrap around */
-		if ((astart + length - 1 >= astart) &&
-		    (astart + length - 1 <= r->start + r->length - 1)) {
-			found = true;
-			break;
-		}
-	}
-	if (!found) {
+	r = find_fit(iset->root, length, alignment);
+	if (!r) {
 		errno = ENOSPC;
 		ret = errno;
 		goto out;
 	}
 
+	astart = align(r->start, alignment);
 	if (r->start == astart) {
 		if (r->length == length) { /* Case #1 */
-			delete_range(r);
+			delete_range(iset, r);
 		} else {	/* Case #2 */
 			r->start += length;
 			r->length -= length;
+			tree_fixup(iset->root, r->start);
 		}
 	} else {
 		rend = r->start + r->length;
@@ -197,9 +368,10 @@ int iset_alloc_range(struct iset *iset, uint64_t length,
 				ret = errno;
 				goto out;
 			}
-			list_add_after(&iset->head, &r->entry, &rnew->entry);
+			iset->root = tree_insert(iset->root, rnew);
 		}
 		r->length = astart - r->start; /* Case #3 & #4 */
+		tree_fixup(iset->root, r->start);
 	}
 
 	*start = astart;
@@ -48,5 +48,6 @@ int rdmanl_get_chardev(struct nl_sock *nl, int ibidx, const char *name,
 bool get_copy_on_fork(void);
 int rdmanl_get_copy_on_fork(struct nl_sock *nl, nl_recvmsg_msg_cb_t cb_func,
 			    void *data);
+int rdmanl_get_sys(struct nl_sock *nl, nl_recvmsg_msg_cb_t cb_func, void *data);
 
 #endif
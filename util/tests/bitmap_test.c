@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
 #include <valgrind/memcheck.h>
 #include <ccan/array_size.h>
 #include <util/bitmap.h>
@@ -50,6 +52,64 @@ static void test_bitmap_find_first_bit(unsigned long *bmp, const int nbits)
 	}
 }
 
+static void test_bitmap_find_first_zero_bit(unsigned long *bmp,
+					    const int nbits)
+{
+	bitmap_fill(bmp, nbits);
+
+	for (int i = 0; i < nbits; i++) {
+		EXPECT_EQ(nbits, bitmap_find_first_zero_bit(bmp, 0, nbits));
+		bitmap_clear_bit(bmp, i);
+		EXPECT_EQ(i, bitmap_find_first_zero_bit(bmp, 0, nbits));
+		EXPECT_EQ(i, bitmap_find_first_zero_bit(bmp, i, nbits));
+		EXPECT_EQ(i, bitmap_find_first_zero_bit(bmp, 0, i + 1));
+		EXPECT_EQ(i, bitmap_find_first_zero_bit(bmp, 0, i));
+		EXPECT_EQ(nbits, bitmap_find_first_zero_bit(bmp, i + 1, nbits));
+		bitmap_set_bit(bmp, i);
+	}
+}
+
+static void test_bitmap_weight_region(unsigned long *bmp, const int nbits)
+{
+	for (int end = 0; end <= nbits; end++) {
+		int start = end / 3;
+
+		bitmap_zero(bmp, nbits);
+		EXPECT_EQ(0, bitmap_weight_region(bmp, 0, nbits));
+		bitmap_fill_region(bmp, start, end);
+		EXPECT_EQ(end - start, bitmap_weight_region(bmp, 0, nbits));
+		EXPECT_EQ(end - start, bitmap_weight_region(bmp, start, end));
+		EXPECT_EQ(end - start - (start < end),
+			  bitmap_weight_region(bmp, start + (start < end),
+					       nbits));
+		EXPECT_EQ(0, bitmap_weight_region(bmp, end, nbits));
+	}
+}
+
+static void test_bitmap_find_next_zero_area(unsigned long *bmp,
+					    const int nbits)
+{
+	for (int region_size = 1; region_size < nbits / 2; region_size++) {
+		int hole = nbits - region_size;
+
+		/* A hole one bit too small right after the start */
+		bitmap_fill(bmp, nbits);
+		bitmap_zero_region(bmp, 1, region_size);
+		bitmap_zero_region(bmp, hole, nbits);
+		EXPECT_EQ(hole,
+			  bitmap_find_next_zero_area(bmp, nbits, 0,
+						     region_size));
+		EXPECT_EQ(nbits,
+			  bitmap_find_next_zero_area(bmp, nbits, hole + 1,
+						     region_size));
+
+		bitmap_zero(bmp, nbits);
+		EXPECT_EQ(hole,
+			  bitmap_find_next_zero_area(bmp, nbits, hole,
+						     region_size));
+	}
+}
+
 static void test_bitmap_zero_region(unsigned long *bmp, const int nbits)
 {
 	for (int end = 0; end <= nbits; end++) {
@@ -98,6 +158,116 @@ static void test_bitmap_find_free_region(unsigned long *bmp, const int nbits)
 	}
 }
 
+static double elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/*
+ * Scan a mostly full multi-megabit bitmap with a few scattered free bits,
+ * which is the worst case for the word scanning loops.
+ */
+#ifdef __x86_64__
+__attribute__((target("popcnt")))
+#endif
+static unsigned long popcnt_words(const unsigned long *bmp,
+				  unsigned long nwords)
+{
+	unsigned long weight = 0;
+
+	for (unsigned long i = 0; i < nwords; i++)
+		weight += __builtin_popcountl(bmp[i]);
+
+	return weight;
+}
+
+/* bitmap_weight_region() on random data against a plain popcnt loop */
+static void bench_bitmap_weight(unsigned long nbits, unsigned int loops)
+{
+	unsigned long nwords = BITS_TO_LONGS(nbits);
+	unsigned long *bmp = bitmap_alloc0(nbits);
+	unsigned long expected, found = 0;
+	struct timespec t0, t1;
+	unsigned int i;
+	double secs;
+
+	srand(1);
+	for (i = 0; i < nwords; i++)
+		bmp[i] = ((unsigned long)rand() << 33) ^
+			 ((unsigned long)rand() << 11) ^ rand();
+	expected = popcnt_words(bmp, nwords);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < loops; i++) {
+		/* Keep the compiler from hoisting the pure call out */
+		asm volatile("" : : "r"(bmp) : "memory");
+		found += popcnt_words(bmp, nwords);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	EXPECT_EQ(expected * loops, found);
+	secs = elapsed(&t0, &t1);
+	printf("       popcnt loop:         %lu Mbit x %u in %.3fs (%.1f Gbit/sec)\n",
+	       nbits >> 20, loops, secs, nbits * (double)loops / secs / 1e9);
+
+	found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < loops; i++)
+		found += bitmap_weight_region(bmp, 0, nbits);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	EXPECT_EQ(expected * loops, found);
+	secs = elapsed(&t0, &t1);
+	printf("       weight_region:       %lu Mbit x %u in %.3fs (%.1f Gbit/sec)\n",
+	       nbits >> 20, loops, secs, nbits * (double)loops / secs / 1e9);
+
+	/* Unaligned start and end exercise the scalar head and tail */
+	EXPECT_EQ(popcnt_words(bmp + 1, nwords - 2) +
+			  __builtin_popcountl(bmp[0] & ~1UL) +
+			  __builtin_popcountl(bmp[nwords - 1] & 1UL),
+		  bitmap_weight_region(bmp, 1, nbits - BITS_PER_LONG + 1));
+
+	free(bmp);
+}
+
+static void bench_bitmap_scan(unsigned long nbits, unsigned int loops)
+{
+	unsigned long *bmp = bitmap_alloc1(nbits);
+	unsigned long found = 0;
+	struct timespec t0, t1;
+	unsigned int i;
+	double secs;
+
+	for (i = 1; i <= 8; i++)
+		bitmap_clear_bit(bmp, nbits / 8 * i - 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < loops; i++) {
+		unsigned long bit = 0;
+
+		while ((bit = bitmap_find_first_zero_bit(bmp, bit, nbits)) <
+		       nbits) {
+			found++;
+			bit++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	EXPECT_EQ(8UL * loops, found);
+	secs = elapsed(&t0, &t1);
+	printf("       find_first_zero_bit: %lu Mbit x %u in %.3fs (%.1f Gbit/sec)\n",
+	       nbits >> 20, loops, secs, nbits * (double)loops / secs / 1e9);
+
+	found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < loops; i++)
+		found += bitmap_weight_region(bmp, 1, nbits);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	EXPECT_EQ((nbits - 9) * loops, found);
+	secs = elapsed(&t0, &t1);
+	printf("       weight_region:       %lu Mbit x %u in %.3fs (%.1f Gbit/sec)\n",
+	       nbits >> 20, loops, secs, nbits * (double)loops / secs / 1e9);
+
+	free(bmp);
+}
+
 int main(int argc, char **argv)
 {
 	int all_failed_tests = 0;
@@ -107,6 +277,7 @@ int main(int argc, char **argv)
 		BITS_PER_LONG + 1,
 		BITS_PER_LONG / 2,
 		BITS_PER_LONG * 2,
+		BITS_PER_LONG * 11 + 5,
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(nbitsv); i++) {
@@ -124,6 +295,9 @@ int main(int argc, char **argv)
 
 		TEST(test_bitmap_empty);
 		TEST(test_bitmap_find_first_bit);
+		TEST(test_bitmap_find_first_zero_bit);
+		TEST(test_bitmap_weight_region);
+		TEST(test_bitmap_find_next_zero_area);
 		TEST(test_bitmap_zero_region);
 		TEST(test_bitmap_fill_region);
 		TEST(test_bitmap_find_free_region);
@@ -133,6 +307,16 @@ int main(int argc, char **argv)
 		free(bmp);
 	}
 
+	failed_tests = 0;
+	bench_bitmap_scan(16UL << 20, argc > 1 ? atoi(argv[1]) : 20);
+	printf("%6s bench_bitmap_scan\n", failed_tests ? "FAILED" : "OK");
+	all_failed_tests += failed_tests;
+
+	failed_tests = 0;
+	bench_bitmap_weight(16UL << 20, argc > 1 ? atoi(argv[1]) : 20);
+	printf("%6s bench_bitmap_weight\n", failed_tests ? "FAILED" : "OK");
+	all_failed_tests += failed_tests;
+
 	if (all_failed_tests) {
 		printf("%d tests failed\n", all_failed_tests);
 		return 1;
@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ccan/container_of.h>
+#include <util/cl_qmap.h>
+#include <util/flat_map.h>
+
+static int failed_tests;
+
+#define EXPECT_EQ(expected, actual) \
+	({ \
+		typeof(expected) _expected = (expected); \
+		typeof(actual) _actual = (actual); \
+		if (_expected != _actual) { \
+			printf("  FAIL at line %d: %s not %s\n", __LINE__, \
+				#expected, #actual); \
+			printf("\tExpected: %ld\n", (long) _expected); \
+			printf("\t  Actual: %ld\n", (long) _actual); \
+			failed_tests++; \
+		} \
+	})
+
+#define VAL(x) ((void *)(uintptr_t)(x))
+
+static void test_flat_map_basic(void)
+{
+	struct flat_map map;
+	struct flat_map_entry *ent;
+	uint64_t prev = 0;
+	unsigned int n = 0;
+
+	flat_map_init(&map);
+	EXPECT_EQ(NULL, flat_map_get(&map, 1));
+
+	EXPECT_EQ(0, flat_map_insert(&map, 5, VAL(50)));
+	EXPECT_EQ(0, flat_map_insert(&map, 3, VAL(30)));
+	EXPECT_EQ(0, flat_map_insert(&map, 5, VAL(51)));
+	/* Lookups work before sorting and keep the first insert */
+	EXPECT_EQ(VAL(50), flat_map_get(&map, 5));
+	EXPECT_EQ(VAL(30), flat_map_get(&map, 3));
+
+	EXPECT_EQ(0, flat_map_sort(&map));
+	EXPECT_EQ(2, flat_map_count(&map));
+	EXPECT_EQ(VAL(50), flat_map_get(&map, 5));
+
+	/* A later batch merges in and loses ties to the sorted part */
+	EXPECT_EQ(0, flat_map_insert(&map, 4, VAL(40)));
+	EXPECT_EQ(0, flat_map_insert(&map, 3, VAL(31)));
+	EXPECT_EQ(0, flat_map_insert(&map, 1, VAL(10)));
+	EXPECT_EQ(0, flat_map_sort(&map));
+	EXPECT_EQ(4, flat_map_count(&map));
+	EXPECT_EQ(VAL(30), flat_map_get(&map, 3));
+	EXPECT_EQ(VAL(40), flat_map_get(&map, 4));
+	EXPECT_EQ(NULL, flat_map_get(&map, 2));
+
+	flat_map_for_each(&map, ent) {
+		EXPECT_EQ(true, !n || ent->key > prev);
+		prev = ent->key;
+		n++;
+	}
+	EXPECT_EQ(4, n);
+
+	flat_map_destroy(&map);
+}
+
+struct qmap_item {
+	cl_map_item_t item;
+	void *value;
+};
+
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/*
+ * Insert, look up and iterate nkeys shuffled keys with both cl_qmap and
+ * flat_map, checking that they agree.
+ */
+static void test_flat_map_vs_qmap(unsigned int nkeys)
+{
+	struct qmap_item **items = calloc(nkeys, sizeof(*items));
+	uint64_t *keys = calloc(nkeys, sizeof(*keys));
+	struct flat_map_entry *ent;
+	struct flat_map map;
+	struct timespec t0;
+	cl_map_item_t *it;
+	cl_qmap_t qmap;
+	uint64_t sum_q = 0, sum_f = 0;
+	unsigned int i, j;
+	double tq[3], tf[3];
+
+	for (i = 0; i < nkeys; i++)
+		keys[i] = i + 1;
+	srand(1);
+	for (i = nkeys - 1; i > 0; i--) {
+		uint64_t tmp = keys[i];
+
+		j = rand() % (i + 1);
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	cl_qmap_init(&qmap);
+	for (i = 0; i < nkeys; i++) {
+		/* One allocation per item, as the cl_qmap users do */
+		items[i] = malloc(sizeof(*items[i]));
+		items[i]->value = VAL(keys[i]);
+		cl_qmap_insert(&qmap, keys[i], &items[i]->item);
+	}
+	tq[0] = elapsed(&t0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	flat_map_init(&map);
+	for (i = 0; i < nkeys; i++)
+		flat_map_insert(&map, keys[i], VAL(keys[i]));
+	flat_map_sort(&map);
+	tf[0] = elapsed(&t0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nkeys; i++) {
+		it = cl_qmap_get(&qmap, keys[i]);
+		sum_q += (uintptr_t)container_of(it, struct qmap_item,
+						 item)->value;
+	}
+	tq[1] = elapsed(&t0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nkeys; i++)
+		sum_f += (uintptr_t)flat_map_get(&map, keys[i]);
+	tf[1] = elapsed(&t0);
+	EXPECT_EQ(sum_q, sum_f);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (it = cl_qmap_head(&qmap); it != cl_qmap_end(&qmap);
+	     it = cl_qmap_next(it))
+		sum_q += cl_qmap_key(it);
+	tq[2] = elapsed(&t0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	flat_map_for_each(&map, ent)
+		sum_f += ent->key;
+	tf[2] = elapsed(&t0);
+	EXPECT_EQ(sum_q, sum_f);
+
+	printf("       %u keys         insert    lookup   iterate (Mops/s)\n",
+	       nkeys);
+	printf("       cl_qmap  %10.2f %9.2f %9.2f\n", nkeys / tq[0] / 1e6,
+	       nkeys / tq[1] / 1e6, nkeys / tq[2] / 1e6);
+	printf("       flat_map %10.2f %9.2f %9.2f\n", nkeys / tf[0] / 1e6,
+	       nkeys / tf[1] / 1e6, nkeys / tf[2] / 1e6);
+
+	flat_map_destroy(&map);
+	for (i = 0; i < nkeys; i++)
+		free(items[i]);
+	free(items);
+	free(keys);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nkeys = argc > 1 ? atoi(argv[1]) : 49151;
+	int all_failed_tests = 0;
+
+#define TEST(name, ...) do { \
+	failed_tests = 0; \
+	name(__VA_ARGS__); \
+	printf("%6s %s\n", failed_tests ? "FAILED" : "OK", #name); \
+	all_failed_tests += failed_tests; \
+	} while (0)
+
+	TEST(test_flat_map_basic);
+	TEST(test_flat_map_vs_qmap, nkeys);
+
+#undef TEST
+
+	if (all_failed_tests) {
+		printf("%d tests failed\n", all_failed_tests);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: (GPL-2.0 OR Linux-OpenIB)
+#include <errno.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ccan/array_size.h>
+#include <util/bitmap.h>
+#include <util/interval_set.h>
+
+static int failed_tests;
+
+#define EXPECT_EQ(expected, actual) \
+	({ \
+		typeof(expected) _expected = (expected); \
+		typeof(actual) _actual = (actual); \
+		if (_expected != _actual) { \
+			printf("  FAIL at line %d: %s not %s\n", __LINE__, \
+				#expected, #actual); \
+			printf("\tExpected: %ld\n", (long) _expected); \
+			printf("\t  Actual: %ld\n", (long) _actual); \
+			failed_tests++; \
+		} \
+	})
+
+static void test_iset_alloc_cases(void)
+{
+	struct iset *iset = iset_create();
+	uint64_t start;
+
+	EXPECT_EQ(ENOSPC, iset_alloc_range(iset, 1, &start, 1));
+	EXPECT_EQ(0, iset_insert_range(iset, 0x1000, 0x1000));
+	EXPECT_EQ(EINVAL, iset_insert_range(iset, 0x1800, 0x1000));
+	EXPECT_EQ(EINVAL, iset_alloc_range(iset, 1, &start, 3));
+
+	/* Case #2, shrink from the front */
+	EXPECT_EQ(0, iset_alloc_range(iset, 0x100, &start, 1));
+	EXPECT_EQ(0x1000, start);
+	/* Case #4, split in the middle */
+	EXPECT_EQ(0, iset_alloc_range(iset, 0x100, &start, 0x200));
+	EXPECT_EQ(0x1200, start);
+	/* The gap left in front of the aligned range is used first */
+	EXPECT_EQ(0, iset_alloc_range(iset, 0x100, &start, 1));
+	EXPECT_EQ(0x1100, start);
+	/* Case #3, shrink from the back */
+	EXPECT_EQ(0, iset_alloc_range(iset, 0x800, &start, 0x800));
+	EXPECT_EQ(0x1800, start);
+	/* Case #1, take the whole range */
+	EXPECT_EQ(0, iset_alloc_range(iset, 0x500, &start, 1));
+	EXPECT_EQ(0x1300, start);
+	EXPECT_EQ(ENOSPC, iset_alloc_range(iset, 1, &start, 1));
+
+	/* Freeing everything combines back into a single range */
+	EXPECT_EQ(0, iset_insert_range(iset, 0x1800, 0x800));
+	EXPECT_EQ(0, iset_insert_range(iset, 0x1000, 0x100));
+	EXPECT_EQ(0, iset_insert_range(iset, 0x1200, 0x100));
+	EXPECT_EQ(0, iset_insert_range(iset, 0x1300, 0x500));
+	EXPECT_EQ(0, iset_insert_range(iset, 0x1100, 0x100));
+	EXPECT_EQ(0, iset_alloc_range(iset, 0x1000, &start, 0x1000));
+	EXPECT_EQ(0x1000, start);
+
+	iset_destroy(iset);
+}
+
+#define STRESS_UNITS 4096
+#define STRESS_SLOTS 512
+
+struct stress_slot {
+	uint64_t start;
+	uint64_t length;
+};
+
+/*
+ * Random alloc/free cycles, checking that no two allocations overlap and that
+ * everything merges back together at the end.
+ */
+static void test_iset_stress(unsigned int cycles, bool check)
+{
+	struct stress_slot slots[STRESS_SLOTS] = {};
+	unsigned long *used = bitmap_alloc0(STRESS_UNITS);
+	struct iset *iset = iset_create();
+	struct timespec t0, t1;
+	unsigned int i, n, ops = 0;
+	uint64_t start, u;
+	double secs;
+
+	srand(1);
+	EXPECT_EQ(0, iset_insert_range(iset, 0, STRESS_UNITS));
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < cycles; i++) {
+		struct stress_slot *slot = &slots[rand() % STRESS_SLOTS];
+
+		if (slot->length) {
+			if (check)
+				bitmap_zero_region(used, slot->start,
+						   slot->start + slot->length);
+			EXPECT_EQ(0, iset_insert_range(iset, slot->start,
+						       slot->length));
+			slot->length = 0;
+		} else {
+			n = 1 + rand() % 16;
+			if (iset_alloc_range(iset, n, &start,
+					     1 << (rand() % 4)))
+				continue;
+
+			if (check) {
+				for (u = start; u < start + n; u++)
+					EXPECT_EQ(false,
+						  bitmap_test_bit(used, u));
+				bitmap_fill_region(used, start, start + n);
+			}
+			slot->start = start;
+			slot->length = n;
+		}
+		ops++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	for (i = 0; i < STRESS_SLOTS; i++)
+		if (slots[i].length)
+			EXPECT_EQ(0, iset_insert_range(iset, slots[i].start,
+						       slots[i].length));
+	EXPECT_EQ(0, iset_alloc_range(iset, STRESS_UNITS, &start, 1));
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (!check)
+		printf("       %u alloc/free ops in %.3fs (%.0f ops/sec)\n",
+		       ops, secs, ops / secs);
+
+	iset_destroy(iset);
+	free(used);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int cycles = argc > 1 ? atoi(argv[1]) : 1000000;
+	int all_failed_tests = 0;
+
+#define TEST(name, ...) do { \
+	failed_tests = 0; \
+	name(__VA_ARGS__); \
+	printf("%6s %s\n", failed_tests ? "FAILED" : "OK", #name); \
+	all_failed_tests += failed_tests; \
+	} while (0)
+
+	TEST(test_iset_alloc_cases);
+	TEST(test_iset_stress, 100000, true);
+	TEST(test_iset_stress, cycles, false);
+
+#undef TEST
+
+	if (all_failed_tests) {
+		printf("%d tests failed\n", all_failed_tests);
+		return 1;
+	}
+
+	return 0;
+}